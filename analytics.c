@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include "analytics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define RING_MASK (ANALYTICS_RING_RECORDS - 1)
+#define BATCH_RECORDS 4096 // Events encoded and written at once
+#define NUM_TEXTS 3        // Strings an event can have
+#define NUM_NUMBERS 8      // Numbers an event can have, besides its timestamp
+#define DICTIONARY_SLOTS (2 * ANALYTICS_MAX_STRINGS) // A power of 2, kept at most half full
+#define MAX_PATH_BYTES 4096
+
+// The longest a block can get: each event adds at most every one of its numbers and strings.
+#define MAX_ROW_BYTES ((1 + NUM_NUMBERS) * 10 + NUM_TEXTS * (10 + ANALYTICS_TEXT_BYTES))
+#define MAX_BLOCK_HEADER_BYTES (5 + 3 * 10)
+#define OUT_BUFFER_BYTES (2 * MAX_BLOCK_HEADER_BYTES + BATCH_RECORDS * MAX_ROW_BYTES)
+
+// An event as it waits on a ring. Guesses have the player and the guess as their strings, and
+// the flags and time to guess as their numbers. Rounds have the host, the word, and the winner as
+// their strings, and the rest of analytics_round_t in order as their numbers.
+typedef struct analytics_entry {
+  uint64_t timestamp_us; // CLOCK_REALTIME
+  uint32_t room_id;
+  uint32_t round;
+  uint32_t numbers[NUM_NUMBERS];
+  analytics_kind_t kind;
+  bool has_winner;
+  uint8_t text_lens[NUM_TEXTS];
+  char texts[NUM_TEXTS][ANALYTICS_TEXT_BYTES];
+} analytics_entry_t;
+
+// The events one thread recorded that haven't been written yet. Only the thread that owns the
+// ring adds events, and only the thread writing them out takes them. A ring is handed to a new
+// thread once its thread has ended.
+typedef struct analytics_ring {
+  _Alignas(64) atomic_uint_fast64_t head; // Events ever added
+  _Alignas(64) atomic_uint_fast64_t tail; // Events ever taken
+  atomic_uint_fast64_t num_dropped;       // Events that didn't fit since the last write
+  struct analytics_ring* next;            // The next ring ever used
+  struct analytics_ring* next_free;       // The next ring without a thread
+  analytics_entry_t entries[ANALYTICS_RING_RECORDS];
+} analytics_ring_t;
+
+// The strings of the current file, each with its id. Only the writing thread uses it.
+typedef struct dictionary {
+  uint32_t slots[DICTIONARY_SLOTS]; // An id plus 1, or 0 for an empty slot
+  char (*strings)[ANALYTICS_TEXT_BYTES];
+  uint8_t* lens;
+  uint32_t num_strings;
+  uint32_t num_written; // Strings already written to the file
+} dictionary_t;
+
+const char* analytics_outcome_names[NUM_ANALYTICS_OUTCOMES] = {"solved", "timed out", "abandoned"};
+
+bool analytics_is_on = false;
+
+static _Atomic(analytics_ring_t*) all_rings; // Every ring ever used
+static analytics_ring_t* free_rings;         // Rings whose thread has ended
+static int num_rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key; // Gives a thread's ring back when the thread ends
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local analytics_ring_t* thread_ring;
+static atomic_uint_fast64_t num_dropped_without_ring;
+
+// Only used while holding write_lock
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static char file_path[MAX_PATH_BYTES];
+static size_t max_bytes;
+static unsigned int next_file = 1; // The sequence number the next file is tried with
+static int file_fd = -1;           // The current file (-1 until the next block starts one)
+static size_t file_bytes;
+static dictionary_t* dictionary;
+static analytics_entry_t* batch;
+static uint8_t* out_buffer;
+
+/**
+ * Put a ring back on the free list. Runs when the thread that recorded to it ends.
+ */
+static void give_back_ring(void* ring) {
+  pthread_mutex_lock(&rings_lock);
+  ((analytics_ring_t*) ring)->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, give_back_ring);
+}
+
+/**
+ * Get the calling thread's ring, taking one the first time the thread records.
+ *
+ * \returns The ring, or NULL if ANALYTICS_MAX_RINGS threads have one or there is no memory for it.
+ */
+static analytics_ring_t* get_thread_ring(void) {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_mutex_lock(&rings_lock);
+  analytics_ring_t* ring = free_rings;
+  if (ring != NULL) {
+    free_rings = ring->next_free;
+  } else if (num_rings < ANALYTICS_MAX_RINGS) {
+    ring = calloc(1, sizeof(analytics_ring_t));
+    if (ring != NULL) {
+      num_rings++;
+      ring->next = atomic_load(&all_rings);
+      atomic_store(&all_rings, ring);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (ring != NULL) {
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+  }
+  return ring;
+}
+
+/**
+ * Get the next free entry of the calling thread's ring.
+ *
+ * \returns The entry, or NULL if the event has to be dropped.
+ */
+static analytics_entry_t* start_entry(analytics_ring_t** ring) {
+  *ring = get_thread_ring();
+  if (*ring == NULL) {
+    atomic_fetch_add_explicit(&num_dropped_without_ring, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  uint64_t head = atomic_load_explicit(&(*ring)->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&(*ring)->tail, memory_order_acquire) == ANALYTICS_RING_RECORDS) {
+    atomic_fetch_add_explicit(&(*ring)->num_dropped, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  analytics_entry_t* entry = &(*ring)->entries[head & RING_MASK];
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  entry->timestamp_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  return entry;
+}
+
+/**
+ * Hand an entry filled in after start_entry to the writing thread.
+ */
+static void finish_entry(analytics_ring_t* ring) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Copy a string into an entry, truncating it.
+ */
+static void set_text(analytics_entry_t* entry, int i, const char* text, size_t len) {
+  len = text == NULL ? 0 : len < ANALYTICS_TEXT_BYTES ? len : ANALYTICS_TEXT_BYTES;
+  if (len > 0) {
+    memcpy(entry->texts[i], text, len);
+  }
+  entry->text_lens[i] = len;
+}
+
+// Record a guess on the calling thread's ring.
+void analytics_record_guess(const analytics_guess_t* guess) {
+  analytics_ring_t* ring;
+  analytics_entry_t* entry = start_entry(&ring);
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->kind = ANALYTICS_GUESS;
+  entry->room_id = guess->room_id;
+  entry->round = guess->round;
+  entry->numbers[0] = guess->flags;
+  entry->numbers[1] = guess->guess_ms;
+  set_text(entry, 0, guess->player, guess->player != NULL ? strlen(guess->player) : 0);
+  set_text(entry, 1, guess->guess, guess->guess_len);
+  finish_entry(ring);
+}
+
+// Record a round that ended on the calling thread's ring.
+void analytics_record_round(const analytics_round_t* round) {
+  analytics_ring_t* ring;
+  analytics_entry_t* entry = start_entry(&ring);
+  if (entry == NULL) {
+    return;
+  }
+
+  entry->kind = ANALYTICS_ROUND;
+  entry->room_id = round->room_id;
+  entry->round = round->round;
+  entry->numbers[0] = round->outcome;
+  entry->numbers[1] = round->num_players;
+  entry->numbers[2] = round->num_questions;
+  entry->numbers[3] = round->num_guesses;
+  entry->numbers[4] = round->solve_ms;
+  entry->numbers[5] = round->guessing_ms;
+  entry->has_winner = round->winner != NULL;
+  set_text(entry, 0, round->host, round->host != NULL ? strlen(round->host) : 0);
+  set_text(entry, 1, round->word, round->word != NULL ? strlen(round->word) : 0);
+  set_text(entry, 2, round->winner, round->winner != NULL ? strlen(round->winner) : 0);
+  finish_entry(ring);
+}
+
+/**
+ * Find a string's id in the dictionary, adding the string if it isn't there yet. The caller
+ * makes sure there is room for it.
+ */
+static uint32_t dictionary_id(const char* string, size_t len) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t) string[i]) * 1099511628211ULL;
+  }
+
+  size_t slot = hash & (DICTIONARY_SLOTS - 1);
+  while (dictionary->slots[slot] != 0) {
+    uint32_t id = dictionary->slots[slot] - 1;
+    if (dictionary->lens[id] == len && memcmp(dictionary->strings[id], string, len) == 0) {
+      return id;
+    }
+    slot = (slot + 1) & (DICTIONARY_SLOTS - 1);
+  }
+
+  uint32_t id = dictionary->num_strings++;
+  memcpy(dictionary->strings[id], string, len);
+  dictionary->lens[id] = len;
+  dictionary->slots[slot] = id + 1;
+  return id;
+}
+
+/**
+ * Write a whole buffer to the current file.
+ *
+ * \returns Non-zero value if an error occurs.
+ */
+static int write_all(const uint8_t* buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(file_fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    buf += written;
+    len -= written;
+    file_bytes += written;
+  }
+  return 0;
+}
+
+/**
+ * Start the next file, with an empty dictionary.
+ *
+ * \returns Non-zero value if an error occurs.
+ */
+static int open_file(void) {
+  char path[MAX_PATH_BYTES + 16];
+  while (true) {
+    snprintf(path, sizeof(path), "%s.%06u", file_path, next_file++);
+    file_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (file_fd != -1 || errno != EEXIST) {
+      break;
+    }
+  }
+  if (file_fd == -1) {
+    log_perror("Failed to create analytics file %s", path);
+    return -1;
+  }
+
+  file_bytes = 0;
+  memset(dictionary->slots, 0, sizeof(dictionary->slots));
+  dictionary->num_strings = 0;
+  dictionary->num_written = 0;
+  if (write_all((const uint8_t*) ANALYTICS_MAGIC, strlen(ANALYTICS_MAGIC)) == -1) {
+    log_perror("Failed to write analytics file %s", path);
+    close(file_fd);
+    file_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Encode the events of one kind in the batch as a block, at the end of the output.
+ *
+ * \returns The new length of the output.
+ */
+static size_t encode_block(size_t out_len, analytics_kind_t kind, size_t num_entries,
+                           uint64_t num_dropped) {
+  size_t num_rows = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    num_rows += batch[i].kind == kind;
+  }
+  if (num_rows == 0 && num_dropped == 0) {
+    return out_len;
+  }
+
+  // Every string of the block gets its id first, so the strings it adds come before the columns.
+  int num_texts = kind == ANALYTICS_GUESS ? 2 : 3;
+  int num_numbers = kind == ANALYTICS_GUESS ? 2 : 6;
+  static uint32_t ids[BATCH_RECORDS][NUM_TEXTS];
+  for (size_t i = 0, row = 0; i < num_entries; i++) {
+    if (batch[i].kind != kind) {
+      continue;
+    }
+    for (int text = 0; text < num_texts; text++) {
+      ids[row][text] = dictionary_id(batch[i].texts[text], batch[i].text_lens[text]);
+    }
+    row++;
+  }
+
+  uint8_t* block = out_buffer + out_len;
+  size_t len = sizeof(uint32_t);
+  block[len++] = kind;
+  len += analytics_put_varint(block + len, num_rows);
+  len += analytics_put_varint(block + len, num_dropped);
+  len += analytics_put_varint(block + len, dictionary->num_strings - dictionary->num_written);
+  for (uint32_t id = dictionary->num_written; id < dictionary->num_strings; id++) {
+    len += analytics_put_varint(block + len, dictionary->lens[id]);
+    memcpy(block + len, dictionary->strings[id], dictionary->lens[id]);
+    len += dictionary->lens[id];
+  }
+  dictionary->num_written = dictionary->num_strings;
+
+  // Column by column, so that each column's values (mostly small deltas and ids) sit together.
+  uint64_t prev_us = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    if (batch[i].kind == kind) {
+      len += analytics_put_varint(block + len, batch[i].timestamp_us - prev_us);
+      prev_us = batch[i].timestamp_us;
+    }
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    if (batch[i].kind == kind) {
+      len += analytics_put_varint(block + len, batch[i].room_id);
+    }
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    if (batch[i].kind == kind) {
+      len += analytics_put_varint(block + len, batch[i].round);
+    }
+  }
+  for (int text = 0; text < num_texts; text++) {
+    for (size_t i = 0, row = 0; i < num_entries; i++) {
+      if (batch[i].kind != kind) {
+        continue;
+      }
+      // A round's winner is 0 when nobody won.
+      uint64_t value = ids[row++][text];
+      if (text == 2) {
+        value = batch[i].has_winner ? value + 1 : 0;
+      }
+      len += analytics_put_varint(block + len, value);
+    }
+  }
+  for (int number = 0; number < num_numbers; number++) {
+    for (size_t i = 0; i < num_entries; i++) {
+      if (batch[i].kind == kind) {
+        len += analytics_put_varint(block + len, batch[i].numbers[number]);
+      }
+    }
+  }
+
+  uint32_t block_len = len - sizeof(uint32_t);
+  memcpy(block, &block_len, sizeof(block_len));
+  return out_len + len;
+}
+
+static int by_timestamp(const void* a, const void* b) {
+  uint64_t timestamp_a = ((const analytics_entry_t*) a)->timestamp_us;
+  uint64_t timestamp_b = ((const analytics_entry_t*) b)->timestamp_us;
+  return timestamp_a < timestamp_b ? -1 : timestamp_a > timestamp_b ? 1 : 0;
+}
+
+/**
+ * Take up to BATCH_RECORDS events from the rings and append them to the current file, as a block
+ * of guesses and a block of rounds written together. Must be called with write_lock held.
+ *
+ * \returns Whether the batch was full, in which case more events may be waiting.
+ */
+static bool write_batch(void) {
+  // Rings are never freed, and new ones are only added in front of the first.
+  size_t num_entries = 0;
+  uint64_t num_dropped = atomic_exchange(&num_dropped_without_ring, 0);
+  for (analytics_ring_t* ring = atomic_load(&all_rings); ring != NULL; ring = ring->next) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail < head && num_entries < BATCH_RECORDS) {
+      batch[num_entries++] = ring->entries[tail++ & RING_MASK];
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    num_dropped += atomic_exchange_explicit(&ring->num_dropped, 0, memory_order_relaxed);
+  }
+  if (num_entries == 0 && num_dropped == 0) {
+    return false;
+  }
+  qsort(batch, num_entries, sizeof(analytics_entry_t), by_timestamp);
+
+  // A full file (or dictionary) is left as it is, and the batch starts the next one.
+  bool is_dictionary_full =
+      dictionary->num_strings + num_entries * NUM_TEXTS > ANALYTICS_MAX_STRINGS;
+  if (file_fd != -1 && (file_bytes >= max_bytes || is_dictionary_full)) {
+    close(file_fd);
+    file_fd = -1;
+  }
+  if (file_fd == -1 && open_file() == -1) {
+    return num_entries == BATCH_RECORDS;
+  }
+
+  size_t out_len = encode_block(0, ANALYTICS_GUESS, num_entries, num_dropped);
+  out_len = encode_block(out_len, ANALYTICS_ROUND, num_entries, 0);
+  if (write_all(out_buffer, out_len) == -1) {
+    log_perror("Failed to write analytics");
+  }
+  return num_entries == BATCH_RECORDS;
+}
+
+// Write every event recorded so far, on the calling thread.
+void analytics_flush(void) {
+  if (!analytics_is_on) {
+    return;
+  }
+
+  pthread_mutex_lock(&write_lock);
+  while (write_batch()) {
+  }
+  pthread_mutex_unlock(&write_lock);
+}
+
+/**
+ * Write what was recorded every ANALYTICS_FLUSH_INTERVAL_MS.
+ */
+static void* write_analytics(void* args) {
+  (void) args;
+  struct timespec interval = {.tv_sec = ANALYTICS_FLUSH_INTERVAL_MS / 1000,
+                              .tv_nsec = ANALYTICS_FLUSH_INTERVAL_MS % 1000 * 1000000L};
+  while (true) {
+    nanosleep(&interval, NULL);
+    analytics_flush();
+  }
+  return NULL;
+}
+
+// Start writing the files, and the background thread.
+int analytics_start(const char* path, size_t max_file_bytes) {
+  if (strlen(path) >= MAX_PATH_BYTES) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  snprintf(file_path, sizeof(file_path), "%s", path);
+  max_bytes = max_file_bytes;
+
+  dictionary = calloc(1, sizeof(dictionary_t));
+  batch = malloc(sizeof(analytics_entry_t) * BATCH_RECORDS);
+  out_buffer = malloc(OUT_BUFFER_BYTES);
+  if (dictionary == NULL || batch == NULL || out_buffer == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  dictionary->strings = malloc(ANALYTICS_TEXT_BYTES * (size_t) ANALYTICS_MAX_STRINGS);
+  dictionary->lens = malloc(ANALYTICS_MAX_STRINGS);
+  if (dictionary->strings == NULL || dictionary->lens == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_analytics, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(writer);
+  analytics_is_on = true;
+  atexit(analytics_flush);
+  return 0;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Game analytics: every guess and every round that ends is streamed to files for offline
+// analysis. A thread that records an event only copies it into a ring buffer of its own (a
+// single-producer, single-consumer queue, dropping the event if the ring is full), and a
+// background thread takes every ring's events, in the order they were recorded, encodes them in
+// columnar blocks, and appends each block to the current file with a single write. Once a file
+// reaches its maximum size, or its dictionary is full, the next block starts a new one, named
+// after the path with a sequence number (path.000001, path.000002, and so on, skipping names
+// that already exist). analyticscsv turns the files back into CSV.
+// Recording is thread-safe, and only takes a lock the first time a thread records. While
+// analytics are off, recording an event only checks a flag.
+
+#define ANALYTICS_RING_RECORDS 1024 // Events that can wait to be written per thread (a power of 2)
+#define ANALYTICS_MAX_RINGS 256     // Threads that can have a ring at once
+#define ANALYTICS_TEXT_BYTES 32     // Longer names and words are truncated
+#define ANALYTICS_MAX_STRINGS 65536 // Dictionary entries a file can have
+#define ANALYTICS_FLUSH_INTERVAL_MS 1000 // How often the background thread writes a block
+#define ANALYTICS_MAGIC "WGGAMES1"
+
+// File format: ANALYTICS_MAGIC, then blocks. A block is its length (4 bytes, host byte order, not
+// counting the length itself), its kind (1 byte), and then varints (7 bits a byte, least
+// significant first, the high bit set on every byte but the last): the number of rows, the
+// number of events dropped since the block before, the number of strings added to the file's
+// dictionary followed by each string (its length and its bytes), and then the rows column by
+// column. Strings are dictionary ids, given out in the order the strings were added (from 0 in
+// each file). Rows are in the order they were recorded, and timestamps (microseconds since the
+// epoch) are the difference from the row before, with the block's first row relative to 0.
+// A block that was only partly written (by a process that died) ends the file.
+//
+// Columns of a guess block: timestamp, room, round, player, guess, flags (ANALYTICS_CORRECT and
+// ANALYTICS_WINNER), and milliseconds since the guessing phase opened.
+// Columns of a round block: timestamp, room, round, host, secret word, winner (its id plus 1, or 0
+// if nobody won), outcome, players, questions asked, guesses, milliseconds from when the word was
+// picked to the end of the round, and milliseconds of the guessing phase (0 if it never opened).
+
+typedef enum analytics_kind {
+  ANALYTICS_GUESS = 1,
+  ANALYTICS_ROUND = 2
+} analytics_kind_t;
+
+#define ANALYTICS_CORRECT 1 // The guess was the secret word
+#define ANALYTICS_WINNER 2  // The guess won the round
+
+typedef enum analytics_outcome {
+  ANALYTICS_SOLVED,    // A player guessed the secret word
+  ANALYTICS_TIMED_OUT, // Nobody guessed the secret word in time
+  ANALYTICS_ABANDONED, // The host left
+  NUM_ANALYTICS_OUTCOMES
+} analytics_outcome_t;
+
+typedef struct analytics_guess {
+  uint32_t room_id;
+  uint32_t round;
+  const char* player;
+  const char* guess;
+  size_t guess_len;
+  uint32_t flags;
+  uint32_t guess_ms;
+} analytics_guess_t;
+
+typedef struct analytics_round {
+  uint32_t room_id;
+  uint32_t round;
+  const char* host;
+  const char* word;
+  const char* winner; // NULL if nobody won
+  analytics_outcome_t outcome;
+  uint32_t num_players;
+  uint32_t num_questions;
+  uint32_t num_guesses;
+  uint32_t solve_ms;
+  uint32_t guessing_ms;
+} analytics_round_t;
+
+extern const char* analytics_outcome_names[NUM_ANALYTICS_OUTCOMES];
+
+extern bool analytics_is_on; // Only set by analytics_start
+
+// Start writing the files, named after path, and the background thread. Files are started anew
+// once they reach max_file_bytes. Whatever is still waiting is written when the process exits.
+// Returns non-zero value if an error occurs.
+int analytics_start(const char* path, size_t max_file_bytes);
+
+// Record a guess on the calling thread's ring.
+void analytics_record_guess(const analytics_guess_t* guess);
+
+// Record a round that ended on the calling thread's ring.
+void analytics_record_round(const analytics_round_t* round);
+
+// Write every event recorded so far, on the calling thread.
+void analytics_flush(void);
+
+// Encode a varint. Returns the number of bytes it takes (at most 10).
+static inline size_t analytics_put_varint(uint8_t* buf, uint64_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (uint8_t) value | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = (uint8_t) value;
+  return len;
+}
+
+// Decode a varint from the first len bytes of buf. Returns the number of bytes it takes, or 0 if
+// it continues past len bytes (or is too long).
+static inline size_t analytics_get_varint(const uint8_t* buf, size_t len, uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < len && i < 10; i++) {
+    *value |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+    if ((buf[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "analytics.h"
+
+// Converts analytics files written by the server into CSV: the guesses, or with -r the rounds, of
+// every file in the order given, with a header line. Timestamps are seconds since the epoch.
+
+typedef struct string {
+  char* bytes;
+  size_t len;
+} string_t;
+
+// The strings of the file being read
+typedef struct dictionary {
+  string_t* strings;
+  size_t num_strings;
+} dictionary_t;
+
+// A block being read, column by column
+typedef struct block_reader {
+  const uint8_t* data;
+  size_t len;
+  size_t offset;
+  bool is_valid;
+} block_reader_t;
+
+/**
+ * Read the next varint of a block. Once the block runs out, every varint reads as 0.
+ */
+uint64_t next_varint(block_reader_t* reader) {
+  uint64_t value;
+  size_t len = analytics_get_varint(reader->data + reader->offset, reader->len - reader->offset,
+                                    &value);
+  if (len == 0) {
+    reader->is_valid = false;
+    return 0;
+  }
+  reader->offset += len;
+  return value;
+}
+
+/**
+ * Write a string as a CSV field, quoted if it has to be.
+ */
+void print_csv_string(const string_t* string) {
+  bool needs_quotes = false;
+  for (size_t i = 0; i < string->len; i++) {
+    needs_quotes = needs_quotes || strchr(",\"\r\n", string->bytes[i]) != NULL;
+  }
+  if (!needs_quotes) {
+    fwrite(string->bytes, 1, string->len, stdout);
+    return;
+  }
+
+  putchar('"');
+  for (size_t i = 0; i < string->len; i++) {
+    if (string->bytes[i] == '"') {
+      putchar('"');
+    }
+    putchar(string->bytes[i]);
+  }
+  putchar('"');
+}
+
+/**
+ * Look a string up by its id.
+ */
+const string_t* get_string(const dictionary_t* dictionary, uint64_t id, block_reader_t* reader) {
+  static const string_t empty = {.bytes = "", .len = 0};
+  if (id >= dictionary->num_strings) {
+    reader->is_valid = false;
+    return &empty;
+  }
+  return &dictionary->strings[id];
+}
+
+/**
+ * Read a block, adding its strings to the dictionary, and print its rows if they are of the kind
+ * asked for.
+ *
+ * \returns The number of events dropped before the block, or -1 if the block isn't valid.
+ */
+long long read_block(block_reader_t* reader, dictionary_t* dictionary, analytics_kind_t kind) {
+  analytics_kind_t block_kind = reader->data[reader->offset++];
+  uint64_t num_rows = next_varint(reader);
+  uint64_t num_dropped = next_varint(reader);
+  uint64_t num_strings = next_varint(reader);
+  if (!reader->is_valid || num_rows > reader->len || num_strings > reader->len) {
+    return -1;
+  }
+
+  dictionary->strings = realloc(dictionary->strings,
+                                sizeof(string_t) * (dictionary->num_strings + num_strings + 1));
+  for (uint64_t i = 0; i < num_strings; i++) {
+    uint64_t len = next_varint(reader);
+    if (!reader->is_valid || len > reader->len - reader->offset) {
+      return -1;
+    }
+    string_t* string = &dictionary->strings[dictionary->num_strings++];
+    string->bytes = malloc(len + 1);
+    memcpy(string->bytes, reader->data + reader->offset, len);
+    string->bytes[len] = '\0';
+    string->len = len;
+    reader->offset += len;
+  }
+
+  if (block_kind != kind || num_rows == 0) {
+    return num_dropped;
+  }
+
+  // The columns are read into rows before printing.
+  int num_columns = kind == ANALYTICS_GUESS ? 7 : 12;
+  uint64_t* columns = malloc(sizeof(uint64_t) * num_rows * num_columns);
+  for (int column = 0; column < num_columns; column++) {
+    uint64_t prev = 0;
+    for (uint64_t row = 0; row < num_rows; row++) {
+      uint64_t value = next_varint(reader);
+      if (column == 0) {
+        value += prev;
+        prev = value;
+      }
+      columns[column * num_rows + row] = value;
+    }
+  }
+  if (!reader->is_valid) {
+    free(columns);
+    return -1;
+  }
+
+  for (uint64_t row = 0; row < num_rows; row++) {
+    uint64_t timestamp_us = columns[row];
+    printf("%llu.%06llu,%llu,%llu,", (unsigned long long)(timestamp_us / 1000000),
+           (unsigned long long)(timestamp_us % 1000000),
+           (unsigned long long) columns[num_rows + row],
+           (unsigned long long) columns[2 * num_rows + row]);
+    print_csv_string(get_string(dictionary, columns[3 * num_rows + row], reader));
+    putchar(',');
+    print_csv_string(get_string(dictionary, columns[4 * num_rows + row], reader));
+
+    if (kind == ANALYTICS_GUESS) {
+      uint64_t flags = columns[5 * num_rows + row];
+      printf(",%d,%d,%llu\n", (flags & ANALYTICS_CORRECT) != 0, (flags & ANALYTICS_WINNER) != 0,
+             (unsigned long long) columns[6 * num_rows + row]);
+      continue;
+    }
+
+    putchar(',');
+    uint64_t winner = columns[5 * num_rows + row];
+    if (winner != 0) {
+      print_csv_string(get_string(dictionary, winner - 1, reader));
+    }
+    uint64_t outcome = columns[6 * num_rows + row];
+    printf(",%s", outcome < NUM_ANALYTICS_OUTCOMES ? analytics_outcome_names[outcome] : "?");
+    for (int column = 7; column < num_columns; column++) {
+      printf(",%llu", (unsigned long long) columns[column * num_rows + row]);
+    }
+    putchar('\n');
+  }
+
+  free(columns);
+  return reader->is_valid ? (long long) num_dropped : -1;
+}
+
+/**
+ * Print the rows of one file.
+ *
+ * \returns The number of events dropped by the server while it wrote the file, or -1 if the file
+ *          can't be read.
+ */
+long long read_file(const char* path, analytics_kind_t kind) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  char magic[sizeof(ANALYTICS_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, ANALYTICS_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s is not an analytics file\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  // Every file starts with an empty dictionary.
+  dictionary_t dictionary = {.strings = NULL, .num_strings = 0};
+  long long num_dropped = 0;
+  uint8_t* data = NULL;
+  uint32_t block_len;
+  while (fread(&block_len, sizeof(block_len), 1, file) == 1) {
+    data = realloc(data, block_len > 0 ? block_len : 1);
+    if (block_len == 0 || fread(data, 1, block_len, file) != block_len) {
+      fprintf(stderr, "%s ends with a block that was only partly written\n", path);
+      break;
+    }
+
+    block_reader_t reader = {.data = data, .len = block_len, .offset = 0, .is_valid = true};
+    long long num_block_dropped = read_block(&reader, &dictionary, kind);
+    if (num_block_dropped == -1) {
+      fprintf(stderr, "%s has a block that isn't valid\n", path);
+      break;
+    }
+    num_dropped += num_block_dropped;
+  }
+
+  for (size_t i = 0; i < dictionary.num_strings; i++) {
+    free(dictionary.strings[i].bytes);
+  }
+  free(dictionary.strings);
+  free(data);
+  fclose(file);
+  return num_dropped;
+}
+
+int main(int argc, char** argv) {
+  analytics_kind_t kind = ANALYTICS_GUESS;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r")) != -1) {
+    switch (opt) {
+      case 'r':
+        kind = ANALYTICS_ROUND;
+        break;
+      default:
+        argc = 0; // Print the usage message below
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-r] <analytics file>...\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  if (kind == ANALYTICS_GUESS) {
+    printf("time,room,round,player,guess,correct,winner,guess_ms\n");
+  } else {
+    printf("time,room,round,host,word,winner,outcome,players,questions,guesses,solve_ms,"
+           "guessing_ms\n");
+  }
+
+  bool is_ok = true;
+  long long num_dropped = 0;
+  for (int i = optind; i < argc; i++) {
+    long long num_file_dropped = read_file(argv[i], kind);
+    is_ok = is_ok && num_file_dropped != -1;
+    num_dropped += num_file_dropped > 0 ? num_file_dropped : 0;
+  }
+
+  if (num_dropped > 0) {
+    fprintf(stderr, "The server dropped %lld events that didn't fit\n", num_dropped);
+  }
+  return is_ok ? 0 : 1;
+}
@@ -1,19 +1,116 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include "message.h"
 #include "socket.h"
 
+/*******************
+ * Client Settings
+ *******************/
+#define RECONNECT_ATTEMPTS 10 // Times to try connecting again after the connection dropped
+#define RECONNECT_DELAY 1 // Seconds between attempts to connect again
+
 /*******************
  * Global variables
  *******************/
 // Keep the username in a global so we can access it.
 const char *username;
 
+// Where to connect again if the connection drops.
+char* server_name;
+unsigned short port;
+
+// Replacing a dropped connection and sending messages never happen at the same time.
+pthread_mutex_t connection_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t connection_changed = PTHREAD_COND_INITIALIZER;
+bool is_reconnecting = false; // The connection dropped and is being replaced
+bool is_disconnected = false; // The connection is gone for good
+bool is_quitting = false; // The player asked to leave, so a dropped connection is expected
+
+/**
+ * Wait until messages can be sent, and take the connection lock so that the connection can't be 
+ * replaced while a message is sent.
+ * 
+ * \returns false if the connection is gone for good (and the lock isn't taken).
+ */
+bool lock_connection(int socket_fd) {
+  while (true) {
+    bool is_active = session_wait(socket_fd);
+
+    pthread_mutex_lock(&connection_lock);
+    if (is_disconnected) {
+      pthread_mutex_unlock(&connection_lock);
+      return false;
+    }
+
+    // Without a session (the server only speaks the legacy format), messages are sent right away.
+    if (!is_reconnecting && (is_active == session_is_active(socket_fd))) {
+      return true;
+    }
+
+    while (is_reconnecting) {
+      pthread_cond_wait(&connection_changed, &connection_lock);
+    }
+    pthread_mutex_unlock(&connection_lock);
+  }
+}
+
+/**
+ * Connect to the server again after the connection dropped, and ask for the player's seat back. 
+ * The new connection gets the same file descriptor, so the other thread keeps using it.
+ * 
+ * \returns true if the seat was asked for, or false if the connection is gone for good.
+ */
+bool reconnect(int socket_fd) {
+  // Only a session the server accepted has a seat to take back.
+  pthread_mutex_lock(&connection_lock);
+  uint64_t token = session_token(socket_fd);
+  bool can_resume = token != 0 && session_is_active(socket_fd) && !is_quitting;
+  is_reconnecting = can_resume;
+  is_disconnected = !can_resume;
+  session_end(socket_fd);
+  pthread_cond_broadcast(&connection_changed);
+  pthread_mutex_unlock(&connection_lock);
+
+  if (!can_resume) {
+    return false;
+  }
+
+  printf("Connection lost. Reconnecting...\n");
+  bool is_resumed = false;
+  for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && !is_resumed; attempt++) {
+    // Give a network that just went down a moment to come back.
+    sleep(RECONNECT_DELAY);
+
+    int new_socket_fd = socket_connect(server_name, port);
+    if (new_socket_fd == -1) {
+      continue;
+    }
+
+    pthread_mutex_lock(&connection_lock);
+    is_resumed = dup2(new_socket_fd, socket_fd) != -1 && session_resume(socket_fd, token) == 0;
+    pthread_mutex_unlock(&connection_lock);
+    close(new_socket_fd);
+  }
+
+  pthread_mutex_lock(&connection_lock);
+  is_reconnecting = false;
+  is_disconnected = !is_resumed;
+  pthread_cond_broadcast(&connection_changed);
+  pthread_mutex_unlock(&connection_lock);
+
+  if (!is_resumed) {
+    perror("Failed to reconnect");
+  }
+  return is_resumed;
+}
+
 /**
  * Read in user input and send that message to the server.
  */
@@ -33,13 +130,24 @@ void* send_to_server (void* args) {
     user_info->username = strdup(username);
     user_info->message = strdup(line);
 
-    // Send message to server.
-    int rc = send_message(socket_fd, user_info);
-
-    if (rc == -1) {
-      perror("Failed to send message to server");
-      close(socket_fd); // Close client's side of the socket connecting to server.
-      exit(EXIT_FAILURE);
+    // Send message to server. Messages typed before the server accepted the session (or while the 
+    // connection is being replaced) are sent once it has. If the connection dropped, the message 
+    // is sent again over the new one.
+    int rc = -1;
+    while (rc == -1) {
+      if (!lock_connection(socket_fd)) {
+        fprintf(stderr, "Lost the connection to the server\n");
+        close(socket_fd); // Close client's side of the socket connecting to server.
+        exit(EXIT_FAILURE);
+      }
+
+      is_quitting = strcmp(line, "quit") == 0;
+      rc = send_message(socket_fd, user_info);
+      pthread_mutex_unlock(&connection_lock);
+
+      if (rc == -1) {
+        perror("Failed to send message to server");
+      }
     }
 
     free(user_info->username);
@@ -69,8 +177,11 @@ void* read_from_server (void* args) {
     // Receive a message from the server
     user_info_t* user_info = receive_message(socket_fd);
     
-    // Error receiving the message.
+    // The connection dropped, so take the seat back over a new one if there is one to take.
     if (user_info == NULL) {
+      if (reconnect(socket_fd)) {
+        continue;
+      }
       break;
     }
 
@@ -82,21 +193,25 @@ void* read_from_server (void* args) {
     free(user_info->message);
     free(user_info);
   }
-  
+
   return NULL;
 }
 
 int main(int argc, char** argv) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s <username> <server name> <port>\n", argv[0]);
+  // A Unix socket (unix:<path>) doesn't need a port.
+  bool is_local = argc >= 3 && 
+                  strncmp(argv[2], SOCKET_UNIX_PREFIX, strlen(SOCKET_UNIX_PREFIX)) == 0;
+  if (argc != 4 && !(argc == 3 && is_local)) {
+    fprintf(stderr, "Usage: %s <username> <server name> <port>\n"
+                    "       %s <username> unix:<socket path>\n", argv[0], argv[0]);
     exit(EXIT_FAILURE);
   }
 
   username = argv[1];
 
   // Read command line arguments
-  char* server_name = argv[2];
-  unsigned short port = atoi(argv[3]);
+  server_name = argv[2];
+  port = argc == 4 ? atoi(argv[3]) : 0;
 
   // Connect to the server
   int socket_fd = socket_connect(server_name, port);
@@ -104,6 +219,12 @@ int main(int argc, char** argv) {
     perror("Failed to connect");
     exit(EXIT_FAILURE);
   }
+
+  // Register the username once, instead of sending it with every message.
+  if (session_hello(socket_fd, username) == -1) {
+    perror("Failed to send message to server");
+    exit(EXIT_FAILURE);
+  }
   
   // Begin sending and reading messages to/from the server.
   pthread_t send_message_thread;
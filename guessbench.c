@@ -0,0 +1,165 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "secret.h"
+
+// Times the two ways a guess can be checked against the secret word: comparing it with the word
+// ignoring case (like frame_message_equals), and comparing its keyed hash with the word's (like
+// the server does). Both see the same guesses, a few of which are right, and must agree on how
+// many are.
+
+#define DEFAULT_GUESSES 1000000
+#define DEFAULT_RUNS 5           // Runs of each check, the fastest of which is reported
+#define SECRET_WORD "pineapple"
+#define MAX_GUESS_LEN 16
+#define RIGHT_GUESS_EVERY 1000   // Every this many guesses, one is the secret word (in mixed case)
+
+typedef struct guess {
+  char text[MAX_GUESS_LEN];
+  size_t len;
+} guess_t;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Make up guesses of random letters. Their lengths are spread like real words', or are all the
+ * secret word's length, when every guess gets past the length check.
+ */
+static void make_guesses(guess_t* guesses, size_t num_guesses, bool same_len) {
+  size_t secret_len = strlen(SECRET_WORD);
+  for (size_t i = 0; i < num_guesses; i++) {
+    if (i % RIGHT_GUESS_EVERY == 0) {
+      memcpy(guesses[i].text, "PineApple", secret_len);
+      guesses[i].len = secret_len;
+      continue;
+    }
+
+    guesses[i].len = same_len ? secret_len : 3 + rand() % 10;
+    for (size_t j = 0; j < guesses[i].len; j++) {
+      // Many guesses start like the word does, so the comparison doesn't always stop at once.
+      guesses[i].text[j] = j == 0 && rand() % 2 ? 'p' : 'a' + rand() % 26;
+    }
+  }
+}
+
+/**
+ * Check every guess by comparing it with the word, ignoring case. Returns the number of right
+ * guesses.
+ */
+static size_t check_by_compare(const guess_t* guesses, size_t num_guesses, const char* word) {
+  size_t num_right = 0;
+  for (size_t i = 0; i < num_guesses; i++) {
+    size_t word_len = strlen(word);
+    if (guesses[i].len == word_len && strncasecmp(guesses[i].text, word, word_len) == 0) {
+      num_right++;
+    }
+  }
+  return num_right;
+}
+
+/**
+ * Check every guess by comparing its length, then its hash, with the secret's. Returns the number
+ * of right guesses.
+ */
+static size_t check_by_hash(const guess_t* guesses, size_t num_guesses, const secret_t* secret) {
+  size_t num_right = 0;
+  for (size_t i = 0; i < num_guesses; i++) {
+    if (guesses[i].len == secret->len &&
+        secret_hash(guesses[i].text, guesses[i].len) == secret->hash) {
+      num_right++;
+    }
+  }
+  return num_right;
+}
+
+/**
+ * Time both checks over one set of guesses and print how long a guess took with each.
+ */
+static void run(const char* name, const guess_t* guesses, size_t num_guesses, int num_runs,
+                const secret_t* secret) {
+  uint64_t best_compare_ns = UINT64_MAX;
+  uint64_t best_hash_ns = UINT64_MAX;
+  size_t right_compare = 0;
+  size_t right_hash = 0;
+
+  // The checks take turns, so both see the CPU in the same state.
+  for (int i = 0; i < num_runs; i++) {
+    uint64_t start_ns = now_ns();
+    right_compare = check_by_compare(guesses, num_guesses, secret->word);
+    uint64_t elapsed_ns = now_ns() - start_ns;
+    best_compare_ns = elapsed_ns < best_compare_ns ? elapsed_ns : best_compare_ns;
+
+    start_ns = now_ns();
+    right_hash = check_by_hash(guesses, num_guesses, secret);
+    elapsed_ns = now_ns() - start_ns;
+    best_hash_ns = elapsed_ns < best_hash_ns ? elapsed_ns : best_hash_ns;
+  }
+
+  if (right_compare != right_hash) {
+    fprintf(stderr, "The checks disagree: %zu right guesses compared, %zu hashed\n",
+            right_compare, right_hash);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%s: strncasecmp %.1f ns/guess, keyed hash %.1f ns/guess (%zu of %zu guesses right)\n",
+         name, (double)best_compare_ns / num_guesses, (double)best_hash_ns / num_guesses,
+         right_hash, num_guesses);
+}
+
+int main(int argc, char** argv) {
+  long num_guesses = DEFAULT_GUESSES;
+  int num_runs = DEFAULT_RUNS;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_guesses = atol(optarg);
+        break;
+      case 'r':
+        num_runs = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n guesses] [-r runs]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc || num_guesses <= 0 || num_runs <= 0) {
+    fprintf(stderr, "Usage: %s [-n guesses] [-r runs]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  secret_t secret;
+  secret_init(&secret);
+  if (secret_init_key() != 0 || secret_set(&secret, SECRET_WORD, strlen(SECRET_WORD)) != 0) {
+    perror("Failed to hold the secret word");
+    exit(EXIT_FAILURE);
+  }
+
+  guess_t* guesses = malloc(sizeof(guess_t) * num_guesses);
+  if (guesses == NULL) {
+    perror("Failed to allocate the guesses");
+    exit(EXIT_FAILURE);
+  }
+
+  // The same guesses every time, so runs can be compared.
+  srand(1);
+  make_guesses(guesses, num_guesses, false);
+  run("mixed lengths", guesses, num_guesses, num_runs, &secret);
+  make_guesses(guesses, num_guesses, true);
+  run("secret's length", guesses, num_guesses, num_runs, &secret);
+
+  free(guesses);
+  secret_wipe(&secret);
+  return 0;
+}
@@ -0,0 +1,355 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define INITIAL_CAPACITY 4096
+#define FDS_PER_MESSAGE 250 // File descriptors passed per message (the kernel allows up to 253)
+#define ACKNOWLEDGEMENT 'A'
+
+// Wire format: the state's length and number of file descriptors (8 bytes each, little-endian),
+// the state, and then one message per FDS_PER_MESSAGE file descriptors, each a single byte with
+// the file descriptors attached. Numbers in the state are 8 bytes, little-endian, and strings
+// are their length plus one (0 for NULL) followed by the string without its null terminator.
+
+/**
+ * Make room for len more bytes in a buffer.
+ */
+static void reserve(handoff_buffer_t* buffer, size_t len) {
+  if (buffer->len + len <= buffer->capacity) {
+    return;
+  }
+
+  while (buffer->len + len > buffer->capacity) {
+    buffer->capacity = buffer->capacity > 0 ? buffer->capacity * 2 : INITIAL_CAPACITY;
+  }
+  buffer->data = realloc(buffer->data, buffer->capacity);
+}
+
+/**
+ * Write len bytes to a buffer.
+ */
+static void put_bytes(handoff_buffer_t* buffer, const void* bytes, size_t len) {
+  reserve(buffer, len);
+  memcpy(buffer->data + buffer->len, bytes, len);
+  buffer->len += len;
+}
+
+/**
+ * Read len bytes from a buffer, or nothing (invalidating the buffer) if there aren't that many.
+ *
+ * \returns The bytes, or NULL if the buffer isn't valid.
+ */
+static const char* get_bytes(handoff_buffer_t* buffer, size_t len) {
+  if (!buffer->is_valid || len > buffer->len - buffer->pos) {
+    buffer->is_valid = false;
+    return NULL;
+  }
+
+  const char* bytes = buffer->data + buffer->pos;
+  buffer->pos += len;
+  return bytes;
+}
+
+static void encode_u64(char* buf, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (char)(value >> (8 * i));
+  }
+}
+
+static uint64_t decode_u64(const char* buf) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)(unsigned char)buf[i] << (8 * i);
+  }
+  return value;
+}
+
+// Initialize an empty buffer.
+void handoff_buffer_init(handoff_buffer_t* buffer) {
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+  buffer->pos = 0;
+  buffer->is_valid = true;
+  buffer->fds = NULL;
+  buffer->num_fds = 0;
+  buffer->max_fds = 0;
+}
+
+// Free the memory of a buffer.
+void handoff_buffer_destroy(handoff_buffer_t* buffer) {
+  // The state has every room's secret word in it.
+  if (buffer->data != NULL) {
+    explicit_bzero(buffer->data, buffer->capacity);
+  }
+  free(buffer->data);
+  free(buffer->fds);
+  handoff_buffer_init(buffer);
+}
+
+// Write a number.
+void handoff_put_u64(handoff_buffer_t* buffer, uint64_t value) {
+  char buf[8];
+  encode_u64(buf, value);
+  put_bytes(buffer, buf, sizeof(buf));
+}
+
+// Write a string, or NULL.
+void handoff_put_string(handoff_buffer_t* buffer, const char* string) {
+  if (string == NULL) {
+    handoff_put_u64(buffer, 0);
+    return;
+  }
+
+  size_t len = strlen(string);
+  handoff_put_u64(buffer, len + 1);
+  put_bytes(buffer, string, len);
+}
+
+// Write a file descriptor.
+void handoff_put_fd(handoff_buffer_t* buffer, int fd) {
+  if (buffer->num_fds == buffer->max_fds) {
+    buffer->max_fds = buffer->max_fds > 0 ? buffer->max_fds * 2 : FDS_PER_MESSAGE;
+    buffer->fds = realloc(buffer->fds, sizeof(int) * buffer->max_fds);
+  }
+
+  handoff_put_u64(buffer, buffer->num_fds);
+  buffer->fds[buffer->num_fds++] = fd;
+}
+
+// Read a number.
+uint64_t handoff_get_u64(handoff_buffer_t* buffer) {
+  const char* bytes = get_bytes(buffer, 8);
+  return bytes == NULL ? 0 : decode_u64(bytes);
+}
+
+// Read a string, or NULL.
+char* handoff_get_string(handoff_buffer_t* buffer) {
+  uint64_t len = handoff_get_u64(buffer);
+  if (len == 0) {
+    return NULL;
+  }
+
+  const char* bytes = get_bytes(buffer, len - 1);
+  return bytes == NULL ? NULL : strndup(bytes, len - 1);
+}
+
+// Read a file descriptor.
+int handoff_get_fd(handoff_buffer_t* buffer) {
+  uint64_t index = handoff_get_u64(buffer);
+  if (!buffer->is_valid || index >= buffer->num_fds) {
+    buffer->is_valid = false;
+    return -1;
+  }
+
+  return buffer->fds[index];
+}
+
+/**
+ * Set up the address of the Unix socket at path.
+ *
+ * \returns Non-zero value if the path is too long.
+ */
+static int make_address(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+// Open the Unix socket a new server process connects to.
+int handoff_listen(const char* path) {
+  struct sockaddr_un addr;
+  if (make_address(path, &addr) == -1) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  // The process this one took over from doesn't need its socket anymore.
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 1)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Connect to the server process listening at path.
+int handoff_connect(const char* path) {
+  struct sockaddr_un addr;
+  if (make_address(path, &addr) == -1) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Write all of a buffer to the channel.
+ */
+static int write_all(int channel, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t rc = write(channel, buf, len);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return -1;
+    }
+    buf += rc;
+    len -= rc;
+  }
+
+  return 0;
+}
+
+/**
+ * Read exactly len bytes from the channel.
+ */
+static int read_all(int channel, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t rc = read(channel, buf, len);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      if (rc == 0) {
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+    buf += rc;
+    len -= rc;
+  }
+
+  return 0;
+}
+
+// Send the state in a buffer and its file descriptors.
+int handoff_send(int channel, const handoff_buffer_t* state) {
+  char header[16];
+  encode_u64(header, state->len);
+  encode_u64(header + 8, state->num_fds);
+  if (write_all(channel, header, sizeof(header)) == -1 ||
+      write_all(channel, state->data, state->len) == -1) {
+    return -1;
+  }
+
+  char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+  for (size_t first = 0; first < state->num_fds; first += FDS_PER_MESSAGE) {
+    size_t num_fds = state->num_fds - first;
+    if (num_fds > FDS_PER_MESSAGE) {
+      num_fds = FDS_PER_MESSAGE;
+    }
+
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = CMSG_SPACE(sizeof(int) * num_fds)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+    memcpy(CMSG_DATA(cmsg), state->fds + first, sizeof(int) * num_fds);
+
+    ssize_t rc;
+    while ((rc = sendmsg(channel, &msg, 0)) == -1 && errno == EINTR) {
+    }
+    if (rc != 1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Receive the state and its file descriptors.
+int handoff_receive(int channel, handoff_buffer_t* state) {
+  char header[16];
+  if (read_all(channel, header, sizeof(header)) == -1) {
+    return -1;
+  }
+
+  size_t len = decode_u64(header);
+  size_t num_fds = decode_u64(header + 8);
+  reserve(state, len);
+  if (read_all(channel, state->data, len) == -1) {
+    return -1;
+  }
+  state->len = len;
+  state->fds = malloc(sizeof(int) * (num_fds > 0 ? num_fds : 1));
+  state->max_fds = num_fds;
+
+  // Each message carries a single byte, so the file descriptors attached to two messages are
+  // never read at once.
+  char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+  while (state->num_fds < num_fds) {
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+    ssize_t rc;
+    while ((rc = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+    if (rc != 1 || (msg.msg_flags & MSG_CTRUNC)) {
+      errno = rc == 0 ? ECONNRESET : EMFILE;
+      return -1;
+    }
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+
+      size_t num_received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (num_received > num_fds - state->num_fds) {
+        errno = EPROTO;
+        return -1;
+      }
+      memcpy(state->fds + state->num_fds, CMSG_DATA(cmsg), sizeof(int) * num_received);
+      state->num_fds += num_received;
+    }
+  }
+
+  return 0;
+}
+
+// Tell the old process that the state arrived.
+int handoff_acknowledge(int channel) {
+  char byte = ACKNOWLEDGEMENT;
+  return write_all(channel, &byte, 1);
+}
+
+// Wait until the new process says the state arrived.
+bool handoff_wait_acknowledged(int channel) {
+  char byte;
+  return read_all(channel, &byte, 1) == 0 && byte == ACKNOWLEDGEMENT;
+}
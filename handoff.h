@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hands a running server over to a new server process (a hot restart). The new process connects
+// to the old one over a Unix socket, and the old one sends it a description of its state followed
+// by every socket the state refers to, passed with SCM_RIGHTS, so no connection is ever closed.
+// The state is written into a buffer with the put functions and read back in the same order with
+// the get functions. Sockets are written as indexes into the buffer's list of file descriptors.
+// A buffer is not thread-safe: callers must serialize access to it.
+
+typedef struct handoff_buffer {
+  char* data;
+  size_t len;      // Bytes written
+  size_t capacity;
+  size_t pos;      // Bytes read
+  bool is_valid;   // Cleared once a get found something it couldn't read (later gets return 0)
+  int* fds;        // The file descriptors the state refers to
+  size_t num_fds;
+  size_t max_fds;
+} handoff_buffer_t;
+
+// Initialize an empty buffer.
+void handoff_buffer_init(handoff_buffer_t* buffer);
+
+// Free the memory of a buffer. The file descriptors in it are not closed.
+void handoff_buffer_destroy(handoff_buffer_t* buffer);
+
+// Write a number.
+void handoff_put_u64(handoff_buffer_t* buffer, uint64_t value);
+
+// Write a null-terminated string, or NULL.
+void handoff_put_string(handoff_buffer_t* buffer, const char* string);
+
+// Write a file descriptor, which is sent along with the state.
+void handoff_put_fd(handoff_buffer_t* buffer, int fd);
+
+// Read a number.
+uint64_t handoff_get_u64(handoff_buffer_t* buffer);
+
+// Read a string (which must be freed later), or NULL if NULL was written.
+char* handoff_get_string(handoff_buffer_t* buffer);
+
+// Read a file descriptor that was received along with the state (-1 if the buffer isn't valid).
+int handoff_get_fd(handoff_buffer_t* buffer);
+
+// Open the Unix socket a new server process connects to, replacing whatever is at path (such as
+// the socket of the process being replaced, or one left behind by a crash). Returns the socket,
+// or -1 if an error occurs.
+int handoff_listen(const char* path);
+
+// Connect to the server process listening at path, to take over from it. Returns the connection,
+// or -1 if an error occurs (errno is ENOENT or ECONNREFUSED if no server is listening there).
+int handoff_connect(const char* path);
+
+// Send the state in a buffer and its file descriptors (old process). Returns non-zero value if
+// an error occurs.
+int handoff_send(int channel, const handoff_buffer_t* state);
+
+// Receive the state and its file descriptors into an empty buffer (new process). The file
+// descriptors are close-on-exec. Returns non-zero value if an error occurs.
+int handoff_receive(int channel, handoff_buffer_t* state);
+
+// Tell the old process that the state arrived, so it can exit (new process). Returns non-zero
+// value if an error occurs.
+int handoff_acknowledge(int channel);
+
+// Wait until the new process says the state arrived (old process). Returns false if the new
+// process gave up (or died) instead, in which case the old one keeps serving.
+bool handoff_wait_acknowledged(int channel);
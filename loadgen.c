@@ -0,0 +1,655 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "message.h"
+#include "socket.h"
+
+// Load generator for the server. Opens many player connections as fast as possible and checks
+// that every connection is greeted with its own welcome message. Optionally, it then measures how
+// fast the server relays messages by having the host send messages that every player receives.
+// With sessions, players register their name once instead of receiving it with every message.
+// The drop test instead has every player vanish at once, and measures how long the server takes to
+// find out and disconnect them.
+// The churn test opens and closes every connection over and over, for some rounds, so that the
+// server's memory can be watched (with wgstat, or its RSS) while connections come and go.
+// The game benchmark has every connection play whole games, following a fixed script: hosts pick
+// words from a word list, askers ask and hosts answer in turn, and every guesser then floods the
+// server with guesses from the list until someone finds the word. It measures how many guesses
+// the server checks per second and how long each guess takes to be answered. Players connect
+// again after each game, all together once every game ended, so that the lobby fills every room
+// (which takes a number of connections divisible by the room size).
+
+/*******************
+ * Load Generator Settings
+ *******************/
+#define DROP_TEST_TIMEOUT 120 // Seconds the drop test waits for the server to disconnect everyone
+#define NUM_WORDS 32 // Words in the game benchmark's word list
+#define RELAY_TIMEOUT 10 // Seconds the relay benchmark waits for a host or the next message
+
+/*******************
+ * Global variables
+ *******************/
+char* server_name;
+unsigned short port;
+int connections_per_thread;
+int relay_messages = 0;     // Number of messages the host sends in the relay benchmark
+bool use_sessions = false;  // Whether the connections ask the server for a session
+bool drop_test = false;     // Whether every player goes silent to see how fast the server notices
+int churn_rounds = 1;       // Number of times every connection is opened and closed
+int num_games = 0;          // Number of games every connection plays in the game benchmark
+
+atomic_int num_connected;   // Connections that were accepted and welcomed
+atomic_int num_failed;      // Connections that failed, weren't welcomed first, or missed relays
+atomic_int num_busy;        // Connections the server turned away because it was overloaded
+atomic_int host_fd = -1;    // The connection the server made the host
+atomic_int num_relayed;     // Connections that received every relayed message
+atomic_int num_games_played; // Games that connections saw to the end
+atomic_int num_rounds_won;  // Rounds of the game benchmark that a guess won
+atomic_long num_guesses;    // Guesses the server answered in the game benchmark
+pthread_barrier_t games_ended; // Where players of the game benchmark wait for every game to end
+
+// The game benchmark's script: hosts pick these words, and guessers try them in order.
+static const char* words[NUM_WORDS] = {
+  "apple", "banana", "cherry", "grape", "lemon", "mango", "melon", "peach", "pear", "plum", "kiwi",
+  "lime", "olive", "onion", "garlic", "carrot", "potato", "tomato", "pepper", "radish", "turnip",
+  "celery", "spinach", "lettuce", "cabbage", "pumpkin", "squash", "ginger", "almond", "walnut",
+  "cashew", "peanut"
+};
+
+// How long one player's guesses took to be answered, in microseconds.
+typedef struct latencies {
+  float* values;
+  size_t num_values;
+  size_t capacity;
+} latencies_t;
+
+/**
+ * Get the current time in seconds from a monotonic clock.
+ */
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Get the number of bytes this process has read so far, and the number of read system calls it
+ * took. Both are 0 if the kernel doesn't report them.
+ */
+void get_read_counters(long* bytes, long* reads) {
+  *bytes = 0;
+  *reads = 0;
+
+  FILE* file = fopen("/proc/self/io", "r");
+  if (file == NULL) {
+    return;
+  }
+
+  char line[64];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    sscanf(line, "rchar: %ld", bytes);
+    sscanf(line, "syscr: %ld", reads);
+  }
+  fclose(file);
+}
+
+/**
+ * Open this thread's share of connections and check the first message received on each one.
+ * The connections are kept open (like real players waiting in a game) and returned to main.
+ */
+void* connect_players(void* args) {
+  int* fds = (int*)args;
+
+  for (int i = 0; i < connections_per_thread; i++) {
+    fds[i] = socket_connect(server_name, port);
+    if (fds[i] == -1) {
+      atomic_fetch_add(&num_failed, 1);
+      continue;
+    }
+
+    if (use_sessions && session_hello(fds[i], "loadgen") == -1) {
+      atomic_fetch_add(&num_failed, 1);
+      continue;
+    }
+
+    // The first message on every connection must be the welcome message from the server.
+    user_info_t* user_info = receive_message(fds[i]);
+    if (user_info == NULL) {
+      atomic_fetch_add(&num_failed, 1);
+      continue;
+    }
+
+    if (strcmp(user_info->username, "Server") == 0 &&
+        strncmp(user_info->message, "Welcome", strlen("Welcome")) == 0) {
+      atomic_fetch_add(&num_connected, 1);
+    } else if (strcmp(user_info->username, "Server") == 0 &&
+               strncmp(user_info->message, "Server busy", strlen("Server busy")) == 0) {
+      // The server closes connections it turns away, so there is nothing left to keep open.
+      atomic_fetch_add(&num_busy, 1);
+      close(fds[i]);
+      fds[i] = -1;
+    } else {
+      atomic_fetch_add(&num_failed, 1);
+    }
+
+    free(user_info->username);
+    free(user_info->message);
+    free(user_info);
+  }
+
+  return NULL;
+}
+
+/**
+ * Receive messages on one connection during the relay benchmark, until all of the host's messages
+ * have arrived or none has for RELAY_TIMEOUT seconds.
+ */
+void* receive_relayed(void* args) {
+  int fd = *(int*)args;
+  int received = 0;
+  double deadline = now_seconds() + RELAY_TIMEOUT;
+
+  while (received < relay_messages) {
+    // Pings keep arriving while the host is silent and are answered inside receive_message, so
+    // the short receive timeout is what gets the player back here to look at the clock. Frames
+    // arrive whole, so the timeout falls between them.
+    user_info_t* user_info = receive_message(fd);
+    if (user_info == NULL) {
+      if ((errno == EAGAIN || errno == EWOULDBLOCK) && now_seconds() < deadline) {
+        continue;
+      }
+      return NULL;
+    }
+
+    // Only the first host's room takes part; players in any other room give up at the deadline.
+    if (strncmp(user_info->message, "You are the host", strlen("You are the host")) == 0) {
+      int no_host = -1;
+      atomic_compare_exchange_strong(&host_fd, &no_host, fd);
+    } else if (strncmp(user_info->message, "relay ", strlen("relay ")) == 0) {
+      received++;
+      deadline = now_seconds() + RELAY_TIMEOUT;
+    }
+
+    free(user_info->username);
+    free(user_info->message);
+    free(user_info);
+  }
+
+  atomic_fetch_add(&num_relayed, 1);
+  return NULL;
+}
+
+/**
+ * Have the host send relay_messages messages and measure how long it takes for every player to 
+ * receive all of them. Players that hear nothing for RELAY_TIMEOUT seconds give up and count as
+ * failed, which happens when there are more players than fit in a room.
+ */
+void run_relay_benchmark(int** fds, int num_threads) {
+  int num_players = num_threads * connections_per_thread;
+  pthread_t* readers = malloc(sizeof(pthread_t) * num_players);
+  int num_readers = 0;
+
+  struct timeval timeout = {.tv_sec = 1};
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < connections_per_thread; j++) {
+      if (fds[i][j] != -1) {
+        setsockopt(fds[i][j], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pthread_create(&readers[num_readers++], NULL, receive_relayed, &fds[i][j]);
+      }
+    }
+  }
+
+  // Wait for the server to pick a host, then set the secret word.
+  double deadline = now_seconds() + RELAY_TIMEOUT;
+  while (atomic_load(&host_fd) == -1 && now_seconds() < deadline) {
+    usleep(1000);
+  }
+  if (atomic_load(&host_fd) == -1) {
+    fprintf(stderr, "No player was made the host within %d s\n", RELAY_TIMEOUT);
+    for (int i = 0; i < num_readers; i++) {
+      pthread_join(readers[i], NULL);
+    }
+    atomic_fetch_add(&num_failed, num_readers - atomic_load(&num_relayed));
+    free(readers);
+    return;
+  }
+
+  // Once the host's session is accepted, it sends session frames like everyone else.
+  if (use_sessions) {
+    session_wait(atomic_load(&host_fd));
+  }
+
+  user_info_t user_info = {.username = "loadgen", .message = "secret"};
+  send_message(atomic_load(&host_fd), &user_info);
+
+  // The host's messages are forwarded to every player.
+  char message[32];
+  user_info.message = message;
+
+  // Give the players a moment to read the messages that started the game, so that only relayed
+  // messages are counted.
+  usleep(100000);
+  long start_bytes, start_reads;
+  get_read_counters(&start_bytes, &start_reads);
+
+  double start = now_seconds();
+  for (int i = 0; i < relay_messages; i++) {
+    snprintf(message, sizeof(message), "relay %d", i);
+    if (send_message(atomic_load(&host_fd), &user_info) == -1) {
+      perror("Failed to send message to server");
+      break;
+    }
+  }
+
+  for (int i = 0; i < num_readers; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  long end_bytes, end_reads;
+  get_read_counters(&end_bytes, &end_reads);
+
+  long delivered = (long)atomic_load(&num_relayed) * relay_messages;
+  printf("%d of %d players received all %d messages in %.3f s (%.0f deliveries/s)\n", 
+         atomic_load(&num_relayed), num_readers, relay_messages, elapsed, delivered / elapsed);
+  if (atomic_load(&num_relayed) < num_readers) {
+    // Players in other rooms than the host's never see the host's messages.
+    fprintf(stderr, "%d players went %d s without a relayed message; the room size may be "
+            "smaller than the number of connections\n", num_readers - atomic_load(&num_relayed),
+            RELAY_TIMEOUT);
+    atomic_fetch_add(&num_failed, num_readers - atomic_load(&num_relayed));
+  }
+  if (delivered > 0) {
+    printf("%.1f bytes and %.2f read calls per delivered message\n",
+           (double)(end_bytes - start_bytes) / delivered,
+           (double)(end_reads - start_reads) / delivered);
+  }
+
+  free(readers);
+}
+
+/**
+ * Have every player go silent at once, like clients whose machines vanished without closing their
+ * connections: nothing is read or sent anymore, so pings go unanswered. Measure how long it takes
+ * the server to find out and disconnect every player.
+ */
+void run_drop_test(int** fds, int num_threads) {
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    perror("Failed to create epoll instance");
+    return;
+  }
+
+  // The server closing its end is all that is watched for; nothing is ever read.
+  int num_players = 0;
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < connections_per_thread; j++) {
+      struct epoll_event event = {.events = EPOLLRDHUP, .data.fd = fds[i][j]};
+      if (fds[i][j] != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i][j], &event) == 0) {
+        num_players++;
+      }
+    }
+  }
+
+  double start = now_seconds();
+  double slowest = 0;
+  int num_dropped = 0;
+  struct epoll_event events[256];
+  while (num_dropped < num_players && now_seconds() - start < DROP_TEST_TIMEOUT) {
+    int num_events = epoll_wait(epoll_fd, events, 256, 1000);
+    for (int i = 0; i < num_events; i++) {
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+      slowest = now_seconds() - start;
+      num_dropped++;
+    }
+  }
+  close(epoll_fd);
+
+  printf("%d of %d silent players disconnected by the server in %.3f s\n", num_dropped, 
+         num_players, slowest);
+}
+
+/**
+ * Send a message from a player of the game benchmark. A send fails once the server closed the
+ * connection at the end of the game, but what the server sent before (like the end of the game)
+ * can still be read, so failures are left for the next receive to notice.
+ */
+void send_line(int fd, char* username, const char* message) {
+  user_info_t user_info = {.username = username, .message = (char*) message};
+  send_message(fd, &user_info);
+}
+
+/**
+ * Note how long a guess took to be answered.
+ */
+void add_latency(latencies_t* latencies, double seconds) {
+  if (latencies->num_values == latencies->capacity) {
+    latencies->capacity = latencies->capacity == 0 ? 1024 : latencies->capacity * 2;
+    latencies->values = realloc(latencies->values, sizeof(float) * latencies->capacity);
+  }
+  latencies->values[latencies->num_values++] = seconds * 1e6;
+}
+
+/**
+ * Play one game as a player of the game benchmark, reacting to what the server sends until it
+ * closes the connection at the end of the game.
+ * 
+ * \param player The player's number, which decides the words it picks and guesses first
+ * \param game How many games the player played before
+ * \returns True if the game was played to its end.
+ */
+bool play_game(int player, int game, latencies_t* latencies) {
+  int fd = socket_connect(server_name, port);
+  if (fd == -1) {
+    atomic_fetch_add(&num_failed, 1);
+    return false;
+  }
+
+  char username[32];
+  snprintf(username, sizeof(username), "player%d", player);
+
+  bool is_host = false;
+  bool has_ended = false;
+  int num_hosted = 0;
+  int num_asked = 0;
+  int num_answers = 0;
+  bool is_guessing = false;
+  bool awaiting_answer = false; // Whether a guess was sent and not answered yet
+  int num_guessed = 0;
+  double guess_sent = 0;
+  char question[64];
+
+  user_info_t* user_info;
+  while ((user_info = receive_message(fd)) != NULL) {
+    const char* message = user_info->message;
+    bool from_server = strcmp(user_info->username, "Server") == 0;
+    bool round_ended = false;
+    bool guess_answered = false;
+    bool send_guess = false;
+
+    if (!from_server) {
+      // Everyone sees every question, answer, and message sent out of turn (even their own), and
+      // only the script's questions end with a question mark.
+      size_t len = strlen(message);
+      if (is_host && strcmp(user_info->username, username) != 0 && len > 0 &&
+          message[len - 1] == '?') {
+        send_line(fd, username, num_answers++ % 2 == 0 ? "yes" : "no");
+      }
+    } else if (strncmp(message, "You are the host", strlen("You are the host")) == 0) {
+      is_host = true;
+      send_line(fd, username, words[(player + game + num_hosted++) % NUM_WORDS]);
+    } else if (strncmp(message, "It is your turn to ask", strlen("It is your turn to ask")) == 0) {
+      snprintf(question, sizeof(question), "Is it question %d of player %d?", num_asked++,
+               player);
+      send_line(fd, username, question);
+    } else if (strncmp(message, "It is time to make your guess",
+                       strlen("It is time to make your guess")) == 0) {
+      is_guessing = !is_host;
+      send_guess = is_guessing;
+      num_guessed = 0;
+    } else if (strncmp(message, "Wrong guess", strlen("Wrong guess")) == 0) {
+      guess_answered = true;
+      send_guess = is_guessing && num_guessed < NUM_WORDS;
+    } else if (strstr(message, "is the winner of this round") != NULL) {
+      if (strncmp(message, username, strlen(username)) == 0 &&
+          message[strlen(username)] == ' ') {
+        atomic_fetch_add(&num_rounds_won, 1);
+      }
+      round_ended = true;
+    } else if (strncmp(message, "Time is up", strlen("Time is up")) == 0 ||
+               strncmp(message, "The host left", strlen("The host left")) == 0 ||
+               strncmp(message, "The host took too long to pick",
+                       strlen("The host took too long to pick")) == 0) {
+      round_ended = true;
+    } else if (strncmp(message, "The game has ended", strlen("The game has ended")) == 0) {
+      has_ended = true;
+    }
+
+    // A guess is answered by a wrong guess message, or by the end of the round.
+    if (awaiting_answer && (guess_answered || round_ended)) {
+      add_latency(latencies, now_seconds() - guess_sent);
+      atomic_fetch_add(&num_guesses, 1);
+      awaiting_answer = false;
+    }
+    if (round_ended) {
+      is_host = false;
+      is_guessing = false;
+    }
+
+    // Guesses go one at a time, each as soon as the one before was answered. Guessers start at
+    // different words, so that the flood isn't the same guess over and over.
+    if (send_guess) {
+      guess_sent = now_seconds();
+      awaiting_answer = true;
+      send_line(fd, username, words[(player * 7 + num_guessed++) % NUM_WORDS]);
+    }
+
+    free(user_info->username);
+    free(user_info->message);
+    free(user_info);
+  }
+
+  close(fd);
+  if (!has_ended) {
+    atomic_fetch_add(&num_failed, 1);
+  }
+  return has_ended;
+}
+
+/**
+ * Play every game of one player of the game benchmark.
+ */
+void* play_games(void* args) {
+  int player = (int)(intptr_t)args;
+  latencies_t* latencies = calloc(1, sizeof(latencies_t));
+
+  for (int game = 0; game < num_games; game++) {
+    if (play_game(player, game, latencies)) {
+      atomic_fetch_add(&num_games_played, 1);
+    }
+    pthread_barrier_wait(&games_ended);
+  }
+  return latencies;
+}
+
+static int by_value(const void* a, const void* b) {
+  float value_a = *(const float*) a;
+  float value_b = *(const float*) b;
+  return value_a < value_b ? -1 : value_a > value_b ? 1 : 0;
+}
+
+/**
+ * Have every player play num_games games, and report how many guesses the server answered per
+ * second and how long it took to answer them.
+ */
+void run_game_benchmark(int num_players) {
+  pthread_t* players = malloc(sizeof(pthread_t) * num_players);
+  pthread_barrier_init(&games_ended, NULL, num_players);
+
+  double start = now_seconds();
+  for (int i = 0; i < num_players; i++) {
+    pthread_create(&players[i], NULL, play_games, (void*)(intptr_t) i);
+  }
+
+  latencies_t all = {.values = NULL, .num_values = 0, .capacity = 0};
+  for (int i = 0; i < num_players; i++) {
+    latencies_t* latencies;
+    pthread_join(players[i], (void**) &latencies);
+    for (size_t j = 0; j < latencies->num_values; j++) {
+      add_latency(&all, latencies->values[j] / 1e6);
+    }
+    free(latencies->values);
+    free(latencies);
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("%d players played %d games (%d rounds won, %d connections failed) in %.3f s\n",
+         num_players, atomic_load(&num_games_played), atomic_load(&num_rounds_won),
+         atomic_load(&num_failed), elapsed);
+  printf("%ld guesses answered (%.0f guesses/s)\n", atomic_load(&num_guesses),
+         atomic_load(&num_guesses) / elapsed);
+  if (all.num_values > 0) {
+    qsort(all.values, all.num_values, sizeof(float), by_value);
+    printf("guess latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+           all.values[all.num_values / 2], all.values[all.num_values * 9 / 10],
+           all.values[all.num_values * 99 / 100], all.values[all.num_values - 1]);
+  }
+
+  pthread_barrier_destroy(&games_ended);
+  free(all.values);
+  free(players);
+}
+
+/**
+ * Open every connection, report how it went, run the benchmarks that were asked for, and close
+ * every connection again.
+ */
+void run_round(pthread_t* threads, int** fds, int num_threads) {
+  atomic_store(&num_connected, 0);
+  atomic_store(&num_failed, 0);
+  atomic_store(&num_busy, 0);
+
+  double start = now_seconds();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, connect_players, fds[i]);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  double elapsed = now_seconds() - start;
+
+  int connected = atomic_load(&num_connected);
+  printf("%d connections welcomed, %d failed in %.3f s (%.0f connects/s)\n", connected,
+         atomic_load(&num_failed), elapsed, connected / elapsed);
+  if (atomic_load(&num_busy) > 0) {
+    printf("%d connections turned away by the server as busy\n", atomic_load(&num_busy));
+  }
+
+  if (relay_messages > 0) {
+    run_relay_benchmark(fds, num_threads);
+  }
+
+  if (drop_test) {
+    run_drop_test(fds, num_threads);
+  }
+
+  // Close all connections.
+  for (int i = 0; i < num_threads; i++) {
+    for (int j = 0; j < connections_per_thread; j++) {
+      if (fds[i][j] != -1) {
+        close(fds[i][j]);
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  // Read command line options.
+  int opt;
+  while ((opt = getopt(argc, argv, "c:dg:r:s")) != -1) {
+    switch (opt) {
+      case 'c':
+        churn_rounds = atoi(optarg);
+        break;
+      case 'd':
+        drop_test = true;
+        use_sessions = true; // Only clients with a session answer pings
+        break;
+      case 'g':
+        num_games = atoi(optarg);
+        break;
+      case 'r':
+        relay_messages = atoi(optarg);
+        break;
+      case 's':
+        use_sessions = true;
+        break;
+      default:
+        argc = 0; // Print the usage message below
+    }
+  }
+
+  if (argc - optind != 3 && argc - optind != 4) {
+    fprintf(stderr, "Usage: %s [-c churn rounds] [-d] [-g games] [-r relay messages] [-s] "
+                    "<server name> <port> <connections> [threads]\n"
+                    "(the server name can be unix:<socket path>, and the port is then ignored)\n", 
+            argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Read command line arguments
+  server_name = argv[optind];
+  port = atoi(argv[optind + 1]);
+  int num_connections = atoi(argv[optind + 2]);
+  int num_threads = argc - optind == 4 ? atoi(argv[optind + 3]) : 8;
+  if (num_connections <= 0 || num_threads <= 0 || churn_rounds <= 0 || num_games < 0) {
+    fprintf(stderr, "The number of connections, threads, and churn rounds must be positive, and "
+                    "the number of games can't be negative\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // The benchmarks need every player of one round in the same game.
+  if (churn_rounds > 1 && (relay_messages > 0 || drop_test)) {
+    fprintf(stderr, "The churn test can't be combined with the relay benchmark or drop test\n");
+    exit(EXIT_FAILURE);
+  }
+  // Players of the game benchmark answer prompts right away, which can be before the server
+  // accepted their session, when a client has to wait.
+  if (num_games > 0 && (churn_rounds > 1 || relay_messages > 0 || drop_test || use_sessions)) {
+    fprintf(stderr, "The game benchmark can't be combined with sessions or the other tests\n");
+    exit(EXIT_FAILURE);
+  }
+  connections_per_thread = (num_connections + num_threads - 1) / num_threads;
+
+  // Every connection stays open until the end, so allow as many open files as possible.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  // Players of the game benchmark connect on their own threads, once per game. The server closes
+  // the connection at the end of a game, which a player may only notice when sending.
+  if (num_games > 0) {
+    signal(SIGPIPE, SIG_IGN);
+    run_game_benchmark(num_connections);
+    return atomic_load(&num_failed) == 0 ? 0 : 1;
+  }
+
+  pthread_t* threads = malloc(sizeof(pthread_t) * num_threads);
+  int** fds = malloc(sizeof(int*) * num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    fds[i] = malloc(sizeof(int) * connections_per_thread);
+  }
+
+  int total_failed = 0;
+  for (int round = 0; round < churn_rounds; round++) {
+    if (churn_rounds > 1) {
+      printf("Round %d: ", round + 1);
+    }
+    run_round(threads, fds, num_threads);
+    total_failed += atomic_load(&num_failed);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    free(fds[i]);
+  }
+  free(fds);
+  free(threads);
+
+  return total_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+#include "lobby.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOBBY_PAUSE -1 // Added to the lobby instead of a socket fd to pause the matchmaker
+
+/**
+ * Get the time a number of milliseconds from now, as a deadline for sem_timedwait.
+ *
+ * \param ms The number of milliseconds from now
+ * \param deadline Set to the deadline
+ */
+static void deadline_after(int ms, struct timespec* deadline) {
+  clock_gettime(CLOCK_REALTIME, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Hold the matchmaker until the lobby is resumed, with the players of the next room where
+ * lobby_get_waiting can see them.
+ *
+ * \param lobby The lobby being paused
+ * \param socket_fds The socket fds of the players of the next room
+ * \param num_players The number of players
+ */
+static void wait_while_paused(lobby_t* lobby, int* socket_fds, size_t num_players) {
+  profiled_mutex_lock(&lobby->pause_lock);
+  lobby->paused_fds = socket_fds;
+  lobby->num_paused = num_players;
+  lobby->is_paused = true;
+  pthread_cond_broadcast(&lobby->pause_changed);
+
+  while (lobby->is_paused) {
+    profiled_cond_wait(&lobby->pause_changed, &lobby->pause_lock);
+  }
+  profiled_mutex_unlock(&lobby->pause_lock);
+}
+
+/**
+ * Take players out of the lobby in arrival order and start a room whenever enough of them are
+ * waiting, or the first of them has waited long enough.
+ *
+ * \param args The lobby to match players from
+ */
+static void* run_matchmaker(void* args) {
+  lobby_t* lobby = (lobby_t*)args;
+
+  int* socket_fds = malloc(sizeof(int) * lobby->room_size);
+  size_t num_players = 0;
+  struct timespec deadline; // When the first player of the next room has waited long enough
+
+  while (1) {
+    // Without enough players for a room, there is nothing to start when the wait is over.
+    int rc;
+    if (num_players < LOBBY_MIN_PLAYERS) {
+      rc = sem_wait(&lobby->queued_players);
+    } else {
+      rc = sem_timedwait(&lobby->queued_players, &deadline);
+    }
+
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (rc == 0) {
+      // The player is guaranteed to be in the queue, but its producer may still be publishing it.
+      void* item;
+      while (!queue_pop(&lobby->waiting, &item)) {
+        sched_yield();
+      }
+      sem_post(&lobby->free_slots);
+
+      // Everyone that arrived before the pause is already in the next room.
+      if ((int)(intptr_t)item == LOBBY_PAUSE) {
+        wait_while_paused(lobby, socket_fds, num_players);
+        continue;
+      }
+
+      socket_fds[num_players++] = (int)(intptr_t)item;
+      if (num_players == 1) {
+        deadline_after(lobby->max_wait_ms, &deadline);
+      }
+
+      // Keep filling the room while players are still arriving.
+      if (num_players < lobby->room_size) {
+        continue;
+      }
+    }
+
+    // The room is full or its first player has waited long enough.
+    lobby->start_room(socket_fds, num_players);
+    num_players = 0;
+  }
+
+  return NULL;
+}
+
+// Start the matchmaker of a lobby.
+int lobby_init(lobby_t* lobby, size_t capacity, size_t room_size, int max_wait_ms,
+               lobby_match_fn start_room) {
+  if (room_size < LOBBY_MIN_PLAYERS || max_wait_ms < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (queue_init(&lobby->waiting, capacity) == -1) {
+    return -1;
+  }
+
+  // Never allow more players in the queue than it can hold.
+  sem_init(&lobby->queued_players, 0, 0);
+  sem_init(&lobby->free_slots, 0, lobby->waiting.mask + 1);
+
+  lobby->room_size = room_size;
+  lobby->max_wait_ms = max_wait_ms;
+  lobby->start_room = start_room;
+  profiled_mutex_init(&lobby->pause_lock, "lobby.pause_lock");
+  pthread_cond_init(&lobby->pause_changed, NULL);
+  lobby->is_paused = false;
+  lobby->paused_fds = NULL;
+  lobby->num_paused = 0;
+
+  int rc = pthread_create(&lobby->matchmaker, NULL, run_matchmaker, lobby);
+  if (rc != 0) {
+    queue_destroy(&lobby->waiting);
+    errno = rc;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Add a player to the lobby.
+void lobby_enter(lobby_t* lobby, int socket_fd) {
+  // Wait for a free slot so that the push below cannot fail.
+  while (sem_wait(&lobby->free_slots) == -1 && errno == EINTR) {
+  }
+
+  while (!queue_push(&lobby->waiting, (void*)(intptr_t)socket_fd)) {
+    sched_yield();
+  }
+
+  sem_post(&lobby->queued_players);
+}
+
+// Add a player to the lobby unless the queue is full.
+bool lobby_try_enter(lobby_t* lobby, int socket_fd) {
+  if (sem_trywait(&lobby->free_slots) == -1) {
+    return false;
+  }
+
+  while (!queue_push(&lobby->waiting, (void*)(intptr_t)socket_fd)) {
+    sched_yield();
+  }
+
+  sem_post(&lobby->queued_players);
+  return true;
+}
+
+// Stop matching players into rooms.
+void lobby_pause(lobby_t* lobby) {
+  lobby_enter(lobby, LOBBY_PAUSE);
+
+  profiled_mutex_lock(&lobby->pause_lock);
+  while (!lobby->is_paused) {
+    profiled_cond_wait(&lobby->pause_changed, &lobby->pause_lock);
+  }
+  profiled_mutex_unlock(&lobby->pause_lock);
+}
+
+// Get the socket fds of every player waiting in a paused lobby.
+size_t lobby_get_waiting(lobby_t* lobby, int** socket_fds) {
+  size_t num_queued = 0;
+  while (sem_trywait(&lobby->queued_players) == 0) {
+    num_queued++;
+  }
+
+  size_t num_waiting = lobby->num_paused + num_queued;
+  *socket_fds = malloc(sizeof(int) * (num_waiting > 0 ? num_waiting : 1));
+  memcpy(*socket_fds, lobby->paused_fds, sizeof(int) * lobby->num_paused);
+
+  // Players added since the pause are still queued. Each is put back behind the others, so the
+  // queue ends up as it was.
+  for (size_t i = 0; i < num_queued; i++) {
+    void* item;
+    while (!queue_pop(&lobby->waiting, &item)) {
+      sched_yield();
+    }
+    (*socket_fds)[lobby->num_paused + i] = (int)(intptr_t)item;
+
+    while (!queue_push(&lobby->waiting, item)) {
+      sched_yield();
+    }
+  }
+
+  for (size_t i = 0; i < num_queued; i++) {
+    sem_post(&lobby->queued_players);
+  }
+  return num_waiting;
+}
+
+// Start matching players into rooms again.
+void lobby_resume(lobby_t* lobby) {
+  profiled_mutex_lock(&lobby->pause_lock);
+  lobby->is_paused = false;
+  pthread_cond_broadcast(&lobby->pause_changed);
+  profiled_mutex_unlock(&lobby->pause_lock);
+}
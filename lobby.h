@@ -0,0 +1,58 @@
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lock_profile.h"
+#include "queue.h"
+
+// The lobby where connected players wait to be matched into a room. Any thread can add a player
+// to the lobby over a lock-free queue, and a single matchmaker thread takes them out in arrival
+// order and groups them into rooms of a target size. A room is started with fewer players (but
+// at least LOBBY_MIN_PLAYERS) once its first player has waited for the maximum wait time.
+
+#define LOBBY_MIN_PLAYERS 2
+
+// Called on the matchmaker thread with the socket fds of the players of a new room. The array is
+// reused for the next room, so it must be copied.
+typedef void (*lobby_match_fn)(int* socket_fds, size_t num_players);
+
+typedef struct lobby {
+  queue_t waiting;       // Socket fds of players that haven't been seen by the matchmaker yet
+  sem_t queued_players;  // Counts players waiting in the queue (the matchmaker sleeps on this)
+  sem_t free_slots;      // Counts free queue slots (players wait on this when the queue is full)
+  size_t room_size;
+  int max_wait_ms;
+  lobby_match_fn start_room;
+  pthread_t matchmaker;
+  profiled_mutex_t pause_lock;
+  pthread_cond_t pause_changed;
+  bool is_paused;
+  int* paused_fds;       // The players of the next room while the matchmaker is paused
+  size_t num_paused;
+} lobby_t;
+
+// Start a matchmaker that calls start_room for every room of up to room_size players, with room
+// for capacity players waiting in the queue. Returns non-zero value if an error occurs.
+int lobby_init(lobby_t* lobby, size_t capacity, size_t room_size, int max_wait_ms,
+               lobby_match_fn start_room);
+
+// Add a player to the lobby. Blocks while the queue is full, so no player is ever dropped.
+void lobby_enter(lobby_t* lobby, int socket_fd);
+
+// Add a player to the lobby unless the queue is full. Returns whether the player was added.
+bool lobby_try_enter(lobby_t* lobby, int socket_fd);
+
+// Stop matching players into rooms. Every player added before this was called has been put in a
+// room (or is waiting for the next one) by the time it returns.
+void lobby_pause(lobby_t* lobby);
+
+// Get the socket fds of every player waiting in a paused lobby, in arrival order (the array must
+// be freed). Players added since the lobby was paused are included. Nothing may be added to the
+// lobby meanwhile. Returns the number of players.
+size_t lobby_get_waiting(lobby_t* lobby, int** socket_fds);
+
+// Start matching players into rooms again, after a pause.
+void lobby_resume(lobby_t* lobby);
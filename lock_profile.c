@@ -0,0 +1,244 @@
+#include "lock_profile.h"
+
+#ifdef LOCK_PROFILE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define NUM_TOP_SITES 10 // Call sites listed in the report
+
+// Every mutex and call site that was ever taken, newest first. Nothing is ever removed.
+static _Atomic(profiled_mutex_t*) all_locks;
+static _Atomic(lock_site_t*) all_sites;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Find the histogram bucket of a time: the first one whose bound the time is under.
+ */
+static int bucket_of(uint64_t ns) {
+  int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  return bucket < LOCK_PROFILE_BUCKETS ? bucket : LOCK_PROFILE_BUCKETS - 1;
+}
+
+static void count(atomic_uint_fast64_t* counter, uint64_t amount) {
+  atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+static uint64_t read_counter(atomic_uint_fast64_t* counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Add a mutex to the report the first time it is taken.
+ */
+static void register_lock(profiled_mutex_t* lock) {
+  if (atomic_load_explicit(&lock->is_registered, memory_order_acquire) ||
+      atomic_exchange(&lock->is_registered, true)) {
+    return;
+  }
+
+  lock->trace_type = trace_add_type(lock->name, "waited ns", NULL);
+  lock->next = atomic_load(&all_locks);
+  while (!atomic_compare_exchange_weak(&all_locks, &lock->next, lock)) {
+  }
+}
+
+/**
+ * Add a call site to the report the first time it takes a mutex.
+ */
+static void register_site(lock_site_t* site, profiled_mutex_t* lock) {
+  if (atomic_load_explicit(&site->is_registered, memory_order_acquire) ||
+      atomic_exchange(&site->is_registered, true)) {
+    return;
+  }
+
+  site->lock_name = lock->name;
+  site->next = atomic_load(&all_sites);
+  while (!atomic_compare_exchange_weak(&all_sites, &site->next, site)) {
+  }
+}
+
+/**
+ * Charge the time a mutex has been held to it. Must be called by the holder, right before it lets
+ * go of the mutex.
+ *
+ * \returns The time held, which the caller charges to the call site that took the mutex.
+ */
+static uint64_t end_hold(profiled_mutex_t* lock) {
+  uint64_t held_ns = now_ns() - lock->acquired_ns;
+  trace_event(lock->trace_type, TRACE_END, 0, 0);
+  count(&lock->hold_ns, held_ns);
+  count(&lock->hold_histogram[bucket_of(held_ns)], 1);
+  return held_ns;
+}
+
+// Initialize a mutex, named in the report.
+void profiled_mutex_init(profiled_mutex_t* lock, const char* name) {
+  *lock = (profiled_mutex_t) PROFILED_MUTEX_INITIALIZER(name);
+  pthread_mutex_init(&lock->mutex, NULL);
+}
+
+// Take a mutex, on behalf of a call site.
+void lock_profile_acquire(profiled_mutex_t* lock, lock_site_t* site) {
+  register_lock(lock);
+  register_site(site, lock);
+
+  // Only a mutex that is already held is worth timing the wait for.
+  uint64_t wait_ns = 0;
+  uint64_t acquired_ns;
+  if (pthread_mutex_trylock(&lock->mutex) == 0) {
+    acquired_ns = now_ns();
+  } else {
+    uint64_t started_ns = now_ns();
+    pthread_mutex_lock(&lock->mutex);
+    acquired_ns = now_ns();
+    wait_ns = acquired_ns - started_ns;
+    count(&lock->num_contended, 1);
+  }
+
+  lock->acquired_ns = acquired_ns;
+  lock->held_from = site;
+  trace_event(lock->trace_type, TRACE_BEGIN, wait_ns < UINT32_MAX ? wait_ns : UINT32_MAX, 0);
+  count(&lock->num_acquired, 1);
+  count(&lock->wait_ns, wait_ns);
+  count(&lock->wait_histogram[bucket_of(wait_ns)], 1);
+  count(&site->num_acquired, 1);
+  count(&site->wait_ns, wait_ns);
+}
+
+// Release a mutex.
+void lock_profile_release(profiled_mutex_t* lock) {
+  lock_site_t* site = lock->held_from;
+  uint64_t held_ns = end_hold(lock);
+  pthread_mutex_unlock(&lock->mutex);
+  count(&site->hold_ns, held_ns);
+}
+
+// Wait on a condition variable with a mutex held.
+void lock_profile_cond_wait(pthread_cond_t* cond, profiled_mutex_t* lock, lock_site_t* site) {
+  register_site(site, lock);
+
+  // The wait lets go of the mutex, and taking it back afterwards isn't counted as an acquisition,
+  // since the time it took can't be told apart from the wait itself.
+  lock_site_t* held_from = lock->held_from;
+  count(&held_from->hold_ns, end_hold(lock));
+  pthread_cond_wait(cond, &lock->mutex);
+  lock->acquired_ns = now_ns();
+  lock->held_from = site;
+  trace_event(lock->trace_type, TRACE_BEGIN, 0, 0);
+}
+
+/**
+ * Write a time with the unit that suits it.
+ */
+static void print_time(FILE* out, uint64_t ns) {
+  if (ns < 1000) {
+    fprintf(out, "%7llu ns", (unsigned long long)ns);
+  } else if (ns < 1000000) {
+    fprintf(out, "%7.1f us", ns / 1e3);
+  } else if (ns < 1000000000) {
+    fprintf(out, "%7.1f ms", ns / 1e6);
+  } else {
+    fprintf(out, "%7.2f s ", ns / 1e9);
+  }
+}
+
+/**
+ * Find the bound that a share of the times in a histogram are under.
+ */
+static uint64_t percentile(atomic_uint_fast64_t* histogram, double share) {
+  uint64_t total = 0;
+  for (int i = 0; i < LOCK_PROFILE_BUCKETS; i++) {
+    total += read_counter(&histogram[i]);
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < LOCK_PROFILE_BUCKETS; i++) {
+    seen += read_counter(&histogram[i]);
+    if (seen > 0 && seen >= share * total) {
+      return i == 0 ? 0 : (uint64_t)1 << i;
+    }
+  }
+  return 0;
+}
+
+static int by_lock_hold(const void* a, const void* b) {
+  uint64_t hold_a = read_counter(&(*(profiled_mutex_t**)a)->hold_ns);
+  uint64_t hold_b = read_counter(&(*(profiled_mutex_t**)b)->hold_ns);
+  return hold_a < hold_b ? 1 : hold_a > hold_b ? -1 : 0;
+}
+
+static int by_site_hold(const void* a, const void* b) {
+  uint64_t hold_a = read_counter(&(*(lock_site_t**)a)->hold_ns);
+  uint64_t hold_b = read_counter(&(*(lock_site_t**)b)->hold_ns);
+  return hold_a < hold_b ? 1 : hold_a > hold_b ? -1 : 0;
+}
+
+// Write the report for every mutex taken so far.
+void lock_profile_report(FILE* out) {
+  // Mutexes and call sites taken while the report is written may be left out of it.
+  size_t num_locks = 0;
+  size_t max_locks = 16;
+  profiled_mutex_t** locks = malloc(sizeof(profiled_mutex_t*) * max_locks);
+  for (profiled_mutex_t* lock = atomic_load(&all_locks); lock != NULL; lock = lock->next) {
+    if (num_locks == max_locks) {
+      max_locks *= 2;
+      locks = realloc(locks, sizeof(profiled_mutex_t*) * max_locks);
+    }
+    locks[num_locks++] = lock;
+  }
+
+  size_t num_sites = 0;
+  size_t max_sites = 64;
+  lock_site_t** sites = malloc(sizeof(lock_site_t*) * max_sites);
+  for (lock_site_t* site = atomic_load(&all_sites); site != NULL; site = site->next) {
+    if (num_sites == max_sites) {
+      max_sites *= 2;
+      sites = realloc(sites, sizeof(lock_site_t*) * max_sites);
+    }
+    sites[num_sites++] = site;
+  }
+  qsort(locks, num_locks, sizeof(profiled_mutex_t*), by_lock_hold);
+  qsort(sites, num_sites, sizeof(lock_site_t*), by_site_hold);
+
+  fprintf(out, "Lock profile (percentiles are histogram bounds)\n");
+  fprintf(out, "%-24s %10s %9s %10s %10s %10s %10s %10s %10s\n", "mutex", "acquired",
+          "contended", "wait", "wait p50", "wait p99", "held", "held p50", "held p99");
+  for (size_t i = 0; i < num_locks; i++) {
+    uint64_t num_acquired = read_counter(&locks[i]->num_acquired);
+    uint64_t num_contended = read_counter(&locks[i]->num_contended);
+    fprintf(out, "%-24s %10llu %8.2f%% ", locks[i]->name, (unsigned long long)num_acquired,
+            num_acquired > 0 ? 100.0 * num_contended / num_acquired : 0.0);
+    print_time(out, read_counter(&locks[i]->wait_ns));
+    print_time(out, percentile(locks[i]->wait_histogram, 0.5));
+    print_time(out, percentile(locks[i]->wait_histogram, 0.99));
+    print_time(out, read_counter(&locks[i]->hold_ns));
+    print_time(out, percentile(locks[i]->hold_histogram, 0.5));
+    print_time(out, percentile(locks[i]->hold_histogram, 0.99));
+    fprintf(out, "\n");
+  }
+
+  fprintf(out, "Top call sites by time held\n");
+  for (size_t i = 0; i < num_sites && i < NUM_TOP_SITES; i++) {
+    uint64_t num_acquired = read_counter(&sites[i]->num_acquired);
+    fprintf(out, "%10llu acquired, held", (unsigned long long)num_acquired);
+    print_time(out, read_counter(&sites[i]->hold_ns));
+    fprintf(out, ", waited");
+    print_time(out, read_counter(&sites[i]->wait_ns));
+    fprintf(out, "  %s at %s:%d (%s)\n", sites[i]->lock_name, sites[i]->file, sites[i]->line,
+            sites[i]->function);
+  }
+  fflush(out);
+
+  free(locks);
+  free(sites);
+}
+
+#endif
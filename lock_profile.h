@@ -0,0 +1,97 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Mutexes that can be profiled. Built with -DLOCK_PROFILE, every profiled mutex counts how often
+// it is taken and how often it was already held, keeps histograms of how long threads waited for
+// it and how long they held it, and charges both times to the line that took it. The report
+// lists the mutexes and their busiest call sites, by total time held. While tracing is on, the
+// time each mutex is held is also a span in the trace.
+// Built without it, a profiled mutex is a plain pthread mutex and every macro below is the pthread
+// call it wraps, so profiling costs nothing.
+// The mutexes are as thread-safe as pthread mutexes, and the report can be written at any time.
+
+#define LOCK_PROFILE_BUCKETS 32 // Histogram buckets: bucket i counts times under 2^i ns
+
+#ifdef LOCK_PROFILE
+
+// A place in the code that takes a profiled mutex. Each call site has its own, statically.
+typedef struct lock_site {
+  const char* file;
+  int line;
+  const char* function;
+  const char* lock_name; // The name of the first mutex taken here
+  atomic_bool is_registered;
+  atomic_uint_fast64_t num_acquired;
+  atomic_uint_fast64_t wait_ns; // Total time spent waiting for the mutex
+  atomic_uint_fast64_t hold_ns; // Total time the mutex was held after being taken here
+  struct lock_site* next;       // The next registered call site
+} lock_site_t;
+
+typedef struct profiled_mutex {
+  pthread_mutex_t mutex;
+  const char* name;
+  atomic_bool is_registered;
+  atomic_uint_fast64_t num_acquired;
+  atomic_uint_fast64_t num_contended; // Acquisitions that found the mutex held
+  atomic_uint_fast64_t wait_ns;
+  atomic_uint_fast64_t hold_ns;
+  atomic_uint_fast64_t wait_histogram[LOCK_PROFILE_BUCKETS];
+  atomic_uint_fast64_t hold_histogram[LOCK_PROFILE_BUCKETS];
+  uint64_t acquired_ns;   // When the holder took the mutex (only touched while holding it)
+  lock_site_t* held_from; // Where the holder took it
+  uint16_t trace_type;    // The type of the spans the mutex is held for
+  struct profiled_mutex* next; // The next registered mutex
+} profiled_mutex_t;
+
+#define PROFILED_MUTEX_INITIALIZER(lock_name) \
+  {.mutex = PTHREAD_MUTEX_INITIALIZER, .name = lock_name}
+
+#define LOCK_SITE_INITIALIZER {.file = __FILE__, .line = __LINE__, .function = __func__}
+
+// Initialize a mutex, named in the report. A mutex stays in the report once it was taken, so it
+// must never be freed.
+void profiled_mutex_init(profiled_mutex_t* lock, const char* name);
+
+// Take a mutex, on behalf of a call site.
+void lock_profile_acquire(profiled_mutex_t* lock, lock_site_t* site);
+
+// Release a mutex.
+void lock_profile_release(profiled_mutex_t* lock);
+
+// Wait on a condition variable with a mutex held. The time spent waiting isn't counted as held.
+void lock_profile_cond_wait(pthread_cond_t* cond, profiled_mutex_t* lock, lock_site_t* site);
+
+#define profiled_mutex_lock(lock)                     \
+  do {                                                \
+    static lock_site_t site_ = LOCK_SITE_INITIALIZER; \
+    lock_profile_acquire((lock), &site_);             \
+  } while (0)
+
+#define profiled_mutex_unlock(lock) lock_profile_release(lock)
+
+#define profiled_cond_wait(cond, lock)                \
+  do {                                                \
+    static lock_site_t site_ = LOCK_SITE_INITIALIZER; \
+    lock_profile_cond_wait((cond), (lock), &site_);   \
+  } while (0)
+
+// Write the report for every mutex taken so far.
+void lock_profile_report(FILE* out);
+
+#else
+
+typedef pthread_mutex_t profiled_mutex_t;
+
+#define PROFILED_MUTEX_INITIALIZER(lock_name) PTHREAD_MUTEX_INITIALIZER
+#define profiled_mutex_init(lock, name) pthread_mutex_init((lock), NULL)
+#define profiled_mutex_lock(lock) pthread_mutex_lock(lock)
+#define profiled_mutex_unlock(lock) pthread_mutex_unlock(lock)
+#define profiled_cond_wait(cond, lock) pthread_cond_wait((cond), (lock))
+#define lock_profile_report(out) ((void) (out))
+
+#endif
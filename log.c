@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (LOG_RING_RECORDS - 1)
+#define BATCH_RECORDS 1024     // Records formatted and written at once
+#define OUT_BUFFER_BYTES 65536 // Bytes written at once
+#define MAX_LINE_BYTES 1024    // Longer messages are truncated
+
+typedef union log_arg {
+  long long integer; // Also the offset of a string in the record's text
+  double real;
+  const void* pointer;
+} log_arg_t;
+
+typedef struct log_entry {
+  uint64_t timestamp_ns; // CLOCK_REALTIME
+  log_site_t* site;
+  log_arg_t args[LOG_MAX_ARGS];
+  uint32_t num_suppressed; // Messages suppressed at the site right before this one
+  int error;               // errno when the message was logged
+  char text[LOG_TEXT_BYTES];
+} log_entry_t;
+
+// The records one thread logged that haven't been written yet. Only the thread that owns the ring
+// adds records, and only the thread writing them out takes them. A ring is handed to a new thread
+// once its thread has ended.
+typedef struct log_ring {
+  _Alignas(64) atomic_uint_fast64_t head; // Records ever added
+  _Alignas(64) atomic_uint_fast64_t tail; // Records ever taken
+  atomic_uint_fast64_t num_dropped;       // Records that didn't fit since the last write
+  struct log_ring* next;                  // The next ring ever used
+  struct log_ring* next_free;             // The next ring without a thread
+  log_entry_t entries[LOG_RING_RECORDS];
+} log_ring_t;
+
+log_level_t log_min_level = LOG_LEVEL_INFO;
+
+static const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Atomic(log_ring_t*) all_rings; // Every ring ever used
+static log_ring_t* free_rings;         // Rings whose thread has ended
+static int num_rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key; // Gives a thread's ring back when the thread ends
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring_t* thread_ring;
+static atomic_uint_fast64_t num_dropped_without_ring;
+
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER; // Held while taking records
+static log_entry_t batch[BATCH_RECORDS];
+static char out_buffer[OUT_BUFFER_BYTES];
+
+// Parse a log level by name.
+int log_parse_level(const char* name, log_level_t* level) {
+  const char* names[] = {"debug", "info", "warn", "error"};
+  for (int i = 0; i < 4; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *level = (log_level_t) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Find the next conversion in a format.
+ *
+ * \param spec Set to where the conversion starts (its '%').
+ * \param kind Set to the kind of argument the conversion takes.
+ * \returns Where the conversion ends, or NULL if there are no more supported conversions.
+ */
+static const char* next_conversion(const char* format, const char** spec, log_arg_kind_t* kind) {
+  for (const char* c = format; *c != '\0'; c++) {
+    if (*c != '%') {
+      continue;
+    }
+    if (c[1] == '%') {
+      c++;
+      continue;
+    }
+
+    *spec = c++;
+    while (*c != '\0' && strchr("-+ #0", *c) != NULL) {
+      c++;
+    }
+    while (*c >= '0' && *c <= '9') {
+      c++;
+    }
+    if (*c == '.') {
+      c++;
+      while (*c >= '0' && *c <= '9') {
+        c++;
+      }
+    }
+
+    // size_t and ptrdiff_t are as long as long.
+    int num_longs = 0;
+    while (*c == 'h') {
+      c++;
+    }
+    while (*c == 'l') {
+      num_longs++;
+      c++;
+    }
+    if (*c == 'j') {
+      num_longs = 2;
+      c++;
+    } else if (*c == 'z' || *c == 't') {
+      num_longs = 1;
+      c++;
+    }
+
+    switch (*c) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        *kind = num_longs == 0 ? LOG_ARG_INT : num_longs == 1 ? LOG_ARG_LONG : LOG_ARG_LONG_LONG;
+        return c + 1;
+      case 'f': case 'e': case 'g': case 'E': case 'G':
+        *kind = LOG_ARG_DOUBLE;
+        return c + 1;
+      case 's':
+        *kind = LOG_ARG_STRING;
+        return c + 1;
+      case 'p':
+        *kind = LOG_ARG_POINTER;
+        return c + 1;
+      default:
+        return NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Find the kinds of arguments a site's format takes, the first time the site logs.
+ */
+static void parse_site(log_site_t* site) {
+  pthread_mutex_lock(&sites_lock);
+  if (!atomic_load_explicit(&site->is_parsed, memory_order_relaxed)) {
+    const char* rest = site->format;
+    const char* spec;
+    site->num_args = 0;
+    while (site->num_args < LOG_MAX_ARGS &&
+           (rest = next_conversion(rest, &spec, &site->arg_kinds[site->num_args])) != NULL) {
+      site->num_args++;
+    }
+    atomic_store_explicit(&site->is_parsed, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&sites_lock);
+}
+
+/**
+ * Put a ring back on the free list. Runs when the thread that logged to it ends.
+ */
+static void give_back_ring(void* ring) {
+  pthread_mutex_lock(&rings_lock);
+  ((log_ring_t*) ring)->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, give_back_ring);
+}
+
+/**
+ * Get the calling thread's ring, taking one the first time the thread logs.
+ *
+ * \returns The ring, or NULL if LOG_MAX_RINGS threads have one or there is no memory for it.
+ */
+static log_ring_t* get_thread_ring(void) {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_mutex_lock(&rings_lock);
+  log_ring_t* ring = free_rings;
+  if (ring != NULL) {
+    free_rings = ring->next_free;
+  } else if (num_rings < LOG_MAX_RINGS) {
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring != NULL) {
+      num_rings++;
+      ring->next = atomic_load(&all_rings);
+      atomic_store(&all_rings, ring);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (ring != NULL) {
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+  }
+  return ring;
+}
+
+/**
+ * Check whether a site has logged LOG_MAX_PER_SECOND messages in the current second already.
+ */
+static bool is_over_rate(log_site_t* site, uint64_t second) {
+  uint64_t window = atomic_load_explicit(&site->window, memory_order_relaxed);
+  if (window != second && atomic_compare_exchange_strong(&site->window, &window, second)) {
+    atomic_store_explicit(&site->num_in_window, 0, memory_order_relaxed);
+  }
+  return atomic_fetch_add_explicit(&site->num_in_window, 1, memory_order_relaxed) >=
+         LOG_MAX_PER_SECOND;
+}
+
+// Record a message on the calling thread's ring.
+void log_record(log_site_t* site, ...) {
+  int error = errno;
+  if (!atomic_load_explicit(&site->is_parsed, memory_order_acquire)) {
+    parse_site(site);
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (is_over_rate(site, now.tv_sec)) {
+    atomic_fetch_add_explicit(&site->num_suppressed, 1, memory_order_relaxed);
+    errno = error;
+    return;
+  }
+
+  log_ring_t* ring = get_thread_ring();
+  if (ring == NULL) {
+    atomic_fetch_add_explicit(&num_dropped_without_ring, 1, memory_order_relaxed);
+    errno = error;
+    return;
+  }
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_RECORDS) {
+    atomic_fetch_add_explicit(&ring->num_dropped, 1, memory_order_relaxed);
+    errno = error;
+    return;
+  }
+
+  log_entry_t* entry = &ring->entries[head & RING_MASK];
+  entry->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  entry->site = site;
+  entry->num_suppressed = atomic_exchange_explicit(&site->num_suppressed, 0, memory_order_relaxed);
+  entry->error = error;
+
+  va_list args;
+  va_start(args, site);
+  size_t text_len = 0;
+  for (int i = 0; i < site->num_args; i++) {
+    switch (site->arg_kinds[i]) {
+      case LOG_ARG_INT:
+        entry->args[i].integer = va_arg(args, int);
+        break;
+      case LOG_ARG_LONG:
+        entry->args[i].integer = va_arg(args, long);
+        break;
+      case LOG_ARG_LONG_LONG:
+        entry->args[i].integer = va_arg(args, long long);
+        break;
+      case LOG_ARG_DOUBLE:
+        entry->args[i].real = va_arg(args, double);
+        break;
+      case LOG_ARG_POINTER:
+        entry->args[i].pointer = va_arg(args, void*);
+        break;
+      case LOG_ARG_STRING: {
+        // Strings share the text, and the ones that don't fit are truncated (or left empty).
+        const char* string = va_arg(args, const char*);
+        if (string == NULL) {
+          string = "(null)";
+        }
+        size_t offset = text_len < LOG_TEXT_BYTES ? text_len : LOG_TEXT_BYTES - 1;
+        size_t len = strnlen(string, LOG_TEXT_BYTES - 1 - offset);
+        memcpy(entry->text + offset, string, len);
+        entry->text[offset + len] = '\0';
+        entry->args[i].integer = offset;
+        text_len = offset + len + 1;
+        break;
+      }
+    }
+  }
+  va_end(args);
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  errno = error;
+}
+
+/**
+ * Format a record as a line.
+ *
+ * \returns The length of the line.
+ */
+static size_t format_entry(const log_entry_t* entry, char* line) {
+  time_t seconds = entry->timestamp_ns / 1000000000;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  size_t len = strftime(line, MAX_LINE_BYTES, "%Y-%m-%d %H:%M:%S", &local);
+  len += snprintf(line + len, MAX_LINE_BYTES - len, ".%06u %-5s ",
+                  (unsigned)(entry->timestamp_ns % 1000000000 / 1000),
+                  level_names[entry->site->level]);
+
+  // Each conversion is formatted with the text before it, on its own.
+  const log_site_t* site = entry->site;
+  const char* rest = site->format;
+  char segment[MAX_LINE_BYTES];
+  for (int i = 0; i < site->num_args && len < MAX_LINE_BYTES - 1; i++) {
+    const char* spec;
+    log_arg_kind_t kind;
+    const char* end = next_conversion(rest, &spec, &kind);
+    size_t segment_len = end - rest < MAX_LINE_BYTES - 1 ? end - rest : MAX_LINE_BYTES - 1;
+    memcpy(segment, rest, segment_len);
+    segment[segment_len] = '\0';
+    rest = end;
+
+    const log_arg_t* arg = &entry->args[i];
+    size_t room = MAX_LINE_BYTES - len;
+    int written = 0;
+    switch (kind) {
+      case LOG_ARG_INT:
+        written = snprintf(line + len, room, segment, (int) arg->integer);
+        break;
+      case LOG_ARG_LONG:
+        written = snprintf(line + len, room, segment, (long) arg->integer);
+        break;
+      case LOG_ARG_LONG_LONG:
+        written = snprintf(line + len, room, segment, arg->integer);
+        break;
+      case LOG_ARG_DOUBLE:
+        written = snprintf(line + len, room, segment, arg->real);
+        break;
+      case LOG_ARG_STRING:
+        written = snprintf(line + len, room, segment, entry->text + arg->integer);
+        break;
+      case LOG_ARG_POINTER:
+        written = snprintf(line + len, room, segment, arg->pointer);
+        break;
+    }
+    len += written > 0 ? ((size_t) written < room ? (size_t) written : room - 1) : 0;
+  }
+
+  // What follows the last conversion only has escaped percent signs left.
+  for (const char* c = rest; *c != '\0' && len < MAX_LINE_BYTES - 1; c++) {
+    line[len++] = *c;
+    if (c[0] == '%' && c[1] == '%') {
+      c++;
+    }
+  }
+  line[len] = '\0';
+
+  if (site->with_error) {
+    char error_buf[128];
+    len += snprintf(line + len, MAX_LINE_BYTES - len, ": %s",
+                    strerror_r(entry->error, error_buf, sizeof(error_buf)));
+    len = len < MAX_LINE_BYTES - 1 ? len : MAX_LINE_BYTES - 1;
+  }
+  if (entry->num_suppressed > 0) {
+    len += snprintf(line + len, MAX_LINE_BYTES - len, " (%u similar messages suppressed)",
+                    entry->num_suppressed);
+  }
+  len = len < MAX_LINE_BYTES - 1 ? len : MAX_LINE_BYTES - 2;
+  line[len++] = '\n';
+  return len;
+}
+
+/**
+ * Write a whole buffer to a file descriptor.
+ */
+static void write_all(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buf, len);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    buf += written;
+    len -= written;
+  }
+}
+
+static int by_timestamp(const void* a, const void* b) {
+  uint64_t timestamp_a = ((const log_entry_t*) a)->timestamp_ns;
+  uint64_t timestamp_b = ((const log_entry_t*) b)->timestamp_ns;
+  return timestamp_a < timestamp_b ? -1 : timestamp_a > timestamp_b ? 1 : 0;
+}
+
+/**
+ * Take up to BATCH_RECORDS records from the rings and write them, oldest first. Must be called
+ * with write_lock held.
+ *
+ * \returns Whether the batch was full, in which case more records may be waiting.
+ */
+static bool write_batch(void) {
+  // Rings are never freed, and new ones are only added in front of the first.
+  size_t num_entries = 0;
+  uint64_t num_dropped = atomic_exchange(&num_dropped_without_ring, 0);
+  for (log_ring_t* ring = atomic_load(&all_rings); ring != NULL; ring = ring->next) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail < head && num_entries < BATCH_RECORDS) {
+      batch[num_entries++] = ring->entries[tail++ & RING_MASK];
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    num_dropped += atomic_exchange_explicit(&ring->num_dropped, 0, memory_order_relaxed);
+  }
+  qsort(batch, num_entries, sizeof(log_entry_t), by_timestamp);
+
+  // Lines go out in order, so the buffer is written whenever the next line goes to the other fd.
+  size_t out_len = 0;
+  int out_fd = STDOUT_FILENO;
+  char line[MAX_LINE_BYTES];
+  for (size_t i = 0; i < num_entries; i++) {
+    size_t line_len = format_entry(&batch[i], line);
+    int fd = batch[i].site->level >= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+    if (fd != out_fd || out_len + line_len > OUT_BUFFER_BYTES) {
+      write_all(out_fd, out_buffer, out_len);
+      out_len = 0;
+      out_fd = fd;
+    }
+    memcpy(out_buffer + out_len, line, line_len);
+    out_len += line_len;
+  }
+  write_all(out_fd, out_buffer, out_len);
+
+  if (num_dropped > 0) {
+    int len = snprintf(line, sizeof(line), "Dropped %llu log messages that didn't fit\n",
+                       (unsigned long long) num_dropped);
+    write_all(STDERR_FILENO, line, len);
+  }
+  return num_entries == BATCH_RECORDS;
+}
+
+// Write every message logged so far, on the calling thread.
+void log_flush(void) {
+  pthread_mutex_lock(&write_lock);
+  while (write_batch()) {
+  }
+  pthread_mutex_unlock(&write_lock);
+}
+
+/**
+ * Write what was logged every LOG_FLUSH_INTERVAL_MS.
+ */
+static void* write_logs(void* args) {
+  (void) args;
+  struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L};
+  while (true) {
+    log_flush();
+    nanosleep(&interval, NULL);
+  }
+  return NULL;
+}
+
+// Start the background thread.
+int log_start(void) {
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, write_logs, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(writer);
+  atexit(log_flush);
+  return 0;
+}
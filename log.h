@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Asynchronous logging. A thread that logs only copies the message's arguments into a fixed-size
+// binary record on a ring buffer of its own (a single-producer, single-consumer queue), and a
+// background thread formats the records of every ring, in the order they were logged, and writes
+// them in batches: debug and info messages to stdout, warnings and errors to stderr.
+// Every call site logs at most LOG_MAX_PER_SECOND messages a second, and the next message logged
+// there says how many were suppressed in between. Memory is bounded: a record that doesn't fit in
+// its thread's ring, or logged by a thread that can't get one, is dropped and counted, and the
+// number dropped is logged.
+// Formats take at most LOG_MAX_ARGS arguments of the printf conversions d, i, u, x, X, o, c, f, e,
+// g, s, and p (with the length modifiers hh, h, l, ll, j, z, and t). Strings are copied, and
+// together truncated to LOG_TEXT_BYTES bytes.
+// Logging is thread-safe, and only takes a lock the first time a thread (or call site) logs.
+
+#define LOG_RING_RECORDS 64 // Records that can wait to be written per thread (a power of 2)
+#define LOG_MAX_RINGS 1024  // Threads that can have a ring at once
+#define LOG_MAX_ARGS 6
+#define LOG_TEXT_BYTES 56
+#define LOG_MAX_PER_SECOND 10
+#define LOG_FLUSH_INTERVAL_MS 10 // How often the background thread writes what was logged
+
+typedef enum log_level {
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR
+} log_level_t;
+
+typedef enum log_arg_kind {
+  LOG_ARG_INT,
+  LOG_ARG_LONG,
+  LOG_ARG_LONG_LONG,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STRING,
+  LOG_ARG_POINTER
+} log_arg_kind_t;
+
+// A place in the code that logs. Each call site has its own, statically.
+typedef struct log_site {
+  log_level_t level;
+  const char* format;
+  bool with_error; // Whether errno is described after the message, like perror does
+  atomic_bool is_parsed;
+  int num_args;
+  log_arg_kind_t arg_kinds[LOG_MAX_ARGS];
+  atomic_uint_fast64_t window;         // The second the site's messages are being counted for
+  atomic_uint_fast32_t num_in_window;  // Messages logged here in that second
+  atomic_uint_fast32_t num_suppressed; // Messages suppressed since the last one logged here
+} log_site_t;
+
+#define LOG_SITE_INITIALIZER(site_level, site_format, site_with_error) \
+  {.level = site_level, .format = site_format, .with_error = site_with_error}
+
+extern log_level_t log_min_level; // Messages below it are ignored (only set before logging)
+
+// Parse a log level by name (debug, info, warn, or error). Returns non-zero value if the name
+// isn't one.
+int log_parse_level(const char* name, log_level_t* level);
+
+// Start the background thread, and write whatever is still waiting when the process exits.
+// Messages logged before are only written once it has started. Returns non-zero value if an error
+// occurs.
+int log_start(void);
+
+// Record a message on the calling thread's ring, with the arguments of the site's format.
+void log_record(log_site_t* site, ...);
+
+// Write every message logged so far, on the calling thread.
+void log_flush(void);
+
+// The format is also handed to printf in dead code, only for the compiler to check it.
+#define log_at(level, with_error, format, ...)                                 \
+  do {                                                                         \
+    static log_site_t site_ = LOG_SITE_INITIALIZER(level, format, with_error); \
+    if (0) {                                                                   \
+      printf(format, ##__VA_ARGS__);                                           \
+    }                                                                          \
+    if ((level) >= log_min_level) {                                            \
+      log_record(&site_, ##__VA_ARGS__);                                       \
+    }                                                                          \
+  } while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, false, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, false, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, false, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, false, __VA_ARGS__)
+
+// Log an error followed by a description of errno, like perror.
+#define log_perror(...) log_at(LOG_LEVEL_ERROR, true, __VA_ARGS__)
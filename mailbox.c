@@ -0,0 +1,62 @@
+#include "mailbox.h"
+
+#include <stddef.h>
+
+// Initialize an empty mailbox.
+void mailbox_init(mailbox_t* mailbox) {
+  atomic_init(&mailbox->stub.next, NULL);
+  atomic_init(&mailbox->head, &mailbox->stub);
+  mailbox->tail = &mailbox->stub;
+}
+
+// Add a message to the back of the mailbox.
+void mailbox_post(mailbox_t* mailbox, mailbox_node_t* node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+
+  // Claim the back of the list first, and only then link the message behind the one it follows.
+  // Until the link is stored, the consumer can't see this message (or anything posted after it).
+  mailbox_node_t* prev = atomic_exchange(&mailbox->head, node);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Take the oldest message out of the mailbox.
+mailbox_node_t* mailbox_take(mailbox_t* mailbox) {
+  mailbox_node_t* tail = mailbox->tail;
+  mailbox_node_t* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  // Skip over the stub.
+  if (tail == &mailbox->stub) {
+    if (next == NULL) {
+      return NULL;
+    }
+    mailbox->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+
+  if (next != NULL) {
+    mailbox->tail = next;
+    return tail;
+  }
+
+  // The tail is the last message unless a producer has claimed the back but not linked in yet.
+  if (tail != atomic_load(&mailbox->head)) {
+    return NULL;
+  }
+
+  // Put the stub behind the last message, so that taking it leaves the list with a node in it.
+  mailbox_post(mailbox, &mailbox->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next != NULL) {
+    mailbox->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+// Check whether the mailbox has no messages.
+bool mailbox_is_empty(mailbox_t* mailbox) {
+  return mailbox->tail == &mailbox->stub && atomic_load(&mailbox->stub.next) == NULL &&
+         atomic_load(&mailbox->head) == &mailbox->stub;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// An unbounded, lock-free, multi-producer/single-consumer queue of messages. Messages are linked
+// through a node embedded in them, so posting never allocates. Any thread can post, but only one
+// thread at a time may take messages out.
+// Citation: Dmitry Vyukov's intrusive MPSC node-based queue.
+
+// The link of a message. It is embedded in whatever is being posted.
+typedef struct mailbox_node {
+  struct mailbox_node* _Atomic next;
+} mailbox_node_t;
+
+typedef struct mailbox {
+  mailbox_node_t* _Atomic head; // The message posted last (producers swap themselves in here)
+  mailbox_node_t* tail;         // The next message to take, or the stub (consumer only)
+  mailbox_node_t stub;          // Keeps the list from ever being empty
+} mailbox_t;
+
+// Initialize an empty mailbox.
+void mailbox_init(mailbox_t* mailbox);
+
+// Add a message to the back of the mailbox. Never blocks.
+void mailbox_post(mailbox_t* mailbox, mailbox_node_t* node);
+
+// Take the oldest message out of the mailbox (consumer only). Returns NULL if the mailbox is empty
+// (or the oldest message is still being linked in by a producer, which only takes a moment).
+mailbox_node_t* mailbox_take(mailbox_t* mailbox);
+
+// Check whether the mailbox has no messages, not even one that is being posted (consumer only).
+bool mailbox_is_empty(mailbox_t* mailbox);
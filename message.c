@@ -1,149 +1,2581 @@
 #include "message.h"
 
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-// These functions were taken from the P2P lab and adpated for this project to send/receive a 
-// struct with the sender's name and the message.
-// Citation: P2P lab (starter code)
+#include "lock_profile.h"
+#include "trace.h"
+#include "uring.h"
 
-// Send a across a socket with a header that includes the message length.
-int send_message(int fd, user_info_t* user_info) {
-  // If the message or user info is NULL, set errno to EINVAL and return an error
-  if (user_info == NULL) {
-    errno = EINVAL;
+// The backend used by every thread to send and receive messages.
+static message_io_backend_t io_backend = MESSAGE_IO_BLOCKING;
+
+// The number of sockets that threads are writing to right now.
+static atomic_size_t sends_in_progress;
+
+// The types of the spans that writes are traced as (registered once the backend is picked).
+static uint16_t send_trace_type;
+static uint16_t uring_send_trace_type;
+
+// Counts the messages sent (NULL if nothing counts them).
+static message_count_fn count_sent;
+
+// Counts the memory held for connections (NULL if nothing counts it).
+static message_memory_fn count_memory_fn;
+
+static int send_fields(int fd, user_info_t* user_info);
+static int write_fields(int fd, user_info_t* user_info);
+static int send_all(int fd, const char* buf, size_t len);
+static int send_encoded(const int* fds, size_t num_fds, const char* frame, size_t frame_len);
+static int receive_all(int fd, void* buf, size_t len);
+static int receive_start(int fd, void* buf, size_t len);
+static int uring_send_frame(const int* fds, size_t num_fds, user_info_t* user_info);
+static int uring_send_raw(const int* fds, size_t num_fds, const char* frame, size_t frame_len);
+static ssize_t uring_receive(int fd, void* buf, size_t len);
+static bool cork_hold(const int* fds, size_t num_fds, const char* frame, size_t frame_len);
+static bool cork_hold_fields(const int* fds, size_t num_fds, user_info_t* user_info);
+static void count_message(opcode_t opcode, size_t num_messages, size_t num_bytes);
+static void count_memory(ssize_t num_bytes);
+static void cork_close(int fd);
+static void uring_forget(int fd);
+
+// Read up to len bytes from a socket using the selected backend (same contract as read).
+static ssize_t receive_bytes(int fd, void* buf, size_t len) {
+  if (io_backend == MESSAGE_IO_URING) {
+    return uring_receive(fd, buf, len);
+  }
+
+  return read(fd, buf, len);
+}
+
+
+/*******************
+ * Sessions
+ *******************/
+// Wire format of a session:
+//   hello  (client to server): "WGS", highest version supported (1 byte), username length
+//                              (4 bytes, little-endian), username
+//   accept (server to client): "WGS", version picked (1 byte), player id (4 bytes, little-endian)
+//   resume (client to server): "WGR", highest version supported (1 byte), token (8 bytes,
+//                              little-endian), sent instead of a hello to take a seat back
+//   frame  (after the accept): opcode (1 byte), player id (varint), payload length (varint),
+//                              payload
+// The hello and the accept are sent where a legacy frame's size_t message length would be. The
+// second byte of the magic alone makes that length far larger than MAX_MESSAGE_LENGTH, so neither
+// can be mistaken for a legacy frame. Varints are unsigned LEB128: 7 bits per byte, least
+// significant group first, with the top bit set on every byte but the last.
+
+#define SESSION_HEADER_LEN 8
+#define RESUME_LEN (SESSION_HEADER_LEN + 4) // The magic, the version, and an 8-byte token
+#define MAX_SNAPSHOT_LENGTH (64 * 1024) // Snapshots carry the whole room, so they can be longer
+#define SESSION_MIN_FRAME_HEADER_LEN 3 // An opcode and two one-byte varints
+#define SESSION_MAX_FRAME_HEADER_LEN (1 + 2 * VARINT_MAX_LEN)
+#define VARINT_MAX_LEN 5 // Enough for any 32-bit value
+#define SESSION_MAX_FDS (1 << 20) // Sockets with higher file descriptors can't use sessions
+
+typedef enum session_mode {
+  SESSION_NONE,    // Legacy frames only
+  SESSION_PENDING, // The client sent a hello and is waiting for the accept
+  SESSION_ACTIVE,  // Session frames only
+} session_mode_t;
+
+// The session state of one socket
+typedef struct session {
+  atomic_int mode;
+  int version;       // The protocol version both ends agreed on
+  uint16_t local_id; // The player id this end sends messages as
+  uint16_t peer_id;  // The player at the other end (server side)
+  atomic_int turn;   // What the server expects this client to send next (client side)
+  atomic_bool ready; // The server said what it expects for the first time (client side)
+  uint64_t token;    // The token that takes the player's seat back (client side)
+  char** names;      // Player names by id, as sent by the server (client side)
+  size_t num_names;
+} session_t;
+
+// Session state of every socket, indexed by file descriptor
+static session_t* sessions = NULL;
+static size_t max_sessions = 0;
+static pthread_once_t sessions_once = PTHREAD_ONCE_INIT;
+
+// Clients wait on this for their session to be accepted.
+static profiled_mutex_t sessions_lock = PROFILED_MUTEX_INITIALIZER("sessions_lock");
+static pthread_cond_t sessions_changed = PTHREAD_COND_INITIALIZER;
+
+static void sessions_create() {
+  // Make room for every file descriptor the process is allowed to open.
+  max_sessions = SESSION_MAX_FDS;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_max < SESSION_MAX_FDS) {
+    max_sessions = limit.rlim_max;
+  }
+
+  sessions = calloc(max_sessions, sizeof(session_t));
+  if (sessions == NULL) {
+    max_sessions = 0;
+  }
+}
+
+/**
+ * Get the session state of a socket.
+ *
+ * \returns The socket's session state, or NULL if the socket can't use a session.
+ */
+static session_t* session_get(int fd) {
+  pthread_once(&sessions_once, sessions_create);
+
+  if (fd < 0 || (size_t)fd >= max_sessions) {
+    return NULL;
+  }
+  return &sessions[fd];
+}
+
+/**
+ * Get the mode of a socket's session state (SESSION_NONE if it has none).
+ */
+static session_mode_t session_mode(session_t* session) {
+  return session == NULL ? SESSION_NONE : atomic_load(&session->mode);
+}
+
+static void put_u32(char* buf, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint32_t get_u32(const char* buf) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)(unsigned char)buf[i] << (8 * i);
+  }
+  return value;
+}
+
+static void put_u64(char* buf, uint64_t value) {
+  put_u32(buf, value & 0xffffffff);
+  put_u32(buf + 4, value >> 32);
+}
+
+static uint64_t get_u64(const char* buf) {
+  return get_u32(buf) | (uint64_t)get_u32(buf + 4) << 32;
+}
+
+/**
+ * Encode a varint.
+ *
+ * \returns The number of bytes written (at most VARINT_MAX_LEN).
+ */
+static size_t put_varint(char* buf, uint32_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+  return len;
+}
+
+/**
+ * Decode a varint from the first len bytes of buf.
+ *
+ * \returns The number of bytes the varint takes, 0 if it continues past len bytes, or -1 if it is
+ *          longer than any 32-bit value needs.
+ */
+static int get_varint(const char* buf, size_t len, uint32_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (i == VARINT_MAX_LEN) {
+      return -1;
+    }
+
+    *value |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+    if (!(buf[i] & 0x80)) {
+      return i + 1;
+    }
+  }
+
+  return len < VARINT_MAX_LEN ? 0 : -1;
+}
+
+/**
+ * Check whether the 8 bytes where a legacy message length would be are a hello or an accept.
+ */
+static bool is_session_header(const void* header) {
+  return memcmp(header, SESSION_MAGIC, strlen(SESSION_MAGIC)) == 0;
+}
+
+/**
+ * Check whether the 8 bytes where a legacy message length would be start a resume request.
+ */
+static bool is_resume_header(const void* header) {
+  return memcmp(header, RESUME_MAGIC, strlen(RESUME_MAGIC)) == 0;
+}
+
+/**
+ * Fill in the header of a session frame.
+ *
+ * \returns The length of the header.
+ */
+static size_t put_session_frame_header(char* buf, opcode_t opcode, uint16_t player_id,
+                                       size_t payload_len) {
+  size_t len = 0;
+  buf[len++] = opcode;
+  len += put_varint(buf + len, player_id);
+  len += put_varint(buf + len, payload_len);
+  return len;
+}
+
+/**
+ * Read the header of a session frame, without reading any of its payload. Only the bytes the
+ * varints turn out to need are read, one at a time beyond the shortest possible header (which is
+ * all that is needed for ids and payloads shorter than 128).
+ *
+ * \returns Non-zero value if the connection ends or the header isn't valid.
+ */
+static int receive_session_frame_header(int fd, opcode_t* opcode, uint32_t* player_id,
+                                        uint32_t* payload_len) {
+  char header[SESSION_MAX_FRAME_HEADER_LEN];
+  size_t len = SESSION_MIN_FRAME_HEADER_LEN;
+  if (receive_start(fd, header, len) == -1) {
     return -1;
   }
 
-  if (user_info->message == NULL) {
-    errno = EINVAL;
+  size_t pos = 1;
+  uint32_t* fields[] = {player_id, payload_len};
+  for (int i = 0; i < 2; i++) {
+    int rc;
+    while ((rc = get_varint(header + pos, len - pos, fields[i])) == 0) {
+      if (receive_all(fd, header + len, 1) == -1) {
+        return -1;
+      }
+      len++;
+    }
+
+    if (rc == -1) {
+      errno = EPROTO;
+      return -1;
+    }
+    pos += rc;
+  }
+
+  *opcode = (unsigned char)header[0];
+  size_t max_payload_len = *opcode == OP_SNAPSHOT ? MAX_SNAPSHOT_LENGTH : MAX_MESSAGE_LENGTH;
+  if (*opcode == 0 || *opcode >= NUM_OPCODES || *player_id > UINT16_MAX ||
+      *payload_len > max_payload_len) {
+    errno = EPROTO;
     return -1;
   }
 
-  // First, send the length of the message in a size_t
-  size_t message_len = strlen(user_info->message);
-  if (write(fd, &message_len, sizeof(size_t)) != sizeof(size_t)) {
-    // Writing failed, so return an error
+  return 0;
+}
+
+/**
+ * Send a session frame to one socket with a single write.
+ */
+static int send_session_frame(int fd, opcode_t opcode, uint16_t player_id, const char* payload,
+                              size_t payload_len) {
+  if (payload_len > MAX_MESSAGE_LENGTH) {
+    errno = EINVAL;
     return -1;
   }
 
-  // Now we can send the message. Loop until the entire message has been written.
-  size_t bytes_written = 0;
-  while (bytes_written < message_len) {
-    // Try to write the entire remaining message
-    ssize_t rc = write(fd, user_info->message + bytes_written, message_len - bytes_written);
+  char frame[SESSION_MAX_FRAME_HEADER_LEN + MAX_MESSAGE_LENGTH];
+  size_t header_len = put_session_frame_header(frame, opcode, player_id, payload_len);
+  memcpy(frame + header_len, payload, payload_len);
 
-    // Did the write fail? If so, return an error
-    if (rc <= 0) return -1;
+  count_message(opcode, 1, header_len + payload_len);
+  return send_encoded(&fd, 1, frame, header_len + payload_len);
+}
 
-    // If there was no error, write returned the number of bytes written
-    bytes_written += rc;
+/**
+ * Encode a string as its length (a varint) followed by its bytes.
+ *
+ * \returns The number of bytes written (at most VARINT_MAX_LEN more than the string's length).
+ */
+static size_t put_string(char* buf, const char* string) {
+  size_t len = strlen(string);
+  size_t header_len = put_varint(buf, len);
+  memcpy(buf + header_len, string, len);
+  return header_len + len;
+}
+
+// Decodes the fields of a payload one after another. Once a field runs past the end of the
+// payload, every later field reads as empty and failed is set.
+typedef struct payload_reader {
+  const char* buf;
+  size_t len;
+  size_t pos;
+  bool failed;
+} payload_reader_t;
+
+static uint32_t read_varint(payload_reader_t* reader) {
+  uint32_t value = 0;
+  int rc = reader->failed ? -1 : get_varint(reader->buf + reader->pos, reader->len - reader->pos,
+                                            &value);
+  if (rc <= 0) {
+    reader->failed = true;
+    return 0;
   }
 
-  // Then, send the length of the username in a size_t
-  size_t username_len = strlen(user_info->username);
-  if (write(fd, &username_len, sizeof(size_t)) != sizeof(size_t)) {
-    // Writing failed, so return an error
-    return -1;
+  reader->pos += rc;
+  return value;
+}
+
+static unsigned char read_byte(payload_reader_t* reader) {
+  if (reader->failed || reader->pos == reader->len) {
+    reader->failed = true;
+    return 0;
   }
 
-  // Now we can send the username. Loop until the entire username has been written.
-  bytes_written = 0;
-  while (bytes_written < username_len) {
-    // Try to write the entire remaining username
-    ssize_t rc = write(fd, user_info->username + bytes_written, username_len - bytes_written);
+  return reader->buf[reader->pos++];
+}
 
-    // Did the write fail? If so, return an error
-    if (rc <= 0) return -1;
+/**
+ * Decode a string written by put_string.
+ *
+ * \returns A copy of the string (which must be freed later).
+ */
+static char* read_string(payload_reader_t* reader) {
+  uint32_t len = read_varint(reader);
+  if (reader->failed || len > reader->len - reader->pos) {
+    reader->failed = true;
+    return strdup("");
+  }
 
-    // If there was no error, write returned the number of bytes written
-    bytes_written += rc;
+  char* string = strndup(reader->buf + reader->pos, len);
+  reader->pos += len;
+  return string;
+}
+
+/**
+ * Get the name to show for a player id (which must be freed later).
+ */
+static char* session_username(session_t* session, uint16_t player_id) {
+  if (player_id == SESSION_SERVER_ID) {
+    return strdup("Server");
   }
 
-  return 0;
+  if (player_id < session->num_names && session->names[player_id] != NULL) {
+    return strdup(session->names[player_id]);
+  }
+
+  // The server hasn't sent the player's name.
+  char name[32];
+  snprintf(name, sizeof(name), "Player %d", player_id);
+  return strdup(name);
 }
 
-// Receive a message from a socket and return the message string (which must be freed later)
-user_info_t* receive_message(int fd) { 
-  user_info_t* user_info = malloc(sizeof(user_info_t));
+/**
+ * Remember the name of a player (client side). Takes ownership of the name.
+ */
+static void session_set_name(session_t* session, uint16_t player_id, char* name) {
+  if (player_id >= session->num_names) {
+    size_t num_names = (size_t)player_id + 1;
+    session->names = realloc(session->names, sizeof(char*) * num_names);
+    for (size_t i = session->num_names; i < num_names; i++) {
+      session->names[i] = NULL;
+    }
+    session->num_names = num_names;
+  }
 
-  // First try to read in the message length
+  free(session->names[player_id]);
+  session->names[player_id] = name;
+}
+
+/**
+ * Take in a snapshot of the game after the client took its seat back (client side): the names of
+ * the players are remembered, the client is ready to send once more, and the rest is described in
+ * a message from the server.
+ *
+ * \param session     The socket's session state
+ * \param payload     The snapshot
+ * \param payload_len The length of the snapshot
+ *
+ * \returns The message describing the game, or NULL if the snapshot isn't valid.
+ */
+static user_info_t* receive_snapshot(session_t* session, const char* payload,
+                                     size_t payload_len) {
+  payload_reader_t reader = {.buf = payload, .len = payload_len, .pos = 0, .failed = false};
+  snapshot_phase_t phase = read_byte(&reader);
+  opcode_t turn = read_byte(&reader);
+  uint16_t host_id = read_varint(&reader);
+  uint16_t asker_id = read_varint(&reader);
+  unsigned int num_questions = read_varint(&reader);
+  unsigned int max_questions = read_varint(&reader);
+  char* secret_word = read_string(&reader);
+
+  // The names come first, so that everything after them can be shown with names.
+  char* scores_buf;
+  size_t scores_len;
+  FILE* scores = open_memstream(&scores_buf, &scores_len);
+  fprintf(scores, "Scores:");
+  uint32_t num_players = read_varint(&reader);
+  for (uint32_t i = 0; i < num_players && !reader.failed; i++) {
+    uint16_t player_id = read_varint(&reader);
+    unsigned int score = read_varint(&reader);
+    bool is_away = read_byte(&reader);
+    char* name = read_string(&reader);
+    fprintf(scores, "%s %s %u%s", i > 0 ? "," : "", name, score, is_away ? " (away)" : "");
+    session_set_name(session, player_id, name);
+  }
+  fclose(scores);
+
+  char* host = session_username(session, host_id);
+  char* asker = session_username(session, asker_id);
+
+  char* message_buf;
   size_t message_len;
-  if (read(fd, &message_len, sizeof(size_t)) != sizeof(size_t)) {
-    // Reading failed. Return an error
-    return NULL;
+  FILE* message = open_memstream(&message_buf, &message_len);
+  if (host_id == session->local_id) {
+    fprintf(message, "You are back in the game. You are the host.");
+  } else {
+    fprintf(message, "You are back in the game. %s is the host.", host);
+  }
+  if (secret_word[0] != '\0') {
+    fprintf(message, " Your secret word is %s.", secret_word);
   }
 
-  // Now make sure the message length is reasonable
-  if (message_len > MAX_MESSAGE_LENGTH) {
-    errno = EINVAL;
+  switch (phase) {
+    case PHASE_PICKING:
+      fprintf(message, "\nThe host is picking a secret word.");
+      break;
+    case PHASE_ASKING:
+      if (asker_id == session->local_id) {
+        fprintf(message, "\nIt is your turn to ask question %u of %u.", num_questions + 1,
+                max_questions);
+      } else {
+        fprintf(message, "\nIt is %s's turn to ask question %u of %u.", asker, num_questions + 1,
+                max_questions);
+      }
+      break;
+    case PHASE_ANSWERING:
+      fprintf(message, "\n%s is answering %s's question.", host, asker);
+      break;
+    case PHASE_GUESSING:
+      fprintf(message, "\nEveryone is guessing the secret word.");
+      break;
+  }
+
+  uint32_t num_history = read_varint(&reader);
+  for (uint32_t i = 0; i < num_history && !reader.failed; i++) {
+    char* exchange_asker = session_username(session, read_varint(&reader));
+    char* question = read_string(&reader);
+    bool is_answered = read_byte(&reader);
+    char* answer = read_string(&reader);
+    fprintf(message, "\n%s asked: %s (%s)", exchange_asker, question,
+            is_answered ? answer : "no answer");
+    free(exchange_asker);
+    free(question);
+    free(answer);
+  }
+
+  fprintf(message, "\n%s", scores_buf);
+  fclose(message);
+  free(scores_buf);
+  free(host);
+  free(asker);
+  free(secret_word);
+
+  if (reader.failed) {
+    free(message_buf);
+    errno = EPROTO;
     return NULL;
   }
 
-  // Allocate space for the message and a null terminator
-  char* message_result = malloc(message_len + 1);
+  // Like the first turn after an accept, the snapshot lets the client send.
+  profiled_mutex_lock(&sessions_lock);
+  atomic_store(&session->turn, turn);
+  atomic_store(&session->ready, true);
+  pthread_cond_broadcast(&sessions_changed);
+  profiled_mutex_unlock(&sessions_lock);
 
-  // Try to read the message. Loop until the entire message has been read.
-  size_t bytes_read = 0;
-  while (bytes_read < message_len) {
-    // Try to read the entire remaining message
-    ssize_t rc = read(fd, message_result + bytes_read, message_len - bytes_read);
+  user_info_t* user_info = malloc(sizeof(user_info_t));
+  user_info->username = strdup("Server");
+  user_info->message = message_buf;
+  return user_info;
+}
 
-    // Did the read fail? If so, return an error
-    if (rc <= 0) {
-      free(message_result);
+/**
+ * Receive session frames until one with something to show arrives, keeping track of the player
+ * names and turns sent along the way (client side).
+ *
+ * \returns The message with the sender's name, or NULL when an error occurs.
+ */
+static user_info_t* receive_session_message(int fd, session_t* session) {
+  while (true) {
+    opcode_t opcode;
+    uint32_t player_id, payload_len;
+    if (receive_session_frame_header(fd, &opcode, &player_id, &payload_len) == -1) {
       return NULL;
     }
 
-    // Update the number of bytes read
-    bytes_read += rc;
+    char* payload = malloc(payload_len + 1);
+    if (receive_all(fd, payload, payload_len) == -1) {
+      free(payload);
+      return NULL;
+    }
+    payload[payload_len] = '\0';
+
+    user_info_t* user_info = NULL;
+    switch (opcode) {
+      case OP_JOIN:
+        session_set_name(session, player_id, payload);
+        continue;
+
+      case OP_TURN:
+        if (payload_len == 1) {
+          atomic_store(&session->turn, (unsigned char)payload[0]);
+        }
+
+        // The server sends the first turn right after the accept, and nothing can be sent
+        // without it.
+        if (!atomic_load(&session->ready)) {
+          profiled_mutex_lock(&sessions_lock);
+          atomic_store(&session->ready, true);
+          pthread_cond_broadcast(&sessions_changed);
+          profiled_mutex_unlock(&sessions_lock);
+        }
+        break;
+
+      case OP_TOKEN:
+        if (payload_len == sizeof(uint64_t)) {
+          session->token = get_u64(payload);
+        }
+        break;
+
+      case OP_PING:
+        // A failed answer means the connection is gone, which the next receive finds out.
+        send_session_frame(fd, OP_PONG, session->local_id, "", 0);
+        break;
+
+      case OP_SNAPSHOT:
+        user_info = receive_snapshot(session, payload, payload_len);
+        if (user_info == NULL) {
+          free(payload);
+          return NULL;
+        }
+        break;
+
+      case OP_SCORE: {
+        uint32_t score;
+        if (get_varint(payload, payload_len, &score) <= 0) {
+          break;
+        }
+
+        char* username = session_username(session, player_id);
+        char message[MAX_MESSAGE_LENGTH];
+        snprintf(message, sizeof(message), "%s has %u points.", username, score);
+        free(username);
+
+        user_info = malloc(sizeof(user_info_t));
+        user_info->username = strdup("Server");
+        user_info->message = strdup(message);
+        break;
+      }
+
+      case OP_NOTICE:
+      case OP_SECRET:
+      case OP_QUESTION:
+      case OP_ANSWER:
+      case OP_GUESS:
+      case OP_CHAT:
+        user_info = malloc(sizeof(user_info_t));
+        user_info->message = payload;
+        user_info->username = session_username(session, player_id);
+        return user_info;
+
+      default:
+        break; // Nothing the client needs to know about
+    }
+
+    free(payload);
+    if (user_info != NULL) {
+      return user_info;
+    }
   }
+}
 
-  // Add a null terminator to the message
-  message_result[message_len] = '\0';
+/**
+ * Switch a client's socket over to session frames once the server's accept arrived.
+ *
+ * \param session The socket's session state
+ * \param header  The accept
+ *
+ * \returns Non-zero value if the accept isn't valid.
+ */
+static int session_activate(session_t* session, const char* header) {
+  int version = (unsigned char)header[3];
+  uint32_t player_id = get_u32(header + 4);
+  if (version < SESSION_MIN_VERSION || version > SESSION_VERSION || player_id > UINT16_MAX) {
+    errno = EPROTO;
+    return -1;
+  }
 
-  user_info->message = message_result;
+  session->version = version;
+  session->local_id = player_id;
+  session->peer_id = SESSION_SERVER_ID;
+  atomic_store(&session->mode, SESSION_ACTIVE);
+  return 0;
+}
 
-  // Then, try to read in the username length
-  size_t username_len;
-  if (read(fd, &username_len, sizeof(size_t)) != sizeof(size_t)) {
-    // Reading failed. Return an error
+/**
+ * Receive the rest of a client's hello as a frame whose username is the client's username, and
+ * pick the protocol version for the session (server side).
+ *
+ * \param fd     The socket
+ * \param header The first 8 bytes of the hello, which have already been read
+ *
+ * \returns The frame, or NULL when an error occurs.
+ */
+static message_frame_t* receive_hello(int fd, const char* header) {
+  // The client speaks every version from the minimum up to the one it sent.
+  session_t* session = session_get(fd);
+  int version = (unsigned char)header[3];
+  if (session == NULL || version < SESSION_MIN_VERSION) {
+    errno = EPROTO;
     return NULL;
   }
+  session->version = version < SESSION_VERSION ? version : SESSION_VERSION;
 
-  // Now make sure the username length is reasonable
+  size_t username_len = get_u32(header + 4);
   if (username_len > MAX_MESSAGE_LENGTH) {
     errno = EINVAL;
     return NULL;
   }
 
-  // Allocate space for the username and a null terminator
-  char* username_result = malloc(username_len + 1);
+  size_t len = SESSION_HEADER_LEN + username_len;
+  message_frame_t* frame = malloc(sizeof(message_frame_t) + len);
+  memcpy(frame->bytes, header, SESSION_HEADER_LEN);
 
-  // Try to read the username. Loop until the entire username has been read.
-  bytes_read = 0;
-  while (bytes_read < username_len) {
-    // Try to read the entire remaining username
-    ssize_t rc = read(fd, username_result + bytes_read, username_len - bytes_read);
+  if (receive_all(fd, frame->bytes + SESSION_HEADER_LEN, username_len) == -1) {
+    free(frame);
+    return NULL;
+  }
 
-    // Did the read fail? If so, return an error
-    if (rc <= 0) {
-      free(username_result);
-      return NULL;
+  atomic_init(&frame->refs, 1);
+  frame->kind = FRAME_HELLO;
+  frame->opcode = OP_JOIN;
+  frame->player_id = 0;
+  frame->token = 0;
+  frame->len = len;
+  frame->message = frame->bytes + SESSION_HEADER_LEN;
+  frame->message_len = 0;
+  frame->username = frame->bytes + SESSION_HEADER_LEN;
+  frame->username_len = username_len;
+  count_memory(sizeof(message_frame_t) + frame->len);
+  return frame;
+}
+
+/**
+ * Receive the rest of a client's resume request as a frame with the token, and pick the protocol
+ * version for the session (server side).
+ *
+ * \param fd     The socket
+ * \param header The first 8 bytes of the request, which have already been read
+ *
+ * \returns The frame, or NULL when an error occurs.
+ */
+static message_frame_t* receive_resume(int fd, const char* header) {
+  session_t* session = session_get(fd);
+  int version = (unsigned char)header[3];
+  if (session == NULL || version < SESSION_RESUME_VERSION) {
+    errno = EPROTO;
+    return NULL;
+  }
+  session->version = version < SESSION_VERSION ? version : SESSION_VERSION;
+
+  message_frame_t* frame = malloc(sizeof(message_frame_t) + RESUME_LEN);
+  memcpy(frame->bytes, header, SESSION_HEADER_LEN);
+  if (receive_all(fd, frame->bytes + SESSION_HEADER_LEN, RESUME_LEN - SESSION_HEADER_LEN) == -1) {
+    free(frame);
+    return NULL;
+  }
+
+  atomic_init(&frame->refs, 1);
+  frame->kind = FRAME_RESUME;
+  frame->opcode = 0;
+  frame->player_id = 0;
+  frame->token = get_u64(frame->bytes + 4);
+  frame->len = RESUME_LEN;
+  frame->message = frame->bytes + RESUME_LEN;
+  frame->message_len = 0;
+  frame->username = frame->bytes + RESUME_LEN;
+  frame->username_len = 0;
+  count_memory(sizeof(message_frame_t) + frame->len);
+  return frame;
+}
+
+/**
+ * Receive a session frame from a client (server side). Its player id is replaced with the id the
+ * session was accepted for, so no player can send messages under another player's id.
+ *
+ * \returns The frame, or NULL when an error occurs.
+ */
+static message_frame_t* receive_session_frame(int fd, session_t* session) {
+  opcode_t opcode;
+  uint32_t player_id, message_len;
+  if (receive_session_frame_header(fd, &opcode, &player_id, &message_len) == -1) {
+    return NULL;
+  }
+
+  // The header is rebuilt around the payload, which is read straight into the frame.
+  char header[SESSION_MAX_FRAME_HEADER_LEN];
+  size_t header_len = put_session_frame_header(header, opcode, session->peer_id, message_len);
+  size_t len = header_len + message_len;
+  message_frame_t* frame = malloc(sizeof(message_frame_t) + len);
+  memcpy(frame->bytes, header, header_len);
+
+  if (receive_all(fd, frame->bytes + header_len, message_len) == -1) {
+    free(frame);
+    return NULL;
+  }
+
+  atomic_init(&frame->refs, 1);
+  frame->kind = FRAME_SESSION;
+  frame->opcode = opcode;
+  frame->player_id = session->peer_id;
+  frame->token = 0;
+  frame->len = len;
+  frame->message = frame->bytes + header_len;
+  frame->message_len = message_len;
+  frame->username = NULL;
+  frame->username_len = 0;
+  count_memory(sizeof(message_frame_t) + frame->len);
+  return frame;
+}
+
+// Ask the server for a session.
+int session_hello(int fd, const char* username) {
+  session_t* session = session_get(fd);
+  size_t username_len = strlen(username);
+  if (session == NULL || username_len > MAX_MESSAGE_LENGTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char hello[SESSION_HEADER_LEN + MAX_MESSAGE_LENGTH];
+  memcpy(hello, SESSION_MAGIC, strlen(SESSION_MAGIC));
+  hello[3] = SESSION_VERSION;
+  put_u32(hello + 4, username_len);
+  memcpy(hello + SESSION_HEADER_LEN, username, username_len);
+
+  // The accept can arrive as soon as the hello is sent.
+  atomic_store(&session->turn, OP_CHAT);
+  atomic_store(&session->ready, false);
+  atomic_store(&session->mode, SESSION_PENDING);
+  return send_encoded(&fd, 1, hello, SESSION_HEADER_LEN + username_len);
+}
+
+// Ask the server for the seat that a token was issued for.
+int session_resume(int fd, uint64_t token) {
+  session_t* session = session_get(fd);
+  if (session == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char resume[RESUME_LEN];
+  memcpy(resume, RESUME_MAGIC, strlen(RESUME_MAGIC));
+  resume[3] = SESSION_VERSION;
+  put_u64(resume + 4, token);
+
+  // The seat is still the one the token was issued for.
+  session->token = token;
+  atomic_store(&session->turn, OP_CHAT);
+  atomic_store(&session->ready, false);
+  atomic_store(&session->mode, SESSION_PENDING);
+  return send_encoded(&fd, 1, resume, sizeof(resume));
+}
+
+// Get the token the server issued for a socket's session.
+uint64_t session_token(int fd) {
+  session_t* session = session_get(fd);
+  return session == NULL ? 0 : session->token;
+}
+
+// Take a resume request off a new socket if all of it has already arrived.
+bool session_take_resume(int fd, int timeout_ms, uint64_t* token) {
+  session_t* session = session_get(fd);
+  if (session == NULL) {
+    return false;
+  }
+
+  // Nothing has been received from the socket yet, so the kernel has everything that arrived. Wait
+  // for the whole request, but give up as soon as the bytes that arrived can't be one.
+  char resume[RESUME_LEN];
+  struct pollfd poll_fd = {.fd = fd, .events = POLLIN};
+  ssize_t len = 0;
+  while (len < (ssize_t)sizeof(resume)) {
+    if (poll(&poll_fd, 1, timeout_ms) <= 0) {
+      return false;
     }
 
-    // Update the number of bytes read
-    bytes_read += rc;
+    // Nothing new arrived means the socket was closed (or only part of the request was sent).
+    ssize_t new_len = recv(fd, resume, sizeof(resume), MSG_PEEK | MSG_DONTWAIT);
+    if (new_len <= len) {
+      return false;
+    }
+
+    size_t magic_len = strlen(RESUME_MAGIC);
+    if (memcmp(resume, RESUME_MAGIC, (size_t)new_len < magic_len ? (size_t)new_len : magic_len)) {
+      return false;
+    }
+    len = new_len;
   }
 
-  // Add a null terminator to the username
-  username_result[username_len] = '\0';
+  if ((unsigned char)resume[3] < SESSION_RESUME_VERSION ||
+      recv(fd, resume, sizeof(resume), MSG_DONTWAIT) != sizeof(resume)) {
+    return false;
+  }
 
-  user_info->username = username_result;
+  int version = (unsigned char)resume[3];
+  session->version = version < SESSION_VERSION ? version : SESSION_VERSION;
+  *token = get_u64(resume + 4);
+  return true;
+}
 
-  return user_info;
+// Wait until the server accepted or the session ended.
+bool session_wait(int fd) {
+  session_t* session = session_get(fd);
+  if (session == NULL) {
+    return false;
+  }
+
+  profiled_mutex_lock(&sessions_lock);
+  while (atomic_load(&session->mode) == SESSION_PENDING ||
+         (atomic_load(&session->mode) == SESSION_ACTIVE && !atomic_load(&session->ready))) {
+    profiled_cond_wait(&sessions_changed, &sessions_lock);
+  }
+  profiled_mutex_unlock(&sessions_lock);
+
+  return atomic_load(&session->mode) == SESSION_ACTIVE;
+}
+
+// Accept a client's hello.
+int session_accept(int fd, uint16_t player_id) {
+  session_t* session = session_get(fd);
+  if (session == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char accept[SESSION_HEADER_LEN];
+  memcpy(accept, SESSION_MAGIC, strlen(SESSION_MAGIC));
+  accept[3] = session->version;
+  put_u32(accept + 4, player_id);
+  if (send_encoded(&fd, 1, accept, sizeof(accept)) == -1) {
+    return -1;
+  }
+
+  session->local_id = SESSION_SERVER_ID;
+  session->peer_id = player_id;
+  atomic_store(&session->mode, SESSION_ACTIVE);
+  return 0;
+}
+
+// Tell a client with a session the name of a player.
+int session_send_name(int fd, uint16_t player_id, const char* name) {
+  return send_session_frame(fd, OP_JOIN, player_id, name, strlen(name));
+}
+
+// Check whether a client's session can take its seat back after a reconnect.
+bool session_can_resume(int fd) {
+  session_t* session = session_get(fd);
+  return session_mode(session) == SESSION_ACTIVE && session->version >= SESSION_RESUME_VERSION;
+}
+
+// Check whether a client's session answers pings.
+bool session_can_ping(int fd) {
+  session_t* session = session_get(fd);
+  return session_mode(session) == SESSION_ACTIVE && session->version >= SESSION_HEARTBEAT_VERSION;
+}
+
+// Ask a client with a session whether it is still there.
+int session_send_ping(int fd) {
+  if (!session_can_ping(fd)) {
+    return 0;
+  }
+
+  return send_session_frame(fd, OP_PING, SESSION_SERVER_ID, "", 0);
+}
+
+// Give a client with a session the token that takes its seat back.
+int session_send_token(int fd, uint64_t token) {
+  char payload[sizeof(uint64_t)];
+  put_u64(payload, token);
+  return send_session_frame(fd, OP_TOKEN, SESSION_SERVER_ID, payload, sizeof(payload));
+}
+
+// Bring a client that took its seat back up to date.
+int session_send_snapshot(int fd, const snapshot_t* snapshot) {
+  // Work out how long the snapshot can get, so it can be encoded in one go.
+  const char* secret_word = snapshot->secret_word != NULL ? snapshot->secret_word : "";
+  size_t max_len = 2 + 5 * VARINT_MAX_LEN + strlen(secret_word) + VARINT_MAX_LEN;
+  for (size_t i = 0; i < snapshot->num_players; i++) {
+    max_len += 3 * VARINT_MAX_LEN + 1 + strlen(snapshot->players[i].name);
+  }
+  for (size_t i = 0; i < snapshot->num_history; i++) {
+    const snapshot_exchange_t* exchange = &snapshot->history[i];
+    max_len += 3 * VARINT_MAX_LEN + 1 + strlen(exchange->question) +
+               (exchange->answer != NULL ? strlen(exchange->answer) : 0);
+  }
+
+  char* frame = malloc(SESSION_MAX_FRAME_HEADER_LEN + max_len);
+  char* payload = frame + SESSION_MAX_FRAME_HEADER_LEN;
+  size_t len = 0;
+  payload[len++] = snapshot->phase;
+  payload[len++] = snapshot->turn;
+  len += put_varint(payload + len, snapshot->host_id);
+  len += put_varint(payload + len, snapshot->asker_id);
+  len += put_varint(payload + len, snapshot->num_questions);
+  len += put_varint(payload + len, snapshot->max_questions);
+  len += put_string(payload + len, secret_word);
+
+  len += put_varint(payload + len, snapshot->num_players);
+  for (size_t i = 0; i < snapshot->num_players; i++) {
+    const snapshot_player_t* player = &snapshot->players[i];
+    len += put_varint(payload + len, player->player_id);
+    len += put_varint(payload + len, player->score);
+    payload[len++] = player->is_away;
+    len += put_string(payload + len, player->name);
+  }
+
+  len += put_varint(payload + len, snapshot->num_history);
+  for (size_t i = 0; i < snapshot->num_history; i++) {
+    const snapshot_exchange_t* exchange = &snapshot->history[i];
+    len += put_varint(payload + len, exchange->asker_id);
+    len += put_string(payload + len, exchange->question);
+    payload[len++] = exchange->answer != NULL;
+    len += put_string(payload + len, exchange->answer != NULL ? exchange->answer : "");
+  }
+
+  if (len > MAX_SNAPSHOT_LENGTH) {
+    free(frame);
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  // Put the header right in front of the payload.
+  char header[SESSION_MAX_FRAME_HEADER_LEN];
+  size_t header_len = put_session_frame_header(header, OP_SNAPSHOT, SESSION_SERVER_ID, len);
+  memcpy(payload - header_len, header, header_len);
+
+  count_message(OP_SNAPSHOT, 1, header_len + len);
+  int rc = send_encoded(&fd, 1, payload - header_len, header_len + len);
+  free(frame);
+  return rc;
+}
+
+// Tell a client with a session what the server expects from it next.
+int session_send_turn(int fd, opcode_t opcode) {
+  if (!session_is_active(fd)) {
+    return 0;
+  }
+
+  char payload = opcode;
+  return send_session_frame(fd, OP_TURN, SESSION_SERVER_ID, &payload, 1);
+}
+
+// Tell a client with a session the score of a player.
+int session_send_score(int fd, uint16_t player_id, unsigned int score) {
+  if (!session_is_active(fd)) {
+    return 0;
+  }
+
+  char payload[VARINT_MAX_LEN];
+  return send_session_frame(fd, OP_SCORE, player_id, payload, put_varint(payload, score));
+}
+
+// Check whether a socket's session has been accepted.
+bool session_is_active(int fd) {
+  return session_mode(session_get(fd)) == SESSION_ACTIVE;
+}
+
+// Get the protocol version of a socket's accepted session.
+int session_version(int fd) {
+  session_t* session = session_get(fd);
+  return session_mode(session) == SESSION_ACTIVE ? session->version : 0;
+}
+
+// Carry over a session that another server process accepted.
+int session_restore(int fd, int version, uint16_t player_id) {
+  session_t* session = session_get(fd);
+  if (session == NULL || version < SESSION_MIN_VERSION || version > SESSION_VERSION) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  session->version = version;
+  session->local_id = SESSION_SERVER_ID;
+  session->peer_id = player_id;
+  atomic_store(&session->mode, SESSION_ACTIVE);
+  return 0;
+}
+
+// Forget a socket's session.
+void session_end(int fd) {
+  session_t* session = session_get(fd);
+  if (session == NULL) {
+    return;
+  }
+
+  profiled_mutex_lock(&sessions_lock);
+  for (size_t i = 0; i < session->num_names; i++) {
+    free(session->names[i]);
+  }
+  free(session->names);
+  session->names = NULL;
+  session->num_names = 0;
+  session->token = 0;
+  atomic_store(&session->mode, SESSION_NONE);
+  pthread_cond_broadcast(&sessions_changed);
+  profiled_mutex_unlock(&sessions_lock);
+}
+
+// These functions were taken from the P2P lab and adpated for this project to send/receive a 
+// struct with the sender's name and the message.
+// Citation: P2P lab (starter code)
+
+// Send a across a socket with a header that includes the message length.
+int send_message(int fd, user_info_t* user_info) {
+  // If the message or user info is NULL, set errno to EINVAL and return an error
+  if (user_info == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (user_info->message == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Over a session, the other end already knows who is sending. The server's messages are 
+  // notices, and a client's messages are whatever the server last said it expects.
+  session_t* session = session_get(fd);
+  if (session_mode(session) == SESSION_ACTIVE) {
+    opcode_t opcode = OP_NOTICE;
+    if (session->local_id != SESSION_SERVER_ID) {
+      opcode = strcmp(user_info->message, "quit") == 0 ? OP_QUIT : atomic_load(&session->turn);
+    }
+
+    return send_session_frame(fd, opcode, session->local_id, user_info->message,
+                              strlen(user_info->message));
+  }
+
+  count_message(0, 1, 2 * sizeof(size_t) + strlen(user_info->message) +
+                        strlen(user_info->username));
+  if (io_backend == MESSAGE_IO_URING) {
+    return uring_send_frame(&fd, 1, user_info);
+  }
+
+  return send_fields(fd, user_info);
+}
+
+// Send each field of a message with its own write.
+static int send_fields(int fd, user_info_t* user_info) {
+  if (cork_hold_fields(&fd, 1, user_info)) {
+    return 0;
+  }
+
+  atomic_fetch_add(&sends_in_progress, 1);
+  trace_event(send_trace_type, TRACE_BEGIN, fd, 
+              strlen(user_info->message) + strlen(user_info->username) + 2 * sizeof(size_t));
+  int rc = write_fields(fd, user_info);
+  trace_event(send_trace_type, TRACE_END, 0, 0);
+  atomic_fetch_sub(&sends_in_progress, 1);
+  return rc;
+}
+
+// Write each field of a message.
+static int write_fields(int fd, user_info_t* user_info) {
+  // First, send the length of the message in a size_t
+  size_t message_len = strlen(user_info->message);
+  if (write(fd, &message_len, sizeof(size_t)) != sizeof(size_t)) {
+    // Writing failed, so return an error
+    return -1;
+  }
+
+  // Now we can send the message. Loop until the entire message has been written.
+  size_t bytes_written = 0;
+  while (bytes_written < message_len) {
+    // Try to write the entire remaining message
+    ssize_t rc = write(fd, user_info->message + bytes_written, message_len - bytes_written);
+
+    // Did the write fail? If so, return an error
+    if (rc <= 0) return -1;
+
+    // If there was no error, write returned the number of bytes written
+    bytes_written += rc;
+  }
+
+  // Then, send the length of the username in a size_t
+  size_t username_len = strlen(user_info->username);
+  if (write(fd, &username_len, sizeof(size_t)) != sizeof(size_t)) {
+    // Writing failed, so return an error
+    return -1;
+  }
+
+  // Now we can send the username. Loop until the entire username has been written.
+  bytes_written = 0;
+  while (bytes_written < username_len) {
+    // Try to write the entire remaining username
+    ssize_t rc = write(fd, user_info->username + bytes_written, username_len - bytes_written);
+
+    // Did the write fail? If so, return an error
+    if (rc <= 0) return -1;
+
+    // If there was no error, write returned the number of bytes written
+    bytes_written += rc;
+  }
+
+  return 0;
+}
+
+/**
+ * Send the same message to sockets of which some have a session. Each format is only encoded once.
+ *
+ * \param fds             The sockets
+ * \param num_fds         The number of sockets
+ * \param num_session_fds The number of those sockets that have a session
+ * \param user_info       The message
+ *
+ * \returns Non-zero value if an error occurs for any of the sockets.
+ */
+static int broadcast_mixed(const int* fds, size_t num_fds, size_t num_session_fds,
+                           user_info_t* user_info) {
+  int* session_fds = malloc(sizeof(int) * num_session_fds);
+  int* legacy_fds = malloc(sizeof(int) * (num_fds - num_session_fds + 1));
+  size_t num_legacy_fds = 0;
+  num_session_fds = 0;
+  for (size_t i = 0; i < num_fds; i++) {
+    if (session_is_active(fds[i])) {
+      session_fds[num_session_fds++] = fds[i];
+    } else {
+      legacy_fds[num_legacy_fds++] = fds[i];
+    }
+  }
+
+  // Only the server sends to several sockets, so the message is a notice from the server.
+  message_frame_t* frame = frame_encode(FRAME_SESSION, OP_NOTICE, SESSION_SERVER_ID, 
+                                        user_info->message, strlen(user_info->message), NULL, 0);
+
+  int result = 0;
+  int saved_errno = 0;
+  if (frame == NULL || broadcast_frame(session_fds, num_session_fds, frame) == -1) {
+    result = -1;
+    saved_errno = errno;
+  }
+  if (num_legacy_fds > 0 && broadcast_message(legacy_fds, num_legacy_fds, user_info) == -1) {
+    result = -1;
+    saved_errno = errno;
+  }
+
+  frame_release(frame);
+  free(session_fds);
+  free(legacy_fds);
+
+  errno = saved_errno;
+  return result;
+}
+
+// Send the same message to several sockets.
+int broadcast_message(const int* fds, size_t num_fds, user_info_t* user_info) {
+  if (user_info == NULL || user_info->message == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Sockets with a session get a session frame, and the others the legacy frame.
+  size_t num_session_fds = 0;
+  for (size_t i = 0; i < num_fds; i++) {
+    if (session_is_active(fds[i])) {
+      num_session_fds++;
+    }
+  }
+
+  if (num_session_fds > 0) {
+    return broadcast_mixed(fds, num_fds, num_session_fds, user_info);
+  }
+
+  // io_uring sends the message to every socket with a single system call.
+  if (io_backend == MESSAGE_IO_URING) {
+    count_message(0, num_fds, num_fds * (2 * sizeof(size_t) + strlen(user_info->message) +
+                                         strlen(user_info->username)));
+    return uring_send_frame(fds, num_fds, user_info);
+  }
+
+  // Otherwise, send to each socket in turn. Keep going if one fails, but report the failure.
+  int result = 0;
+  int saved_errno = 0;
+  for (size_t i = 0; i < num_fds; i++) {
+    if (send_message(fds[i], user_info) == -1) {
+      result = -1;
+      saved_errno = errno;
+    }
+  }
+
+  errno = saved_errno;
+  return result;
+}
+
+// Receive a message from a socket and return the message string (which must be freed later)
+user_info_t* receive_message(int fd) { 
+  session_t* session = session_get(fd);
+  if (session_mode(session) == SESSION_ACTIVE) {
+    return receive_session_message(fd, session);
+  }
+
+  // First try to read in the message length
+  size_t message_len;
+  if (receive_all(fd, &message_len, sizeof(size_t)) == -1) {
+    // Reading failed. Return an error
+    return NULL;
+  }
+
+  // The server accepted our session, so everything after this is in the session format.
+  if (session_mode(session) == SESSION_PENDING && is_session_header(&message_len)) {
+    if (session_activate(session, (const char*)&message_len) == -1) {
+      return NULL;
+    }
+    return receive_session_message(fd, session);
+  }
+
+  // Now make sure the message length is reasonable
+  if (message_len > MAX_MESSAGE_LENGTH) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Allocate space for the message and a null terminator
+  char* message_result = malloc(message_len + 1);
+
+  // Try to read the message. Loop until the entire message has been read.
+  size_t bytes_read = 0;
+  while (bytes_read < message_len) {
+    // Try to read the entire remaining message
+    ssize_t rc = receive_bytes(fd, message_result + bytes_read, message_len - bytes_read);
+
+    // Did the read fail? If so, return an error
+    if (rc <= 0) {
+      free(message_result);
+      return NULL;
+    }
+
+    // Update the number of bytes read
+    bytes_read += rc;
+  }
+
+  // Add a null terminator to the message
+  message_result[message_len] = '\0';
+
+  // Then, try to read in the username length
+  size_t username_len;
+  if (receive_all(fd, &username_len, sizeof(size_t)) == -1) {
+    // Reading failed. Return an error
+    free(message_result);
+    return NULL;
+  }
+
+  // Now make sure the username length is reasonable
+  if (username_len > MAX_MESSAGE_LENGTH) {
+    free(message_result);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  // Allocate space for the username and a null terminator
+  char* username_result = malloc(username_len + 1);
+
+  // Try to read the username. Loop until the entire username has been read.
+  bytes_read = 0;
+  while (bytes_read < username_len) {
+    // Try to read the entire remaining username
+    ssize_t rc = receive_bytes(fd, username_result + bytes_read, username_len - bytes_read);
+
+    // Did the read fail? If so, return an error
+    if (rc <= 0) {
+      free(username_result);
+      free(message_result);
+      return NULL;
+    }
+
+    // Update the number of bytes read
+    bytes_read += rc;
+  }
+
+  // Add a null terminator to the username
+  username_result[username_len] = '\0';
+
+  // Only allocated now that nothing can fail anymore.
+  user_info_t* user_info = malloc(sizeof(user_info_t));
+  user_info->message = message_result;
+  user_info->username = username_result;
+  return user_info;
+}
+
+// Read exactly len bytes from a socket. Returns non-zero value if the connection ends or fails
+// first.
+static int receive_all(int fd, void* buf, size_t len) {
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t rc = receive_bytes(fd, (char*)buf + bytes_read, len - bytes_read);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return -1;
+    }
+    bytes_read += rc;
+  }
+
+  return 0;
+}
+
+// Read exactly len bytes that start a frame from a socket. Unlike receive_all, a signal that
+// arrives before anything was read stops the wait (with errno set to EINTR), since nothing of the
+// frame is lost then. Returns non-zero value if the connection ends or fails first.
+static int receive_start(int fd, void* buf, size_t len) {
+  ssize_t rc = receive_bytes(fd, buf, len);
+  if (rc <= 0) {
+    return -1;
+  }
+
+  return receive_all(fd, (char*)buf + rc, len - rc);
+}
+
+// Receive a message from a socket as a raw frame.
+message_frame_t* receive_frame(int fd) {
+  session_t* session = session_get(fd);
+  if (session_mode(session) == SESSION_ACTIVE) {
+    return receive_session_frame(fd, session);
+  }
+
+  // Read the message length straight into the frame, then grow the frame once the username 
+  // length is known.
+  size_t message_len;
+  if (receive_start(fd, &message_len, sizeof(size_t)) == -1) {
+    return NULL;
+  }
+
+  // A client asking for a session sends a hello (or a resume request) instead of its first frame.
+  if (is_session_header(&message_len)) {
+    return receive_hello(fd, (const char*)&message_len);
+  } else if (is_resume_header(&message_len)) {
+    return receive_resume(fd, (const char*)&message_len);
+  }
+
+  if (message_len > MAX_MESSAGE_LENGTH) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  size_t len = 2 * sizeof(size_t) + message_len;
+  message_frame_t* frame = malloc(sizeof(message_frame_t) + len);
+  memcpy(frame->bytes, &message_len, sizeof(size_t));
+
+  // Read the message and the username length together.
+  if (receive_all(fd, frame->bytes + sizeof(size_t), message_len + sizeof(size_t)) == -1) {
+    free(frame);
+    return NULL;
+  }
+
+  size_t username_len;
+  memcpy(&username_len, frame->bytes + sizeof(size_t) + message_len, sizeof(size_t));
+  if (username_len > MAX_MESSAGE_LENGTH) {
+    free(frame);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  len += username_len;
+  message_frame_t* grown = realloc(frame, sizeof(message_frame_t) + len);
+  if (grown == NULL) {
+    free(frame);
+    return NULL;
+  }
+  frame = grown;
+
+  if (receive_all(fd, frame->bytes + 2 * sizeof(size_t) + message_len, username_len) == -1) {
+    free(frame);
+    return NULL;
+  }
+
+  atomic_init(&frame->refs, 1);
+  frame->kind = FRAME_LEGACY;
+  frame->opcode = 0; // Worked out by the server from the state of the game
+  frame->player_id = 0;
+  frame->token = 0;
+  frame->len = len;
+  frame->message = frame->bytes + sizeof(size_t);
+  frame->message_len = message_len;
+  frame->username = frame->bytes + 2 * sizeof(size_t) + message_len;
+  frame->username_len = username_len;
+  count_memory(sizeof(message_frame_t) + frame->len);
+  return frame;
+}
+
+// Write all of a buffer to a socket.
+static int send_all(int fd, const char* buf, size_t len) {
+  atomic_fetch_add(&sends_in_progress, 1);
+  trace_event(send_trace_type, TRACE_BEGIN, fd, len);
+
+  size_t bytes_written = 0;
+  while (bytes_written < len) {
+    ssize_t rc = write(fd, buf + bytes_written, len - bytes_written);
+    if (rc == -1 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      trace_event(send_trace_type, TRACE_END, 0, 0);
+      atomic_fetch_sub(&sends_in_progress, 1);
+      return -1;
+    }
+    bytes_written += rc;
+  }
+
+  trace_event(send_trace_type, TRACE_END, 0, 0);
+  atomic_fetch_sub(&sends_in_progress, 1);
+  return 0;
+}
+
+// Send a received frame as-is to several sockets.
+int broadcast_frame(const int* fds, size_t num_fds, message_frame_t* frame) {
+  if (frame == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  count_message(frame->opcode, num_fds, num_fds * frame->len);
+  return send_encoded(fds, num_fds, frame->bytes, frame->len);
+}
+
+// Write an encoded frame to several sockets.
+static int send_encoded(const int* fds, size_t num_fds, const char* frame, size_t frame_len) {
+  if (cork_hold(fds, num_fds, frame, frame_len)) {
+    return 0;
+  }
+
+  if (io_backend == MESSAGE_IO_URING) {
+    return uring_send_raw(fds, num_fds, frame, frame_len);
+  }
+
+  // The frame is already encoded, so every socket gets it with a single write.
+  int result = 0;
+  int saved_errno = 0;
+  for (size_t i = 0; i < num_fds; i++) {
+    if (send_all(fds[i], frame, frame_len) == -1) {
+      result = -1;
+      saved_errno = errno;
+    }
+  }
+
+  errno = saved_errno;
+  return result;
+}
+
+// Encode a message as a frame of the given kind.
+message_frame_t* frame_encode(frame_kind_t kind, opcode_t opcode, uint16_t player_id,
+                              const char* message, size_t message_len, const char* username,
+                              size_t username_len) {
+  if ((kind != FRAME_LEGACY && kind != FRAME_SESSION) || message_len > MAX_MESSAGE_LENGTH ||
+      username_len > MAX_MESSAGE_LENGTH) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  char header[SESSION_MAX_FRAME_HEADER_LEN];
+  size_t header_len = 0;
+  if (kind == FRAME_SESSION) {
+    header_len = put_session_frame_header(header, opcode, player_id, message_len);
+  }
+
+  size_t len = kind == FRAME_SESSION ? header_len + message_len
+                                     : 2 * sizeof(size_t) + message_len + username_len;
+  message_frame_t* frame = malloc(sizeof(message_frame_t) + len);
+
+  if (kind == FRAME_SESSION) {
+    memcpy(frame->bytes, header, header_len);
+    memcpy(frame->bytes + header_len, message, message_len);
+    frame->message = frame->bytes + header_len;
+    frame->username = NULL;
+    frame->username_len = 0;
+  } else {
+    memcpy(frame->bytes, &message_len, sizeof(size_t));
+    memcpy(frame->bytes + sizeof(size_t), message, message_len);
+    memcpy(frame->bytes + sizeof(size_t) + message_len, &username_len, sizeof(size_t));
+    memcpy(frame->bytes + 2 * sizeof(size_t) + message_len, username, username_len);
+    frame->message = frame->bytes + sizeof(size_t);
+    frame->username = frame->bytes + 2 * sizeof(size_t) + message_len;
+    frame->username_len = username_len;
+  }
+
+  atomic_init(&frame->refs, 1);
+  frame->kind = kind;
+  frame->opcode = opcode;
+  frame->player_id = player_id;
+  frame->token = 0;
+  frame->message_len = message_len;
+  frame->len = len;
+  count_memory(sizeof(message_frame_t) + frame->len);
+  return frame;
+}
+
+// Check whether a frame's message is exactly text.
+bool frame_message_equals(const message_frame_t* frame, const char* text, bool ignore_case) {
+  size_t text_len = strlen(text);
+  if (frame->message_len != text_len) {
+    return false;
+  }
+
+  if (ignore_case) {
+    return strncasecmp(frame->message, text, text_len) == 0;
+  }
+  return memcmp(frame->message, text, text_len) == 0;
+}
+
+// Take another reference to a frame.
+void frame_retain(message_frame_t* frame) {
+  atomic_fetch_add(&frame->refs, 1);
+}
+
+// Drop a reference to a frame.
+void frame_release(message_frame_t* frame) {
+  if (frame != NULL && atomic_fetch_sub(&frame->refs, 1) == 1) {
+    count_memory(-(ssize_t)(sizeof(message_frame_t) + frame->len));
+    free(frame);
+  }
+}
+
+
+/*******************
+ * Corked output
+ *******************/
+// While a thread is corked, whatever it sends is appended to a buffer per socket instead of being
+// written. Flushing writes each buffer with a single write, so the frames that handling one event
+// sends a socket leave together (usually in one packet), no matter how many places in the game
+// logic they were sent from.
+
+#define CORK_INITIAL_CAPACITY 512
+
+// The frames held back for one socket
+typedef struct corked_output {
+  int fd;
+  char* data;
+  size_t len;
+  size_t capacity;
+} corked_output_t;
+
+// Per-thread corking state
+typedef struct cork {
+  bool is_corked;
+  int max_delay_us;      // How long a held-back frame can wait before the next send flushes it
+  uint64_t first_held_us; // When the oldest held-back frame was held back (0 if there is none)
+  corked_output_t* outputs;
+  size_t num_outputs;    // Outputs in use (the buffers of the others are kept for reuse)
+  size_t num_allocated;
+  size_t next_output;    // Where to start looking for a socket's output
+} cork_t;
+
+static pthread_key_t cork_key;
+static pthread_once_t cork_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Get the current time in microseconds from a monotonic clock.
+ */
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Free a thread's corking state. Anything still held back is dropped.
+ */
+static void cork_destroy(void* args) {
+  cork_t* cork = (cork_t*)args;
+
+  for (size_t i = 0; i < cork->num_allocated; i++) {
+    count_memory(-(ssize_t)cork->outputs[i].capacity);
+    free(cork->outputs[i].data);
+  }
+  free(cork->outputs);
+  free(cork);
+}
+
+static void cork_make_key() {
+  pthread_key_create(&cork_key, cork_destroy);
+}
+
+/**
+ * Get the calling thread's corking state.
+ *
+ * \param create Whether to create the state if the thread doesn't have one yet
+ *
+ * \returns The thread's corking state, or NULL if it has none (or it couldn't be created).
+ */
+static cork_t* cork_get(bool create) {
+  pthread_once(&cork_key_once, cork_make_key);
+
+  cork_t* cork = pthread_getspecific(cork_key);
+  if (cork == NULL && create) {
+    cork = calloc(1, sizeof(cork_t));
+    if (cork != NULL) {
+      pthread_setspecific(cork_key, cork);
+    }
+  }
+
+  return cork;
+}
+
+/**
+ * Write everything a thread held back, one write per socket.
+ *
+ * \returns 0 if every socket got everything, or -1 with errno set if any write failed.
+ */
+static int cork_flush(cork_t* cork) {
+  // What is flushed must be written, not held back again.
+  bool is_corked = cork->is_corked;
+  cork->is_corked = false;
+
+  int result = 0;
+  int saved_errno = 0;
+  for (size_t i = 0; i < cork->num_outputs; i++) {
+    corked_output_t* output = &cork->outputs[i];
+    if (send_encoded(&output->fd, 1, output->data, output->len) == -1) {
+      result = -1;
+      saved_errno = errno;
+    }
+    output->len = 0;
+  }
+
+  cork->num_outputs = 0;
+  cork->next_output = 0;
+  cork->first_held_us = 0;
+  cork->is_corked = is_corked;
+
+  errno = saved_errno;
+  return result;
+}
+
+/**
+ * Get the output of a socket, adding it if nothing was held back for the socket yet. Broadcasts
+ * go to the sockets of a room in the same order every time, so the search starts right after the
+ * output that was found last.
+ *
+ * \returns The output, or NULL if there is no memory for it.
+ */
+static corked_output_t* cork_output(cork_t* cork, int fd) {
+  for (size_t n = 0; n < cork->num_outputs; n++) {
+    size_t i = (cork->next_output + n) % cork->num_outputs;
+    if (cork->outputs[i].fd == fd) {
+      cork->next_output = i + 1;
+      return &cork->outputs[i];
+    }
+  }
+
+  if (cork->num_outputs == cork->num_allocated) {
+    size_t num_allocated = cork->num_allocated > 0 ? cork->num_allocated * 2 : 8;
+    corked_output_t* outputs = realloc(cork->outputs, sizeof(corked_output_t) * num_allocated);
+    if (outputs == NULL) {
+      return NULL;
+    }
+    memset(outputs + cork->num_allocated, 0,
+           sizeof(corked_output_t) * (num_allocated - cork->num_allocated));
+    cork->outputs = outputs;
+    cork->num_allocated = num_allocated;
+  }
+
+  corked_output_t* output = &cork->outputs[cork->num_outputs++];
+  output->fd = fd;
+  output->len = 0;
+  cork->next_output = cork->num_outputs;
+  return output;
+}
+
+/**
+ * Append a frame to a socket's output.
+ *
+ * \returns Non-zero value if there is no memory for it.
+ */
+static int cork_append(cork_t* cork, int fd, const char* frame, size_t frame_len) {
+  corked_output_t* output = cork_output(cork, fd);
+  if (output == NULL) {
+    return -1;
+  }
+
+  if (output->len + frame_len > output->capacity) {
+    size_t capacity = output->capacity > 0 ? output->capacity : CORK_INITIAL_CAPACITY;
+    while (capacity < output->len + frame_len) {
+      capacity *= 2;
+    }
+
+    char* data = realloc(output->data, capacity);
+    if (data == NULL) {
+      return -1;
+    }
+    count_memory(capacity - output->capacity);
+    output->data = data;
+    output->capacity = capacity;
+  }
+
+  memcpy(output->data + output->len, frame, frame_len);
+  output->len += frame_len;
+  return 0;
+}
+
+/**
+ * Hold back an encoded frame for several sockets if the calling thread is corked. A frame that
+ * can't be held back is written right after everything held back before it.
+ *
+ * \returns true if the frame was held back, and false if it still needs to be written.
+ */
+static bool cork_hold(const int* fds, size_t num_fds, const char* frame, size_t frame_len) {
+  cork_t* cork = cork_get(false);
+  if (cork == NULL || !cork->is_corked) {
+    return false;
+  }
+
+  // Nothing waits longer than the thread allows.
+  uint64_t now = now_us();
+  if (cork->first_held_us != 0 && now - cork->first_held_us >= (uint64_t)cork->max_delay_us) {
+    cork_flush(cork);
+  }
+
+  for (size_t i = 0; i < num_fds; i++) {
+    if (cork_append(cork, fds[i], frame, frame_len) == -1) {
+      // The sockets this frame was already appended for get it twice otherwise.
+      for (size_t j = 0; j < i; j++) {
+        cork_output(cork, fds[j])->len -= frame_len;
+      }
+      cork_flush(cork);
+      return false;
+    }
+  }
+
+  if (cork->first_held_us == 0) {
+    cork->first_held_us = now;
+  }
+  return true;
+}
+
+/**
+ * Hold back a legacy message for several sockets if the calling thread is corked.
+ *
+ * \returns true if the message was held back, and false if it still needs to be sent.
+ */
+static bool cork_hold_fields(const int* fds, size_t num_fds, user_info_t* user_info) {
+  cork_t* cork = cork_get(false);
+  if (cork == NULL || !cork->is_corked) {
+    return false;
+  }
+
+  message_frame_t* frame = frame_encode(FRAME_LEGACY, 0, 0, user_info->message,
+                                        strlen(user_info->message), user_info->username,
+                                        strlen(user_info->username));
+  if (frame == NULL) {
+    return false;
+  }
+
+  bool is_held = cork_hold(fds, num_fds, frame->bytes, frame->len);
+  frame_release(frame);
+  return is_held;
+}
+
+// Hold back whatever this thread sends until it is flushed.
+void message_io_cork(int max_delay_us) {
+  cork_t* cork = cork_get(true);
+  if (cork == NULL) {
+    return;
+  }
+
+  cork->is_corked = true;
+  cork->max_delay_us = max_delay_us;
+}
+
+// Write everything this thread held back.
+int message_io_flush(void) {
+  cork_t* cork = cork_get(false);
+  if (cork == NULL) {
+    return 0;
+  }
+
+  return cork_flush(cork);
+}
+
+// Write everything this thread held back, and stop holding back what it sends.
+int message_io_uncork(void) {
+  cork_t* cork = cork_get(false);
+  if (cork == NULL) {
+    return 0;
+  }
+
+  cork->is_corked = false;
+  return cork_flush(cork);
+}
+
+/**
+ * Write what the calling thread held back for a socket that is about to be closed, and forget its
+ * output. Flushing later would write to whatever connection reuses the file descriptor.
+ */
+static void cork_close(int fd) {
+  cork_t* cork = cork_get(false);
+  if (cork == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < cork->num_outputs; i++) {
+    if (cork->outputs[i].fd != fd) {
+      continue;
+    }
+
+    // The socket is going away, so a failed write doesn't matter to anyone.
+    corked_output_t output = cork->outputs[i];
+    send_encoded(&output.fd, 1, output.data, output.len);
+    output.len = 0;
+
+    // The last output in use takes its place, and its buffer is kept for reuse.
+    cork->outputs[i] = cork->outputs[cork->num_outputs - 1];
+    cork->outputs[cork->num_outputs - 1] = output;
+    cork->num_outputs--;
+    cork->next_output = 0;
+    return;
+  }
+}
+
+
+/*******************
+ * io_uring backend
+ *******************/
+// Each thread that sends or receives messages gets its own ring. Outgoing frames are encoded once
+// into a buffer registered with the ring, so a broadcast submits one write per recipient, all in
+// a single system call. Incoming data arrives through a multishot receive that keeps filling
+// buffers from a provided-buffer ring, so a frame is usually read without any system call.
+
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 16 // Must be a power of two
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_SEND_BUFFER_SIZE (2 * (sizeof(size_t) + MAX_MESSAGE_LENGTH))
+#define URING_RECV_TAG UINT64_MAX         // user_data of the multishot receive
+#define URING_CANCEL_TAG (UINT64_MAX - 1) // user_data of a receive cancellation
+// user_data of a write: the generation of the send in the upper half, the socket's index below it
+#define URING_WRITE_TAG(generation, i) (((uint64_t)(generation) << 32) | (uint64_t)(i))
+#define URING_GENERATION_MASK 0x7FFFFFFF  // Keeps write tags clear of the receive and cancel tags
+#define URING_PAGE_ROUND(size) (((size) + 4095) & ~(size_t)4095)
+#define URING_RECV_BUFFERS_SIZE (URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE)
+#define URING_RECV_RING_SIZE URING_PAGE_ROUND(URING_RECV_BUFFERS * sizeof(struct io_uring_buf))
+#define URING_BUFFERS_SIZE \
+  (URING_RECV_BUFFERS_SIZE + URING_RECV_RING_SIZE + URING_PAGE_ROUND(URING_SEND_BUFFER_SIZE))
+// Memory of a thread's io_uring state, besides the rings the kernel maps
+#define URING_IO_MEMORY (sizeof(uring_io_t) + URING_BUFFERS_SIZE)
+
+// States of the multishot receive on a thread's ring
+typedef enum recv_state {
+  RECV_IDLE,    // No receive is in flight (it needs to be armed before waiting for data)
+  RECV_ARMED,   // The receive is in flight and will keep delivering data
+  RECV_EOF,     // The peer closed the connection
+  RECV_ERROR,   // The receive failed (recv_error holds the errno value)
+} recv_state_t;
+
+// Per-thread io_uring state
+typedef struct uring_io {
+  uring_t ring;
+  char* buffers; // The send buffer, receive buffer ring, and receive buffers, mapped together
+  char* send_buffer; // Registered as fixed buffer 0
+  struct io_uring_buf_ring* recv_ring; // Provided buffers for buffer group 0
+  char* recv_buffers;
+  unsigned short recv_ring_tail;
+
+  bool blocking; // The ring stopped working and was torn down, so this thread uses plain I/O
+  uint32_t send_generation; // Generation of the latest send, carried in its writes' user_data
+
+  int recv_fd; // The socket this thread receives from, or -1
+  recv_state_t recv_state;
+  int recv_error;
+
+  // Received bytes that haven't been consumed yet
+  char* pending;
+  size_t pending_start;
+  size_t pending_end;
+  size_t pending_capacity;
+} uring_io_t;
+
+// Progress of the writes of one frame to a set of sockets
+typedef struct uring_send {
+  const int* fds;
+  size_t num_fds;
+  size_t frame_len;
+  size_t* bytes_sent;
+  size_t* retry;      // Indices of sockets that still need a write submitted
+  size_t num_retry;
+  size_t num_done;
+  size_t num_in_flight; // Writes handed to the ring that haven't completed yet
+  uint32_t generation;
+  int error;          // The errno value of the last failed write (0 if none failed)
+} uring_send_t;
+
+// Data that was read ahead from a socket by a thread that then released it
+typedef struct uring_leftover {
+  int fd;
+  char* data;
+  size_t len;
+  struct uring_leftover* next;
+} uring_leftover_t;
+
+static pthread_key_t uring_io_key;
+static pthread_once_t uring_io_key_once = PTHREAD_ONCE_INIT;
+static uring_leftover_t* uring_leftovers = NULL;
+static profiled_mutex_t uring_leftovers_lock = PROFILED_MUTEX_INITIALIZER("uring_leftovers_lock");
+
+/**
+ * Give a receive buffer (back) to the kernel.
+ *
+ * \param io  The thread's io_uring state
+ * \param bid The id of the buffer
+ */
+static void uring_provide_buffer(uring_io_t* io, unsigned short bid) {
+  struct io_uring_buf* buf = &io->recv_ring->bufs[io->recv_ring_tail & (URING_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(io->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE);
+  buf->len = URING_RECV_BUFFER_SIZE;
+  buf->bid = bid;
+
+  io->recv_ring_tail++;
+  __atomic_store_n(&io->recv_ring->tail, io->recv_ring_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Free a thread's io_uring state. The kernel cancels anything still in flight.
+ */
+static void uring_io_destroy(void* args) {
+  uring_io_t* io = (uring_io_t*)args;
+
+  count_memory(-(ssize_t)io->pending_capacity);
+  if (!io->blocking) {
+    uring_destroy(&io->ring);
+  }
+  if (io->buffers != NULL) {
+    munmap(io->buffers, URING_BUFFERS_SIZE);
+  }
+  free(io->pending);
+  free(io);
+}
+
+/**
+ * Create a ring along with its registered send buffer and provided receive buffers.
+ *
+ * \returns The new io_uring state, or NULL if the kernel doesn't support something we need.
+ */
+static uring_io_t* uring_io_create() {
+  uring_io_t* io = calloc(1, sizeof(uring_io_t));
+  if (io == NULL) {
+    return NULL;
+  }
+
+  if (uring_init(&io->ring, URING_ENTRIES) == -1) {
+    free(io);
+    return NULL;
+  }
+
+  io->recv_fd = -1;
+  io->recv_state = RECV_IDLE;
+
+  // Buffers shared with the kernel must be page aligned. They are mapped rather than allocated, so
+  // that they go back to the kernel when the thread exits instead of staying in its malloc arena.
+  void* buffers = mmap(NULL, URING_BUFFERS_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    uring_io_destroy(io);
+    return NULL;
+  }
+  io->buffers = buffers;
+  io->recv_buffers = io->buffers;
+  io->recv_ring = (struct io_uring_buf_ring*)(io->buffers + URING_RECV_BUFFERS_SIZE);
+  io->send_buffer = io->buffers + URING_RECV_BUFFERS_SIZE + URING_RECV_RING_SIZE;
+
+  // Register the send buffer, so the kernel doesn't have to map it on every write.
+  struct iovec send_iov = {.iov_base = io->send_buffer, .iov_len = URING_SEND_BUFFER_SIZE};
+  if (uring_register(&io->ring, IORING_REGISTER_BUFFERS, &send_iov, 1) == -1) {
+    uring_io_destroy(io);
+    return NULL;
+  }
+
+  // Register the ring of receive buffers the multishot receive fills.
+  memset(io->recv_ring, 0, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (uint64_t)(uintptr_t)io->recv_ring,
+      .ring_entries = URING_RECV_BUFFERS,
+      .bgid = 0,
+  };
+  if (uring_register(&io->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    uring_io_destroy(io);
+    return NULL;
+  }
+
+  for (unsigned short bid = 0; bid < URING_RECV_BUFFERS; bid++) {
+    uring_provide_buffer(io, bid);
+  }
+
+  return io;
+}
+
+/**
+ * Free a thread's io_uring state when the thread exits.
+ */
+static void uring_io_exit(void* args) {
+  count_memory(-(ssize_t)URING_IO_MEMORY);
+  uring_io_destroy(args);
+}
+
+static void uring_io_make_key() {
+  pthread_key_create(&uring_io_key, uring_io_exit);
+}
+
+/**
+ * Get the calling thread's io_uring state, creating it the first time.
+ *
+ * \returns The thread's io_uring state, or NULL if it couldn't be created.
+ */
+static uring_io_t* uring_io_get() {
+  pthread_once(&uring_io_key_once, uring_io_make_key);
+
+  uring_io_t* io = pthread_getspecific(uring_io_key);
+  if (io == NULL) {
+    io = uring_io_create();
+    if (io != NULL) {
+      count_memory(URING_IO_MEMORY);
+      pthread_setspecific(uring_io_key, io);
+    }
+  }
+
+  return io;
+}
+
+/**
+ * Append received bytes to the thread's pending data.
+ */
+static void uring_append_pending(uring_io_t* io, const char* data, size_t len) {
+  // Move the unconsumed bytes to the front before growing the buffer.
+  if (io->pending_start > 0) {
+    memmove(io->pending, io->pending + io->pending_start, io->pending_end - io->pending_start);
+    io->pending_end -= io->pending_start;
+    io->pending_start = 0;
+  }
+
+  if (io->pending_end + len > io->pending_capacity) {
+    size_t capacity = io->pending_capacity == 0 ? URING_RECV_BUFFER_SIZE : io->pending_capacity;
+    while (capacity < io->pending_end + len) {
+      capacity *= 2;
+    }
+    io->pending = realloc(io->pending, capacity);
+    count_memory(capacity - io->pending_capacity);
+    io->pending_capacity = capacity;
+  }
+
+  memcpy(io->pending + io->pending_end, data, len);
+  io->pending_end += len;
+}
+
+/**
+ * Handle every completion that is currently available on a thread's ring.
+ *
+ * \param io   The thread's io_uring state
+ * \param send The progress of the frame being sent, or NULL if no frame is being sent
+ */
+static void uring_reap(uring_io_t* io, uring_send_t* send) {
+  struct io_uring_cqe* cqe;
+  while ((cqe = uring_peek_cqe(&io->ring)) != NULL) {
+    if (cqe->user_data == URING_RECV_TAG) {
+      // Move the received data out of the kernel's buffer and give the buffer back.
+      if (cqe->res > 0) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        uring_append_pending(io, io->recv_buffers + (size_t)bid * URING_RECV_BUFFER_SIZE,
+                             cqe->res);
+        uring_provide_buffer(io, bid);
+      }
+
+      // The receive stops on EOF, errors, cancellation, or when it runs out of buffers.
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == 0) {
+          io->recv_state = RECV_EOF;
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+          io->recv_state = RECV_ERROR;
+          io->recv_error = -cqe->res;
+        } else {
+          io->recv_state = RECV_IDLE;
+        }
+      }
+    } else if (cqe->user_data != URING_CANCEL_TAG && send != NULL &&
+               cqe->user_data >> 32 == send->generation &&
+               (cqe->user_data & UINT32_MAX) < send->num_fds) {
+      // A write of the frame being sent finished. Writes left over from an earlier send are
+      // dropped, as their indices mean nothing to this one.
+      size_t i = cqe->user_data & UINT32_MAX;
+      send->num_in_flight--;
+      if (cqe->res <= 0) {
+        send->error = cqe->res == 0 ? EPIPE : -cqe->res;
+        send->num_done++;
+      } else {
+        send->bytes_sent[i] += cqe->res;
+        if (send->bytes_sent[i] == send->frame_len) {
+          send->num_done++;
+        } else {
+          send->retry[send->num_retry++] = i; // Only part of the frame was written
+        }
+      }
+    }
+
+    uring_cqe_seen(&io->ring);
+  }
+}
+
+/**
+ * Tear down a thread's ring after it stopped working, so the thread uses plain I/O from now on.
+ * The buffers stay mapped until the thread exits, as the kernel may still be finishing requests
+ * that used them.
+ */
+static void uring_fall_back(uring_io_t* io) {
+  uring_destroy(&io->ring);
+  io->blocking = true;
+  io->recv_state = RECV_IDLE;
+}
+
+/**
+ * Wait until every write of a frame that was handed to the ring has completed.
+ *
+ * \param io   The thread's io_uring state
+ * \param send The progress of the frame being sent
+ *
+ * \returns 0 once no write is in flight, or -1 if the ring stopped working before that.
+ */
+static int uring_drain(uring_io_t* io, uring_send_t* send) {
+  uring_reap(io, send);
+  while (send->num_in_flight > 0) {
+    // The kernel turns down new work while completions pile up, which reaping takes care of. A
+    // ring that fails without completing anything is not coming back.
+    size_t in_flight = send->num_in_flight;
+    int rc = uring_submit_and_wait(&io->ring, 1);
+    uring_reap(io, send);
+    if (rc == -1 && send->num_in_flight == in_flight) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Write a frame to every socket, submitting all writes in one system call.
+ *
+ * \param io        The thread's io_uring state
+ * \param fds       The sockets to write to
+ * \param num_fds   The number of sockets
+ * \param frame     The frame, either in the registered buffer or anywhere else in memory
+ * \param frame_len The length of the frame
+ * \param fixed     Whether the frame is in the registered buffer
+ *
+ * \returns 0 if every socket got the whole frame, or -1 with errno set if any write failed.
+ */
+static int uring_write_frame(uring_io_t* io, const int* fds, size_t num_fds, const char* frame,
+                             size_t frame_len, bool fixed) {
+  io->send_generation = (io->send_generation + 1) & URING_GENERATION_MASK;
+  uring_send_t send = {
+      .fds = fds,
+      .num_fds = num_fds,
+      .frame_len = frame_len,
+      .bytes_sent = calloc(num_fds, sizeof(size_t)),
+      .retry = malloc(sizeof(size_t) * num_fds),
+      .num_retry = 0,
+      .num_done = 0,
+      .num_in_flight = 0,
+      .generation = io->send_generation,
+      .error = 0,
+  };
+
+  // Every socket starts out needing a write.
+  for (size_t i = 0; i < num_fds; i++) {
+    send.retry[send.num_retry++] = i;
+  }
+  atomic_fetch_add(&sends_in_progress, num_fds);
+  trace_event(uring_send_trace_type, TRACE_BEGIN, num_fds, frame_len);
+
+  // The writes go to different sockets, so they are not linked: a linked chain is cancelled after
+  // its first failure, and one player who left would stop everyone else from getting the frame.
+  bool ring_failed = false;
+  while (send.num_done < num_fds) {
+    while (send.num_retry > 0) {
+      struct io_uring_sqe* sqe = uring_get_sqe(&io->ring);
+      if (sqe == NULL) {
+        break;
+      }
+
+      size_t i = send.retry[--send.num_retry];
+      sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+      sqe->fd = fds[i];
+      sqe->addr = (uint64_t)(uintptr_t)(frame + send.bytes_sent[i]);
+      sqe->len = frame_len - send.bytes_sent[i];
+      sqe->buf_index = 0;
+      sqe->user_data = URING_WRITE_TAG(send.generation, i);
+      send.num_in_flight++;
+    }
+
+    if (uring_submit_and_wait(&io->ring, 1) == -1) {
+      ring_failed = true;
+      break;
+    }
+
+    uring_reap(io, &send);
+  }
+
+  if (ring_failed) {
+    // Nothing may be left in flight once bytes_sent and retry are freed, so wait for every write
+    // the kernel has. If that fails too, the ring is given up on.
+    int ring_error = errno;
+    if (uring_drain(io, &send) == -1) {
+      uring_fall_back(io);
+      send.error = ring_error; // The writes still in flight are counted as failed
+    }
+
+    // Whatever the ring didn't get to is written the plain way.
+    for (size_t k = 0; k < send.num_retry; k++) {
+      size_t i = send.retry[k];
+      if (send_all(fds[i], frame + send.bytes_sent[i], frame_len - send.bytes_sent[i]) == -1) {
+        send.error = errno;
+      }
+    }
+  }
+
+  trace_event(uring_send_trace_type, TRACE_END, 0, 0);
+  atomic_fetch_sub(&sends_in_progress, num_fds);
+  free(send.bytes_sent);
+  free(send.retry);
+
+  if (send.error != 0) {
+    errno = send.error;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Encode a message into the thread's registered buffer and write it to every socket.
+ *
+ * \returns 0 if every socket got the whole frame, or -1 with errno set if any write failed.
+ */
+static int uring_send_frame(const int* fds, size_t num_fds, user_info_t* user_info) {
+  if (cork_hold_fields(fds, num_fds, user_info)) {
+    return 0;
+  }
+
+  size_t message_len = strlen(user_info->message);
+  size_t username_len = strlen(user_info->username);
+  size_t frame_len = 2 * sizeof(size_t) + message_len + username_len;
+
+  uring_io_t* io = uring_io_get();
+
+  // Frames that don't fit the registered buffer (or a thread without a ring) use plain writes.
+  if (io == NULL || io->blocking || frame_len > URING_SEND_BUFFER_SIZE) {
+    int rc = 0;
+    for (size_t i = 0; i < num_fds; i++) {
+      if (send_fields(fds[i], user_info) == -1) {
+        rc = -1;
+      }
+    }
+    return rc;
+  }
+
+  // Encode the frame exactly as the blocking backend sends it.
+  char* frame = io->send_buffer;
+  memcpy(frame, &message_len, sizeof(size_t));
+  memcpy(frame + sizeof(size_t), user_info->message, message_len);
+  memcpy(frame + sizeof(size_t) + message_len, &username_len, sizeof(size_t));
+  memcpy(frame + 2 * sizeof(size_t) + message_len, user_info->username, username_len);
+
+  return uring_write_frame(io, fds, num_fds, frame, frame_len, true);
+}
+
+/**
+ * Write an already encoded frame to every socket straight from where it is in memory.
+ *
+ * \returns 0 if every socket got the whole frame, or -1 with errno set if any write failed.
+ */
+static int uring_send_raw(const int* fds, size_t num_fds, const char* frame, size_t frame_len) {
+  uring_io_t* io = uring_io_get();
+
+  // A thread without a ring uses plain writes.
+  if (io == NULL || io->blocking) {
+    int rc = 0;
+    for (size_t i = 0; i < num_fds; i++) {
+      if (send_all(fds[i], frame, frame_len) == -1) {
+        rc = -1;
+      }
+    }
+    return rc;
+  }
+
+  return uring_write_frame(io, fds, num_fds, frame, frame_len, false);
+}
+
+/**
+ * Start (or restart) the multishot receive on a socket.
+ */
+static int uring_arm_receive(uring_io_t* io, int fd) {
+  struct io_uring_sqe* sqe = uring_get_sqe(&io->ring);
+  if (sqe == NULL) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = URING_RECV_TAG;
+
+  io->recv_state = RECV_ARMED;
+  return 0;
+}
+
+/**
+ * Read up to len bytes from a socket through the thread's multishot receive. Unlike read, this 
+ * waits until len bytes are available unless the connection ends first.
+ */
+static ssize_t uring_receive(int fd, void* buf, size_t len) {
+  uring_io_t* io = uring_io_get();
+  if (io == NULL) {
+    return read(fd, buf, len);
+  }
+
+  // Switch this thread over to a different socket.
+  if (io->recv_fd != fd) {
+    if (io->recv_fd != -1) {
+      message_io_release(io->recv_fd);
+    }
+    io->recv_fd = fd;
+    io->recv_state = RECV_IDLE;
+
+    // Pick up anything another thread read ahead from this socket.
+    profiled_mutex_lock(&uring_leftovers_lock);
+    uring_leftover_t** link = &uring_leftovers;
+    while (*link != NULL && (*link)->fd != fd) {
+      link = &(*link)->next;
+    }
+    uring_leftover_t* leftover = *link;
+    if (leftover != NULL) {
+      *link = leftover->next;
+    }
+    profiled_mutex_unlock(&uring_leftovers_lock);
+
+    if (leftover != NULL) {
+      uring_append_pending(io, leftover->data, leftover->len);
+      count_memory(-(ssize_t)(sizeof(uring_leftover_t) + leftover->len));
+      free(leftover->data);
+      free(leftover);
+    }
+  }
+
+  // A thread whose ring was torn down reads the plain way once the data read ahead is used up.
+  if (io->blocking && io->pending_end == io->pending_start) {
+    return read(fd, buf, len);
+  }
+
+  // Wait for enough data, or for the connection to end.
+  while (!io->blocking && io->pending_end - io->pending_start < len &&
+         (io->recv_state == RECV_IDLE || io->recv_state == RECV_ARMED)) {
+    if (io->recv_state == RECV_IDLE && uring_arm_receive(io, fd) == -1) {
+      return -1;
+    }
+
+    if (uring_submit_and_wait(&io->ring, 1) == -1) {
+      return -1;
+    }
+
+    uring_reap(io, NULL);
+  }
+
+  size_t available = io->pending_end - io->pending_start;
+  if (available == 0) {
+    if (io->recv_state == RECV_ERROR) {
+      errno = io->recv_error;
+      return -1;
+    }
+    return 0;
+  }
+
+  size_t n = available < len ? available : len;
+  memcpy(buf, io->pending + io->pending_start, n);
+  io->pending_start += n;
+  return n;
+}
+
+// Stop reading from a socket on this thread.
+void message_io_release(int fd) {
+  if (io_backend != MESSAGE_IO_URING) {
+    return;
+  }
+
+  uring_io_t* io = pthread_getspecific(uring_io_key);
+  if (io == NULL || io->recv_fd != fd) {
+    return;
+  }
+
+  // Cancel the multishot receive and collect whatever it delivered before stopping.
+  if (io->recv_state == RECV_ARMED) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&io->ring);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = URING_RECV_TAG;
+      sqe->user_data = URING_CANCEL_TAG;
+    }
+
+    while (io->recv_state == RECV_ARMED && uring_submit_and_wait(&io->ring, 1) == 0) {
+      uring_reap(io, NULL);
+    }
+  }
+
+  // Hand the data that was read ahead to the next thread that receives from this socket.
+  size_t available = io->pending_end - io->pending_start;
+  if (available > 0) {
+    uring_leftover_t* leftover = malloc(sizeof(uring_leftover_t));
+    leftover->fd = fd;
+    leftover->len = available;
+    leftover->data = malloc(available);
+    memcpy(leftover->data, io->pending + io->pending_start, available);
+    count_memory(sizeof(uring_leftover_t) + available);
+
+    profiled_mutex_lock(&uring_leftovers_lock);
+    leftover->next = uring_leftovers;
+    uring_leftovers = leftover;
+    profiled_mutex_unlock(&uring_leftovers_lock);
+  }
+
+  io->recv_fd = -1;
+  io->recv_state = RECV_IDLE;
+  io->pending_start = 0;
+  io->pending_end = 0;
+}
+
+/**
+ * Drop whatever was read ahead from a socket that is about to be closed, which the next receiver
+ * would otherwise take as the start of a new connection that reuses the file descriptor.
+ */
+static void uring_forget(int fd) {
+  message_io_release(fd);
+
+  profiled_mutex_lock(&uring_leftovers_lock);
+  uring_leftover_t** link = &uring_leftovers;
+  while (*link != NULL && (*link)->fd != fd) {
+    link = &(*link)->next;
+  }
+  uring_leftover_t* leftover = *link;
+  if (leftover != NULL) {
+    *link = leftover->next;
+  }
+  profiled_mutex_unlock(&uring_leftovers_lock);
+
+  if (leftover != NULL) {
+    count_memory(-(ssize_t)(sizeof(uring_leftover_t) + leftover->len));
+    free(leftover->data);
+    free(leftover);
+  }
+}
+
+// Close a socket, after writing what this thread held back for it and forgetting its state.
+void message_io_close(int fd) {
+  cork_close(fd);
+  session_end(fd);
+  if (io_backend == MESSAGE_IO_URING) {
+    uring_forget(fd);
+  }
+  close(fd);
+}
+
+/**
+ * Check that the kernel supports everything the io_uring backend uses by receiving a byte through
+ * a multishot receive on a socket pair.
+ */
+static bool uring_supported() {
+  uring_io_t* io = uring_io_create();
+  if (io == NULL) {
+    return false;
+  }
+
+  bool supported = false;
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+    char byte = 'x';
+    if (write(fds[1], &byte, 1) == 1 && uring_arm_receive(io, fds[0]) == 0 &&
+        uring_submit_and_wait(&io->ring, 1) == 0) {
+      uring_reap(io, NULL);
+      supported = io->recv_state == RECV_ARMED && io->pending_end == 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  uring_io_destroy(io);
+  return supported;
+}
+
+// Select how messages are sent and received.
+message_io_backend_t message_io_init(message_io_backend_t backend) {
+  if (backend == MESSAGE_IO_URING && !uring_supported()) {
+    backend = MESSAGE_IO_BLOCKING;
+  }
+
+  io_backend = backend;
+  send_trace_type = trace_add_type("send", "fd", "bytes");
+  uring_send_trace_type = trace_add_type("io_uring send", "sockets", "bytes");
+  return io_backend;
+}
+
+// Count every message sent from now on.
+void message_io_count_sent(message_count_fn count) {
+  count_sent = count;
+}
+
+// Count the memory held for connections from now on.
+void message_io_count_memory(message_memory_fn count) {
+  count_memory_fn = count;
+}
+
+/**
+ * Count memory that was allocated (or freed, if num_bytes is negative) for connections, if
+ * anything counts it.
+ */
+static void count_memory(ssize_t num_bytes) {
+  if (count_memory_fn != NULL) {
+    count_memory_fn(num_bytes);
+  }
+}
+
+/**
+ * Count a message that is being sent, if anything counts them.
+ */
+static void count_message(opcode_t opcode, size_t num_messages, size_t num_bytes) {
+  if (count_sent != NULL) {
+    count_sent(opcode, num_messages, num_bytes);
+  }
+}
+
+// Get the number of sockets that threads are writing to right now.
+size_t message_io_sends_in_progress(void) {
+  return atomic_load(&sends_in_progress);
+}
+
+// Get the name of a backend.
+const char* message_io_backend_name(message_io_backend_t backend) {
+  return backend == MESSAGE_IO_URING ? "io_uring" : "blocking";
 }
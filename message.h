@@ -1,12 +1,280 @@
 #pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "user.h"
 
 #define MAX_MESSAGE_LENGTH 2048
 
-// Send a across a socket with a header that includes the message length. Returns non-zero value if
-// an error occurs.
+// Clients that support sessions register their username once, in a hello sent right after they
+// connect. Once the server accepts the session (after any legacy frames it already sent), frames
+// in both directions carry an opcode saying what they are and a player id instead of a name, and
+// the server tells the client every player's name. See "Session Protocol" in the README for the
+// wire format.
+#define SESSION_MAGIC "WGS"
+#define RESUME_MAGIC "WGR" // Sent instead of a hello by a client taking its seat back
+#define SESSION_VERSION 4           // The highest protocol version this side speaks
+#define SESSION_MIN_VERSION 2       // The lowest protocol version this side speaks
+#define SESSION_RESUME_VERSION 3    // The lowest protocol version that can take a seat back
+#define SESSION_HEARTBEAT_VERSION 4 // The lowest protocol version that answers pings
+#define SESSION_SERVER_ID 0         // The player id of messages from the server
+
+// What a session frame is. Legacy frames don't have one, so the server works it out from the
+// state of the game and who sent the frame.
+typedef enum opcode {
+  OP_JOIN = 1,      // Server: a player's name (the player id is the player's)
+  OP_SECRET = 2,    // Client: the host's secret word
+  OP_QUESTION = 3,  // Client: the asker's question (relayed to every player)
+  OP_ANSWER = 4,    // Client: the host's answer or remark (relayed to every player)
+  OP_GUESS = 5,     // Client: a guess of the secret word
+  OP_NOTICE = 6,    // Server: a message from the server
+  OP_SCORE = 7,     // Server: a player's score (a varint)
+  OP_TURN = 8,      // Server: the opcode the server expects from the client next (one byte)
+  OP_CHAT = 9,      // Client: a message while it isn't the player's turn
+  OP_QUIT = 10,     // Client: leaving the game
+  OP_TOKEN = 11,    // Server: the token that takes the player's seat back after a reconnect
+  OP_SNAPSHOT = 12, // Server: the state of the game, sent instead of a turn after a reconnect
+  OP_PING = 13,     // Server: asks whether the client is still there (no payload)
+  OP_PONG = 14,     // Client: the answer to a ping, which the client's library sends by itself
+  NUM_OPCODES,
+} opcode_t;
+
+// The formats a frame can arrive in.
+typedef enum frame_kind {
+  FRAME_LEGACY,  // Message and username, each with a size_t length
+  FRAME_SESSION, // Message from a player id (the username is not in the frame)
+  FRAME_HELLO,   // A client asking for a session (the username is the only field)
+  FRAME_RESUME,  // A client asking for its seat back (the token is the only field)
+} frame_kind_t;
+
+// A received message kept exactly as it arrived on the wire, so it can be forwarded to other
+// sockets without being decoded and encoded again. The message and username point into the
+// frame's bytes and are NOT null-terminated. Frames are reference counted, so a frame can be
+// handed to several senders and is freed by whoever releases it last.
+typedef struct message_frame {
+  atomic_int refs;
+  frame_kind_t kind;
+  opcode_t opcode;    // What a session frame is (0 for legacy frames)
+  uint16_t player_id; // The sender of a session frame
+  uint64_t token;     // The token of a resume frame
+  const char* message;
+  size_t message_len;
+  const char* username;
+  size_t username_len;
+  size_t len;   // Length of the whole frame (headers included)
+  char bytes[];
+} message_frame_t;
+
+// The ways messages can be sent and received.
+typedef enum message_io_backend {
+  MESSAGE_IO_BLOCKING, // One blocking read/write system call per field of a message
+  MESSAGE_IO_URING,    // io_uring with registered send buffers and multishot receives
+} message_io_backend_t;
+
+// Select how messages are sent and received by every thread. Must be called before any messages
+// are sent or received. Returns the backend actually in use, which is MESSAGE_IO_BLOCKING if the
+// kernel doesn't support the requested one.
+message_io_backend_t message_io_init(message_io_backend_t backend);
+
+// Called with every message a thread sends: its opcode (0 for a legacy frame), how many sockets
+// it is sent to, and the bytes sent to all of them together.
+typedef void (*message_count_fn)(opcode_t opcode, size_t num_messages, size_t num_bytes);
+
+// Count every message sent from now on with count. Must be called before any messages are sent.
+void message_io_count_sent(message_count_fn count);
+
+// Called with the bytes allocated for connections (or freed, when num_bytes is negative): frames
+// and output that were received or held back, and what was read ahead from sockets.
+typedef void (*message_memory_fn)(ssize_t num_bytes);
+
+// Count the memory allocated for connections from now on with count. Must be called before any
+// messages are sent or received.
+void message_io_count_memory(message_memory_fn count);
+
+// Get the name of a backend (for printing).
+const char* message_io_backend_name(message_io_backend_t backend);
+
+// Get the number of sockets that threads are writing to right now. A write blocks while the
+// socket's send buffer is full, so a number that keeps growing means clients can't keep up with
+// what is sent to them.
+size_t message_io_sends_in_progress(void);
+
+// Stop reading from a socket on this thread, so that another thread can continue receiving
+// messages from it. Any data that was already read ahead is handed over to the next receiver.
+void message_io_release(int fd);
+
+// Close a socket: write what this thread held back for it, forget its session, and drop anything
+// that was read ahead from it, so that nothing reaches a connection that gets the same file
+// descriptor later. Must be used instead of close for every socket that messages were sent or
+// received on.
+void message_io_close(int fd);
+
+// Hold back everything this thread sends (to any socket) until it flushes, so that each socket
+// gets what was sent to it meanwhile in a single write. A frame is never held back for more than
+// max_delay_us: the first send after that flushes. The thread must not wait for anything from a
+// socket it has held frames back for.
+void message_io_cork(int max_delay_us);
+
+// Write everything this thread held back, one write per socket. The thread stays corked. Returns
+// non-zero value if an error occurs for any of the sockets (the others still get their frames).
+int message_io_flush(void);
+
+// Write everything this thread held back, and stop holding back what it sends. Returns non-zero
+// value if an error occurs for any of the sockets.
+int message_io_uncork(void);
+
+// Send a across a socket with a header that includes the message length. Over a session, only the
+// message is sent: as a notice from the server, or from a client as OP_QUIT for "quit" and
+// otherwise as the opcode the server last said it expects. Returns non-zero value if an error
+// occurs.
 int send_message(int fd, user_info_t* message);
 
-// Receive a message from a socket and return the message string (which must be freed later).
-// Returns NULL when an error occurs.
-user_info_t* receive_message(int fd);
\ No newline at end of file
+// Send the same message to several sockets. The message is only encoded once. Returns non-zero
+// value if an error occurs for any of the sockets (the others still get the message).
+int broadcast_message(const int* fds, size_t num_fds, user_info_t* message);
+
+// Receive a message from a socket and return the message string (which must be freed later). Over a
+// session, the username is looked up in the names the server sent, and scores arrive as messages
+// from the server. Returns NULL when an error occurs.
+user_info_t* receive_message(int fd);
+
+// Receive a message from a socket as a raw frame with one reference (which must be released
+// later). Over a session, the frame's player id is always the id of the player the session was
+// accepted for. Returns NULL when an error occurs. With blocking I/O, a signal that arrives before
+// any of the frame did makes it return NULL with errno set to EINTR, and the frame is received by
+// the next call instead.
+message_frame_t* receive_frame(int fd);
+
+// Send a received frame as-is to several sockets. Returns non-zero value if an error occurs for
+// any of the sockets (the others still get the frame).
+int broadcast_frame(const int* fds, size_t num_fds, message_frame_t* frame);
+
+// Encode a message as a frame of the given kind (FRAME_LEGACY or FRAME_SESSION), with one
+// reference. The username is only used by legacy frames, and the opcode and player id by session
+// frames.
+message_frame_t* frame_encode(frame_kind_t kind, opcode_t opcode, uint16_t player_id,
+                              const char* message, size_t message_len, const char* username,
+                              size_t username_len);
+
+// The phases of a round, as seen by a player taking their seat back.
+typedef enum snapshot_phase {
+  PHASE_PICKING,   // The host is picking the secret word
+  PHASE_ASKING,    // The asker is asking a question
+  PHASE_ANSWERING, // The host is answering the asker's question
+  PHASE_GUESSING,  // Everyone but the host is guessing
+} snapshot_phase_t;
+
+typedef struct snapshot_player {
+  uint16_t player_id;
+  unsigned int score;
+  bool is_away; // The player's connection dropped, and their seat is being held
+  const char* name;
+} snapshot_player_t;
+
+// A question asked this round, and the host's answer.
+typedef struct snapshot_exchange {
+  uint16_t asker_id;
+  const char* question;
+  const char* answer; // NULL if the host hasn't answered (or the question was skipped)
+} snapshot_exchange_t;
+
+// The state of a game, which brings a player who reconnected up to date in a single frame.
+typedef struct snapshot {
+  snapshot_phase_t phase;
+  opcode_t turn; // What the server expects from the player next
+  uint16_t host_id;
+  uint16_t asker_id;
+  unsigned int num_questions; // Questions answered this round
+  unsigned int max_questions;
+  const char* secret_word; // Only sent to the host (NULL for everyone else)
+  snapshot_player_t* players;
+  size_t num_players;
+  snapshot_exchange_t* history; // This round's questions, in the order they were asked
+  size_t num_history;
+} snapshot_t;
+
+// Check whether a frame's message is exactly text (ignoring case if ignore_case is true).
+bool frame_message_equals(const message_frame_t* frame, const char* text, bool ignore_case);
+
+// Take another reference to a frame.
+void frame_retain(message_frame_t* frame);
+
+// Drop a reference to a frame, freeing it once the last reference is gone.
+void frame_release(message_frame_t* frame);
+
+// Ask the server for the seat that a token was issued for, after the connection that got the token
+// dropped (client side). It works like session_hello: the accept is followed by a snapshot of the
+// game instead of a turn. Returns non-zero value if an error occurs.
+int session_resume(int fd, uint64_t token);
+
+// Get the token the server issued for a socket's session (client side), or 0 if there is
+// none.
+uint64_t session_token(int fd);
+
+// Take a resume request off a new socket, waiting up to timeout_ms for it to arrive (server side).
+// Stops waiting as soon as the first bytes show that it isn't one. Otherwise nothing is read, and a
+// request that arrives later comes as a resume frame. Returns true and sets the token if a request
+// was taken.
+bool session_take_resume(int fd, int timeout_ms, uint64_t* token);
+
+// Check whether a client's session can take its seat back after a reconnect, which means the
+// client understands tokens and snapshots (server side).
+bool session_can_resume(int fd);
+
+// Check whether a client's session answers pings, so that its silence means the connection is
+// dead (server side).
+bool session_can_ping(int fd);
+
+// Ask a client with a session whether it is still there. Does nothing if the session doesn't
+// answer pings. Returns non-zero value if an error occurs.
+int session_send_ping(int fd);
+
+// Give a client with a session the token that takes its seat back. Returns non-zero value if an
+// error occurs.
+int session_send_token(int fd, uint64_t token);
+
+// Bring a client that took its seat back up to date. Returns non-zero value if an error occurs.
+int session_send_snapshot(int fd, const snapshot_t* snapshot);
+
+// Ask the server for a session (client side). Messages are still sent and received in the legacy
+// format until the accept arrives, which receive_message handles. Returns non-zero value if an
+// error occurs.
+int session_hello(int fd, const char* username);
+
+// Wait until the server accepted and said what it expects first, or the session ended (client
+// side). Returns true if the session is active.
+bool session_wait(int fd);
+
+// Accept a client's hello, giving the client its player id (server side). Everything sent to the
+// socket afterwards uses the session format. Returns non-zero value if an error occurs.
+int session_accept(int fd, uint16_t player_id);
+
+// Tell a client with a session the name of a player. Returns non-zero value if an error occurs.
+int session_send_name(int fd, uint16_t player_id, const char* name);
+
+// Tell a client what the server expects from it next. Does nothing if the socket has no session.
+// Returns non-zero value if an error occurs.
+int session_send_turn(int fd, opcode_t opcode);
+
+// Tell a client the score of a player. Does nothing if the socket has no session. Returns non-zero
+// value if an error occurs.
+int session_send_score(int fd, uint16_t player_id, unsigned int score);
+
+// Check whether a socket's session has been accepted.
+bool session_is_active(int fd);
+
+// Get the protocol version of a socket's accepted session, or 0 if the socket has none (server
+// side).
+int session_version(int fd);
+
+// Carry over a session that the server process this one took over from accepted, for the same
+// client on the socket that process handed over (server side). Returns non-zero value if an error
+// occurs.
+int session_restore(int fd, int version, uint16_t player_id);
+
+// Forget a socket's session. Must be called before the socket is closed, so that a connection that
+// gets the same file descriptor later starts out in the legacy format.
+void session_end(int fd);
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+const char* room_phase_names[NUM_ROOM_PHASES] = {
+  "starting", "picking", "asking", "answering", "guessing", "ending"
+};
+
+metrics_segment_t* metrics_segment;
+_Thread_local metrics_slot_t* metrics_thread_slot;
+
+static atomic_uint next_slot; // Threads take slots in turn
+static atomic_uint next_room; // Where the search for a free entry starts
+
+// Create the segment, or set up private memory for the counters.
+int metrics_create(const char* name) {
+  void* segment;
+  if (name == NULL) {
+    segment = mmap(NULL, sizeof(metrics_segment_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  } else {
+    // A reader that mapped the old segment keeps it, and sees the new one once it opens the name
+    // again.
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return -1;
+    }
+    if (ftruncate(fd, sizeof(metrics_segment_t)) == -1) {
+      close(fd);
+      shm_unlink(name);
+      return -1;
+    }
+    segment = mmap(NULL, sizeof(metrics_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  if (segment == MAP_FAILED) {
+    return -1;
+  }
+
+  // The memory starts zeroed, so every counter starts at 0 and every entry is free.
+  metrics_segment = segment;
+  metrics_segment->num_slots = METRICS_SLOTS;
+  metrics_segment->num_metrics = NUM_METRICS;
+  metrics_segment->max_rooms = METRICS_MAX_ROOMS;
+  metrics_segment->pid = getpid();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  metrics_segment->started_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  // The magic is written last, so a reader that finds it never sees a half-written header.
+  atomic_thread_fence(memory_order_release);
+  memcpy(metrics_segment->magic, METRICS_MAGIC, sizeof(metrics_segment->magic));
+  return 0;
+}
+
+// Map the segment with a name for reading.
+const metrics_segment_t* metrics_open(const char* name, ino_t* inode) {
+  int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat stat;
+  if (fstat(fd, &stat) == -1 || stat.st_size < (off_t) sizeof(metrics_segment_t)) {
+    close(fd);
+    return NULL;
+  }
+  if (inode != NULL) {
+    *inode = stat.st_ino;
+  }
+
+  const metrics_segment_t* segment = mmap(NULL, sizeof(metrics_segment_t), PROT_READ,
+                                          MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    return NULL;
+  }
+
+  // A segment of another version has a different layout.
+  if (memcmp(segment->magic, METRICS_MAGIC, sizeof(segment->magic)) != 0 ||
+      segment->num_slots != METRICS_SLOTS || segment->num_metrics != NUM_METRICS ||
+      segment->max_rooms != METRICS_MAX_ROOMS) {
+    metrics_close(segment);
+    return NULL;
+  }
+  return segment;
+}
+
+// Unmap a segment mapped with metrics_open.
+void metrics_close(const metrics_segment_t* segment) {
+  munmap((void*) segment, sizeof(metrics_segment_t));
+}
+
+// Pick the calling thread's slot.
+metrics_slot_t* metrics_take_slot(void) {
+  unsigned int slot = atomic_fetch_add_explicit(&next_slot, 1, memory_order_relaxed);
+  metrics_thread_slot = &metrics_segment->slots[slot % METRICS_SLOTS];
+  return metrics_thread_slot;
+}
+
+// Sum a counter (or gauge) over every slot.
+int64_t metrics_read(const metrics_segment_t* segment, metric_t metric) {
+  int64_t total = 0;
+  for (int i = 0; i < METRICS_SLOTS; i++) {
+    // The segment is only mapped for reading, so the load can't be an atomic read-modify-write.
+    total += atomic_load_explicit((atomic_int_fast64_t*) &segment->slots[i].values[metric],
+                                  memory_order_relaxed);
+  }
+  return total;
+}
+
+// Take a free entry in the table for a room.
+int metrics_add_room(uint32_t id) {
+  unsigned int start = atomic_fetch_add_explicit(&next_room, 1, memory_order_relaxed);
+  for (unsigned int i = 0; i < METRICS_MAX_ROOMS; i++) {
+    int entry = (start + i) % METRICS_MAX_ROOMS;
+    unsigned int free_id = 0;
+    if (atomic_compare_exchange_strong(&metrics_segment->rooms[entry].id, &free_id, id)) {
+      return entry;
+    }
+  }
+  return -1;
+}
+
+// Publish a room's phase and number of players in its entry.
+void metrics_update_room(int entry, room_phase_t phase, unsigned int num_players) {
+  atomic_store_explicit(&metrics_segment->rooms[entry].phase, phase, memory_order_relaxed);
+  atomic_store_explicit(&metrics_segment->rooms[entry].num_players, num_players,
+                        memory_order_relaxed);
+}
+
+// Free a room's entry.
+void metrics_remove_room(int entry) {
+  atomic_store_explicit(&metrics_segment->rooms[entry].num_players, 0, memory_order_relaxed);
+  atomic_store(&metrics_segment->rooms[entry].id, 0);
+}
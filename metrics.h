@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "message.h"
+
+// Server statistics published in a shared memory segment, which wgstat (or anything else) can map
+// and read without the server doing anything. Counters are split into cache-line aligned slots,
+// and each thread only adds to its own slot (threads share slots once there are more threads than
+// METRICS_SLOTS), so counting never bounces a cache line between cores. A reader sums the slots.
+// Gauges (like the number of open connections) are counted the same way, going up and down.
+// Rooms also publish their phase and number of players in a table, each room in its own entry.
+// Without a name, the counters are kept in private memory instead, so counting costs the same.
+// Counting is thread-safe. Readers may see counters a few updates apart from each other.
+
+#define METRICS_MAGIC "WGSTAT1"
+#define METRICS_SLOTS 64
+#define METRICS_MAX_ROOMS 4096 // Rooms that get an entry in the table (the rest are only counted)
+
+// Phases of a room, which is counted in one of them from when it is first published.
+typedef enum room_phase {
+  ROOM_STARTING,  // The room was matched, and its game hasn't started yet
+  ROOM_PICKING,   // The host is picking the secret word
+  ROOM_ASKING,    // The asker is asking a question
+  ROOM_ANSWERING, // The host is answering the asker's question
+  ROOM_GUESSING,  // Everyone but the host is guessing
+  ROOM_ENDING,    // The scores are announced, and the players are leaving
+  NUM_ROOM_PHASES
+} room_phase_t;
+
+// Messages are counted per opcode, with legacy frames (which don't have one) as opcode 0.
+typedef enum metric {
+  METRIC_CONNECTIONS_ACCEPTED,
+  METRIC_CONNECTIONS_OPEN, // Gauge
+  METRIC_CONNECTIONS_TURNED_AWAY,
+  METRIC_ROOMS_OPENED,
+  METRIC_PLAYERS, // Gauge: players in rooms, including the ones whose seat is held
+  METRIC_ROUNDS,
+  METRIC_GUESSES_CHECKED,
+  METRIC_GUESSES_CORRECT,
+  METRIC_MEMORY, // Gauge: bytes allocated for connections (frames, buffers, read-ahead data)
+  METRIC_QUEUED_BYTES, // Gauge: bytes of received frames waiting in the rooms' mailboxes
+  METRIC_ROOMS_IN_PHASE, // Gauges, one per room phase
+  METRIC_MESSAGES_SENT = METRIC_ROOMS_IN_PHASE + NUM_ROOM_PHASES, // One per opcode, and so on
+  METRIC_BYTES_SENT = METRIC_MESSAGES_SENT + NUM_OPCODES,
+  METRIC_MESSAGES_RECEIVED = METRIC_BYTES_SENT + NUM_OPCODES,
+  METRIC_BYTES_RECEIVED = METRIC_MESSAGES_RECEIVED + NUM_OPCODES,
+  NUM_METRICS = METRIC_BYTES_RECEIVED + NUM_OPCODES
+} metric_t;
+
+typedef struct metrics_slot {
+  _Alignas(64) atomic_int_fast64_t values[NUM_METRICS];
+} metrics_slot_t;
+
+// A room's entry in the table. The id is 0 while the entry is free.
+typedef struct metrics_room {
+  atomic_uint id;
+  atomic_uint phase;
+  atomic_uint num_players;
+} metrics_room_t;
+
+typedef struct metrics_segment {
+  char magic[8];
+  uint32_t num_slots;
+  uint32_t num_metrics;
+  uint32_t max_rooms;
+  pid_t pid;
+  uint64_t started_ns; // CLOCK_REALTIME
+  metrics_slot_t slots[METRICS_SLOTS];
+  metrics_room_t rooms[METRICS_MAX_ROOMS];
+} metrics_segment_t;
+
+extern const char* room_phase_names[NUM_ROOM_PHASES];
+
+extern metrics_segment_t* metrics_segment;
+extern _Thread_local metrics_slot_t* metrics_thread_slot;
+
+// Create the segment, replacing any segment with the same name (such as the one of the process
+// being replaced by a hot restart, which keeps counting in the old one), or set up private memory
+// for the counters if name is NULL. Must be called before anything is counted. Returns non-zero
+// value if an error occurs.
+int metrics_create(const char* name);
+
+// Map the segment with a name for reading. Returns NULL if an error occurs, and sets inode (if
+// not NULL) to the inode of the segment, which changes once a new server replaces it.
+const metrics_segment_t* metrics_open(const char* name, ino_t* inode);
+
+// Unmap a segment mapped with metrics_open.
+void metrics_close(const metrics_segment_t* segment);
+
+// Pick the calling thread's slot, the first time the thread counts.
+metrics_slot_t* metrics_take_slot(void);
+
+// Add to a counter (or gauge).
+static inline void metrics_add(metric_t metric, int64_t amount) {
+  metrics_slot_t* slot = metrics_thread_slot != NULL ? metrics_thread_slot : metrics_take_slot();
+  atomic_fetch_add_explicit(&slot->values[metric], amount, memory_order_relaxed);
+}
+
+// Sum a counter (or gauge) over every slot.
+int64_t metrics_read(const metrics_segment_t* segment, metric_t metric);
+
+// Take a free entry in the table for a room. Returns the entry, or -1 if the table is full.
+int metrics_add_room(uint32_t id);
+
+// Publish a room's phase and number of players in its entry.
+void metrics_update_room(int entry, room_phase_t phase, unsigned int num_players);
+
+// Free a room's entry.
+void metrics_remove_room(int entry);
@@ -0,0 +1,108 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define IDLE_POLL_US 100 // How often pool_wait_idle checks for unfinished items
+
+/**
+ * Repeatedly take an item from the pool's queue and run the pool's task on it.
+ *
+ * \param args The worker pool this thread belongs to
+ */
+static void* pool_worker(void* args) {
+  worker_pool_t* pool = (worker_pool_t*)args;
+
+  while (1) {
+    // Sleep until an item has been queued.
+    while (sem_wait(&pool->queued_tasks) == -1 && errno == EINTR) {
+    }
+
+    // The item is guaranteed to be in the queue, but its producer may still be publishing it.
+    void* item;
+    while (!queue_pop(&pool->tasks, &item)) {
+      sched_yield();
+    }
+    sem_post(&pool->free_slots);
+
+    pool->run_task(item);
+    atomic_fetch_sub(&pool->num_unfinished, 1);
+  }
+
+  return NULL;
+}
+
+// Start the worker threads of a pool.
+int pool_init(worker_pool_t* pool, size_t num_threads, size_t capacity, pool_task_fn run_task) {
+  if (num_threads == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (queue_init(&pool->tasks, capacity) == -1) {
+    return -1;
+  }
+
+  // Never allow more submissions than the queue can hold.
+  sem_init(&pool->queued_tasks, 0, 0);
+  sem_init(&pool->free_slots, 0, pool->tasks.mask + 1);
+
+  atomic_init(&pool->num_unfinished, 0);
+  pool->run_task = run_task;
+  pool->num_threads = num_threads;
+  pool->threads = malloc(sizeof(pthread_t) * num_threads);
+  if (pool->threads == NULL) {
+    sem_destroy(&pool->queued_tasks);
+    sem_destroy(&pool->free_slots);
+    queue_destroy(&pool->tasks);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_threads; i++) {
+    int rc = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+    if (rc != 0) {
+      // Nothing has been submitted yet, so the workers started so far are all asleep in sem_wait,
+      // which is a cancellation point.
+      for (size_t j = 0; j < i; j++) {
+        pthread_cancel(pool->threads[j]);
+        pthread_join(pool->threads[j], NULL);
+      }
+      free(pool->threads);
+      pool->threads = NULL;
+      sem_destroy(&pool->queued_tasks);
+      sem_destroy(&pool->free_slots);
+      queue_destroy(&pool->tasks);
+      errno = rc;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Hand an item to the pool.
+void pool_submit(worker_pool_t* pool, void* item) {
+  atomic_fetch_add(&pool->num_unfinished, 1);
+
+  // Wait for a free slot so that the push below cannot fail.
+  while (sem_wait(&pool->free_slots) == -1 && errno == EINTR) {
+  }
+
+  while (!queue_push(&pool->tasks, item)) {
+    sched_yield();
+  }
+
+  sem_post(&pool->queued_tasks);
+}
+
+// Wait until the pool has no items left to run.
+void pool_wait_idle(worker_pool_t* pool) {
+  // This is only needed rarely (before a hot restart), so it polls instead of making every item
+  // signal its completion.
+  while (atomic_load(&pool->num_unfinished) > 0) {
+    usleep(IDLE_POLL_US);
+  }
+}
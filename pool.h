@@ -0,0 +1,34 @@
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+// A fixed-size pool of worker threads that run a task function on every submitted item. Items are
+// handed to the workers over a bounded lock-free queue.
+
+typedef void (*pool_task_fn)(void* item);
+
+typedef struct worker_pool {
+  queue_t tasks;
+  sem_t queued_tasks; // Counts items waiting in the queue (workers sleep on this)
+  sem_t free_slots;   // Counts free queue slots (submitters wait on this when the queue is full)
+  atomic_size_t num_unfinished; // Items submitted but not run to completion yet
+  pthread_t* threads;
+  size_t num_threads;
+  pool_task_fn run_task;
+} worker_pool_t;
+
+// Start num_threads workers that call run_task on each item, with room for capacity queued items.
+// Returns non-zero value if an error occurs.
+int pool_init(worker_pool_t* pool, size_t num_threads, size_t capacity, pool_task_fn run_task);
+
+// Hand an item to the pool. Blocks while the queue is full, so no item is ever dropped.
+void pool_submit(worker_pool_t* pool, void* item);
+
+// Wait until every item submitted so far (or while waiting) has been run to completion. Waiting
+// only ends once nothing submits any more items.
+void pool_wait_idle(worker_pool_t* pool);
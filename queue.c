@@ -0,0 +1,106 @@
+#include "queue.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Initialize a queue that holds up to capacity items (rounded up to a power of two).
+int queue_init(queue_t* queue, size_t capacity) {
+  if (capacity < 2) {
+    capacity = 2;
+  }
+
+  // Round the capacity up to a power of two so positions can be mapped to cells with a mask.
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  queue->cells = malloc(sizeof(queue_cell_t) * size);
+  if (queue->cells == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // Each cell starts out expecting to be filled at the position equal to its index.
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+    queue->cells[i].item = NULL;
+  }
+
+  queue->mask = size - 1;
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+
+  return 0;
+}
+
+// Free the memory held by a queue.
+void queue_destroy(queue_t* queue) {
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+// Add an item to the back of the queue.
+bool queue_push(queue_t* queue, void* item) {
+  queue_cell_t* cell;
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+  while (true) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+    if (diff == 0) {
+      // The cell is free for this position, so try to claim the position.
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The cell still holds an item from the previous lap, so the queue is full.
+      return false;
+    } else {
+      // Another producer claimed this position first. Try again with the latest position.
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  // Publish the item to consumers.
+  cell->item = item;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  return true;
+}
+
+// Remove the item at the front of the queue.
+bool queue_pop(queue_t* queue, void** item) {
+  queue_cell_t* cell;
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+  while (true) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      // The cell holds a published item for this position, so try to claim it.
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Nothing has been published at this position yet, so the queue is empty.
+      return false;
+    } else {
+      // Another consumer claimed this position first. Try again with the latest position.
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  // Take the item and mark the cell as free for the producer one lap ahead.
+  *item = cell->item;
+  atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A bounded, lock-free, multi-producer/multi-consumer queue of pointers.
+// Citation: Dmitry Vyukov's bounded MPMC queue.
+
+typedef struct queue_cell {
+  atomic_size_t sequence;
+  void* item;
+} queue_cell_t;
+
+typedef struct queue {
+  queue_cell_t* cells;
+  size_t mask;
+  alignas(64) atomic_size_t enqueue_pos;
+  alignas(64) atomic_size_t dequeue_pos;
+} queue_t;
+
+// Initialize a queue that holds up to capacity items (rounded up to a power of two). Returns
+// non-zero value if an error occurs.
+int queue_init(queue_t* queue, size_t capacity);
+
+// Free the memory held by a queue. The queue must not be in use by any other thread.
+void queue_destroy(queue_t* queue);
+
+// Add an item to the back of the queue. Returns false if the queue is full.
+bool queue_push(queue_t* queue, void* item);
+
+// Remove the item at the front of the queue and store it in *item. Returns false if the queue is
+// empty (or the front item is still being published by a producer).
+bool queue_pop(queue_t* queue, void** item);
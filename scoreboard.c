@@ -0,0 +1,189 @@
+#include "scoreboard.h"
+
+#include <stdlib.h>
+
+/**
+ * Check whether a bucket has no entries.
+ */
+static bool bucket_is_empty(score_bucket_t* bucket) {
+  return bucket->entries.next == &bucket->entries;
+}
+
+/**
+ * Link a bucket that just got its first entry into the list of buckets with entries, right above
+ * another bucket (or at the bottom if below is NULL).
+ */
+static void link_bucket(scoreboard_t* board, score_bucket_t* bucket, score_bucket_t* below) {
+  score_bucket_t* above = below != NULL ? below->higher : board->lowest;
+
+  bucket->lower = below;
+  bucket->higher = above;
+
+  if (below != NULL) {
+    below->higher = bucket;
+  } else {
+    board->lowest = bucket;
+  }
+
+  if (above != NULL) {
+    above->lower = bucket;
+  } else {
+    board->highest = bucket;
+  }
+}
+
+/**
+ * Unlink a bucket that just lost its last entry from the list of buckets with entries.
+ */
+static void unlink_bucket(scoreboard_t* board, score_bucket_t* bucket) {
+  if (bucket->lower != NULL) {
+    bucket->lower->higher = bucket->higher;
+  } else {
+    board->lowest = bucket->higher;
+  }
+
+  if (bucket->higher != NULL) {
+    bucket->higher->lower = bucket->lower;
+  } else {
+    board->highest = bucket->lower;
+  }
+
+  bucket->lower = NULL;
+  bucket->higher = NULL;
+}
+
+/**
+ * Append an entry to the end of a bucket.
+ */
+static void append_entry(score_bucket_t* bucket, score_entry_t* entry) {
+  entry->prev = bucket->entries.prev;
+  entry->next = &bucket->entries;
+  bucket->entries.prev->next = entry;
+  bucket->entries.prev = entry;
+}
+
+/**
+ * Unlink an entry from the bucket it is in.
+ */
+static void unlink_entry(score_entry_t* entry) {
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->next = NULL;
+  entry->prev = NULL;
+}
+
+// Initialize an empty scoreboard.
+int scoreboard_init(scoreboard_t* board, unsigned int max_score) {
+  board->buckets = malloc(sizeof(score_bucket_t) * ((size_t)max_score + 1));
+  if (board->buckets == NULL) {
+    return -1;
+  }
+
+  for (unsigned int score = 0; score <= max_score; score++) {
+    score_bucket_t* bucket = &board->buckets[score];
+    bucket->entries.next = &bucket->entries;
+    bucket->entries.prev = &bucket->entries;
+    bucket->lower = NULL;
+    bucket->higher = NULL;
+    bucket->num_ahead = 0;
+  }
+
+  board->max_score = max_score;
+  board->highest = NULL;
+  board->lowest = NULL;
+  board->num_entries = 0;
+  return 0;
+}
+
+// Free the memory of a scoreboard.
+void scoreboard_destroy(scoreboard_t* board) {
+  free(board->buckets);
+  board->buckets = NULL;
+}
+
+// Add an entry with a score of 0.
+void scoreboard_add(scoreboard_t* board, score_entry_t* entry, void* arg) {
+  entry->score = 0;
+  entry->arg = arg;
+
+  // Nothing is below a score of 0.
+  score_bucket_t* bucket = &board->buckets[0];
+  if (bucket_is_empty(bucket)) {
+    link_bucket(board, bucket, NULL);
+  }
+
+  append_entry(bucket, entry);
+  board->num_entries++;
+}
+
+// Take an entry off the scoreboard.
+void scoreboard_remove(scoreboard_t* board, score_entry_t* entry) {
+  score_bucket_t* bucket = &board->buckets[entry->score];
+  unlink_entry(entry);
+  if (bucket_is_empty(bucket)) {
+    unlink_bucket(board, bucket);
+  }
+  board->num_entries--;
+
+  // The entry no longer counts as ahead of any lower score.
+  for (unsigned int score = 0; score < entry->score; score++) {
+    board->buckets[score].num_ahead--;
+  }
+}
+
+// Give an entry one more point.
+int scoreboard_award(scoreboard_t* board, score_entry_t* entry) {
+  if (entry->score == board->max_score) {
+    return -1;
+  }
+
+  score_bucket_t* from = &board->buckets[entry->score];
+  score_bucket_t* to = from + 1;
+
+  // The old bucket still has the entry while the new one is linked in, so a new bucket goes
+  // right above it.
+  if (bucket_is_empty(to)) {
+    link_bucket(board, to, from);
+  }
+
+  unlink_entry(entry);
+  append_entry(to, entry);
+  entry->score++;
+
+  if (bucket_is_empty(from)) {
+    unlink_bucket(board, from);
+  }
+
+  // Only the old score has one more entry ahead of it.
+  from->num_ahead++;
+  return 0;
+}
+
+// Get an entry's rank.
+size_t scoreboard_rank(scoreboard_t* board, score_entry_t* entry) {
+  return board->buckets[entry->score].num_ahead + 1;
+}
+
+// Get the entry that reached the highest score first.
+score_entry_t* scoreboard_leader(scoreboard_t* board) {
+  if (board->highest == NULL) {
+    return NULL;
+  }
+
+  return board->highest->entries.next;
+}
+
+// Get up to k entries from the highest score down.
+size_t scoreboard_top(scoreboard_t* board, score_entry_t** top, size_t k) {
+  size_t num_top = 0;
+
+  for (score_bucket_t* bucket = board->highest; bucket != NULL && num_top < k;
+       bucket = bucket->lower) {
+    for (score_entry_t* entry = bucket->entries.next; entry != &bucket->entries && num_top < k;
+         entry = entry->next) {
+      top[num_top++] = entry;
+    }
+  }
+
+  return num_top;
+}
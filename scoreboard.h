@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A ranking of players by score. Players with the same score share a bucket, and the buckets that
+// aren't empty are linked from the highest score down, so awarding a point only moves a player to
+// the neighbouring bucket. Each bucket also counts the players ahead of its score, which makes a
+// player's rank O(1) and the top K players O(K), no matter how many players there are. Players
+// with the same score are listed in the order they reached it.
+// The scoreboard is not thread-safe: callers must serialize access to it.
+
+// A player's place on a scoreboard. It is embedded in whatever is being ranked.
+typedef struct score_entry {
+  struct score_entry* next; // The next entry with the same score
+  struct score_entry* prev;
+  unsigned int score;
+  void* arg; // Whatever the owner of the entry wants to get back from rank queries
+} score_entry_t;
+
+// The entries that have the same score.
+typedef struct score_bucket {
+  score_entry_t entries;       // Sentinel of a circular list, in the order the score was reached
+  struct score_bucket* lower;  // The next bucket with entries and a lower score
+  struct score_bucket* higher; // The next bucket with entries and a higher score
+  size_t num_ahead;            // Entries with a higher score than this bucket's
+} score_bucket_t;
+
+typedef struct scoreboard {
+  score_bucket_t* buckets; // Indexed by score
+  unsigned int max_score;
+  score_bucket_t* highest; // The bucket of the leading entries (NULL if there are no entries)
+  score_bucket_t* lowest;  // The bucket of the trailing entries (NULL if there are no entries)
+  size_t num_entries;
+} scoreboard_t;
+
+// Initialize an empty scoreboard for scores of up to max_score. Returns non-zero value if an
+// error occurs.
+int scoreboard_init(scoreboard_t* board, unsigned int max_score);
+
+// Free the memory of a scoreboard. The entries themselves belong to the caller.
+void scoreboard_destroy(scoreboard_t* board);
+
+// Add an entry with a score of 0 (behind everyone else that has 0 points).
+void scoreboard_add(scoreboard_t* board, score_entry_t* entry, void* arg);
+
+// Take an entry off the scoreboard. This is O(score), since every lower score moves up a place.
+void scoreboard_remove(scoreboard_t* board, score_entry_t* entry);
+
+// Give an entry one more point. Returns non-zero value if the entry already has the maximum score.
+int scoreboard_award(scoreboard_t* board, score_entry_t* entry);
+
+// Get an entry's rank (1 for the leaders). Entries with the same score share a rank.
+size_t scoreboard_rank(scoreboard_t* board, score_entry_t* entry);
+
+// Get the entry that reached the highest score first (NULL if there are no entries).
+score_entry_t* scoreboard_leader(scoreboard_t* board);
+
+// Get up to k entries from the highest score down. Returns the number of entries stored in top.
+size_t scoreboard_top(scoreboard_t* board, score_entry_t** top, size_t k);
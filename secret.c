@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include "secret.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "siphash.h"
+
+static uint8_t hash_key[SIPHASH_KEY_LEN];
+
+// Pick the random key that words and guesses are hashed with.
+int secret_init_key(void) {
+  size_t filled = 0;
+  while (filled < sizeof(hash_key)) {
+    ssize_t rc = getrandom(hash_key + filled, sizeof(hash_key) - filled, 0);
+    if (rc == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    filled += rc;
+  }
+
+  return 0;
+}
+
+// Hash a guess the way words are hashed.
+uint64_t secret_hash(const char* text, size_t len) {
+  return siphash24(hash_key, text, len, true);
+}
+
+// Initialize a secret that holds no word.
+void secret_init(secret_t* secret) {
+  secret->word = NULL;
+  secret->len = 0;
+  secret->buffer_len = 0;
+  secret->hash = 0;
+}
+
+// Hold a word, wiping the one held before.
+int secret_set(secret_t* secret, const char* word, size_t len) {
+  secret_wipe(secret);
+
+  // The word gets whole pages of its own, so locking them and leaving them out of core dumps
+  // doesn't affect anything else.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t buffer_len = (len + 1 + page_size - 1) / page_size * page_size;
+  char* buffer = mmap(NULL, buffer_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  if (buffer == MAP_FAILED) {
+    return -1;
+  }
+
+  // Both only harden the buffer, so the word is still held if the process isn't allowed to lock
+  // any more memory.
+  mlock(buffer, buffer_len);
+  madvise(buffer, buffer_len, MADV_DONTDUMP);
+
+  memcpy(buffer, word, len);
+  buffer[len] = '\0';
+  secret->word = buffer;
+  secret->len = len;
+  secret->buffer_len = buffer_len;
+  secret->hash = secret_hash(word, len);
+  return 0;
+}
+
+// Wipe the held word and give its memory back.
+void secret_wipe(secret_t* secret) {
+  if (secret->word == NULL) {
+    return;
+  }
+
+  // The compiler can't drop this as a dead store, even though the memory is unmapped right after.
+  explicit_bzero(secret->word, secret->buffer_len);
+  munlock(secret->word, secret->buffer_len);
+  munmap(secret->word, secret->buffer_len);
+  secret_init(secret);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A secret word kept in memory of its own, which is locked so it is never swapped out, left out of
+// core dumps, and wiped as soon as the word isn't needed anymore. Guesses are compared with a
+// keyed hash of the case-folded word instead of the word itself, so checking a guess never
+// touches the word.
+// A secret is not thread-safe: callers must serialize access to it. Hashing is thread-safe.
+
+typedef struct secret {
+  char* word;        // Null-terminated (NULL while the secret holds no word)
+  size_t len;
+  size_t buffer_len; // Bytes mapped for the word
+  uint64_t hash;     // Keyed hash of the case-folded word
+} secret_t;
+
+// Pick the random key that words and guesses are hashed with. Must be called once, before
+// anything is hashed. Returns non-zero value if an error occurs.
+int secret_init_key(void);
+
+// Hash a guess the way words are hashed, ignoring case.
+uint64_t secret_hash(const char* text, size_t len);
+
+// Initialize a secret that holds no word.
+void secret_init(secret_t* secret);
+
+// Hold a word, wiping the one held before. Returns non-zero value if an error occurs (the secret
+// then holds no word).
+int secret_set(secret_t* secret, const char* word, size_t len);
+
+// Wipe the held word and give its memory back. Does nothing if the secret holds no word.
+void secret_wipe(secret_t* secret);
@@ -1,13 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
-
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "analytics.h"
+#include "handoff.h"
+#include "lobby.h"
+#include "lock_profile.h"
+#include "log.h"
+#include "mailbox.h"
 #include "message.h"
+#include "metrics.h"
+#include "pool.h"
+#include "scoreboard.h"
+#include "secret.h"
 #include "socket.h"
+#include "timer_wheel.h"
+#include "token_map.h"
+#include "trace.h"
 #include "user.h"
 
 /*************************
@@ -16,7 +41,17 @@
 // A node where its value is the socket file descriptor
 typedef struct user_node {
   int socket_fd;
-  int score;
+  score_entry_t standing; // The player's score and place in the room's scoreboard
+  uint16_t player_id; // The player's id in the room (used instead of the name over a session)
+  char* username; // NULL until the player sent a hello or a message
+  bool has_session;
+  opcode_t turn; // What the player's client was last told the game expects from them
+  uint64_t token; // Takes the player's seat back after a reconnect (TOKEN_NONE without a session)
+  bool is_away; // The player's connection dropped, and their seat is held until away_deadline
+  uint64_t away_deadline; // The tick the player's seat is given up on
+  int resume_fd; // A connection taking the seat back once the stale one is closed (-1 if none)
+  _Atomic uint64_t last_heard; // The tick anything last arrived from the player's client
+  atomic_size_t queued_bytes; // Memory of the player's frames waiting in the room's mailbox
   struct user_node* next;
 } user_node_t;
 
@@ -27,19 +62,43 @@ typedef struct user_list {
 } user_list_t;
 
 
+// A question asked in the current round
+typedef struct asked_question {
+  uint16_t asker_id;
+  char* question;
+  char* answer; // NULL until the host answers with a yes or a no
+} asked_question_t;
+
+
+// The guessing phase of one round. Players' threads check guesses against it while the room's 
+// actor handles other events, so it is never changed once published (except for its claim), and 
+// only freed with the room. It only has the secret word's hash, never the word.
+typedef struct guess_round {
+  uint64_t secret_hash; // The keyed hash of the case-folded secret word
+  size_t secret_len;
+  uint64_t opened_us; // When the guessing phase started
+  _Atomic uint64_t best_claim; // The earliest correct guess so far (0 if none), see Guess Resolution
+  struct guess_round* prev; // The round before (rounds are freed together with the room)
+} guess_round_t;
+
+
 /*************************
  * Server Info Structure
  *************************/
+// The state of one room's game. Every room is matched from the lobby and plays on its own. Only 
+// the room's actor touches the game (see Room Actors), so the struct needs no lock.
 typedef struct server_info {
-  int connecting_user_socket_fd; // The most recent connecting user (facilitates adding connections)
+  worker_pool_t* room_pool; // The workers the room's actor runs on (see Room Pools)
+  mailbox_t mailbox; // Events waiting for the room's actor
+  atomic_bool is_scheduled; // The room's actor is queued for (or running on) a room worker
+  atomic_int refs; // The room's players (together), its events, and its actor's run on a worker
   user_list_t* chat_users; // List of currently connected users
 
   // Note: The order of asking q's & being the host = the order of the nodes in the linked list.
   // Game-Related Info:
-  bool is_game_initialized;
   user_node_t* curr_host; 
   user_node_t* curr_asker;
-  char* secret_word;
+  secret_t secret_word; // Only held from when the host picks it until the round is over
   int curr_question; // answered by host for 1 round
   int max_questions; // answered by host for 1 round
   bool is_receiving_secret_word;
@@ -47,24 +106,261 @@ typedef struct server_info {
   bool guessed_secret_word;
   bool asker_updated;
   bool host_updated;
-  user_node_t* leading_player;
-  char* leading_username;
+  scoreboard_t scoreboard; // The players ranked by score
   bool end_game;
+  bool is_question_pending; // The asker has asked, and the host hasn't answered yet
+  wheel_timer_t turn_timer; // Expires when the player the game is waiting on took too long
+  uint64_t turn_deadline; // The tick the turn timer is set to expire on (0 if it isn't running)
+  wheel_timer_t away_timer; // Expires when the first held seat of a player that is away is given up
+  wheel_timer_t heartbeat_timer; // Expires when the players' clients are due to be pinged
+  asked_question_t* questions; // The questions of the current round (up to max_questions)
+  int num_questions;
+  guess_round_t* _Atomic guess_round; // The open guessing phase (NULL while nobody can guess)
+  guess_round_t* last_round; // The latest guessing phase, open or not (NULL before the first)
+  uint32_t num_rounds; // Rounds whose secret word was picked (the current one included)
+  uint64_t word_picked_us; // When the host picked the current round's secret word
+  uint32_t num_round_guesses; // Guesses handled in the current round
+  struct server_info* prev_room; // The rooms that haven't been freed are linked for hot restarts
+  struct server_info* next_room;
+  uint32_t id; // Tells the rooms apart in traces and metrics
+  int metrics_entry; // The room's entry in the metrics table (-1 if it has none)
+  int published_phase; // The phase the room is counted in (-1 until it is first published)
+  int published_players; // The players the room is counted with
 } server_info_t;
 
 
+/*************************
+ * Stoppable Threads
+ *************************/
+// A thread that waits on a socket or the clock, and has to stop before the server can be handed 
+// over to a new process (see Hot Restart)
+typedef struct stoppable_thread {
+  pthread_t thread;
+  atomic_bool is_stopped; // The thread is waiting for the handoff to end
+  struct stoppable_thread* prev;
+  struct stoppable_thread* next;
+} stoppable_thread_t;
+
+
+// The timers of the rooms whose ids fall in one shard, and the thread that expires them
+typedef struct timer_shard {
+  timer_wheel_t wheel;
+  profiled_mutex_t lock; // Protects the wheel and the wake tick
+  uint64_t wake_tick; // The tick the thread sleeps until (UINT64_MAX while no timer is pending)
+  int wake_fd; // An eventfd that wakes the thread up early, when a timer is due sooner
+  _Atomic uint64_t lag_ms; // How late the thread wakes up, on average
+  stoppable_thread_t stoppable; // The shard's thread
+} timer_shard_t;
+
+// The arguments of a player's thread
+typedef struct player_thread_args {
+  server_info_t* server_info; // The room the player plays in
+  user_node_t* player; // Only freed after the player's thread posted its last frame
+  stoppable_thread_t stoppable; // Lets a hot restart stop the player's thread
+} player_thread_args_t;
+
+
+/*************************
+ * Arrival Structure
+ *************************/
+// A new connection that was welcomed, and may still ask for a seat back before it joins the lobby
+typedef struct arrival {
+  int socket_fd;
+  uint64_t deadline; // When it joins the lobby even if it hasn't sent anything (in ms)
+  bool is_decided; // It sent something (or closed), so it is known whether it is resuming
+  bool is_resuming; // It asked for a seat back, so it doesn't join the lobby
+  struct arrival* next;
+} arrival_t;
+
+
+/*************************
+ * Room Events
+ *************************/
+// Everything that happens to a room is posted to its mailbox as an event, and the room's actor 
+// handles the events one at a time, in the order they were posted.
+typedef enum room_event_kind {
+  EVENT_START,        // The lobby matched the room's players
+  EVENT_FRAME,        // A player's thread received a frame (or found the connection ended)
+  EVENT_RESUME,       // A new connection asked for the seat of one of the room's players
+  EVENT_TURN_TIMEOUT, // The turn timer expired
+  EVENT_AWAY_TIMEOUT, // The away timer expired
+  EVENT_HEARTBEAT,    // The heartbeat timer expired
+} room_event_kind_t;
+
+typedef struct room_event {
+  mailbox_node_t node; // Links the event into the room's mailbox (must be first)
+  room_event_kind_t kind;
+  user_node_t* player; // The player whose thread received the frame (EVENT_FRAME)
+  message_frame_t* frame; // The frame with one reference, or NULL if the connection ended
+  int socket_fd; // The new connection (EVENT_RESUME)
+  uint64_t token; // The token the new connection sent (EVENT_RESUME)
+  uint64_t deadline; // The tick the expired timer was set to (EVENT_TURN_TIMEOUT)
+  guess_round_t* correct_guess; // The round whose secret word the frame guessed (or NULL)
+  sem_t* handled; // Posted once the event has been handled (NULL if nobody waits for that)
+  size_t queued_bytes; // Memory of the frame, counted in the player's queued bytes (EVENT_FRAME)
+  uint32_t trace_flow; // Links the event to where it was posted in the trace (0 if it isn't)
+} room_event_t;
+
+
+// The types of the events the server traces (see trace.h)
+typedef struct server_trace_types {
+  uint16_t frame;       // A player's thread checks a frame and posts it to the room's actor
+  uint16_t room_event;  // The room's actor handles an event
+  uint16_t guess;       // A player's thread checks a guess
+  uint16_t next_round;  // The room moves on to the next round
+  uint16_t end_game;    // The room announces the scores and disconnects everyone
+  uint16_t player;      // Thread names
+  uint16_t room_worker;
+  uint16_t welcome_worker;
+  uint16_t matchmaker;
+  uint16_t listener;
+  uint16_t timer;
+} server_trace_types_t;
+
+
 /*******************
  * Global variables
  *******************/
-server_info_t* server_info_global = NULL; // Global struct containing all game info
-pthread_mutex_t server_info_global_lock; // A lock that should be used to protect the modification 
-                                         // of the server info struct.
+worker_pool_t welcome_pool; // Workers that greet newly accepted connections and add them to the lobby
+lobby_t lobby; // Players waiting to be matched into a room
+worker_pool_t* room_pools; // Workers that run the actors of rooms with events to handle
+int num_room_pools; // One per listener, or just one with a single listener (see Room Pools)
+uint16_t* room_pool_by_fd; // The room pool of the listener that accepted each socket
+size_t max_room_pool_fds; // Sockets with higher file descriptors use the first room pool
+timer_shard_t* timer_shards; // The rooms' turn deadlines, held seats, and pings, by room id
+int num_timer_shards;
+int turn_timeout_ms; // How long a player has to take their turn (0 means forever)
+token_map_t seat_tokens; // The room of every player with a token (to take a seat back)
+profiled_mutex_t seat_tokens_lock; // Protects the seat tokens
+int resume_grace_ms; // How long the seat of a player whose connection dropped is held
+int ping_interval_ms; // How often clients with a session are pinged (0 means never)
+int dead_peer_ms; // How long a client can stay silent before its connection is given up on
+int arrivals_epoll_fd; // Watches new connections for a resume before they join the lobby
+arrival_t* first_arrival; // New connections being watched, oldest first
+arrival_t* last_arrival;
+profiled_mutex_t arrivals_lock; // Protects the arrivals
+bool are_arrivals_stopped; // A hot restart stopped the arrivals thread, so nothing is watched
+atomic_int num_rooms; // Rooms that haven't been freed yet
+int max_rooms; // Rooms at which new players are turned away (0 means no limit)
+int max_sends_in_progress; // Sockets being written to at which new players are turned away
+int max_timer_lag_ms; // Timer threads' lag at which new players are turned away
+message_frame_t* busy_frame; // The message that turns a new player away, encoded once
+atomic_bool is_shedding; // Whether new players are being turned away
+int cork_delay_us; // How long a message can wait to share a write with the next (0 means never)
+size_t max_queued_bytes; // Memory of a player's frames that can wait for the actor (0: no limit)
+int64_t max_memory; // Connection memory at which new players are turned away (0 means no limit)
+server_info_t* all_rooms; // Every room that hasn't been freed
+profiled_mutex_t all_rooms_lock; // Protects the list of rooms
+char* handoff_path; // The Unix socket a new server process takes over through (NULL means never)
+char* local_path; // The Unix socket players on this machine can connect to (NULL means none)
+atomic_bool is_handing_off; // Whether stoppable threads have to stop
+stoppable_thread_t* stoppable_threads; // Every thread a hot restart has to stop
+profiled_mutex_t stoppable_threads_lock; // Protects the stoppable threads
+profiled_mutex_t handoff_lock; // Protects the stopped threads' wait for the handoff to end
+pthread_cond_t handoff_failed; // Broadcast when the stopped threads can go on
+char* trace_path; // Where the trace is dumped (NULL means nothing is traced)
+char* metrics_name; // The shared memory segment the metrics are published in (NULL for none)
+char* analytics_path; // What the analytics files are named after (NULL means nothing is recorded)
+server_trace_types_t traced; // The types of the events the server traces
+atomic_uint last_room_id;
+
+
+/*************************
+ * Listener Structure
+ *************************/
+// A listening socket and the thread that accepts connections from it
+typedef struct listener {
+  int socket_fd;
+  int cpu; // The core the accepting thread runs on, or -1 to let the OS decide
+  bool welcome_inline; // Welcome new players on the accepting thread instead of the welcome pool
+  bool is_local; // A Unix socket, whose peers can't vanish without the kernel knowing
+  int room_pool_index; // The room pool of the games whose first player it accepted
+  stoppable_thread_t stoppable; // The accepting thread
+} listener_t;
+
+// The arguments of the thread that waits for a new server process to take over
+typedef struct handoff_thread_args {
+  int socket_fd; // The Unix socket the new process connects to
+  listener_t* listeners; // The TCP listeners, followed by the Unix one if there is one
+  int num_listeners; // TCP listeners
+  unsigned short port;
+  char* local_path; // The path of the Unix listener (NULL if there is none)
+} handoff_thread_args_t;
+
+
+/*******************
+ * Server Settings
+ *******************/
+#define DEFAULT_WELCOME_WORKERS 4 // Number of threads that greet new connections
+#define WELCOME_QUEUE_CAPACITY 4096 // Accepted connections that can wait for a welcome worker
+#define DEFAULT_TURN_TIMEOUT 60 // Seconds a player has to pick a word, ask, answer, or guess
+#define DEFAULT_ROOM_SIZE 4 // Number of players the lobby puts in a room
+#define DEFAULT_MAX_LOBBY_WAIT 5 // Seconds a player waits in the lobby for a full room
+#define LOBBY_CAPACITY 4096 // Players that can wait for the matchmaker
+#define DEFAULT_ROOM_WORKERS 0 // Threads that run the rooms' actors (0 means one per core)
+#define ROOM_QUEUE_CAPACITY 65536 // Rooms that can wait for a room worker at once
+#define TIMER_TICK_MS 10 // Resolution of turn deadlines
+#define NUM_LEADERS_SHOWN 3 // Number of leaders announced after every round
+#define DEFAULT_RESUME_GRACE 30 // Seconds a player whose connection dropped has to reconnect
+#define RESUME_WAIT_MS 100 // Time a new connection has to ask for a seat back before the lobby
+#define MAX_ARRIVAL_EVENTS 256 // New connections the arrivals thread lets in per wakeup
+#define DEFAULT_PING_INTERVAL 5 // Seconds between pings to clients with a session
+#define DEFAULT_DEAD_PEER_TIMEOUT 15 // Seconds a client can stay silent before it is disconnected
+#define DEFAULT_MAX_ROOMS 0 // Rooms at which new players are turned away (0 means no limit)
+#define DEFAULT_MAX_SENDS_IN_PROGRESS 1024 // Sockets being written to when players are turned away
+#define DEFAULT_MAX_TIMER_LAG 250 // Milliseconds of timer lag at which players are turned away
+#define BUSY_RETRY_AFTER 5 // Seconds a player that was turned away is told to wait before retrying
+#define DEFAULT_CORK_DELAY 500 // Microseconds a message can wait to share a write with the next
+#define DEFAULT_MAX_QUEUED 64 // KiB of a player's frames that can wait for the room's actor
+#define DEFAULT_MAX_MEMORY 0 // MiB of connection memory at which players are turned away (0: none)
+#define DEFAULT_ANALYTICS_FILE_SIZE 64 // MiB an analytics file grows to before the next one starts
+#define THREAD_STACK_SIZE (256 * 1024) // Stack of every player, listener, and timer thread
+#define ROOM_POOL_MAX_FDS (1 << 20) // Sockets with higher file descriptors use the first room pool
+#define GUESS_SEALED (1ULL << 63) // Set in a round's claim once the round's winner is decided
+#define GUESS_PLAYER_BITS 16 // Low bits of a claim that hold the guesser's player id
+#define HANDOFF_SIGNAL SIGUSR1 // Interrupts a stoppable thread's wait, so that it stops
+#define HANDOFF_SIGNAL_INTERVAL_US 1000 // How often threads that haven't stopped are signaled
+#define HANDOFF_STATE_VERSION 4 // Changes whenever the layout of the handed over state does
+#define DIAGNOSTICS_SIGNAL SIGUSR2 // Writes the lock profile and dumps the trace
+
+// Log a failed send to a client. A client that closed or reset its connection is routine (its own
+// thread removes the player), so that is only logged at debug level. Any other errno is an error.
+// A macro, so that every call site keeps its own rate limit.
+#define log_send_failure()                                                \
+  do {                                                                    \
+    if (errno == EPIPE || errno == ECONNRESET) {                          \
+      log_at(LOG_LEVEL_DEBUG, true, "Failed to send message to client"); \
+    } else {                                                              \
+      log_perror("Failed to send message to client");                     \
+    }                                                                     \
+  } while (0)
 
 
 /*******************
  * Function Declarations
  *******************/
 void* forward_msg(void* args);
+room_event_t* create_event(room_event_kind_t kind);
+void post_event(server_info_t* server_info, room_event_t* event);
+void start_game(server_info_t* server_info);
+void handle_frame(server_info_t* server_info, user_node_t* player, message_frame_t* frame, 
+                  guess_round_t* correct_guess);
+size_t get_player_fds(user_list_t* users, int** fds);
+void cancel_turn_timer(server_info_t* server_info);
+void cancel_away_timer(server_info_t* server_info);
+void hand_over_host(server_info_t* server_info, user_node_t* next_host);
+void record_round(server_info_t* server_info, analytics_outcome_t outcome, user_node_t* winner);
+void end_game(server_info_t* server_info);
+void release_room(server_info_t* server_info);
+void unpublish_room(server_info_t* server_info);
+void give_up_seats(server_info_t* server_info);
+void turn_down_resume(int socket_fd);
+void cancel_heartbeat_timer(server_info_t* server_info);
+void check_heartbeats(server_info_t* server_info);
+uint64_t now_ticks();
+void start_player_thread(server_info_t* server_info, user_node_t* player);
+void start_stoppable_thread(stoppable_thread_t* stoppable, void* (*run)(void*), void* args);
+void stop_for_handoff(stoppable_thread_t* stoppable);
 
 
 /*******************
@@ -72,53 +368,82 @@ void* forward_msg(void* args);
  *******************/
 
 /**
- * Removes a user from the list of users in server info.
+ * Stop a player's token from taking their seat back. Runs on the room's actor.
  * 
- * \param user_to_delete_fd The file descriptor of the user to be deleted from the list
+ * \param server_info The room the player plays in
+ * \param socket_fd The socket file descriptor of the player
  */
-void remove_user(int user_to_delete_fd) {
-  pthread_mutex_lock(&server_info_global_lock);
+void forget_seat_token(server_info_t* server_info, int socket_fd) {
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->socket_fd == socket_fd && current->token != TOKEN_NONE) {
+      profiled_mutex_lock(&seat_tokens_lock);
+      token_map_remove(&seat_tokens, current->token);
+      profiled_mutex_unlock(&seat_tokens_lock);
+      current->token = TOKEN_NONE;
+
+      // A connection waiting to take the seat back can't have it anymore.
+      if (current->resume_fd != -1) {
+        turn_down_resume(current->resume_fd);
+        current->resume_fd = -1;
+      }
+    }
+  }
+}
 
-  if (user_to_delete_fd == server_info_global->curr_asker->socket_fd) {
+/**
+ * Removes a user from the list of users in server info. Runs on the room's actor.
+ * 
+ * \param server_info The room the user plays in
+ * \param user_to_delete_fd The file descriptor of the user to be deleted from the list
+ */
+void unlink_user(server_info_t* server_info, int user_to_delete_fd) {
+  // There is no asker until the game has started (or after it has ended).
+  if (server_info->curr_asker != NULL && !server_info->end_game &&
+      user_to_delete_fd == server_info->curr_asker->socket_fd) {
     // Proceed to the next asker for question asking.
-    if (server_info_global->curr_asker->next != NULL) {
-      server_info_global->curr_asker = server_info_global->curr_asker->next;
+    if (server_info->curr_asker->next != NULL) {
+      server_info->curr_asker = server_info->curr_asker->next;
     } else {
-      server_info_global->curr_asker = server_info_global->chat_users->first_user;
+      server_info->curr_asker = server_info->chat_users->first_user;
     }
 
     // If everyone has asked their question (the asker loops back around to the host), 
     // then begin the next round of asking, starting with the first asker of the previous round.
-    if (server_info_global->curr_asker->socket_fd == server_info_global->curr_host->socket_fd) {
-      if (server_info_global->curr_asker->next != NULL) {
-        server_info_global->curr_asker = server_info_global->curr_asker->next;
+    if (server_info->curr_asker->socket_fd == server_info->curr_host->socket_fd) {
+      if (server_info->curr_asker->next != NULL) {
+        server_info->curr_asker = server_info->curr_asker->next;
       } else {
-        server_info_global->curr_asker = server_info_global->chat_users->first_user;
+        server_info->curr_asker = server_info->chat_users->first_user;
       }
     }
   }
 
 
   // Ensure the list of users isn't empty.
-  if (server_info_global->chat_users->first_user == NULL) {
-    perror("No user to delete. The list is empty.");
+  if (server_info->chat_users->first_user == NULL) {
+    log_error("No user to delete. The list is empty.");
     exit(1);
   }
 
+  // The user's seat can't be taken back once they are gone.
+  forget_seat_token(server_info, user_to_delete_fd);
+
   // To remove a node from a linked list requires two separate cases: deleting the head and 
   // deleting elsewhere.
   // Source:https://www.geeksforgeeks.org/c/c-program-for-deleting-a-node-in-a-linked-list/
 
   // Store head node.
-  user_node_t *temp = server_info_global->chat_users->first_user, *prev;
+  user_node_t *temp = server_info->chat_users->first_user, *prev;
 
   // Case 1: Deleting the first user.
   if (temp != NULL && temp->socket_fd == user_to_delete_fd) {
-    server_info_global->chat_users->first_user = temp->next; // Changed head.
-    free(temp); // Free old head.
-    server_info_global->chat_users->numUsers--;
+    server_info->chat_users->first_user = temp->next; // Changed head.
+    scoreboard_remove(&server_info->scoreboard, &temp->standing);
 
-    pthread_mutex_unlock(&server_info_global_lock);
+    free(temp->username);
+    free(temp); // Free old head.
+    server_info->chat_users->numUsers--;
     return;
   }
 
@@ -131,40 +456,89 @@ void remove_user(int user_to_delete_fd) {
 
   // If user to delete was not present in linked list.
   if (temp == NULL) {
-    pthread_mutex_unlock(&server_info_global_lock);
     return;
   }
 
   // Remove the user from the list.
   prev->next = temp->next;
+  scoreboard_remove(&server_info->scoreboard, &temp->standing);
 
+  free(temp->username);
   free(temp); // Free memory
 
   // Decrement number of connected users.
-  server_info_global->chat_users->numUsers--;
+  server_info->chat_users->numUsers--;
+}
+
+/**
+ * Removes a user from the game. Runs on the room's actor.
+ * 
+ * \param server_info The room the user plays in
+ * \param user_to_delete_fd The file descriptor of the user to be deleted from the list
+ * 
+ * \returns Whether the room is now empty, in which case it must be released
+ */
+bool drop_user(server_info_t* server_info, int user_to_delete_fd) {
+  // Remember who hosts next if the host is the one leaving.
+  user_node_t* host = server_info->curr_host;
+  bool is_host_leaving = host != NULL && !server_info->end_game && 
+                         host->socket_fd == user_to_delete_fd;
+  user_node_t* next_host = is_host_leaving ? host->next : NULL;
+
+  // The round the host picked a word for ends without them.
+  if (is_host_leaving && server_info->secret_word.word != NULL && 
+      !server_info->guessed_secret_word) {
+    record_round(server_info, ANALYTICS_ABANDONED, NULL);
+  }
+
+  unlink_user(server_info, user_to_delete_fd);
+
+  // Nobody is left to take a turn.
+  bool is_room_empty = server_info->chat_users->numUsers == 0;
+  if (is_room_empty) {
+    cancel_turn_timer(server_info);
+    cancel_away_timer(server_info);
+    cancel_heartbeat_timer(server_info);
+  } else if (is_host_leaving) {
+    hand_over_host(server_info, next_host);
+  } else if (server_info->curr_host != NULL && !server_info->end_game && 
+             server_info->chat_users->numUsers < LOBBY_MIN_PLAYERS) {
+    // Nobody is left to play against.
+    end_game(server_info);
+  }
 
-  pthread_mutex_unlock(&server_info_global_lock);
+  return is_room_empty;
 }
 
 /**
- * Add a new player to the game.
+ * Add a new player to the game. Only called while the room is created, before anything is posted 
+ * to it.
  * 
- * \param users A linked list of the players of the game
+ * \param server_info The room the player plays in
  * \param new_user_socket_fd The socket file descriptor of the new player
+ * 
+ * \returns The new player
  */
-void add_player_to_list(user_list_t* users, int new_user_socket_fd) {
+user_node_t* add_player_to_list(server_info_t* server_info, int new_user_socket_fd) {
+  user_list_t* users = server_info->chat_users;
+
   // Create a node for the new user.
   user_node_t* newUser = malloc(sizeof(user_node_t));
-  newUser->score = 0;
   newUser->socket_fd = new_user_socket_fd;
+  newUser->username = NULL;
+  newUser->has_session = false;
+  newUser->turn = OP_CHAT;
+  newUser->token = TOKEN_NONE;
+  newUser->is_away = false;
+  newUser->away_deadline = 0;
+  newUser->resume_fd = -1;
+  atomic_init(&newUser->last_heard, now_ticks());
+  atomic_init(&newUser->queued_bytes, 0);
   newUser->next = NULL;
 
   // Add user to list of users.
-  pthread_mutex_lock(&server_info_global_lock);
   if (users->first_user == NULL) { // First connecting user
     users->first_user = newUser;
-    server_info_global->leading_player = newUser;
-    server_info_global->leading_username = malloc(sizeof(char));
   } else { // Subsequent connecting users
     user_node_t* current = users->first_user;
 
@@ -176,686 +550,3889 @@ void add_player_to_list(user_list_t* users, int new_user_socket_fd) {
     current->next = newUser;
   }
 
-  // Increment user count.
+  // Increment user count. Players are only added when the room is created, so the count makes a
+  // unique id (ids start at 1, after SESSION_SERVER_ID).
   users->numUsers++;
-  pthread_mutex_unlock(&server_info_global_lock);
+  newUser->player_id = users->numUsers;
+  scoreboard_add(&server_info->scoreboard, &newUser->standing, newUser);
+  return newUser;
 }
 
-
 /**
- * Change the asker to the next player in the list of users and indicate that the asker has been 
- * updated.
+ * Get the socket file descriptors of all players, so a message can be broadcast to them. Players 
+ * that are away are left out, since the snapshot they get when they come back brings them up to 
+ * date.
+ * 
+ * \param users A linked list of the players of the game
+ * \param fds Set to a newly allocated array of the socket file descriptors (which must be freed)
+ * 
+ * \returns The number of players
  */
-void update_asker() {
-  // Proceed to the next asker for question asking.
-  if (server_info_global->curr_asker->next != NULL) {
-    server_info_global->curr_asker = server_info_global->curr_asker->next;
-  } else {
-    server_info_global->curr_asker = server_info_global->chat_users->first_user;
-  }
+size_t get_player_fds(user_list_t* users, int** fds) {
+  *fds = malloc(sizeof(int) * (users->numUsers > 0 ? users->numUsers : 1));
 
-  // If everyone has asked their question (the asker loops back around to the host), 
-  // then begin the next round of asking, starting with the first asker of the previous 
-  // round.
-  if (server_info_global->curr_asker->socket_fd == server_info_global->curr_host->socket_fd) {
-    if (server_info_global->curr_asker->next != NULL) {
-      server_info_global->curr_asker = server_info_global->curr_asker->next;
-    } else {
-      server_info_global->curr_asker = server_info_global->chat_users->first_user;
+  size_t num_players = 0;
+  for (user_node_t* current = users->first_user; current != NULL; current = current->next) {
+    if (!current->is_away) {
+      (*fds)[num_players++] = current->socket_fd;
     }
   }
 
-  // Indicate that the asker has been changed at this point.
-  server_info_global->asker_updated = true;
+  return num_players;
 }
 
 /**
- * Prepare for the next round by changing the host to the next player in the list of users, 
- * signaling that the server should receive the secret word next, changing the next asker, 
- * and indicating that the asker and host have been updated. 
+ * Close a player's connection.
+ * 
+ * \param socket_fd The socket file descriptor of the connection
  */
-void set_up_for_next_round() {
-  // Update the host for the next round.
-  server_info_global->curr_host = server_info_global->curr_host->next;
-  server_info_global->host_updated = true; // Indicate that there is a new host.
-
-  // Signal that a secret word has to be selected (before the round begins).
-  server_info_global->is_receiving_secret_word = true;
-  server_info_global->curr_question = 0;
-  server_info_global->guessed_secret_word = false;
-
-  // Proceed to the next asker for question asking.
-  if (server_info_global->curr_asker->next != NULL) {
-    server_info_global->curr_asker = server_info_global->curr_asker->next;
-  } else {
-    server_info_global->curr_asker = server_info_global->chat_users->first_user;
-  }
-
-  // If everyone has asked their question (the asker loops back around to the host), 
-  // then begin the next round of asking, starting with the first asker of the previous round.
-  if (server_info_global->curr_asker->socket_fd == server_info_global->curr_host->socket_fd) {
-    if (server_info_global->curr_asker->next != NULL) {
-      server_info_global->curr_asker = server_info_global->curr_asker->next;
-    } else {
-      server_info_global->curr_asker = server_info_global->chat_users->first_user;
-    }
-  }
+void close_connection(int socket_fd) {
+  message_io_close(socket_fd);
+  metrics_add(METRIC_CONNECTIONS_OPEN, -1);
+}
 
-  server_info_global->asker_updated = true; // Indicate that there is a new asker.
+/**
+ * Send a message from the server to one player.
+ * 
+ * \param socket_fd The socket file descriptor of the player
+ * \param message The message to send
+ * 
+ * \returns Non-zero value if an error occurs
+ */
+int send_server_message(int socket_fd, char* message) {
+  user_info_t server_msg = {.message = message, .username = "Server"};
+  return send_message(socket_fd, &server_msg);
 }
 
 /**
- * End the game by announcing the game's winner, sending each individual player their score, and 
- * disconnecting everyone from the server at the end.
+ * Send a message from the server to every player. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ * \param message The message to send
  * 
- * \param server_info A local copy of the global server info struct containing the game state/info
+ * \returns Non-zero value if an error occurs
  */
-void end_game(server_info_t* server_info) {
-  // Print player's own score locally and the winner's score & username globally.
+int broadcast_server_message(server_info_t* server_info, char* message) {
+  user_info_t server_msg = {.message = message, .username = "Server"};
 
-  // Create the global message that will announce the game's winner.
-  char* start_of_msg = "The game has ended.\n";
-  char* game_winner_msg = " is the winner of the game with ";
-  char* rest_of_msg = " points!\n";
+  int* player_fds;
+  size_t num_players = get_player_fds(server_info->chat_users, &player_fds);
+  int rc = broadcast_message(player_fds, num_players, &server_msg);
+  free(player_fds);
 
-  // NOTE: We are assuming that the total points will be no more than 2 digits long.
-  int message_len = strlen(start_of_msg) + strlen(server_info_global->leading_username) + 
-                    strlen(game_winner_msg) + sizeof(int) * 2 + strlen(rest_of_msg) + 1;
-  char *buf = malloc(sizeof(char) * message_len);
-  snprintf(buf, message_len, "The game has ended.\n%s is the winner of the game with %d points!", 
-           server_info_global->leading_username, server_info_global->leading_player->score);
+  return rc;
+}
 
-  user_info_t * winner_of_game = malloc(sizeof(user_info_t));
-  winner_of_game->username = "Server";
-  winner_of_game->message = buf;
+/**
+ * Get the name to show for a player in messages from the server.
+ * 
+ * \param player The player
+ * \param buf A buffer for the name of a player that hasn't sent their username yet
+ * \param size The size of the buffer
+ * 
+ * \returns The player's username, or a name made up from their player id in buf
+ */
+const char* get_display_name(user_node_t* player, char* buf, size_t size) {
+  if (player->username != NULL) {
+    return player->username;
+  }
 
-  user_node_t* curr = server_info->chat_users->first_user;
+  snprintf(buf, size, "Player %u", player->player_id);
+  return buf;
+}
 
-  // Send the message announcing the game's winner to everyone.
-  while (curr != NULL) {
-    int rc = send_message(curr->socket_fd, winner_of_game);
+/**
+ * Announce the standings after a player scored: everyone gets the leaders of the game and their 
+ * own rank, and players with a session also get the scorer's new score. Only the leaders are 
+ * looked at, so this doesn't depend on how many players are in the room. Runs on the
+ * room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param scorer The player who just scored
+ */
+void announce_standings(server_info_t* server_info, user_node_t* scorer) {
+  score_entry_t* leaders[NUM_LEADERS_SHOWN];
+  size_t num_leaders = scoreboard_top(&server_info->scoreboard, leaders, NUM_LEADERS_SHOWN);
+
+  // List the leaders once for everyone.
+  char leaders_msg[MAX_MESSAGE_LENGTH];
+  size_t len = snprintf(leaders_msg, sizeof(leaders_msg), "Leaders:");
+  for (size_t i = 0; i < num_leaders && len < sizeof(leaders_msg); i++) {
+    user_node_t* leader = leaders[i]->arg;
+    char name_buf[32];
+    len += snprintf(leaders_msg + len, sizeof(leaders_msg) - len, "%s %s %u", i > 0 ? "," : "", 
+                    get_display_name(leader, name_buf, sizeof(name_buf)), leader->standing.score);
+  }
 
-    if (rc == -1) {
-      perror("Failed to send message to client");
-      exit(EXIT_FAILURE);
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->is_away) {
+      continue;
     }
 
-    // Create the message showing the player's own score.
-    // NOTE: We are assuming that the total points will be no more than 2 digits long.
-    char* local_score_msg = "Your score: ";
-    int msg_len = strlen(local_score_msg) + sizeof(int) * 2 + 1;
-    char *buf2 = malloc(sizeof(char) * msg_len);
-    snprintf(buf2, msg_len, "Your score: %d", curr->score);
-
-    user_info_t * own_score = malloc(sizeof(user_info_t));
-    own_score->username = "Server";
-    own_score->message = buf2;
-
-    // Send message showing own score (not announcing it to everyone).
-    rc = send_message(curr->socket_fd, own_score);
-    free(buf2);
-    free(own_score);
-
-    if (rc == -1) {
-      perror("Failed to send message to client");
-      exit(EXIT_FAILURE);
+    if (session_send_score(current->socket_fd, scorer->player_id, scorer->standing.score) == -1) {
+      // A player that left is removed by their own thread.
+      log_send_failure();
+      continue;
     }
 
-    // Disconnect everyone out one-by-one since the game ended.
-    close(curr->socket_fd);
-
-    curr = curr->next;
+    char standings_msg[MAX_MESSAGE_LENGTH + 64];
+    snprintf(standings_msg, sizeof(standings_msg), "%s. You are #%zu of %zu.", leaders_msg, 
+             scoreboard_rank(&server_info->scoreboard, &current->standing), 
+             server_info->scoreboard.num_entries);
+    if (send_server_message(current->socket_fd, standings_msg) == -1) {
+      log_send_failure();
+    }
   }
+}
 
-  user_node_t* curr2 = server_info->chat_users->first_user;
-
-  // Also, remove all players from this game's list of players.
-  while (curr2 != NULL) {
-    user_node_t *temp = curr2;
-    remove_user(curr2->socket_fd);
-    curr2 = temp->next;
+/**
+ * Work out what the game expects from a player right now. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * 
+ * \returns The opcode of the message the player can send, or OP_CHAT if it isn't their turn
+ */
+opcode_t expected_opcode(server_info_t* server_info, user_node_t* player) {
+  if (server_info->end_game) {
+    return OP_CHAT;
+  } else if (server_info->is_guessing) {
+    return OP_GUESS;
+  } else if (server_info->is_receiving_secret_word) {
+    return player == server_info->curr_host ? OP_SECRET : OP_CHAT;
+  } else if (player == server_info->curr_host) {
+    return OP_ANSWER;
+  } else if (player == server_info->curr_asker) {
+    return OP_QUESTION;
   }
 
-  free(buf);
-  free(winner_of_game);
+  return OP_CHAT;
 }
 
 /**
- * Validate the guesses by adding a point to the player who successfully guesses the secret word, 
- * announcing the round's winner to everyone, and updating the new leading player of the game. 
- * Everyone who tried to but failed to guess the secret word correctly is also told to try again.
+ * Work out what a message from a player without a session is, since legacy frames don't say. Runs
+ * on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * \param frame The legacy frame the player sent
  * 
- * \param server_info A local copy of the global server info struct containing the game state/info
- * \param user_info A structure containing the guess and username of the player who made the guess
- * \param user_socket_fd The socket file descriptor of the player making the guess
+ * \returns The opcode the message would have had over a session
  */
-void validate_guesses(server_info_t* server_info, user_info_t* user_info, int user_socket_fd) {
-  // Validate the guesses received against the secret word (when it is time to guess the 
-  // secret word).
-  if (strcasecmp(user_info->message, server_info->secret_word) == 0) { // case-insensitive
-    pthread_mutex_lock(&server_info_global_lock);
-    server_info_global->guessed_secret_word = true;
-    server_info_global->is_guessing = false;
-
-    user_node_t* current = server_info_global->chat_users->first_user;
-
-    // Create the message announcing the winner of the round.
-    char* rest_of_message = " is the winner of this round!";
-    char *result = malloc(strlen(user_info->username) + strlen(rest_of_message) + 1);
-    strcpy(result, user_info->username);
-    strcat(result, rest_of_message);
-
-    user_info_t* server_round_winner_msg = malloc(sizeof(user_info_t));
-    server_round_winner_msg->username = strdup("Server");
-    server_round_winner_msg->message = strdup(result);
-    free(result);
-
-    // Calculate new scores.
-    while (current != NULL) {
-      // Announce to everyone the winner of this round (for the secret word).
-      int rc = send_message(current->socket_fd, server_round_winner_msg);
-
-      if (rc == -1) {
-        perror("Failed to send message to client");
-        exit(EXIT_FAILURE);
-      }
-
-      // Update the score for the winner of the round.
-      if (current->socket_fd == user_socket_fd) {
-        current->score++;
-      }
+opcode_t classify_message(server_info_t* server_info, user_node_t* player, 
+                          message_frame_t* frame) {
+  if (frame_message_equals(frame, "quit", false)) {
+    return OP_QUIT;
+  }
 
-      // Update the current leading player of the game.
-      if (current->score > server_info_global->leading_player->score) {
-        server_info_global->leading_player = current;
-        free(server_info_global->leading_username);
-        server_info_global->leading_username = strdup(user_info->username);
-      }
+  return expected_opcode(server_info, player);
+}
 
-      current = current->next;
+/**
+ * Tell every other player with a session the name of a player. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ * \param player The player whose name is new
+ */
+void announce_player_name(server_info_t* server_info, user_node_t* player) {
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->has_session && !current->is_away && current != player &&
+        session_send_name(current->socket_fd, player->player_id, player->username) == -1) {
+      // A player that left is removed by their own thread.
+      log_send_failure();
     }
+  }
+}
 
-    // Indicate the end of the game once everyone has become the host once (and scores for 
-    // the last round have been calculated).
-    if (server_info_global->curr_host->next == NULL) {
-      server_info_global->end_game = true;
-    }
+/**
+ * Start a session for a player whose client sent a hello: the player gets their id, their turn, the
+ * token that takes their seat back if their connection drops, and the names of the players known so 
+ * far, and everyone else with a session gets the player's name. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * \param hello The hello with the player's username
+ * 
+ * \returns Non-zero value if an error occurs
+ */
+int start_session(server_info_t* server_info, user_node_t* player, message_frame_t* hello) {
+  free(player->username);
+  player->username = strndup(hello->username, hello->username_len);
 
-    free(server_round_winner_msg->username);
-    free(server_round_winner_msg->message);
-    free(server_round_winner_msg);
+  if (session_accept(player->socket_fd, player->player_id) == -1) {
+    return -1;
+  }
+  player->has_session = true;
 
-    pthread_mutex_unlock(&server_info_global_lock);
-  } else {
-    // Create message indicating the player wasn't able to guess the secret word.
-    user_info_t* server_try_again_msg = malloc(sizeof(user_info_t));
-    server_try_again_msg->username = strdup("Server");
-    server_try_again_msg->message = strdup("Wrong guess. Try again!");
+  // Let the client know what to send first.
+  player->turn = expected_opcode(server_info, player);
+  if (session_send_turn(player->socket_fd, player->turn) == -1) {
+    return -1;
+  }
 
-    // Send the "Try again!" message to all players that are unsuccessful in guessing the word.
-    int rc = send_message(user_socket_fd, server_try_again_msg);
+  // Only clients that understand tokens and snapshots can take their seat back.
+  if (resume_grace_ms > 0 && player->token == TOKEN_NONE && session_can_resume(player->socket_fd)) {
+    profiled_mutex_lock(&seat_tokens_lock);
+    player->token = token_map_issue(&seat_tokens, server_info);
+    profiled_mutex_unlock(&seat_tokens_lock);
 
-    if (rc == -1) {
-      perror("Failed to send message to client");
-      exit(EXIT_FAILURE);
+    if (player->token != TOKEN_NONE && session_send_token(player->socket_fd, player->token) == -1) {
+      return -1;
     }
+  }
 
-    free(server_try_again_msg->username);
-    free(server_try_again_msg->message);
-    free(server_try_again_msg);
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->username != NULL &&
+        session_send_name(player->socket_fd, current->player_id, current->username) == -1) {
+      return -1;
+    }
   }
-}
 
-/********************************************
- * Thread Worker Functions (Core Functions)
- *******************************************/
+  announce_player_name(server_info, player);
+  return 0;
+}
 
 /**
- * Start the game by picking the first connected user to be the host, getting a secret word from 
- * the host, picking the first asker (as the player that connected to the game second fastest), 
- * and creating threads for each player to be able to forward messages between all of them and to 
- * run the game logic.
+ * Remember the username a player without a session sent along with a message, and tell the 
+ * players with a session if it changed. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * \param frame The legacy frame the player sent
  */
-void* start_game(void* args) {
-  server_info_t* server_info = (server_info_t *) args;
-
-  // Pick the first host to start the game.
-  pthread_mutex_lock(&server_info_global_lock);
-  server_info_global->curr_host = server_info_global->chat_users->first_user;
-  pthread_mutex_unlock(&server_info_global_lock);
-
-  user_info_t* server_pick_secret_msg = malloc(sizeof(user_info_t));
-  server_pick_secret_msg->username = strdup("Server");
-  server_pick_secret_msg->message = strdup("You are the host. Pick your secret word.");
-
-  // Send a message to the first host to pick a secret word.
-  pthread_mutex_lock(&server_info_global_lock);
-  int rc = send_message(server_info_global->curr_host->socket_fd, server_pick_secret_msg);
-  pthread_mutex_unlock(&server_info_global_lock);
-
-  if (rc == -1) {
-    perror("Failed to send message to client");
-    exit(EXIT_FAILURE);
+void update_player_name(server_info_t* server_info, user_node_t* player, message_frame_t* frame) {
+  if (player->username != NULL && strlen(player->username) == frame->username_len &&
+      memcmp(player->username, frame->username, frame->username_len) == 0) {
+    return;
   }
 
-  free(server_pick_secret_msg->username);
-  free(server_pick_secret_msg->message);
-  free(server_pick_secret_msg);
-
-   // Create local copy of server_info to ONLY read data from the struct w/o needing to lock.
-  pthread_mutex_lock(&server_info_global_lock);
-  server_info_t* server_info_local = server_info_global;
-  pthread_mutex_unlock(&server_info_global_lock);
-
-  // Receive the secret word from the host.
-  user_info_t* user_info = receive_message(server_info_local->curr_host->socket_fd);
+  free(player->username);
+  player->username = strndup(frame->username, frame->username_len);
+  announce_player_name(server_info, player);
+}
 
-  // Send message to all players, except the host, signaling the start of the game.
-  pthread_mutex_lock(&server_info_global_lock);
-  user_node_t* current = server_info_global->chat_users->first_user;
-  pthread_mutex_unlock(&server_info_global_lock);
+/**
+ * Forward a player's message to every player. Players that use the same format as the sender get 
+ * the frame exactly as it was received, and the others get it encoded once in their format. Runs
+ * on the room's actor.
+ * 
+ * \param server_info The room of the players
+ * \param sender The player that sent the message
+ * \param frame The message
+ * \param opcode What the message is
+ * 
+ * \returns Non-zero value if an error occurs for any of the players
+ */
+int relay_frame(server_info_t* server_info, user_node_t* sender, message_frame_t* frame, 
+                opcode_t opcode) {
+  int num_users = server_info->chat_users->numUsers;
+  int* session_fds = malloc(sizeof(int) * (num_users > 0 ? num_users : 1));
+  int* legacy_fds = malloc(sizeof(int) * (num_users > 0 ? num_users : 1));
+  size_t num_session_fds = 0;
+  size_t num_legacy_fds = 0;
+
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->is_away) {
+      continue;
+    } else if (current->has_session) {
+      session_fds[num_session_fds++] = current->socket_fd;
+    } else {
+      legacy_fds[num_legacy_fds++] = current->socket_fd;
+    }
+  }
 
-  user_info_t* server_start_game_msg = malloc(sizeof(user_info_t));
-  server_start_game_msg->username = strdup("Server");
-  server_start_game_msg->message = strdup("The game has started. Wait for your turn to ask a "
-                                          "question about the secret word.");
+  int rc = 0;
+  if (num_session_fds > 0) {
+    message_frame_t* session_frame = frame;
+    if (frame->kind != FRAME_SESSION) {
+      session_frame = frame_encode(FRAME_SESSION, opcode, sender->player_id, frame->message, 
+                                   frame->message_len, NULL, 0);
+    }
 
-  // Tell non-host players that the game has started and to wait for their turn to ask the host 
-  // a question.
-  while (current != NULL) {
-    pthread_mutex_lock(&server_info_global_lock);
-    if (current->socket_fd != server_info_global->curr_host->socket_fd) {
-      int rc = send_message(current->socket_fd, server_start_game_msg);
+    if (session_frame == NULL || 
+        broadcast_frame(session_fds, num_session_fds, session_frame) == -1) {
+      rc = -1;
+    }
+    if (session_frame != frame) {
+      frame_release(session_frame);
+    }
+  }
 
-      if (rc == -1) {
-        perror("Failed to send message to client");
-        exit(EXIT_FAILURE);
-      }
+  if (num_legacy_fds > 0) {
+    message_frame_t* legacy_frame = frame;
+    if (frame->kind != FRAME_LEGACY) {
+      legacy_frame = frame_encode(FRAME_LEGACY, opcode, sender->player_id, frame->message, 
+                                  frame->message_len, sender->username, strlen(sender->username));
     }
 
-    current = current->next;
-    pthread_mutex_unlock(&server_info_global_lock);
+    if (legacy_frame == NULL || 
+        broadcast_frame(legacy_fds, num_legacy_fds, legacy_frame) == -1) {
+      rc = -1;
+    }
+    if (legacy_frame != frame) {
+      frame_release(legacy_frame);
+    }
   }
 
-  free(server_start_game_msg->username);
-  free(server_start_game_msg->message);
-  free(server_start_game_msg);
-  
-  // Save the secret word.
-  pthread_mutex_lock(&server_info_global_lock);
-  server_info_global->secret_word = strdup(user_info->message);
-  pthread_mutex_unlock(&server_info_global_lock);
-
-  free(user_info->username);
-  free(user_info->message);
-  free(user_info);
-
-  // Set the first asker (as the next player after the host in the linked list).
-  pthread_mutex_lock(&server_info_global_lock);
-  server_info_global->curr_asker = server_info_global->curr_host->next;
-  pthread_mutex_unlock(&server_info_global_lock);
-
-  // Tell current asker to send a question.
-  user_info_t* server_start_asking_msg = malloc(sizeof(user_info_t));
-  server_start_asking_msg->username = strdup("Server");
-  server_start_asking_msg->message = strdup("It is your turn to ask the host a Yes/No question "
-                                            "about the secret word.");
-
-  pthread_mutex_lock(&server_info_global_lock);
-  rc = send_message(server_info_global->curr_asker->socket_fd, server_start_asking_msg);
-  pthread_mutex_unlock(&server_info_global_lock);
+  free(session_fds);
+  free(legacy_fds);
+  return rc;
+}
 
-  if (rc == -1) {
-    perror("Failed to send message to client");
-    exit(EXIT_FAILURE);
+/**
+ * Start holding back the messages this thread sends while it handles a room's events, so that 
+ * every player gets all of the events' messages in a single write. Nothing is held back for 
+ * longer than the cork delay.
+ */
+void cork_output() {
+  if (cork_delay_us > 0) {
+    message_io_cork(cork_delay_us);
   }
+}
 
-  free(server_start_asking_msg->username);
-  free(server_start_asking_msg->message);
-  free(server_start_asking_msg);
-  
-  // Loop through list of players, and create a thread for each so that they can start 
-  // communicating w/ e/o./o.
-  pthread_mutex_lock(&server_info_global_lock);
-  user_node_t * curr = server_info_global->chat_users->first_user;
-  
-  while (curr != NULL) {
-    pthread_t forward_msg_thread;
-    pthread_create(&forward_msg_thread, NULL, forward_msg, &curr->socket_fd);
-
-    curr = curr->next;
+/**
+ * Send the messages this thread held back since cork_output, and stop holding them back. Must be 
+ * called before the room's actor gives up its worker, so that messages about the room's next 
+ * events (which may be handled on another worker) can't overtake them.
+ */
+void uncork_output() {
+  if (message_io_uncork() == -1) {
+    log_send_failure();
   }
-  pthread_mutex_unlock(&server_info_global_lock);
-  
-  return NULL;
 }
 
 /**
- * Receives and sends user's message to all other users.
+ * Get the current time in microseconds from a monotonic clock.
  */
-void* forward_msg(void* args) {
-  int* user_socket = (int *) args;
-  int user_socket_fd = *user_socket;
+uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-  // Create local copy of server_info to ONLY read data from the struct w/o needing to lock.
-  pthread_mutex_lock(&server_info_global_lock);
-  server_info_t* server_info = server_info_global;
-  pthread_mutex_unlock(&server_info_global_lock);
+/**
+ * Get the current time in milliseconds from a monotonic clock.
+ */
+uint64_t now_ms() {
+  return now_us() / 1000;
+}
 
-  while (true) {
-    // Read a message from the player.
-    user_info_t* user_info = receive_message(user_socket_fd);
-
-    // Remove the user if there's some error when trying to receive a message from it or 
-    // the user is quitting the game.
-    if (user_info == NULL || strcmp(user_info->message, "quit") == 0) {
-      remove_user(user_socket_fd);
-      // Close server's end of the socket.
-      close(user_socket_fd);
+/**
+ * Get the current time in timer ticks.
+ */
+uint64_t now_ticks() {
+  return now_ms() / TIMER_TICK_MS;
+}
+
+/**
+ * Get the player the game is waiting on: the host while they pick a secret word or answer, and 
+ * otherwise the asker. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ * 
+ * \returns The player, or NULL if the game isn't waiting on a single player (before it starts, 
+ *          while everyone guesses, and after it ends)
+ */
+user_node_t* get_waited_on_player(server_info_t* server_info) {
+  if (server_info->curr_host == NULL || server_info->is_guessing || server_info->end_game) {
+    return NULL;
+  }
+
+  if (server_info->is_receiving_secret_word || server_info->is_question_pending) {
+    return server_info->curr_host;
+  }
+  return server_info->curr_asker;
+}
+
+/**
+ * Get the shard that holds a room's timers.
+ * 
+ * \param server_info The room
+ * 
+ * \returns The shard
+ */
+timer_shard_t* get_timer_shard(server_info_t* server_info) {
+  return &timer_shards[server_info->id % num_timer_shards];
+}
+
+/**
+ * (Re)start one of a room's timers, and wake the shard's thread up if it would sleep past it.
+ * 
+ * \param server_info The room
+ * \param timer The timer, which is part of the room
+ * \param expires The tick it expires on
+ * 
+ * \returns The tick it actually expires on (the next one, if expires has passed)
+ */
+uint64_t start_room_timer(server_info_t* server_info, wheel_timer_t* timer, uint64_t expires) {
+  timer_shard_t* shard = get_timer_shard(server_info);
+  profiled_mutex_lock(&shard->lock);
+
+  // A wheel without timers isn't advanced while its thread sleeps, so catch it up first.
+  if (shard->wheel.num_pending == 0) {
+    timer_wheel_advance(&shard->wheel, now_ticks());
+  }
+  timer_wheel_add(&shard->wheel, timer, expires);
+  expires = timer->expires;
+
+  bool is_sooner = expires < shard->wake_tick;
+  if (is_sooner) {
+    shard->wake_tick = expires;
+  }
+  profiled_mutex_unlock(&shard->lock);
+
+  if (is_sooner) {
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) == -1) {
+      log_perror("Failed to wake up a timer thread");
+    }
+  }
+  return expires;
+}
+
+/**
+ * Stop one of a room's timers. Its thread wakes up as planned and finds nothing to do.
+ * 
+ * \param server_info The room
+ * \param timer The timer, which is part of the room
+ */
+void stop_room_timer(server_info_t* server_info, wheel_timer_t* timer) {
+  timer_shard_t* shard = get_timer_shard(server_info);
+  profiled_mutex_lock(&shard->lock);
+  timer_wheel_cancel(&shard->wheel, timer);
+  profiled_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Get how late the timer threads wake up, going by the one that is the furthest behind.
+ * 
+ * \returns The lag in milliseconds
+ */
+uint64_t get_timer_lag_ms() {
+  uint64_t lag_ms = 0;
+  for (int i = 0; i < num_timer_shards; i++) {
+    uint64_t shard_lag_ms = atomic_load(&timer_shards[i].lag_ms);
+    lag_ms = shard_lag_ms > lag_ms ? shard_lag_ms : lag_ms;
+  }
+  return lag_ms;
+}
+
+/**
+ * (Re)start the deadline for the player the game is now waiting on. Runs on the room's 
+ * actor.
+ * 
+ * \param server_info The room whose game is waiting
+ */
+void arm_turn_timer(server_info_t* server_info) {
+  // The game doesn't wait for a player that is away: their turn ends on the next tick.
+  user_node_t* waited_on = get_waited_on_player(server_info);
+  bool is_waiting_on_away = waited_on != NULL && waited_on->is_away;
+  if (turn_timeout_ms == 0 && !is_waiting_on_away) {
+    return;
+  }
+
+  server_info->turn_deadline = start_room_timer(server_info, &server_info->turn_timer, 
+      now_ticks() + (is_waiting_on_away ? 0 : turn_timeout_ms / TIMER_TICK_MS));
+}
+
+/**
+ * Stop the turn deadline, since the game isn't waiting on anyone. Runs on the room's 
+ * actor.
+ * 
+ * \param server_info The room whose game isn't waiting
+ */
+void cancel_turn_timer(server_info_t* server_info) {
+  stop_room_timer(server_info, &server_info->turn_timer);
+  server_info->turn_deadline = 0;
+}
+
+/**
+ * (Re)start the timer that gives up the first held seat of a player that is away, or stop it if 
+ * nobody is away. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ */
+void arm_away_timer(server_info_t* server_info) {
+  uint64_t first_deadline = 0;
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->is_away && (first_deadline == 0 || current->away_deadline < first_deadline)) {
+      first_deadline = current->away_deadline;
+    }
+  }
+
+  if (first_deadline == 0) {
+    cancel_away_timer(server_info);
+    return;
+  }
+
+  start_room_timer(server_info, &server_info->away_timer, first_deadline);
+}
+
+/**
+ * Stop the timer that gives up held seats. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ */
+void cancel_away_timer(server_info_t* server_info) {
+  stop_room_timer(server_info, &server_info->away_timer);
+}
+
+/**
+ * (Re)start the timer that pings the players' clients next. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ */
+void arm_heartbeat_timer(server_info_t* server_info) {
+  if (ping_interval_ms == 0) {
+    return;
+  }
+
+  start_room_timer(server_info, &server_info->heartbeat_timer, 
+                   now_ticks() + ping_interval_ms / TIMER_TICK_MS);
+}
+
+/**
+ * Stop pinging the players' clients. Runs on the room's actor.
+ * 
+ * \param server_info The room of the players
+ */
+void cancel_heartbeat_timer(server_info_t* server_info) {
+  stop_room_timer(server_info, &server_info->heartbeat_timer);
+}
+
+/**
+ * Forget the questions of the round that just ended. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void clear_questions(server_info_t* server_info) {
+  for (int i = 0; i < server_info->num_questions; i++) {
+    free(server_info->questions[i].question);
+    free(server_info->questions[i].answer);
+  }
+  server_info->num_questions = 0;
+}
+
+/**
+ * Change the asker to the next player in the list of users and indicate that the asker has been 
+ * updated.
+ * 
+ * \param server_info The room of the game
+ */
+void update_asker(server_info_t* server_info) {
+  // Players that are away can't ask, so they are skipped (unless everyone is away).
+  for (int i = 0; i < server_info->chat_users->numUsers; i++) {
+    // Proceed to the next asker for question asking.
+    if (server_info->curr_asker->next != NULL) {
+      server_info->curr_asker = server_info->curr_asker->next;
+    } else {
+      server_info->curr_asker = server_info->chat_users->first_user;
+    }
+
+    // If everyone has asked their question (the asker loops back around to the host), 
+    // then begin the next round of asking, starting with the first asker of the previous 
+    // round.
+    if (server_info->curr_asker->socket_fd == server_info->curr_host->socket_fd) {
+      if (server_info->curr_asker->next != NULL) {
+        server_info->curr_asker = server_info->curr_asker->next;
+      } else {
+        server_info->curr_asker = server_info->chat_users->first_user;
+      }
+    }
+
+    if (!server_info->curr_asker->is_away) {
+      break;
+    }
+  }
+
+  // Indicate that the asker has been changed at this point.
+  server_info->asker_updated = true;
+}
+
+/**
+ * Prepare for the next round by changing the host to the next player in the list of users, 
+ * signaling that the server should receive the secret word next, changing the next asker, 
+ * and indicating that the asker and host have been updated. 
+ * 
+ * \param server_info The room of the game
+ */
+void set_up_for_next_round(server_info_t* server_info) {
+  trace_event(traced.next_round, TRACE_BEGIN, server_info->id, 0);
+  metrics_add(METRIC_ROUNDS, 1);
+
+  // Update the host for the next round.
+  server_info->curr_host = server_info->curr_host->next;
+  server_info->host_updated = true; // Indicate that there is a new host.
+
+  // Signal that a secret word has to be selected (before the round begins).
+  server_info->is_receiving_secret_word = true;
+  server_info->curr_question = 0;
+  server_info->guessed_secret_word = false;
+  server_info->is_question_pending = false;
+  clear_questions(server_info);
+  secret_wipe(&server_info->secret_word);
+
+  // Proceed to the next asker for question asking.
+  if (server_info->curr_asker->next != NULL) {
+    server_info->curr_asker = server_info->curr_asker->next;
+  } else {
+    server_info->curr_asker = server_info->chat_users->first_user;
+  }
+
+  // If everyone has asked their question (the asker loops back around to the host), 
+  // then begin the next round of asking, starting with the first asker of the previous round.
+  if (server_info->curr_asker->socket_fd == server_info->curr_host->socket_fd) {
+    if (server_info->curr_asker->next != NULL) {
+      server_info->curr_asker = server_info->curr_asker->next;
+    } else {
+      server_info->curr_asker = server_info->chat_users->first_user;
+    }
+  }
+
+  server_info->asker_updated = true; // Indicate that there is a new asker.
+  trace_event(traced.next_round, TRACE_END, 0, 0);
+}
+
+/**
+ * End the game by announcing the game's winner, sending each individual player their score, and 
+ * disconnecting everyone from the server at the end. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void end_game(server_info_t* server_info) {
+  trace_event(traced.end_game, TRACE_BEGIN, server_info->id, server_info->chat_users->numUsers);
+  server_info->end_game = true;
+  cancel_turn_timer(server_info);
+  secret_wipe(&server_info->secret_word);
+
+  // Print player's own score locally and the winner's score & username globally.
+
+  // Create the global message that will announce the game's winner.
+  char* start_of_msg = "The game has ended.\n";
+  char* game_winner_msg = " is the winner of the game with ";
+  char* rest_of_msg = " points!\n";
+
+  // The winner is whoever reached the highest score first.
+  user_node_t* winner = scoreboard_leader(&server_info->scoreboard)->arg;
+  char name_buf[32];
+  const char* winner_name = get_display_name(winner, name_buf, sizeof(name_buf));
+
+  // NOTE: We are assuming that the total points will be no more than 2 digits long.
+  int message_len = strlen(start_of_msg) + strlen(winner_name) + 
+                    strlen(game_winner_msg) + sizeof(int) * 2 + strlen(rest_of_msg) + 1;
+  char *buf = malloc(sizeof(char) * message_len);
+  snprintf(buf, message_len, "The game has ended.\n%s is the winner of the game with %u points!", 
+           winner_name, winner->standing.score);
+
+  user_info_t * winner_of_game = malloc(sizeof(user_info_t));
+  winner_of_game->username = "Server";
+  winner_of_game->message = buf;
+
+  user_node_t* curr = server_info->chat_users->first_user;
+
+  // Send the message announcing the game's winner to everyone.
+  while (curr != NULL) {
+    // There is no game left to come back to.
+    if (curr->is_away) {
+      curr->away_deadline = now_ticks();
+      curr = curr->next;
+      continue;
+    }
+
+    int rc = send_message(curr->socket_fd, winner_of_game);
+
+    // A player that already left is removed by their own thread.
+    if (rc == -1) {
+      log_send_failure();
+    }
+
+    // Players with a session also get everyone's final score.
+    for (user_node_t* scored = server_info->chat_users->first_user; scored != NULL; 
+         scored = scored->next) {
+      if (session_send_score(curr->socket_fd, scored->player_id, 
+                             scored->standing.score) == -1) {
+        log_send_failure();
+        break;
+      }
+    }
+
+    // Create the message showing the player's own score and rank.
+    char* local_score_msg = "Your score: ";
+    int msg_len = strlen(local_score_msg) + 64;
+    char *buf2 = malloc(sizeof(char) * msg_len);
+    snprintf(buf2, msg_len, "Your score: %u (#%zu of %zu)", curr->standing.score, 
+             scoreboard_rank(&server_info->scoreboard, &curr->standing), 
+             server_info->scoreboard.num_entries);
+
+    user_info_t * own_score = malloc(sizeof(user_info_t));
+    own_score->username = "Server";
+    own_score->message = buf2;
+
+    // Send message showing own score (not announcing it to everyone).
+    rc = send_message(curr->socket_fd, own_score);
+    free(buf2);
+    free(own_score);
+
+    if (rc == -1) {
+      log_send_failure();
+    }
+
+    // Disconnect everyone out one-by-one since the game ended. Each player's thread then sees 
+    // the connection end, removes the player from the game, and closes the socket. Whatever was 
+    // held back for the player has to go out first.
+    if (message_io_flush() == -1) {
+      log_send_failure();
+    }
+    shutdown(curr->socket_fd, SHUT_RDWR);
+
+    curr = curr->next;
+  }
+
+  // The seats of players that are away are given up right away.
+  arm_away_timer(server_info);
+
+  free(buf);
+  free(winner_of_game);
+  trace_event(traced.end_game, TRACE_END, 0, 0);
+}
+
+/*******************
+ * Guess Resolution
+ *******************/
+// In a room with thousands of guessers, checking every guess on the room's actor would make the 
+// actor the bottleneck of the guessing phase. Instead, each player's thread checks its own 
+// player's guesses against the open round as they arrive, so the checks run on as many cores as 
+// there are guessers, and the actor only hears whether a guess was correct.
+// 
+// A correct guess claims the round with a compare-and-swap on the round's claim, which packs the 
+// time the guess was received (since the round opened) above the guesser's player id. An earlier 
+// claim always beats a later one, whichever thread got to the claim first, and the player id 
+// breaks ties. The actor seals the round as soon as it handles a correct guess: the claim at that 
+// moment is the round's winner, who is announced and scored exactly once. A correct guess that 
+// arrives after the seal is too late.
+
+/**
+ * Open the guessing phase of a round, so that players' threads start checking guesses. Runs on 
+ * the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void open_guessing(server_info_t* server_info) {
+  guess_round_t* round = malloc(sizeof(guess_round_t));
+  round->secret_hash = server_info->secret_word.hash;
+  round->secret_len = server_info->secret_word.len;
+  round->opened_us = now_us();
+  atomic_init(&round->best_claim, 0);
+  round->prev = server_info->last_round;
+  server_info->last_round = round;
+
+  server_info->is_guessing = true;
+  atomic_store(&server_info->guess_round, round);
+}
+
+/**
+ * Close the guessing phase, so that no more guesses can win the round. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ * 
+ * \returns The claim of the earliest correct guess (0 if nobody guessed the secret word)
+ */
+uint64_t close_guessing(server_info_t* server_info) {
+  server_info->is_guessing = false;
+
+  guess_round_t* round = atomic_exchange(&server_info->guess_round, NULL);
+  if (round == NULL) {
+    return 0;
+  }
+  return atomic_fetch_or(&round->best_claim, GUESS_SEALED) & ~GUESS_SEALED;
+}
+
+/**
+ * Check whether a frame guesses the secret word of the open round, and claim the round for the 
+ * player if it does (unless an earlier correct guess already has). Runs on the player's thread.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * \param frame The frame the player sent
+ * \param received_us When the frame was received
+ * 
+ * \returns The round whose secret word the frame guessed, or NULL if it isn't a correct guess
+ */
+guess_round_t* check_guess(server_info_t* server_info, user_node_t* player, 
+                           message_frame_t* frame, uint64_t received_us) {
+  // Every player's messages are guesses while the round is open, like the actor sees them.
+  bool is_guess = frame->kind == FRAME_LEGACY || 
+                  (frame->kind == FRAME_SESSION && frame->opcode == OP_GUESS);
+  guess_round_t* round = atomic_load(&server_info->guess_round);
+  if (!is_guess || round == NULL) {
+    return NULL;
+  }
+  metrics_add(METRIC_GUESSES_CHECKED, 1);
+
+  // A guess of the right length is only hashed, and the hashes compared. The key is random, so a 
+  // wrong guess can't be made to match.
+  if (frame->message_len != round->secret_len || 
+      secret_hash(frame->message, frame->message_len) != round->secret_hash) {
+    return NULL;
+  }
+  metrics_add(METRIC_GUESSES_CORRECT, 1);
+
+  // The frame may have been received just before the round opened.
+  uint64_t elapsed_us = received_us > round->opened_us ? received_us - round->opened_us : 0;
+  uint64_t claim = elapsed_us << GUESS_PLAYER_BITS | player->player_id;
+
+  uint64_t best = atomic_load(&round->best_claim);
+  while ((best & GUESS_SEALED) == 0 && (best == 0 || claim < best) && 
+         !atomic_compare_exchange_weak(&round->best_claim, &best, claim)) {
+  }
+  return round;
+}
+
+/**
+ * Find a player by their player id. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player_id The player's id
+ * 
+ * \returns The player, or NULL if they left
+ */
+user_node_t* find_player(server_info_t* server_info, uint16_t player_id) {
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->player_id == player_id) {
+      return current;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Record a guess the actor handled in the analytics (if they are on). Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param player The player that guessed
+ * \param frame The frame containing the guess
+ * \param correct_guess The round whose secret word the guess matched (NULL if it didn't)
+ */
+void record_guess(server_info_t* server_info, user_node_t* player, message_frame_t* frame, 
+                  guess_round_t* correct_guess) {
+  if (!analytics_is_on) {
+    return;
+  }
+
+  // The winner's own guess may only be handled after the round was sealed with their claim.
+  uint32_t flags = 0;
+  if (correct_guess != NULL) {
+    flags |= ANALYTICS_CORRECT;
+    uint64_t claim = atomic_load(&correct_guess->best_claim);
+    if ((claim & GUESS_SEALED) != 0 && 
+        (claim & ((1 << GUESS_PLAYER_BITS) - 1)) == player->player_id) {
+      flags |= ANALYTICS_WINNER;
+    }
+  }
+
+  guess_round_t* round = server_info->last_round;
+  analytics_guess_t guess = {
+    .room_id = server_info->id,
+    .round = server_info->num_rounds,
+    .player = player->username,
+    .guess = frame->message,
+    .guess_len = frame->message_len,
+    .flags = flags,
+    .guess_ms = round != NULL ? (now_us() - round->opened_us) / 1000 : 0,
+  };
+  analytics_record_guess(&guess);
+}
+
+/**
+ * Record a round that ended in the analytics (if they are on). The secret word is only recorded 
+ * once the round is over, when the players learn it anyway. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param outcome How the round ended
+ * \param winner The player that won the round (NULL if nobody did)
+ */
+void record_round(server_info_t* server_info, analytics_outcome_t outcome, user_node_t* winner) {
+  if (!analytics_is_on) {
+    return;
+  }
+
+  // The latest guessing phase may be the one of an earlier round.
+  uint64_t now = now_us();
+  guess_round_t* round = server_info->last_round;
+  bool has_guessing = round != NULL && round->opened_us >= server_info->word_picked_us;
+  analytics_round_t ended = {
+    .room_id = server_info->id,
+    .round = server_info->num_rounds,
+    .host = server_info->curr_host->username,
+    .word = server_info->secret_word.word,
+    .winner = winner != NULL ? winner->username : NULL,
+    .outcome = outcome,
+    .num_players = server_info->chat_users->numUsers,
+    .num_questions = server_info->num_questions,
+    .num_guesses = server_info->num_round_guesses,
+    .solve_ms = (now - server_info->word_picked_us) / 1000,
+    .guessing_ms = has_guessing ? (now - round->opened_us) / 1000 : 0,
+  };
+  analytics_record_round(&ended);
+}
+
+/**
+ * Validate the guesses by adding a point to the player who successfully guesses the secret word, 
+ * announcing the round's winner to everyone, and updating the standings of the game. 
+ * Everyone who tried to but failed to guess the secret word correctly is also told to try again. 
+ * The guess was already checked by the player's thread. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param frame The frame containing the guess
+ * \param player The player making the guess
+ * \param correct_guess The round whose secret word the guess matched (NULL if it didn't)
+ */
+void validate_guesses(server_info_t* server_info, message_frame_t* frame, user_node_t* player, 
+                      guess_round_t* correct_guess) {
+  // Only a correct guess of the round that is still open can win it.
+  if (correct_guess != NULL && correct_guess == atomic_load(&server_info->guess_round)) {
+    // The earliest correct guess wins, which isn't necessarily this one.
+    uint64_t claim = close_guessing(server_info);
+    user_node_t* winner = find_player(server_info, claim & ((1 << GUESS_PLAYER_BITS) - 1));
+    if (winner == NULL) {
+      // The winner left since, so the round goes to the guess at hand.
+      winner = player;
+    }
+    server_info->guessed_secret_word = true;
+
+    user_node_t* current = server_info->chat_users->first_user;
+
+    // Create the message announcing the winner of the round.
+    // A legacy winner whose first frame the actor hasn't handled yet has no username so far.
+    char name_buf[32];
+    const char* username = get_display_name(winner, name_buf, sizeof(name_buf));
+    char* rest_of_message = " is the winner of this round!";
+    char *result = malloc(strlen(username) + strlen(rest_of_message) + 1);
+    strcpy(result, username);
+    strcat(result, rest_of_message);
+
+    user_info_t* server_round_winner_msg = malloc(sizeof(user_info_t));
+    server_round_winner_msg->username = strdup("Server");
+    server_round_winner_msg->message = strdup(result);
+    free(result);
+
+    // Announce to everyone the winner of this round (for the secret word).
+    while (current != NULL) {
+      int rc = current->is_away ? 0 : send_message(current->socket_fd, server_round_winner_msg);
+
+      if (rc == -1) {
+        log_send_failure();
+      }
+
+      current = current->next;
+    }
+
+    server_info->num_round_guesses++;
+    record_guess(server_info, player, frame, correct_guess);
+    record_round(server_info, ANALYTICS_SOLVED, winner);
+
+    // Update the score for the winner of the round (which moves them up the scoreboard).
+    scoreboard_award(&server_info->scoreboard, &winner->standing);
+    announce_standings(server_info, winner);
+
+    // Indicate the end of the game once everyone has become the host once (and scores for 
+    // the last round have been calculated).
+    if (server_info->curr_host->next == NULL) {
+      server_info->end_game = true;
+    }
+
+    free(server_round_winner_msg->username);
+    free(server_round_winner_msg->message);
+    free(server_round_winner_msg);
+  } else {
+    server_info->num_round_guesses++;
+    record_guess(server_info, player, frame, correct_guess);
+
+    // Create message indicating the player wasn't able to guess the secret word.
+    user_info_t* server_try_again_msg = malloc(sizeof(user_info_t));
+    server_try_again_msg->username = strdup("Server");
+    server_try_again_msg->message = strdup("Wrong guess. Try again!");
+
+    // Send the "Try again!" message to all players that are unsuccessful in guessing the word.
+    int rc = send_message(player->socket_fd, server_try_again_msg);
+
+    if (rc == -1) {
+      log_send_failure();
+    }
+
+    free(server_try_again_msg->username);
+    free(server_try_again_msg->message);
+    free(server_try_again_msg);
+  }
+}
+
+/**
+ * Tell the clients with a session what the game now expects from their players. This must come 
+ * before any prompt, so that a client already knows what to send when its player sees the prompt.
+ * Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void update_turns(server_info_t* server_info) {
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    opcode_t turn = expected_opcode(server_info, current);
+    if (current->has_session && !current->is_away && current->turn != turn) {
+      if (session_send_turn(current->socket_fd, turn) == -1) {
+        log_send_failure();
+      }
+      current->turn = turn;
+    }
+  }
+}
+
+/**
+ * Begin the guessing free-for-all by telling all non-host players to make their guess. Runs on 
+ * the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void start_guessing_phase(server_info_t* server_info) {
+  open_guessing(server_info); // It is time for guessing.
+  update_turns(server_info);
+  
+  user_info_t* server_start_guessing_msg = malloc(sizeof(user_info_t));
+  server_start_guessing_msg->username = strdup("Server");
+  server_start_guessing_msg->message = strdup("It is time to make your guess for the "
+                                              "secret word.");
+
+  user_node_t* current = server_info->chat_users->first_user;
+
+  // Send that message to all non-host players, who can begin making their guess.
+  while (current != NULL) {
+    if (current != server_info->curr_host && !current->is_away) {
+      int rc = send_message(current->socket_fd, server_start_guessing_msg);
+
+      // A player that left is removed by their own thread.
+      if (rc == -1) {
+        log_send_failure();
+      }
+    }
+
+    current = current->next;
+  }
+
+  free(server_start_guessing_msg->username);
+  free(server_start_guessing_msg->message);
+  free(server_start_guessing_msg);
+
+  // Everyone has the same amount of time to guess.
+  arm_turn_timer(server_info);
+}
+
+/**
+ * Tell a player that has just become the current asker to send a question, and a player that has 
+ * just become the host to set a secret word. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void announce_turn_changes(server_info_t* server_info) {
+  // Nobody gets a turn once the game is over.
+  if (server_info->end_game) {
+    return;
+  }
+
+  update_turns(server_info);
+
+  // Every time a player becomes the current asker, tell the player to send a question.
+  if (server_info->asker_updated && 
+      (server_info->curr_question < server_info->max_questions) && 
+      !server_info->is_receiving_secret_word && !server_info->curr_asker->is_away) {
+    user_info_t* server_start_asking_msg = malloc(sizeof(user_info_t));
+    server_start_asking_msg->username = strdup("Server");
+    server_start_asking_msg->message = strdup("It is your turn to ask the host a Yes/No "
+                                              "question about the secret word.");
+
+    int rc = send_message(server_info->curr_asker->socket_fd, server_start_asking_msg);
+
+    // A player that left is removed by their own thread, which passes their turn on.
+    if (rc == -1) {
+      log_send_failure();
+    }
+
+    free(server_start_asking_msg->message);
+    free(server_start_asking_msg->username);
+    free(server_start_asking_msg);
+
+    // Reset the state of the asker being updated.
+    server_info->asker_updated = false;
+  }
+
+  // Every time a player becomes the new host, tell the player to set a secret word.
+  if (server_info->host_updated && !server_info->curr_host->is_away) {
+    user_info_t* server_pick_secret_msg = malloc(sizeof(user_info_t));
+    server_pick_secret_msg->username = strdup("Server");
+    server_pick_secret_msg->message = strdup("You are the host. Pick your secret word.");
+
+    int rc = send_message(server_info->curr_host->socket_fd, server_pick_secret_msg);
+
+    // A player that left is removed by their own thread, which passes their turn on.
+    if (rc == -1) {
+      log_send_failure();
+    }
+
+    free(server_pick_secret_msg->username);
+    free(server_pick_secret_msg->message);
+    free(server_pick_secret_msg);
+
+    // Reset the state of the host being updated.
+    server_info->host_updated = false;
+  }
+}
+
+/**
+ * Move the game on without the player it is waiting on: skip an asker that doesn't ask, skip a 
+ * question the host doesn't answer, pass the host role on if the host doesn't pick a secret word, 
+ * and end the guessing phase if nobody guesses the secret word. Runs on the room's actor.
+ * 
+ * \param server_info The room of the game
+ */
+void expire_turn(server_info_t* server_info) {
+  server_info->turn_deadline = 0;
+
+  int rc = 0;
+  if (server_info->is_receiving_secret_word) {
+    // The host didn't pick a secret word, so the next player hosts instead.
+    rc = broadcast_server_message(server_info, "The host took too long to pick a secret word.");
+    server_info->guessed_secret_word = true;
+  } else if (server_info->is_guessing) {
+    // Nobody guessed the secret word, so the round ends without a winner.
+    char* message_format = "Time is up! Nobody guessed the secret word, which was %s.";
+    size_t message_len = strlen(message_format) + server_info->secret_word.len + 1;
+    char* message = malloc(message_len);
+    snprintf(message, message_len, message_format, server_info->secret_word.word);
+
+    rc = broadcast_server_message(server_info, message);
+    free(message);
+
+    // A correct guess that is still on its way is too late.
+    close_guessing(server_info);
+    server_info->guessed_secret_word = true;
+    record_round(server_info, ANALYTICS_TIMED_OUT, NULL);
+  } else if (server_info->is_question_pending) {
+    // The host didn't answer, so skip the question.
+    rc = broadcast_server_message(server_info, "The host took too long to answer, so the "
+                                               "question was skipped.");
+    server_info->is_question_pending = false;
+    server_info->curr_question++;
+    update_asker(server_info);
+    arm_turn_timer(server_info);
+
+    if (server_info->curr_question == server_info->max_questions) {
+      start_guessing_phase(server_info);
+    }
+  } else {
+    // The asker didn't ask a question, so it is the next player's turn to ask.
+    if (!server_info->curr_asker->is_away) {
+      rc = send_server_message(server_info->curr_asker->socket_fd, 
+                               "You took too long to ask a question.");
+    }
+    update_asker(server_info);
+    arm_turn_timer(server_info);
+  }
+
+  if (rc == -1) {
+    log_send_failure();
+  }
+
+  // Move on to the next round (or end the game) if this round is over.
+  if (server_info->guessed_secret_word && server_info->curr_host->next != NULL) {
+    set_up_for_next_round(server_info);
+    arm_turn_timer(server_info);
+  } else if (server_info->guessed_secret_word) {
+    end_game(server_info);
+  }
+
+  announce_turn_changes(server_info);
+}
+
+/**
+ * Handle a player taking too long on their turn. Runs on the room's actor.
+ * 
+ * \param server_info The room whose turn timer expired
+ * \param deadline The tick the expired turn timer was set to
+ */
+void handle_turn_timeout(server_info_t* server_info, uint64_t deadline) {
+  // The player acted (restarting the timer), or the game ended or everyone left after the timer 
+  // expired.
+  if (server_info->end_game || server_info->chat_users->numUsers == 0 || 
+      server_info->turn_deadline != deadline) {
+    return;
+  }
+
+  expire_turn(server_info);
+}
+
+/**
+ * Move on after the host left in the middle of a round: the round is over, and the next player 
+ * hosts a new one (or the game ends if everyone else has already been the host). Runs on 
+ * the room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param next_host The player after the host that left (NULL if the host was the last player)
+ */
+void hand_over_host(server_info_t* server_info, user_node_t* next_host) {
+  int rc = broadcast_server_message(server_info, "The host left, so this round is over.");
+  if (rc == -1) {
+    log_send_failure();
+  }
+
+  close_guessing(server_info);
+
+  // The host must never point at the player that left.
+  if (next_host == NULL || server_info->chat_users->numUsers < LOBBY_MIN_PLAYERS) {
+    server_info->curr_host = server_info->chat_users->first_user;
+    end_game(server_info);
+    return;
+  }
+
+  // Start the next round with the next player as the host.
+  server_info->curr_host = next_host;
+  server_info->host_updated = true;
+  server_info->is_receiving_secret_word = true;
+  server_info->curr_question = 0;
+  server_info->guessed_secret_word = false;
+  server_info->is_question_pending = false;
+  clear_questions(server_info);
+  secret_wipe(&server_info->secret_word);
+
+  // The new host can't be the asker.
+  if (server_info->curr_asker == next_host) {
+    update_asker(server_info);
+  }
+  server_info->asker_updated = true;
+
+  arm_turn_timer(server_info);
+  announce_turn_changes(server_info);
+}
+
+/**
+ * Expire the turn deadlines and held seats of a shard's rooms, and ping their clients, as time 
+ * passes. The thread only wakes up when a timer is due, and sleeps for good while none is pending.
+ * 
+ * \param args The shard
+ */
+void* run_timer_shard(void* args) {
+  timer_shard_t* shard = (timer_shard_t*) args;
+  bool was_stopped = false;
+  trace_name_thread(traced.timer);
+
+  while (true) {
+    profiled_mutex_lock(&shard->lock);
+    uint64_t wake_tick = timer_wheel_next_tick(&shard->wheel);
+    shard->wake_tick = wake_tick;
+    profiled_mutex_unlock(&shard->lock);
+
+    int timeout_ms = -1;
+    if (wake_tick != UINT64_MAX) {
+      uint64_t now = now_ms();
+      timeout_ms = wake_tick * TIMER_TICK_MS > now ? wake_tick * TIMER_TICK_MS - now : 0;
+    } else {
+      atomic_store(&shard->lag_ms, 0); // Nothing is due, so nothing can be late
+    }
+
+    struct pollfd wake = {.fd = shard->wake_fd, .events = POLLIN};
+    int rc = poll(&wake, 1, timeout_ms);
+
+    // A hot restart stops the thread while it sleeps. The time it was stopped isn't lag.
+    if (atomic_load(&is_handing_off)) {
+      stop_for_handoff(&shard->stoppable);
+      was_stopped = true;
+      continue;
+    }
+
+    // A timer that is due sooner than planned woke the thread up, so plan again.
+    if (rc != 0) {
+      uint64_t num_wakeups;
+      if (rc > 0 && read(shard->wake_fd, &num_wakeups, sizeof(num_wakeups)) == -1) {
+        log_perror("Failed to read timer wakeups");
+      }
+      continue;
+    }
+
+    // The thread wakes up late when the CPUs are saturated, or when the room workers are too 
+    // busy to take the last events. Single wakeups are noisy, so the lag is averaged over recent 
+    // ones.
+    uint64_t woke = now_ms();
+    uint64_t lag = !was_stopped && woke > wake_tick * TIMER_TICK_MS ? 
+                   woke - wake_tick * TIMER_TICK_MS : 0;
+    atomic_store(&shard->lag_ms, (atomic_load(&shard->lag_ms) * 7 + lag) / 8);
+    was_stopped = false;
+
+    profiled_mutex_lock(&shard->lock);
+    wheel_timer_t* expired = timer_wheel_advance(&shard->wheel, now_ticks());
+
+    // Turn the expired timers into events, since the timers can be restarted as soon as the lock 
+    // is released. The events are posted after that, because posting can wait for a room worker, 
+    // and the workers need the lock to restart timers. Each room is kept alive until its event is 
+    // posted, even if its last player leaves meanwhile.
+    size_t num_expired = 0;
+    for (wheel_timer_t* timer = expired; timer != NULL; timer = timer->next) {
+      num_expired++;
+    }
+
+    server_info_t** rooms = malloc(sizeof(server_info_t*) * (num_expired > 0 ? num_expired : 1));
+    room_event_t** events = malloc(sizeof(room_event_t*) * (num_expired > 0 ? num_expired : 1));
+    size_t i = 0;
+    for (wheel_timer_t* timer = expired; timer != NULL; timer = timer->next, i++) {
+      rooms[i] = timer->arg;
+      atomic_fetch_add(&rooms[i]->refs, 1);
+
+      if (timer == &rooms[i]->away_timer) {
+        events[i] = create_event(EVENT_AWAY_TIMEOUT);
+      } else if (timer == &rooms[i]->heartbeat_timer) {
+        events[i] = create_event(EVENT_HEARTBEAT);
+      } else {
+        events[i] = create_event(EVENT_TURN_TIMEOUT);
+        events[i]->deadline = timer->expires;
+      }
+    }
+    profiled_mutex_unlock(&shard->lock);
+
+    for (i = 0; i < num_expired; i++) {
+      post_event(rooms[i], events[i]);
+      release_room(rooms[i]);
+    }
+    free(rooms);
+    free(events);
+  }
+
+  return NULL;
+}
+
+/**
+ * Create a room for players matched by the lobby.
+ * 
+ * \param socket_fds The socket file descriptors of the players, in the order they arrived
+ * \param num_players The number of players
+ * \param room_pool The workers the room's actor runs on
+ * 
+ * \returns The new room
+ */
+server_info_t* create_room(int* socket_fds, size_t num_players, worker_pool_t* room_pool) {
+  // Allocate space for server info.
+  server_info_t* server_info = (server_info_t *) malloc(sizeof(server_info_t));
+  server_info->room_pool = room_pool;
+
+  // Initialize fields for server info and the mailbox.
+  user_list_t* users = (user_list_t*) malloc(sizeof(user_list_t));
+  users->first_user = NULL;
+  users->numUsers = 0;
+
+  server_info->chat_users = users;
+  server_info->id = atomic_fetch_add(&last_room_id, 1) + 1;
+  server_info->metrics_entry = -1;
+  server_info->published_phase = -1;
+  server_info->published_players = 0;
+  server_info->curr_host = NULL;
+  server_info->curr_asker = NULL;
+  secret_init(&server_info->secret_word);
+  server_info->curr_question = 0;
+  server_info->max_questions = 2;
+  server_info->is_receiving_secret_word = false;
+  server_info->is_guessing = false;
+  server_info->guessed_secret_word = false;
+  server_info->asker_updated = false;
+  server_info->host_updated = false;
+  server_info->end_game = false;
+  server_info->is_question_pending = false;
+  server_info->turn_deadline = 0;
+  timer_init(&server_info->turn_timer, server_info);
+  timer_init(&server_info->away_timer, server_info);
+  timer_init(&server_info->heartbeat_timer, server_info);
+  server_info->questions = malloc(sizeof(asked_question_t) * server_info->max_questions);
+  server_info->num_questions = 0;
+  atomic_init(&server_info->guess_round, NULL);
+  server_info->last_round = NULL;
+  server_info->num_rounds = 0;
+  server_info->word_picked_us = 0;
+  server_info->num_round_guesses = 0;
+
+  // Every round has one host, and every player hosts once, so nobody can win more rounds than 
+  // there are players.
+  scoreboard_init(&server_info->scoreboard, num_players);
+
+  mailbox_init(&server_info->mailbox);
+  atomic_init(&server_info->is_scheduled, false);
+  atomic_init(&server_info->refs, 1);
+  atomic_fetch_add(&num_rooms, 1);
+  metrics_add(METRIC_ROOMS_OPENED, 1);
+
+  profiled_mutex_lock(&all_rooms_lock);
+  server_info->prev_room = NULL;
+  server_info->next_room = all_rooms;
+  if (all_rooms != NULL) {
+    all_rooms->prev_room = server_info;
+  }
+  all_rooms = server_info;
+  profiled_mutex_unlock(&all_rooms_lock);
+
+  // Add the players in the order they arrived, which is the order they take turns in.
+  for (size_t i = 0; i < num_players; i++) {
+    add_player_to_list(server_info, socket_fds[i]);
+  }
+
+  return server_info;
+}
+
+/**
+ * Drop a reference to a room, and free the room once nothing refers to it anymore.
+ * 
+ * \param server_info The room
+ */
+void release_room(server_info_t* server_info) {
+  if (atomic_fetch_sub(&server_info->refs, 1) != 1) {
+    return;
+  }
+
+  profiled_mutex_lock(&all_rooms_lock);
+  if (server_info->prev_room != NULL) {
+    server_info->prev_room->next_room = server_info->next_room;
+  } else {
+    all_rooms = server_info->next_room;
+  }
+  if (server_info->next_room != NULL) {
+    server_info->next_room->prev_room = server_info->prev_room;
+  }
+  profiled_mutex_unlock(&all_rooms_lock);
+  unpublish_room(server_info);
+
+  // Traversing through the users linked list to free each node 
+  user_node_t* current = server_info->chat_users->first_user;
+  while (current != NULL) {
+    user_node_t* temp = current->next;
+    free(current->username);
+    free(current);
+    current = temp;
+  }
+
+  free(server_info->chat_users); // Freeing the linked list
+  secret_wipe(&server_info->secret_word); // Wiping secret word
+  clear_questions(server_info);
+  free(server_info->questions);
+  scoreboard_destroy(&server_info->scoreboard); // Freeing the scoreboard
+
+  // Players' threads may have been checking guesses against any round until they ended.
+  while (server_info->last_round != NULL) {
+    guess_round_t* prev = server_info->last_round->prev;
+    free(server_info->last_round);
+    server_info->last_round = prev;
+  }
+  free(server_info);
+  atomic_fetch_sub(&num_rooms, 1);
+}
+
+/*******************
+ * Room Pools
+ *******************/
+// With several listeners, each listener's accepting thread is pinned to a core, and it has its 
+// own pool of room workers. A game runs in the pool of the listener that accepted its first 
+// player (the first host), so the work of the listeners' connections stays apart. Players of 
+// every listener still wait in the same lobby, so nobody waits for others to happen to connect 
+// through the same listener.
+
+/**
+ * Remember which listener's room pool a new connection's games run in.
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ * \param index The index of the room pool
+ */
+void set_room_pool(int socket_fd, int index) {
+  if (socket_fd >= 0 && (size_t)socket_fd < max_room_pool_fds) {
+    room_pool_by_fd[socket_fd] = index;
+  }
+}
+
+/**
+ * Get the room pool of the listener that accepted a connection.
+ * 
+ * \param socket_fd The socket file descriptor of the connection
+ * 
+ * \returns The room pool
+ */
+worker_pool_t* get_room_pool(int socket_fd) {
+  if (socket_fd < 0 || (size_t)socket_fd >= max_room_pool_fds) {
+    return &room_pools[0];
+  }
+  return &room_pools[room_pool_by_fd[socket_fd]];
+}
+
+/**
+ * Start a game for players the lobby matched into a room, on the room's actor.
+ * 
+ * \param socket_fds The socket file descriptors of the players
+ * \param num_players The number of players
+ */
+void match_players(int* socket_fds, size_t num_players) {
+  trace_name_thread(traced.matchmaker);
+  post_event(create_room(socket_fds, num_players, get_room_pool(socket_fds[0])), 
+             create_event(EVENT_START));
+}
+
+/*******************
+ * Held Seats
+ *******************/
+// A player with a session whose connection drops keeps their seat (and score) for a while, and 
+// can take it back by connecting again and sending the token they were given. Their old socket 
+// stays open until then, so its file descriptor keeps naming the player in the room.
+
+/**
+ * Hold the seat of a player whose connection dropped. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ */
+void hold_seat(server_info_t* server_info, user_node_t* player) {
+  player->is_away = true;
+  player->away_deadline = now_ticks() + resume_grace_ms / TIMER_TICK_MS;
+  arm_away_timer(server_info);
+
+  char name_buf[32];
+  char message[MAX_MESSAGE_LENGTH];
+  snprintf(message, sizeof(message), "%s lost their connection. Their seat is held for %d "
+           "seconds.", get_display_name(player, name_buf, sizeof(name_buf)), 
+           resume_grace_ms / 1000);
+  if (broadcast_server_message(server_info, message) == -1) {
+    log_send_failure();
+  }
+
+  // The player's turn (if it is theirs) ends on the next tick.
+  if (get_waited_on_player(server_info) == player) {
+    arm_turn_timer(server_info);
+  }
+}
+
+/**
+ * Give up the seats of players that didn't come back in time. Runs on the room's actor.
+ * 
+ * \param server_info The room whose away timer expired
+ */
+void give_up_seats(server_info_t* server_info) {
+  uint64_t now = now_ticks();
+  bool is_room_empty = false;
+  user_node_t* current = server_info->chat_users->first_user;
+  while (current != NULL) {
+    if (!current->is_away || current->away_deadline > now) {
+      current = current->next;
+      continue;
+    }
+
+    if (!server_info->end_game) {
+      char name_buf[32];
+      char message[MAX_MESSAGE_LENGTH];
+      snprintf(message, sizeof(message), "%s didn't come back in time, so they left the game.", 
+               get_display_name(current, name_buf, sizeof(name_buf)));
+      if (broadcast_server_message(server_info, message) == -1) {
+        log_send_failure();
+      }
+    }
+
+    // Dropping the player frees their node, so start over from the first player.
+    int socket_fd = current->socket_fd;
+    is_room_empty = drop_user(server_info, socket_fd);
+    close_connection(socket_fd);
+    current = server_info->chat_users->first_user;
+  }
+
+  if (!is_room_empty) {
+    arm_away_timer(server_info);
+  } else {
+    release_room(server_info);
+  }
+}
+
+/**
+ * Bring a player that took their seat back up to date with a snapshot of the game. Runs on the 
+ * room's actor.
+ * 
+ * \param server_info The room of the game
+ * \param player The player
+ * 
+ * \returns Non-zero value if an error occurs
+ */
+int send_snapshot(server_info_t* server_info, user_node_t* player) {
+  snapshot_t snapshot;
+  if (server_info->is_receiving_secret_word) {
+    snapshot.phase = PHASE_PICKING;
+  } else if (server_info->is_guessing) {
+    snapshot.phase = PHASE_GUESSING;
+  } else if (server_info->is_question_pending) {
+    snapshot.phase = PHASE_ANSWERING;
+  } else {
+    snapshot.phase = PHASE_ASKING;
+  }
+
+  // The snapshot says what the game expects, like a turn would.
+  player->turn = expected_opcode(server_info, player);
+  snapshot.turn = player->turn;
+  snapshot.host_id = server_info->curr_host->player_id;
+  snapshot.asker_id = server_info->curr_asker->player_id;
+  snapshot.num_questions = server_info->curr_question;
+  snapshot.max_questions = server_info->max_questions;
+
+  // Only the host knows the secret word.
+  snapshot.secret_word = NULL;
+  if (player == server_info->curr_host && !server_info->is_receiving_secret_word) {
+    snapshot.secret_word = server_info->secret_word.word;
+  }
+
+  // Players are listed in turn order.
+  int num_users = server_info->chat_users->numUsers;
+  snapshot.players = malloc(sizeof(snapshot_player_t) * num_users);
+  char (*name_bufs)[32] = malloc(sizeof(*name_bufs) * num_users);
+  snapshot.num_players = 0;
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    snapshot_player_t* snapshot_player = &snapshot.players[snapshot.num_players];
+    snapshot_player->player_id = current->player_id;
+    snapshot_player->score = current->standing.score;
+    snapshot_player->is_away = current->is_away;
+    snapshot_player->name = get_display_name(current, name_bufs[snapshot.num_players], 
+                                             sizeof(name_bufs[0]));
+    snapshot.num_players++;
+  }
+
+  snapshot.history = malloc(sizeof(snapshot_exchange_t) * 
+                            (server_info->num_questions > 0 ? server_info->num_questions : 1));
+  snapshot.num_history = server_info->num_questions;
+  for (int i = 0; i < server_info->num_questions; i++) {
+    snapshot.history[i].asker_id = server_info->questions[i].asker_id;
+    snapshot.history[i].question = server_info->questions[i].question;
+    snapshot.history[i].answer = server_info->questions[i].answer;
+  }
+
+  int rc = session_send_snapshot(player->socket_fd, &snapshot);
+  free(snapshot.players);
+  free(name_bufs);
+  free(snapshot.history);
+  return rc;
+}
+
+/**
+ * Tell a player who asked for a seat that isn't held anymore (or was never issued) that it is 
+ * gone, and disconnect them.
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ */
+void turn_down_resume(int socket_fd) {
+  if (send_server_message(socket_fd, "Your seat is no longer held. Connect again to play a new "
+                                     "game.") == -1) {
+    log_send_failure();
+  }
+  close_connection(socket_fd);
+}
+
+/**
+ * Move a player's new connection into their seat in place of the stale one, which is closed, and 
+ * send the player a snapshot of the game. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player, whose thread (if any) has stopped
+ * \param socket_fd The socket file descriptor of the new connection
+ */
+void move_into_seat(server_info_t* server_info, user_node_t* player, int socket_fd) {
+  close_connection(player->socket_fd);
+  player->socket_fd = socket_fd;
+  player->is_away = false;
+  player->away_deadline = 0;
+  atomic_store(&player->last_heard, now_ticks());
+  arm_away_timer(server_info);
+
+  // If the new connection drops as well, the player's thread finds out and holds the seat again.
+  if (session_accept(socket_fd, player->player_id) == -1 || 
+      send_snapshot(server_info, player) == -1) {
+    log_send_failure();
+  }
+
+  char name_buf[32];
+  char message[MAX_MESSAGE_LENGTH];
+  snprintf(message, sizeof(message), "%s is back in the game.", 
+           get_display_name(player, name_buf, sizeof(name_buf)));
+  if (broadcast_server_message(server_info, message) == -1) {
+    log_send_failure();
+  }
+
+  start_player_thread(server_info, player);
+}
+
+/**
+ * Give a player that connected again their seat back: the new connection takes the place of the 
+ * one that dropped, and the player gets a snapshot of the game. The token proves who the player 
+ * is, so the seat doesn't need to be held yet: a connection that dropped without the server 
+ * noticing (like a half-open one) is shut down, and the seat is taken back once the player's thread 
+ * has stopped reading from it. A player whose seat was given up meanwhile is told so and 
+ * disconnected. Runs on the room's actor.
+ * 
+ * \param server_info The room the token was issued for
+ * \param socket_fd The socket file descriptor of the new connection
+ * \param token The token the player sent
+ */
+void take_back_seat(server_info_t* server_info, int socket_fd, uint64_t token) {
+  user_node_t* player = server_info->chat_users->first_user;
+  while (player != NULL && player->token != token) {
+    player = player->next;
+  }
+
+  // A seat can only be taken while the game is still on, and by one connection at a time (so 
+  // nobody plays it twice).
+  if (player == NULL || player->resume_fd != -1 || server_info->end_game) {
+    turn_down_resume(socket_fd);
+    return;
+  }
+
+  if (!player->is_away) {
+    // The player's thread posts the stale connection's end, and handle_frame moves this one in.
+    player->resume_fd = socket_fd;
+    shutdown(player->socket_fd, SHUT_RDWR);
+    return;
+  }
+
+  move_into_seat(server_info, player, socket_fd);
+}
+
+/**
+ * Hand a new connection that asked for a seat back to the actor of the room the token was issued 
+ * for. A player whose token isn't known (anymore) is told so and disconnected.
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ * \param token The token the player sent
+ */
+void resume_seat(int socket_fd, uint64_t token) {
+  // A token is only in the map while its player is in the room, so the room can't be freed 
+  // before this reference is taken.
+  profiled_mutex_lock(&seat_tokens_lock);
+  server_info_t* server_info = token_map_get(&seat_tokens, token);
+  if (server_info != NULL) {
+    atomic_fetch_add(&server_info->refs, 1);
+  }
+  profiled_mutex_unlock(&seat_tokens_lock);
+
+  if (server_info == NULL) {
+    turn_down_resume(socket_fd);
+    return;
+  }
+
+  room_event_t* event = create_event(EVENT_RESUME);
+  event->socket_fd = socket_fd;
+  event->token = token;
+  post_event(server_info, event);
+  release_room(server_info);
+}
+
+/*******************
+ * Heartbeats
+ *******************/
+// Clients with a session are pinged every ping interval, and answer on their own. A client that 
+// hasn't been heard from for the dead peer timeout is disconnected, since its connection is dead 
+// even if the kernel hasn't noticed: the player's thread then releases their seat (or holds it) 
+// and their turn. Clients without pings are covered by TCP keepalives.
+
+/**
+ * Ping the players' clients, and disconnect the ones that have been silent for too long. Runs on 
+ * the room's actor.
+ * 
+ * \param server_info The room whose heartbeat timer expired
+ */
+void check_heartbeats(server_info_t* server_info) {
+  // Nobody needs to be checked on once the game is over.
+  if (server_info->end_game || server_info->chat_users->numUsers == 0) {
+    return;
+  }
+
+  uint64_t now = now_ticks();
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    if (current->is_away || !session_can_ping(current->socket_fd)) {
+      continue;
+    }
+
+    // Wake the player's thread, which finds the connection ended.
+    if (dead_peer_ms > 0 && 
+        now - atomic_load(&current->last_heard) >= (uint64_t)dead_peer_ms / TIMER_TICK_MS) {
+      shutdown(current->socket_fd, SHUT_RDWR);
+      continue;
+    }
+
+    if (session_send_ping(current->socket_fd) == -1) {
+      log_send_failure();
+    }
+  }
+
+  arm_heartbeat_timer(server_info);
+}
+
+/*******************
+ * Admission Control
+ *******************/
+// Every new player makes the server do more work for everyone, so once it is overloaded, new 
+// connections are turned away right after they are accepted, before they cost a welcome or a seat. 
+// Players already in a game keep playing, and even one who is reconnecting gets turned away (but 
+// keeps retrying within the resume grace). The server counts as overloaded while any of these is 
+// over its limit:
+//   - The lag of the timer threads, which wake up late when the CPUs or the rooms are too busy.
+//   - The sockets being written to, which pile up when clients can't keep up with what is sent.
+//   - The rooms, which is the number of games the server is meant to handle at once.
+
+/**
+ * Check whether the server is too busy to take another player.
+ * 
+ * \returns What is over its limit, or NULL if the server can take another player
+ */
+const char* get_overload() {
+  if (max_timer_lag_ms > 0 && get_timer_lag_ms() >= (uint64_t)max_timer_lag_ms) {
+    return "timer lag";
+  }
+
+  if (max_sends_in_progress > 0 && 
+      message_io_sends_in_progress() >= (size_t)max_sends_in_progress) {
+    return "sends in progress";
+  }
+
+  if (max_rooms > 0 && atomic_load(&num_rooms) >= max_rooms) {
+    return "rooms";
+  }
+
+  if (max_memory > 0 && metrics_read(metrics_segment, METRIC_MEMORY) >= max_memory) {
+    return "memory";
+  }
+
+  return NULL;
+}
+
+/**
+ * Tell a new connection that the server is busy, and close it. The message was encoded when the 
+ * server started, and is sent with a single write that never blocks (a client that can't take it 
+ * right away doesn't get it).
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ */
+void turn_away(int socket_fd) {
+  metrics_add(METRIC_CONNECTIONS_TURNED_AWAY, 1);
+  send(socket_fd, busy_frame->bytes, busy_frame->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  // Closing a socket with unread data resets the connection, which can throw away the message 
+  // before the client reads it. Clients send their hello right after they connect, so read 
+  // whatever already arrived.
+  char discard[256];
+  while (recv(socket_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+  }
+
+  close_connection(socket_fd);
+}
+
+/**
+ * Decide whether to admit a new connection, turning it away if the server is overloaded. Prints 
+ * when the server starts and stops turning players away.
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ * 
+ * \returns true if the connection was admitted
+ */
+bool admit_connection(int socket_fd) {
+  const char* overload = get_overload();
+  if (overload == NULL) {
+    if (atomic_exchange(&is_shedding, false)) {
+      log_info("Server no longer overloaded, admitting new players");
+    }
+    return true;
+  }
+
+  if (!atomic_exchange(&is_shedding, true)) {
+    log_warn("Server overloaded (%s), turning new players away", overload);
+  }
+  turn_away(socket_fd);
+  return false;
+}
+
+/*******************
+ * Message Handlers
+ *******************/
+// Each handler acts on one kind of message from a player. Messages are only handed to the handler 
+// for their opcode when the game expects that kind of message from the player; anything else is 
+// handled as out of turn. Runs on the room's actor.
+
+typedef void (*message_handler_t)(server_info_t* server_info, user_node_t* player, 
+                                  message_frame_t* frame);
+
+/**
+ * Save the host's secret word, which starts the round's questions.
+ * 
+ * \param server_info The room of the game
+ * \param player The host
+ * \param frame The secret word
+ */
+void handle_secret(server_info_t* server_info, user_node_t* player, message_frame_t* frame) {
+  (void) player;
+
+  if (secret_set(&server_info->secret_word, frame->message, frame->message_len) == -1) {
+    // The host is still picking, and can send the word again.
+    log_perror("Failed to store the secret word");
+    return;
+  }
+  server_info->is_receiving_secret_word = false;
+  server_info->num_rounds++;
+  server_info->word_picked_us = now_us();
+  server_info->num_round_guesses = 0;
+
+  // The asker is up next.
+  arm_turn_timer(server_info);
+}
+
+/**
+ * Forward the asker's question to everyone.
+ * 
+ * \param server_info The room of the game
+ * \param player The asker
+ * \param frame The question
+ */
+void handle_question(server_info_t* server_info, user_node_t* player, message_frame_t* frame) {
+  int rc = relay_frame(server_info, player, frame, OP_QUESTION);
+  if (rc == -1) {
+    log_send_failure();
+  }
+
+  // Remember the question for players that come back during the round.
+  if (server_info->num_questions < server_info->max_questions) {
+    asked_question_t* asked = &server_info->questions[server_info->num_questions++];
+    asked->asker_id = player->player_id;
+    asked->question = strndup(frame->message, frame->message_len);
+    asked->answer = NULL;
+  }
+
+  // The asker has asked, so the host is up next.
+  server_info->is_question_pending = true;
+  arm_turn_timer(server_info);
+}
+
+/**
+ * Forward the host's answer to everyone. Once the host has answered the question with a yes or a
+ * no, the next player asks (or everyone guesses, after the last question).
+ * 
+ * \param server_info The room of the game
+ * \param player The host
+ * \param frame The answer
+ */
+void handle_answer(server_info_t* server_info, user_node_t* player, message_frame_t* frame) {
+  int rc = relay_frame(server_info, player, frame, OP_ANSWER);
+  if (rc == -1) {
+    log_send_failure();
+  }
+
+  // NOTE: The current host should always be sending a Y/N answer.
+  if (!frame_message_equals(frame, "yes", true) && !frame_message_equals(frame, "no", true)) {
+    return;
+  }
+
+  // The host may answer before the question arrives, so an answered question keeps its answer.
+  if (server_info->num_questions > 0 &&
+      server_info->questions[server_info->num_questions - 1].answer == NULL) {
+    asked_question_t* asked = &server_info->questions[server_info->num_questions - 1];
+    asked->answer = strndup(frame->message, frame->message_len);
+  }
+
+  // Update the number of questions the host has answered.
+  server_info->curr_question++;
+  server_info->is_question_pending = false;
+
+  // Update the current asker, who is up next.
+  update_asker(server_info);
+  arm_turn_timer(server_info);
+
+  // If all questions in a round have been answered, proceed to guessing the secret word.
+  if (server_info->curr_question == server_info->max_questions) {
+    start_guessing_phase(server_info);
+  }
+}
+
+/**
+ * Tell a player that tries to send a message when it's not their turn to wait.
+ * 
+ * \param server_info The room of the game
+ * \param player The player
+ * \param frame The message
+ */
+void handle_out_of_turn(server_info_t* server_info, user_node_t* player, message_frame_t* frame) {
+  (void) frame;
+
+  // Players are only told to wait while questions are being asked.
+  if (server_info->is_receiving_secret_word || server_info->is_guessing || 
+      server_info->end_game) {
+    return;
+  }
+
+  int rc = send_server_message(player->socket_fd, "It is not your turn yet. Please wait.");
+  if (rc == -1) {
+    log_send_failure();
+  }
+}
+
+// The handler of every opcode the game can expect from a player. Guesses are validated by 
+// validate_guesses instead, since their player's thread already checked them.
+message_handler_t message_handlers[NUM_OPCODES] = {
+    [OP_SECRET] = handle_secret,
+    [OP_QUESTION] = handle_question,
+    [OP_ANSWER] = handle_answer,
+    [OP_CHAT] = handle_out_of_turn,
+};
+
+/*******************
+ * Room Actors
+ *******************/
+// Every room runs as an actor: the players' threads, the timer threads, and the connections taking 
+// a seat back only post events to the room's mailbox, and the room's events are handled one at a 
+// time by whichever room worker is running the room. A room is queued for the workers when its 
+// first event arrives, and stays with that worker until its mailbox is empty, so the game state 
+// is only ever touched by one thread at a time and needs no lock. Rooms with events wait in the 
+// pool's queue, which any idle worker takes the next room from.
+
+/**
+ * Create an event for a room, with every field but the kind unset.
+ * 
+ * \param kind What happened
+ * 
+ * \returns The event, which is freed once it has been handled
+ */
+room_event_t* create_event(room_event_kind_t kind) {
+  room_event_t* event = calloc(1, sizeof(room_event_t));
+  event->kind = kind;
+  return event;
+}
+
+/**
+ * Post an event to a room, and queue the room's actor for a room worker unless it is queued or 
+ * running already. Any thread can post an event, but the caller must keep the room alive until 
+ * this returns. The event keeps the room alive until it has been handled.
+ * 
+ * \param server_info The room
+ * \param event The event (freed once it has been handled)
+ */
+void post_event(server_info_t* server_info, room_event_t* event) {
+  atomic_fetch_add(&server_info->refs, 1);
+  mailbox_post(&server_info->mailbox, &event->node);
+
+  // Only the poster that finds the actor idle queues it, with a reference for the run.
+  if (!atomic_exchange(&server_info->is_scheduled, true)) {
+    atomic_fetch_add(&server_info->refs, 1);
+    pool_submit(server_info->room_pool, server_info);
+  }
+}
+
+/**
+ * Hand an event to the function that handles its kind. Runs on the room's actor.
+ * 
+ * \param server_info The room
+ * \param event The event
+ */
+void handle_event(server_info_t* server_info, room_event_t* event) {
+  switch (event->kind) {
+    case EVENT_START:
+      start_game(server_info);
+      break;
+    case EVENT_FRAME:
+      // The player may be freed while the frame is handled.
+      atomic_fetch_sub(&event->player->queued_bytes, event->queued_bytes);
+      metrics_add(METRIC_QUEUED_BYTES, -(int64_t)event->queued_bytes);
+      handle_frame(server_info, event->player, event->frame, event->correct_guess);
+      break;
+    case EVENT_RESUME:
+      take_back_seat(server_info, event->socket_fd, event->token);
+      break;
+    case EVENT_TURN_TIMEOUT:
+      handle_turn_timeout(server_info, event->deadline);
+      break;
+    case EVENT_AWAY_TIMEOUT:
+      give_up_seats(server_info);
+      break;
+    case EVENT_HEARTBEAT:
+      check_heartbeats(server_info);
+      break;
+  }
+}
+
+/**
+ * Find the phase a room's game is in. Runs on the room's actor.
+ * 
+ * \param server_info The room
+ * 
+ * \returns The phase
+ */
+room_phase_t get_room_phase(server_info_t* server_info) {
+  if (server_info->end_game) {
+    return ROOM_ENDING;
+  } else if (server_info->curr_host == NULL) {
+    return ROOM_STARTING;
+  } else if (server_info->is_receiving_secret_word) {
+    return ROOM_PICKING;
+  } else if (server_info->is_guessing) {
+    return ROOM_GUESSING;
+  } else if (server_info->is_question_pending) {
+    return ROOM_ANSWERING;
+  }
+  return ROOM_ASKING;
+}
+
+/**
+ * Publish a room's phase and number of players in the metrics, if they changed. Runs on the 
+ * room's actor.
+ * 
+ * \param server_info The room
+ */
+void publish_room(server_info_t* server_info) {
+  room_phase_t phase = get_room_phase(server_info);
+  int num_players = server_info->chat_users->numUsers;
+  if ((int) phase == server_info->published_phase && 
+      num_players == server_info->published_players) {
+    return;
+  }
+
+  if (server_info->published_phase == -1) {
+    server_info->metrics_entry = metrics_add_room(server_info->id);
+  } else {
+    metrics_add(METRIC_ROOMS_IN_PHASE + server_info->published_phase, -1);
+  }
+  metrics_add(METRIC_ROOMS_IN_PHASE + phase, 1);
+  metrics_add(METRIC_PLAYERS, num_players - server_info->published_players);
+  if (server_info->metrics_entry != -1) {
+    metrics_update_room(server_info->metrics_entry, phase, num_players);
+  }
+  server_info->published_phase = phase;
+  server_info->published_players = num_players;
+}
+
+/**
+ * Take a room that is being freed out of the metrics.
+ * 
+ * \param server_info The room
+ */
+void unpublish_room(server_info_t* server_info) {
+  if (server_info->published_phase == -1) {
+    return;
+  }
+
+  metrics_add(METRIC_ROOMS_IN_PHASE + server_info->published_phase, -1);
+  metrics_add(METRIC_PLAYERS, -server_info->published_players);
+  if (server_info->metrics_entry != -1) {
+    metrics_remove_room(server_info->metrics_entry);
+  }
+}
+
+/**
+ * Run a room's actor: handle the events in the room's mailbox, in order, until it is empty. Runs 
+ * on a room worker.
+ * 
+ * \param args The room (with the reference taken when it was queued)
+ */
+void run_room(void* args) {
+  server_info_t* server_info = (server_info_t*) args;
+  trace_name_thread(traced.room_worker);
+
+  while (true) {
+    // Every player gets what the events sent them in as few writes as possible, and before the 
+    // room can move to another worker.
+    cork_output();
+    mailbox_node_t* node;
+    while ((node = mailbox_take(&server_info->mailbox)) != NULL) {
+      room_event_t* event = (room_event_t*) node;
+      trace_event(traced.room_event, TRACE_BEGIN, server_info->id, event->kind);
+      if (event->trace_flow != 0) {
+        trace_event(traced.frame, TRACE_FLOW_END, event->trace_flow, 0);
+      }
+      handle_event(server_info, event);
+      trace_event(traced.room_event, TRACE_END, 0, 0);
+      if (event->handled != NULL) {
+        sem_post(event->handled);
+      }
+      free(event);
+      release_room(server_info);
+    }
+    uncork_output();
+    publish_room(server_info);
+
+    // An event posted after the last take found the actor still queued, so it is handled here 
+    // unless its poster (or a later one) queues the actor again first.
+    atomic_store(&server_info->is_scheduled, false);
+    if (mailbox_is_empty(&server_info->mailbox) || 
+        atomic_exchange(&server_info->is_scheduled, true)) {
+      break;
+    }
+  }
+
+  release_room(server_info);
+}
+
+/*******************
+ * Stoppable Threads
+ *******************/
+// Before the server can be handed over to a new process, every thread that waits on a socket or 
+// the clock (and could change the game once its wait ends) has to stop. Each stops at a point 
+// where it has nothing half-done: the accepting threads and players' threads stop between 
+// connections and frames, and the timer threads between timers. A thread that is blocked in a 
+// system call is woken up by a signal, which is sent again until the thread has stopped, since 
+// it may arrive just before the thread starts waiting.
+
+/**
+ * Does nothing, but interrupts the system call the signaled thread is blocked in.
+ */
+void wake_for_handoff(int signal) {
+  (void) signal;
+}
+
+/**
+ * Add a thread to the threads a hot restart stops.
+ * 
+ * \param stoppable The thread (which stays in the list until it is forgotten)
+ */
+void watch_thread(stoppable_thread_t* stoppable) {
+  atomic_store(&stoppable->is_stopped, false);
+  stoppable->prev = NULL;
+  stoppable->next = stoppable_threads;
+  if (stoppable_threads != NULL) {
+    stoppable_threads->prev = stoppable;
+  }
+  stoppable_threads = stoppable;
+}
+
+/**
+ * Start a detached thread that a hot restart has to stop. It is added to the stoppable threads 
+ * before it starts, so no handoff can miss it.
+ * 
+ * \param stoppable Set to the new thread (which must stay valid until the thread is forgotten)
+ * \param run The thread's function
+ * \param args The argument of the thread's function
+ */
+void start_stoppable_thread(stoppable_thread_t* stoppable, void* (*run)(void*), void* args) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  // A stack is cached for the next thread once its thread exits, so with a player thread per 
+  // connection the default size would keep megabytes around for connections that are long gone.
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+  profiled_mutex_lock(&stoppable_threads_lock);
+  pthread_create(&stoppable->thread, &attr, run, args);
+  watch_thread(stoppable);
+  profiled_mutex_unlock(&stoppable_threads_lock);
+  pthread_attr_destroy(&attr);
+}
+
+/**
+ * Add the calling thread to the stoppable threads.
+ * 
+ * \param stoppable Set to the calling thread
+ */
+void watch_current_thread(stoppable_thread_t* stoppable) {
+  profiled_mutex_lock(&stoppable_threads_lock);
+  stoppable->thread = pthread_self();
+  watch_thread(stoppable);
+  profiled_mutex_unlock(&stoppable_threads_lock);
+}
+
+/**
+ * Remove a thread that is about to end from the stoppable threads. Runs on the thread itself.
+ * 
+ * \param stoppable The thread
+ */
+void forget_stoppable_thread(stoppable_thread_t* stoppable) {
+  profiled_mutex_lock(&stoppable_threads_lock);
+  if (stoppable->prev != NULL) {
+    stoppable->prev->next = stoppable->next;
+  } else {
+    stoppable_threads = stoppable->next;
+  }
+  if (stoppable->next != NULL) {
+    stoppable->next->prev = stoppable->prev;
+  }
+  profiled_mutex_unlock(&stoppable_threads_lock);
+}
+
+/**
+ * Stop the calling thread until the handoff to a new process is over. Only returns if the 
+ * handoff failed, since the process exits otherwise.
+ * 
+ * \param stoppable The calling thread
+ */
+void stop_for_handoff(stoppable_thread_t* stoppable) {
+  // Stopping doesn't take the lock of the stoppable threads, which stop_threads holds while it 
+  // signals them.
+  atomic_store(&stoppable->is_stopped, true);
+
+  profiled_mutex_lock(&handoff_lock);
+  while (atomic_load(&is_handing_off)) {
+    profiled_cond_wait(&handoff_failed, &handoff_lock);
+  }
+  profiled_mutex_unlock(&handoff_lock);
+  atomic_store(&stoppable->is_stopped, false);
+}
+
+/**
+ * Wait until every stoppable thread has stopped, signaling the ones that haven't. Must be called 
+ * while a handoff is under way.
+ */
+void stop_threads() {
+  profiled_mutex_lock(&stoppable_threads_lock);
+  while (true) {
+    bool is_every_thread_stopped = true;
+    for (stoppable_thread_t* current = stoppable_threads; current != NULL; 
+         current = current->next) {
+      if (!atomic_load(&current->is_stopped)) {
+        is_every_thread_stopped = false;
+        pthread_kill(current->thread, HANDOFF_SIGNAL);
+      }
+    }
+
+    if (is_every_thread_stopped) {
+      break;
+    }
+
+    profiled_mutex_unlock(&stoppable_threads_lock);
+    usleep(HANDOFF_SIGNAL_INTERVAL_US);
+    profiled_mutex_lock(&stoppable_threads_lock);
+  }
+  profiled_mutex_unlock(&stoppable_threads_lock);
+}
+
+/**
+ * Let the stoppable threads go on, after a handoff failed.
+ */
+void resume_threads() {
+  profiled_mutex_lock(&handoff_lock);
+  atomic_store(&is_handing_off, false);
+  pthread_cond_broadcast(&handoff_failed);
+  profiled_mutex_unlock(&handoff_lock);
+}
+
+/**
+ * Start the thread that receives a player's messages and posts them to the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ */
+void start_player_thread(server_info_t* server_info, user_node_t* player) {
+  player_thread_args_t* thread_args = malloc(sizeof(player_thread_args_t));
+  thread_args->server_info = server_info;
+  thread_args->player = player;
+
+  start_stoppable_thread(&thread_args->stoppable, forward_msg, thread_args);
+}
+
+/********************************************
+ * Thread Worker Functions (Core Functions)
+ *******************************************/
+
+/**
+ * Start the game by picking the first connected user to be the host, asking the host for a secret 
+ * word, picking the first asker (as the player that connected to the game second fastest), and 
+ * creating threads for each player to receive their messages. The host's thread receives the 
+ * secret word, like in every later round. Runs on the room's actor.
+ * 
+ * \param server_info The room to start the game of
+ */
+void start_game(server_info_t* server_info) {
+
+  // Pick the first host to start the game, skipping players that left while in the lobby.
+  while (server_info->chat_users->first_user != NULL) {
+    server_info->curr_host = server_info->chat_users->first_user;
+
+    // Send a message to the first host to pick a secret word.
+    int host_socket_fd = server_info->curr_host->socket_fd;
+    int rc = send_server_message(host_socket_fd, "You are the host. Pick your secret word.");
+    if (rc == 0) {
+      break;
+    }
+
+    log_send_failure();
+    unlink_user(server_info, host_socket_fd);
+    close_connection(host_socket_fd);
+  }
+
+  // Tell non-host players that the game has started and to wait for their turn to ask the host 
+  // a question.
+  user_node_t* curr = server_info->chat_users->first_user;
+  while (curr != NULL) {
+    user_node_t* next = curr->next;
+
+    if (curr != server_info->curr_host) {
+      int rc = send_server_message(curr->socket_fd, "The game has started. Wait for your turn to "
+                                                    "ask a question about the secret word.");
+
+      // The player left while in the lobby.
+      if (rc == -1) {
+        log_send_failure();
+        int socket_fd = curr->socket_fd;
+        unlink_user(server_info, socket_fd);
+        close_connection(socket_fd);
+      }
+    }
+
+    curr = next;
+  }
+
+  // Too many players left, so send whoever is still here back to the lobby to wait for others.
+  if (server_info->chat_users->numUsers < LOBBY_MIN_PLAYERS) {
+    for (curr = server_info->chat_users->first_user; curr != NULL; curr = curr->next) {
+      lobby_enter(&lobby, curr->socket_fd);
+    }
+
+    release_room(server_info);
+    return;
+  }
+
+  // Wait for the secret word before anything else happens, and give the host a deadline for it.
+  server_info->is_receiving_secret_word = true;
+  arm_turn_timer(server_info);
+
+  // Set the first asker (as the next player after the host in the linked list). They are told to 
+  // send a question once the secret word has been picked.
+  server_info->curr_asker = server_info->curr_host->next;
+  server_info->asker_updated = true;
+
+  // Find out about players whose connection died without closing.
+  arm_heartbeat_timer(server_info);
+
+  // Loop through list of players, and create a thread for each so that they can start 
+  // communicating w/ e/o.
+  for (curr = server_info->chat_users->first_user; curr != NULL; curr = curr->next) {
+    start_player_thread(server_info, curr);
+  }
+}
+
+/**
+ * Handle a frame a player's thread received: hand it to the handler for its opcode, and move the 
+ * game on. Runs on the room's actor.
+ * 
+ * \param server_info The room of the player
+ * \param player The player
+ * \param frame The frame (released here), or NULL if the player's connection ended
+ * \param correct_guess The round whose secret word the frame guessed (NULL if it didn't)
+ */
+void handle_frame(server_info_t* server_info, user_node_t* player, message_frame_t* frame, 
+                  guess_round_t* correct_guess) {
+  int user_socket_fd = player->socket_fd;
+
+  if (frame != NULL && frame->kind == FRAME_HELLO) {
+    // The player's client supports sessions, so its username is only sent this once.
+    int rc = start_session(server_info, player, frame);
+    frame_release(frame);
+
+    // The player left, which their thread finds out on its next receive.
+    if (rc == -1) {
+      log_send_failure();
+    }
+    return;
+  }
+
+  if (frame != NULL && frame->kind == FRAME_RESUME) {
+    // The player asked for their old seat back only after they were matched into this room. Their 
+    // thread already stopped reading from the socket.
+    uint64_t token = frame->token;
+    frame_release(frame);
+    if (drop_user(server_info, user_socket_fd)) {
+      release_room(server_info);
+    }
+    resume_seat(user_socket_fd, token);
+    return;
+  }
+
+  // Players without a session send their username with every message.
+  if (frame != NULL && frame->kind == FRAME_LEGACY) {
+    update_player_name(server_info, player, frame);
+  }
+
+  opcode_t opcode = OP_QUIT;
+  if (frame != NULL) {
+    opcode = frame->kind == FRAME_SESSION ? frame->opcode 
+                                          : classify_message(server_info, player, frame);
+  }
+
+  // Remove the user if there's some error when trying to receive a message from it or 
+  // the user is quitting the game.
+  if (opcode == OP_QUIT) {
+    // The stale connection that a new one is taking the seat back from has ended.
+    if (frame == NULL && player->resume_fd != -1) {
+      int resume_fd = player->resume_fd;
+      player->resume_fd = -1;
+      if (!server_info->end_game) {
+        move_into_seat(server_info, player, resume_fd);
+        return;
+      }
+      turn_down_resume(resume_fd);
+    }
+
+    // A player with a token whose connection dropped can still take their seat back.
+    if (frame == NULL && player->token != TOKEN_NONE && !server_info->end_game) {
+      hold_seat(server_info, player);
+      return;
+    }
+
+    frame_release(frame);
+    if (drop_user(server_info, user_socket_fd)) {
+      release_room(server_info);
+    }
+    // Close server's end of the socket.
+    close_connection(user_socket_fd);
+    return;
+  }
+
+  bool was_guessed = server_info->guessed_secret_word;
+
+  // Anything the game doesn't expect from the player right now is out of turn.
+  if (opcode != expected_opcode(server_info, player)) {
+    opcode = OP_CHAT;
+  }
+  if (opcode == OP_GUESS) {
+    validate_guesses(server_info, frame, player, correct_guess);
+  } else {
+    message_handlers[opcode](server_info, player, frame);
+  }
+  frame_release(frame);
+
+  // Do setup for the next round once the secret word has been guessed and there is still a 
+  // player that hasn't been the host yet. Only the frame that guessed it ends the round: guesses
+  // that were already on their way when the last round ended must not end the game again.
+  bool is_round_over = !was_guessed && server_info->guessed_secret_word;
+  if (is_round_over && server_info->curr_host->next != NULL) {
+    // Update the host and first guesser of the next round, and get ready to read in the next
+    // secret word.
+    set_up_for_next_round(server_info);
+    arm_turn_timer(server_info);
+  } else if (is_round_over && server_info->curr_host->next == NULL) { // Done with the game.
+    // Announce the winner of the game, print each player's score privately, and disconenct
+    // everyone at the end.
+    end_game(server_info);
+  }
+
+  // Tell the new asker or host (if any) that it is their turn.
+  announce_turn_changes(server_info);
+}
+
+/**
+ * Receives a player's messages and posts each one to the room's actor. The thread stops after 
+ * posting the player's last frame: once the connection ends, the player quits, or the player asks 
+ * for a seat in another room. The actor frees the player only after handling that frame.
+ * 
+ * \param args The player's room and node in the list of users (freed by this thread)
+ */
+void* forward_msg(void* args) {
+  player_thread_args_t* thread_args = (player_thread_args_t*) args;
+  server_info_t* server_info = thread_args->server_info;
+  user_node_t* player = thread_args->player;
+  int user_socket_fd = player->socket_fd;
+  trace_name_thread(traced.player);
+
+  while (true) {
+    // Read a message from the player. It is kept as it arrived, so it can be forwarded as-is.
+    message_frame_t* frame = receive_frame(user_socket_fd);
+    uint64_t received_us = now_us();
+
+    // A hot restart stops the thread between frames. Nothing of the next frame has been read, so 
+    // whichever process goes on gets all of it.
+    if (frame == NULL && errno == EINTR && atomic_load(&is_handing_off)) {
+      stop_for_handoff(&thread_args->stoppable);
+      continue;
+    }
+
+    // Anything at all shows the connection is alive. Answers to pings are only for that.
+    if (frame != NULL) {
+      atomic_store(&player->last_heard, now_ticks());
+      opcode_t opcode = frame->opcode < NUM_OPCODES ? frame->opcode : 0;
+      metrics_add(METRIC_MESSAGES_RECEIVED + opcode, 1);
+      metrics_add(METRIC_BYTES_RECEIVED + opcode, frame->len);
+    }
+
+    if (frame != NULL && frame->kind == FRAME_SESSION && frame->opcode == OP_PONG) {
+      frame_release(frame);
+      continue;
+    }
+
+    // Quitting doesn't depend on the state of the game, so it is known here without asking the 
+    // actor.
+    bool is_last = frame == NULL || frame->kind == FRAME_RESUME || 
+                   (frame->kind == FRAME_SESSION && frame->opcode == OP_QUIT) || 
+                   (frame->kind == FRAME_LEGACY && frame_message_equals(frame, "quit", false));
+
+    // Whoever receives from the socket next gets whatever was already read ahead.
+    if (frame != NULL && frame->kind == FRAME_RESUME) {
+      message_io_release(user_socket_fd);
+    }
+
+    room_event_t* event = create_event(EVENT_FRAME);
+    event->player = player;
+    event->frame = frame;
+    trace_event(traced.frame, TRACE_BEGIN, server_info->id, user_socket_fd);
+
+    // Guesses are checked right here, in parallel with every other guesser's thread.
+    if (frame != NULL && !is_last) {
+      trace_event(traced.guess, TRACE_BEGIN, server_info->id, user_socket_fd);
+      event->correct_guess = check_guess(server_info, player, frame, received_us);
+      trace_event(traced.guess, TRACE_END, 0, 0);
+    }
+
+    // The flow shows which thread the actor handles the frame on.
+    event->trace_flow = trace_new_flow();
+    trace_event(traced.frame, TRACE_FLOW_START, event->trace_flow, 0);
+
+    // The frame's memory is counted until the actor takes it out of the mailbox.
+    if (frame != NULL) {
+      event->queued_bytes = sizeof(message_frame_t) + frame->len;
+      metrics_add(METRIC_QUEUED_BYTES, event->queued_bytes);
+    }
+    size_t queued_bytes = atomic_fetch_add(&player->queued_bytes, event->queued_bytes) + 
+                          event->queued_bytes;
+    bool is_over_queue = max_queued_bytes > 0 && queued_bytes > max_queued_bytes;
+
+    // Frames that follow an accepted hello are in the session format, so the next one can't be 
+    // received until the actor has handled the hello. A player whose frames pile up faster than 
+    // the actor handles them is also made to wait, which leaves the rest in the socket (and, once 
+    // its buffers are full, in the client).
+    if ((frame != NULL && frame->kind == FRAME_HELLO) || (is_over_queue && !is_last)) {
+      sem_t handled;
+      sem_init(&handled, 0, 0);
+      event->handled = &handled;
+      post_event(server_info, event);
+      trace_event(traced.frame, TRACE_END, 0, 0);
+      while (sem_wait(&handled) == -1 && errno == EINTR) {
+      }
+      sem_destroy(&handled);
+      continue;
+    }
+
+    post_event(server_info, event);
+    trace_event(traced.frame, TRACE_END, 0, 0);
+
+    if (is_last) {
       break;
+    }
+  }
+
+  forget_stoppable_thread(&thread_args->stoppable);
+  free(thread_args);
+  return NULL;
+} 
+
+/*******************
+ * Arrivals
+ *******************/
+// A player whose connection dropped sends a resume as the first frame of their new connection. 
+// New connections are welcomed right away, and then a single thread watches each of them for a 
+// short while before it joins the lobby: one whose first frame is a resume takes its seat back 
+// instead, and every other one joins the lobby once it has sent anything, or its wait is over 
+// (legacy clients only speak when asked to). They join in the order they arrived, which is the 
+// order they take turns in. No welcome worker ever waits on a client. A resume that arrives even 
+// later is handled once the player is in a room (see handle_frame).
+
+/**
+ * Add a new player to the lobby. A thread that can't wait for room in the lobby turns the player 
+ * away instead when the lobby is full, since it would hold up every connection behind them.
+ * 
+ * \param socket_fd The socket file descriptor of the player
+ * \param can_wait Whether the calling thread can wait for room in the lobby
+ */
+void enter_lobby(int socket_fd, bool can_wait) {
+  if (can_wait) {
+    lobby_enter(&lobby, socket_fd);
+  } else if (!lobby_try_enter(&lobby, socket_fd)) {
+    log_warn("Lobby full, turning a new player away");
+    turn_away(socket_fd);
+  }
+}
+
+/**
+ * Watch a new connection that was welcomed for a resume, before it joins the lobby.
+ * 
+ * \param socket_fd The socket file descriptor of the new connection
+ * \param can_wait Whether the caller can wait for room in the lobby, if it joins right away
+ */
+void watch_arrival(int socket_fd, bool can_wait) {
+  arrival_t* arrival = malloc(sizeof(arrival_t));
+  arrival->socket_fd = socket_fd;
+  arrival->deadline = now_ms() + RESUME_WAIT_MS;
+  arrival->is_decided = false;
+  arrival->is_resuming = false;
+  arrival->next = NULL;
+
+  // A hot restart only hands over the players in the lobby, so nothing is watched meanwhile.
+  profiled_mutex_lock(&arrivals_lock);
+  struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = arrival};
+  bool is_watched = !are_arrivals_stopped && 
+                    epoll_ctl(arrivals_epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == 0;
+  if (is_watched) {
+    if (last_arrival != NULL) {
+      last_arrival->next = arrival;
+    } else {
+      first_arrival = arrival;
+    }
+    last_arrival = arrival;
+  }
+  profiled_mutex_unlock(&arrivals_lock);
+
+  if (!is_watched) {
+    free(arrival);
+    enter_lobby(socket_fd, can_wait);
+  }
+}
+
+/**
+ * Stop watching a new connection, and give it the seat its resume asks for, if it sent one. Runs 
+ * on the arrivals thread.
+ * 
+ * \param arrival The new connection
+ */
+void check_arrival(arrival_t* arrival) {
+  epoll_ctl(arrivals_epoll_fd, EPOLL_CTL_DEL, arrival->socket_fd, NULL);
+  arrival->is_decided = true;
+
+  uint64_t token;
+  if (session_take_resume(arrival->socket_fd, 0, &token)) {
+    arrival->is_resuming = true;
+    resume_seat(arrival->socket_fd, token);
+  }
+}
+
+/**
+ * Let the oldest new connections go on, as long as it is known whether they asked for a seat back 
+ * or their wait is over: each joins the lobby, unless it is taking a seat back. Every connection 
+ * waits the same time, so the arrivals are in the order their waits end in. Runs on the arrivals 
+ * thread.
+ * 
+ * \param now The time (in ms), or UINT64_MAX to let every connection go on
+ */
+void let_arrivals_in(uint64_t now) {
+  profiled_mutex_lock(&arrivals_lock);
+  arrival_t* arrival = first_arrival;
+  arrival_t* last_let_in = NULL;
+  while (first_arrival != NULL && (first_arrival->is_decided || first_arrival->deadline <= now)) {
+    last_let_in = first_arrival;
+    first_arrival = first_arrival->next;
+  }
+  if (first_arrival == NULL) {
+    last_arrival = NULL;
+  }
+  profiled_mutex_unlock(&arrivals_lock);
+
+  if (last_let_in == NULL) {
+    return;
+  }
+  last_let_in->next = NULL;
+
+  while (arrival != NULL) {
+    arrival_t* next = arrival->next;
+    if (!arrival->is_decided) {
+      check_arrival(arrival);
+    }
+    if (!arrival->is_resuming) {
+      lobby_enter(&lobby, arrival->socket_fd);
+    }
+    free(arrival);
+    arrival = next;
+  }
+}
+
+/**
+ * Check the new connections that sent something, and let them go on in the order they arrived. 
+ * 
+ * \param args The arrivals thread
+ */
+void* watch_arrivals(void* args) {
+  stoppable_thread_t* stoppable = (stoppable_thread_t*) args;
+  struct epoll_event events[MAX_ARRIVAL_EVENTS];
+
+  while (true) {
+    // A connection that arrives while nothing is watched goes on after at most one more wait.
+    profiled_mutex_lock(&arrivals_lock);
+    int timeout_ms = RESUME_WAIT_MS;
+    if (first_arrival != NULL) {
+      uint64_t now = now_ms();
+      timeout_ms = first_arrival->deadline > now ? first_arrival->deadline - now : 0;
+    }
+    profiled_mutex_unlock(&arrivals_lock);
+
+    int num_events = epoll_wait(arrivals_epoll_fd, events, MAX_ARRIVAL_EVENTS, timeout_ms);
+
+    // A hot restart stops the thread once every connection it watched went on.
+    if (num_events == -1 && errno == EINTR && atomic_load(&is_handing_off)) {
+      profiled_mutex_lock(&arrivals_lock);
+      are_arrivals_stopped = true;
+      profiled_mutex_unlock(&arrivals_lock);
+      let_arrivals_in(UINT64_MAX);
+
+      stop_for_handoff(stoppable);
+      profiled_mutex_lock(&arrivals_lock);
+      are_arrivals_stopped = false;
+      profiled_mutex_unlock(&arrivals_lock);
+      continue;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      check_arrival(events[i].data.ptr);
+    }
+    let_arrivals_in(now_ms());
+  }
+
+  return NULL;
+}
+
+/**
+ * Send welcome message with the game instructions to the new user, then add them to the lobby to 
+ * wait for a room. Runs before the user is in the lobby, so the welcome always reaches the player 
+ * before any game message does.
+ * 
+ * \param client_socket_fd The socket file descriptor of the new user
+ * \param can_wait Whether the calling thread can wait for room in the lobby (an accepting 
+ *                 thread can't)
+ */
+void welcome_player(int client_socket_fd, bool can_wait) {
+  user_info_t* welcome_msg = malloc(sizeof(user_info_t));
+  welcome_msg->username = strdup("Server");
+  welcome_msg->message = strdup("Welcome to the Guessing Secret Word game!\n Each player will "
+    "take turn to be the host and pick a secret word.\n Other players will take turn to ask "
+    "yes/no questions to guess the secret word.\n Whoever makes the most correct guesses will "
+    "be the winner!\n");
+
+  // Send the welcome message to the new user.
+  int rc = send_message(client_socket_fd, welcome_msg);
+
+  free(welcome_msg->username);
+  free(welcome_msg->message);
+  free(welcome_msg);
+
+  // The user already left, so there is no one to add to the game.
+  if (rc == -1) {
+    log_send_failure();
+    close_connection(client_socket_fd);
+    return;
+  }
+
+  // The matchmaker puts the new player in a room once enough players are waiting, unless the 
+  // player is only taking their seat back (see Arrivals).
+  if (resume_grace_ms > 0) {
+    watch_arrival(client_socket_fd, can_wait);
+  } else {
+    enter_lobby(client_socket_fd, can_wait);
+  }
+}
+
+/**
+ * Welcome a new user on a welcome worker thread.
+ * 
+ * \param args The socket file descriptor of the new user (stored in the pointer itself).
+ */
+void welcome(void* args) {
+  trace_name_thread(traced.welcome_worker);
+  welcome_player((int)(intptr_t)args, true);
+}
+
+/**
+ * Check whether a failed accept only affected a single connection (or was due to a temporary 
+ * shortage of resources), so the server should keep accepting.
+ */
+bool is_transient_accept_error(int error) {
+  return error == EINTR || error == ECONNABORTED || error == EPROTO || error == EMFILE || 
+         error == ENFILE || error == ENOBUFS || error == ENOMEM || error == EPERM;
+}
+
+/**
+ * Continuously accept connections from a listening socket and get each new player welcomed.
+ * 
+ * \param args The listener to accept connections from
+ */
+void* accept_connections(void* args) {
+  listener_t* listener = (listener_t*) args;
+
+  // Keep this listener's accepting (and welcoming) on its own core.
+  if (listener->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(listener->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+  }
+  trace_name_thread(traced.listener);
+
+  // Continuously wait for a client to connect.
+  while (true) {
+    // Accept connection from user.
+    int client_socket_fd = server_socket_accept(listener->socket_fd, 
+                                                listener->is_local ? 0 : dead_peer_ms); 
+
+    // Connection was unsuccessful.
+    if (client_socket_fd == -1) {
+      // A hot restart stops the thread between connections.
+      if (errno == EINTR && atomic_load(&is_handing_off)) {
+        stop_for_handoff(&listener->stoppable);
+        continue;
+      }
+
+      log_perror("accept failed");
+
+      if (!is_transient_accept_error(errno)) {
+        exit(EXIT_FAILURE);
+      }
+
+      // Give other connections a chance to close if we ran out of file descriptors.
+      if (errno == EMFILE || errno == ENFILE) {
+        usleep(1000);
+      }
+      continue;
+    }
+
+    log_info("Client connected!");
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    metrics_add(METRIC_CONNECTIONS_OPEN, 1);
+
+    if (!admit_connection(client_socket_fd)) {
+      continue;
+    }
+    set_room_pool(client_socket_fd, listener->room_pool_index);
+
+    if (listener->welcome_inline) {
+      // The kernel already spread connections across listeners, so serve this one right here. 
+      // Nothing may block this thread, or every connection behind this one waits.
+      welcome_player(client_socket_fd, false);
     } else {
-      // Validate the guesses received against the secret word (in guessing round).
-      if (server_info->is_guessing) {
-        validate_guesses(server_info, user_info, user_socket_fd);
-      }
+      // Hand the new user to a welcome worker. The socket fd is passed by value, so the next 
+      // accept can't overwrite it.
+      pool_submit(&welcome_pool, (void*)(intptr_t)client_socket_fd);
+    }
+  }
 
-      // Save the new secret word if the game is currently in the process of starting a new round w/ 
-      // a new host.
-      if (server_info->is_receiving_secret_word) {
-        pthread_mutex_lock(&server_info_global_lock);
-        free(server_info_global->secret_word);
-        server_info_global->secret_word = strdup(user_info->message);
-        pthread_mutex_unlock(&server_info_global_lock);
-      }
+  return NULL;
+}
 
-      user_node_t* current = server_info->chat_users->first_user;
-      pthread_mutex_lock(&server_info_global_lock);
-      // Only don't forward a user's message to all users if the message is the secret word.
-      if (!server_info_global->is_receiving_secret_word && !server_info_global->is_guessing && 
-          ((user_socket_fd == server_info_global->curr_asker->socket_fd) || 
-           (user_socket_fd == server_info_global->curr_host->socket_fd))) {
-        // Forward the message to everyone.
-        while (current != NULL) {
-          int rc = send_message(current->socket_fd, user_info);
-
-          if (rc == -1) {
-            perror("Failed to send message to client");
-            exit(EXIT_FAILURE);
-          }
-
-          current = current->next;
-        }
-      } 
-      
-      // Tell users that try to send messages when it's not their turn to wait.
-      if (!server_info_global->is_receiving_secret_word && !server_info_global->is_guessing && 
-          !server_info_global->end_game) {
-        if ((user_socket_fd != server_info_global->curr_asker->socket_fd) && 
-            (user_socket_fd != server_info_global->curr_host->socket_fd)) {
-          user_info_t* not_turn_msg = malloc(sizeof(user_info_t));
-          not_turn_msg->username = strdup("Server");
-          not_turn_msg->message = strdup("It is not your turn yet. Please wait.");
-
-          int rc = send_message(user_socket_fd, not_turn_msg);
-
-          if (rc == -1) {
-            perror("Failed to send message to client");
-            exit(EXIT_FAILURE);
-          }
-
-          free(not_turn_msg->username);
-          free(not_turn_msg->message);
-          free(not_turn_msg);
-        }
-      }
+/*******************
+ * Hot Restart
+ *******************/
+// A new server process takes over from a running one by connecting to its handoff socket. The old 
+// process stops every thread that could start something new (see Stoppable Threads), lets the 
+// welcome workers, the lobby, and the rooms' actors finish what they were doing, and sends the 
+// new process its listening sockets, the players waiting in the lobby, and every room's game along 
+// with its players' sockets. No connection is ever closed, and whatever a client sent that wasn't 
+// handled yet is still waiting in its socket, so clients only notice a short pause.
 
-      // At this point, the secret word should be received, so reset that state.
-      if (server_info_global->is_receiving_secret_word) {
-        server_info_global->is_receiving_secret_word = false;
-      }
+/**
+ * Write a room's game and its players' sockets to the state handed over. Runs on the handoff 
+ * thread, while no room's actor is running.
+ * 
+ * \param state The state handed over
+ * \param server_info The room
+ */
+void write_room(handoff_buffer_t* state, server_info_t* server_info) {
+  handoff_put_u64(state, server_info->scoreboard.max_score);
+  handoff_put_u64(state, server_info->chat_users->numUsers);
+  for (user_node_t* current = server_info->chat_users->first_user; current != NULL; 
+       current = current->next) {
+    // Only the stale connection is handed over, so one still waiting to move into the seat (when 
+    // the player's thread stopped just before the stale one was shut down) is turned down.
+    if (current->resume_fd != -1) {
+      turn_down_resume(current->resume_fd);
+      current->resume_fd = -1;
+    }
 
-      pthread_mutex_unlock(&server_info_global_lock);
-
-      // Once the current host has answered the question, change the current asker.
-      // NOTE: The current host should always be sending a Y/N answer.
-      if (user_socket_fd == server_info->curr_host->socket_fd &&
-          (strcasecmp(user_info->message, "yes") == 0 || strcasecmp(user_info->message, "no") == 0)) {
-        // Change current asker
-      
-        pthread_mutex_lock(&server_info_global_lock);
-        // Update the number of questions the host has answered.
-        server_info_global->curr_question++;
-
-        // Update the current asker.
-        update_asker();
-        pthread_mutex_unlock(&server_info_global_lock);
-
-        pthread_mutex_lock(&server_info_global_lock);
-        // If all questions in a round have been answered, proceed to guessing the secret word.
-        if (server_info_global->curr_question == server_info_global->max_questions) {
-          server_info_global->is_guessing = true; // It is time for guessing.
-          
-          user_info_t* server_start_guessing_msg = malloc(sizeof(user_info_t));
-          server_start_guessing_msg->username = strdup("Server");
-          server_start_guessing_msg->message = strdup("It is time to make your guess for the "
-                                                      "secret word.");
-
-          user_node_t* current = server_info->chat_users->first_user;
-
-          // Send that message to all non-host players, who can begin making their guess.
-          while (current != NULL) {
-            if (current != server_info->curr_host) {
-              int rc = send_message(current->socket_fd, server_start_guessing_msg);
-
-              if (rc == -1) {
-                perror("Failed to send message to client");
-                exit(EXIT_FAILURE);
-              }
-            }
-
-            current = current->next;
-          }
-
-          free(server_start_guessing_msg->username);
-          free(server_start_guessing_msg->message);
-          free(server_start_guessing_msg);
-        }
-        pthread_mutex_unlock(&server_info_global_lock);
-      }
+    handoff_put_fd(state, current->socket_fd);
+    handoff_put_u64(state, current->player_id);
+    handoff_put_string(state, current->username);
+    handoff_put_u64(state, current->has_session);
+    handoff_put_u64(state, session_version(current->socket_fd));
+    handoff_put_u64(state, current->turn);
+    handoff_put_u64(state, current->token);
+    handoff_put_u64(state, current->is_away);
+    handoff_put_u64(state, current->away_deadline);
+  }
 
-      free(user_info->username);
-      free(user_info->message);
-      free(user_info);
-
-      pthread_mutex_lock(&server_info_global_lock);
-      // Do setup for the next round once the secret word has been guessed and there is still a 
-      // player that hasn't been the host yet.
-      if (server_info_global->guessed_secret_word && 
-          server_info_global->curr_host->next != NULL) {
-        // Update the host and first guesser of the next round, and get ready to read in the next
-        // secret word.
-        set_up_for_next_round();
-      } else if (server_info_global->guessed_secret_word && 
-                 server_info_global->curr_host->next == NULL) { // Done with the game.
-        // Announce the winner of the game, print each player's score privately, and disconenct
-        // everyone at the end.
-        end_game(server_info);
-      }
-      
-      // Every time a player becomes the current asker, tell the player to send a question.
-      if (server_info_global->asker_updated && 
-          (server_info->curr_question < server_info->max_questions) && 
-          !server_info_global->is_receiving_secret_word) {
-        user_info_t* server_start_asking_msg = malloc(sizeof(user_info_t));
-        server_start_asking_msg->username = strdup("Server");
-        server_start_asking_msg->message = strdup("It is your turn to ask the host a Yes/No "
-                                                  "question about the secret word.");
-
-        int rc = send_message(server_info_global->curr_asker->socket_fd, server_start_asking_msg);
-
-        if (rc == -1) {
-          perror("Failed to send message to client");
-          exit(EXIT_FAILURE);
-        }
+  // Players with the same score are ranked by who reached it first, so the whole ranking goes 
+  // along with the scores.
+  score_entry_t** ranking = malloc(sizeof(score_entry_t*) * server_info->chat_users->numUsers);
+  size_t num_ranked = scoreboard_top(&server_info->scoreboard, ranking, 
+                                     server_info->chat_users->numUsers);
+  handoff_put_u64(state, num_ranked);
+  for (size_t i = 0; i < num_ranked; i++) {
+    handoff_put_u64(state, ((user_node_t*) ranking[i]->arg)->player_id);
+    handoff_put_u64(state, ranking[i]->score);
+  }
+  free(ranking);
+
+  handoff_put_u64(state, server_info->curr_host->player_id);
+  handoff_put_u64(state, server_info->curr_asker != NULL ? server_info->curr_asker->player_id 
+                                                         : SESSION_SERVER_ID);
+  handoff_put_string(state, server_info->secret_word.word);
+  handoff_put_u64(state, server_info->curr_question);
+  handoff_put_u64(state, server_info->max_questions);
+  handoff_put_u64(state, server_info->is_receiving_secret_word);
+  handoff_put_u64(state, server_info->guessed_secret_word);
+  handoff_put_u64(state, server_info->asker_updated);
+  handoff_put_u64(state, server_info->host_updated);
+  handoff_put_u64(state, server_info->is_question_pending);
+  handoff_put_u64(state, server_info->turn_deadline);
+
+  guess_round_t* round = atomic_load(&server_info->guess_round);
+  handoff_put_u64(state, round != NULL ? round->opened_us : 0);
+  handoff_put_u64(state, server_info->num_rounds);
+  handoff_put_u64(state, server_info->word_picked_us);
+  handoff_put_u64(state, server_info->num_round_guesses);
+
+  handoff_put_u64(state, server_info->num_questions);
+  for (int i = 0; i < server_info->num_questions; i++) {
+    handoff_put_u64(state, server_info->questions[i].asker_id);
+    handoff_put_string(state, server_info->questions[i].question);
+    handoff_put_string(state, server_info->questions[i].answer);
+  }
+}
+
+/**
+ * Read a room's game from the state handed over, and set it up the way the old process had it. 
+ * The players' threads aren't started yet. Runs on the main thread before anything else runs.
+ * 
+ * \param state The state handed over
+ * \param room_pool The workers the room's actor runs on
+ * 
+ * \returns The room, or NULL if the state isn't valid
+ */
+server_info_t* read_room(handoff_buffer_t* state, worker_pool_t* room_pool) {
+  unsigned int max_score = handoff_get_u64(state);
+  size_t num_players = handoff_get_u64(state);
+  if (!state->is_valid || num_players == 0 || num_players > UINT16_MAX) {
+    return NULL;
+  }
+
+  // Nobody can win more rounds than the room had players when it was created, even if some left.
+  server_info_t* server_info = create_room(NULL, 0, room_pool);
+  scoreboard_destroy(&server_info->scoreboard);
+  scoreboard_init(&server_info->scoreboard, max_score);
+
+  for (size_t i = 0; i < num_players && state->is_valid; i++) {
+    user_node_t* player = add_player_to_list(server_info, handoff_get_fd(state));
+    player->player_id = handoff_get_u64(state);
+    player->username = handoff_get_string(state);
+    player->has_session = handoff_get_u64(state);
+    int version = handoff_get_u64(state);
+    player->turn = handoff_get_u64(state);
+    player->token = handoff_get_u64(state);
+    player->is_away = handoff_get_u64(state);
+    player->away_deadline = handoff_get_u64(state);
+
+    if (version > 0 && session_restore(player->socket_fd, version, player->player_id) == -1) {
+      state->is_valid = false;
+    }
 
-        free(server_start_asking_msg->message);
-        free(server_start_asking_msg->username);
-        free(server_start_asking_msg);
+    if (player->token != TOKEN_NONE) {
+      profiled_mutex_lock(&seat_tokens_lock);
+      token_map_put(&seat_tokens, player->token, server_info);
+      profiled_mutex_unlock(&seat_tokens_lock);
+    }
+  }
 
-        // Reset the state of the asker being updated.
-        server_info_global->asker_updated = false;
-      }
+  // Awarding the points from the leaders down leaves players with the same score in the order 
+  // they reached it.
+  size_t num_ranked = handoff_get_u64(state);
+  for (size_t i = 0; i < num_ranked && state->is_valid; i++) {
+    user_node_t* player = find_player(server_info, handoff_get_u64(state));
+    unsigned int score = handoff_get_u64(state);
+    if (player == NULL || score > max_score) {
+      state->is_valid = false;
+      break;
+    }
 
-      // Every time a player becomes the new host, tell the player to set a secret word.
-      if (server_info_global->host_updated) {
-        user_info_t* server_pick_secret_msg = malloc(sizeof(user_info_t));
-        server_pick_secret_msg->username = strdup("Server");
-        server_pick_secret_msg->message = strdup("You are the host. Pick your secret word.");
+    for (unsigned int point = 0; point < score; point++) {
+      scoreboard_award(&server_info->scoreboard, &player->standing);
+    }
+  }
 
-        int rc = send_message(server_info_global->curr_host->socket_fd, server_pick_secret_msg);
+  server_info->curr_host = find_player(server_info, handoff_get_u64(state));
+  server_info->curr_asker = find_player(server_info, handoff_get_u64(state));
+  char* secret_word = handoff_get_string(state);
+  if (secret_word != NULL) {
+    if (secret_set(&server_info->secret_word, secret_word, strlen(secret_word)) == -1) {
+      state->is_valid = false;
+    }
+    explicit_bzero(secret_word, strlen(secret_word));
+    free(secret_word);
+  }
 
-        if (rc == -1) {
-          perror("Failed to send message to client");
-          exit(EXIT_FAILURE);
-        }
+  server_info->curr_question = handoff_get_u64(state);
+  server_info->max_questions = handoff_get_u64(state);
+  server_info->questions = realloc(server_info->questions, 
+                                   sizeof(asked_question_t) * server_info->max_questions);
+  server_info->is_receiving_secret_word = handoff_get_u64(state);
+  server_info->guessed_secret_word = handoff_get_u64(state);
+  server_info->asker_updated = handoff_get_u64(state);
+  server_info->host_updated = handoff_get_u64(state);
+  server_info->is_question_pending = handoff_get_u64(state);
+
+  // Deadlines are ticks of the monotonic clock, which both processes share.
+  uint64_t turn_deadline = handoff_get_u64(state);
+  if (turn_deadline != 0) {
+    server_info->turn_deadline = start_room_timer(server_info, &server_info->turn_timer, 
+                                                  turn_deadline);
+  }
 
-        free(server_pick_secret_msg->username);
-        free(server_pick_secret_msg->message);
-        free(server_pick_secret_msg);
+  // Guesses are still timed from when the guessing phase opened.
+  uint64_t guessing_opened_us = handoff_get_u64(state);
+  if (guessing_opened_us != 0) {
+    open_guessing(server_info);
+    server_info->last_round->opened_us = guessing_opened_us;
+  }
+  server_info->num_rounds = handoff_get_u64(state);
+  server_info->word_picked_us = handoff_get_u64(state);
+  server_info->num_round_guesses = handoff_get_u64(state);
+
+  int num_questions = handoff_get_u64(state);
+  for (int i = 0; i < num_questions && i < server_info->max_questions && state->is_valid; i++) {
+    asked_question_t* question = &server_info->questions[server_info->num_questions++];
+    question->asker_id = handoff_get_u64(state);
+    question->question = handoff_get_string(state);
+    question->answer = handoff_get_string(state);
+  }
 
-        // Reset the state of the host being updated.
-        server_info_global->host_updated = false;
-      }
-      pthread_mutex_unlock(&server_info_global_lock);
+  if (!state->is_valid || server_info->curr_host == NULL || 
+      num_questions > server_info->max_questions) {
+    return NULL;
+  }
+
+  arm_away_timer(server_info);
+  arm_heartbeat_timer(server_info);
+  return server_info;
+}
+
+/**
+ * Write everything the new process needs to the state handed over. Runs on the handoff thread, 
+ * once nothing else is running.
+ * 
+ * \param state The state handed over
+ * \param args The listening sockets
+ * \param stopped_us When the server stopped
+ * 
+ * \returns The number of rooms handed over
+ */
+size_t write_state(handoff_buffer_t* state, handoff_thread_args_t* args, uint64_t stopped_us) {
+  handoff_put_u64(state, HANDOFF_STATE_VERSION);
+  handoff_put_u64(state, stopped_us);
+  handoff_put_u64(state, args->port);
+  handoff_put_u64(state, args->num_listeners);
+  for (int i = 0; i < args->num_listeners; i++) {
+    handoff_put_fd(state, args->listeners[i].socket_fd);
+  }
+  handoff_put_string(state, args->local_path);
+  if (args->local_path != NULL) {
+    handoff_put_fd(state, args->listeners[args->num_listeners].socket_fd);
+  }
 
-      // Update the local copy to be equal to current state of global game state.
-      server_info = server_info_global;
+  int* waiting_fds;
+  size_t num_waiting = lobby_get_waiting(&lobby, &waiting_fds);
+  handoff_put_u64(state, num_waiting);
+  for (size_t i = 0; i < num_waiting; i++) {
+    handoff_put_fd(state, waiting_fds[i]);
+  }
+  free(waiting_fds);
+
+  // Rooms whose game is over only wait for their players to leave, which they do when this 
+  // process exits.
+  profiled_mutex_lock(&all_rooms_lock);
+  size_t num_handed_over = 0;
+  for (server_info_t* room = all_rooms; room != NULL; room = room->next_room) {
+    if (room->curr_host != NULL && !room->end_game) {
+      num_handed_over++;
     }
   }
 
-  return NULL;
-} 
+  handoff_put_u64(state, num_handed_over);
+  for (server_info_t* room = all_rooms; room != NULL; room = room->next_room) {
+    if (room->curr_host != NULL && !room->end_game) {
+      write_room(state, room);
+    }
+  }
+  profiled_mutex_unlock(&all_rooms_lock);
+
+  return num_handed_over;
+}
 
 /**
- * Send welcome message with the game instructions to the new user.
+ * Hand the server over to the new process at the other end of a channel. Runs on the handoff 
+ * thread. Only returns if the handoff failed, in which case the server goes on as before.
  * 
- * \param args The socket file descriptor of the new user.
+ * \param channel The connection to the new process
+ * \param args The listening sockets
  */
-void* welcome(void* args) {
-  int client_socket_fd = *(int*)args;
+void hand_off(int channel, handoff_thread_args_t* args) {
+  uint64_t stopped_us = now_us();
+  atomic_store(&is_handing_off, true);
+
+  // Stop everything that could start something new, and then let whatever was started finish. 
+  // The rooms' actors can still start players' threads, so those are stopped again at the end.
+  stop_threads();
+  if (!args->listeners[0].welcome_inline) {
+    pool_wait_idle(&welcome_pool);
+  }
+  lobby_pause(&lobby);
+  for (int i = 0; i < num_room_pools; i++) {
+    pool_wait_idle(&room_pools[i]);
+  }
+  stop_threads();
+
+  handoff_buffer_t state;
+  handoff_buffer_init(&state);
+  size_t num_handed_over = write_state(&state, args, stopped_us);
+  if (handoff_send(channel, &state) == 0 && handoff_wait_acknowledged(channel)) {
+    log_info("Handed %zu rooms and %zu connections over to the new server process in %.1f ms", 
+             num_handed_over, state.num_fds - args->num_listeners - (args->local_path != NULL), 
+             (now_us() - stopped_us) / 1000.0);
+
+    // The sockets belong to the new process now, so nothing may be cleaned up (or sent) on the 
+    // way out.
+    analytics_flush();
+    log_flush();
+    _exit(EXIT_SUCCESS);
+  }
 
-  user_info_t* welcome_msg = malloc(sizeof(user_info_t));
-  welcome_msg->username = strdup("Server");
-  welcome_msg->message = strdup("Welcome to the Guessing Secret Word game!\n Each player will "
-    "take turn to be the host and pick a secret word.\n Other players will take turn to ask "
-    "yes/no questions to guess the secret word.\n Whoever makes the most correct guesses will "
-    "be the winner!\n");
+  log_perror("The new server process didn't take over");
+  handoff_buffer_destroy(&state);
+  lobby_resume(&lobby);
+  resume_threads();
+}
 
-  // Send a message to the first host to pick a secret word.
-  int rc = send_message(client_socket_fd, welcome_msg);
+/**
+ * Wait for new server processes to take over, one at a time.
+ * 
+ * \param args The handoff socket and the listening sockets
+ */
+void* wait_for_successor(void* args) {
+  handoff_thread_args_t* handoff_args = (handoff_thread_args_t*) args;
 
-  if (rc == -1) {
-    perror("Failed to send message to client");
+  while (true) {
+    int channel = accept4(handoff_args->socket_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (channel == -1) {
+      log_perror("Failed to accept a new server process");
+      continue;
+    }
+
+    log_info("A new server process is taking over");
+    hand_off(channel, handoff_args);
+    close(channel);
+  }
+
+  return NULL;
+}
+
+/**
+ * Take over from the server process at the other end of a channel: set up its rooms and lobby, 
+ * and let it exit. Every thread of the old process that reads from a socket stopped before the 
+ * state was sent, and the old process exits without resuming them once the state is 
+ * acknowledged, so the players' threads can start without waiting for it to be gone. Runs on the 
+ * main thread before anything else runs.
+ * 
+ * \param channel The connection to the old process
+ * \param state The state it handed over, with the listening sockets already read
+ * \param num_listening The number of listening sockets (TCP and Unix)
+ * \param stopped_us When the old process stopped
+ */
+void take_over(int channel, handoff_buffer_t* state, int num_listening, uint64_t stopped_us) {
+  size_t num_waiting = handoff_get_u64(state);
+  int* waiting_fds = malloc(sizeof(int) * (num_waiting > 0 && state->is_valid ? num_waiting : 1));
+  for (size_t i = 0; i < num_waiting && state->is_valid; i++) {
+    waiting_fds[i] = handoff_get_fd(state);
+  }
+
+  // Which listener accepted a room's first player is long forgotten, so the rooms are spread 
+  // across the room pools.
+  size_t num_handed_over = handoff_get_u64(state);
+  for (size_t i = 0; i < num_handed_over && state->is_valid; i++) {
+    if (read_room(state, &room_pools[i % num_room_pools]) == NULL) {
+      state->is_valid = false;
+    }
+  }
+
+  // The old process goes on if the new one gives up before acknowledging.
+  if (!state->is_valid) {
+    fprintf(stderr, "The server process to take over from sent a state that isn't valid\n");
     exit(EXIT_FAILURE);
   }
+  if (handoff_acknowledge(channel) == -1) {
+    perror("Failed to take over from the server process");
+    exit(EXIT_FAILURE);
+  }
+  close(channel);
+
+  // Players that are away don't have a thread until they take their seat back. No room's actor 
+  // runs yet, so the rooms can be published from here.
+  metrics_add(METRIC_CONNECTIONS_OPEN, state->num_fds - num_listening);
+  profiled_mutex_lock(&all_rooms_lock);
+  for (server_info_t* room = all_rooms; room != NULL; room = room->next_room) {
+    publish_room(room);
+    for (user_node_t* player = room->chat_users->first_user; player != NULL; 
+         player = player->next) {
+      if (!player->is_away) {
+        start_player_thread(room, player);
+      }
+    }
+  }
+  profiled_mutex_unlock(&all_rooms_lock);
 
-  free(welcome_msg->username);
-  free(welcome_msg->message);
-  free(welcome_msg);
+  for (size_t i = 0; i < num_waiting; i++) {
+    lobby_enter(&lobby, waiting_fds[i]);
+  }
+  free(waiting_fds);
+
+  log_info("Took over %zu rooms and %zu connections after a %.1f ms pause", num_handed_over, 
+           state->num_fds - num_listening, (now_us() - stopped_us) / 1000.0);
+}
+
+/*******************
+ * Diagnostics
+ *******************/
+
+/**
+ * Register the types of the events the server traces.
+ */
+void add_trace_types(void) {
+  traced.frame = trace_add_type("frame received", "room", "fd");
+  traced.room_event = trace_add_type("room event", "room", "kind");
+  traced.guess = trace_add_type("check guess", "room", "fd");
+  traced.next_round = trace_add_type("next round", "room", NULL);
+  traced.end_game = trace_add_type("end game", "room", "players");
+  traced.player = trace_add_type("player", NULL, NULL);
+  traced.room_worker = trace_add_type("room worker", NULL, NULL);
+  traced.welcome_worker = trace_add_type("welcome worker", NULL, NULL);
+  traced.matchmaker = trace_add_type("matchmaker", NULL, NULL);
+  traced.listener = trace_add_type("listener", NULL, NULL);
+  traced.timer = trace_add_type("timer", NULL, NULL);
+}
+
+/**
+ * Count a message sent to players in the metrics.
+ * 
+ * \param opcode The message's opcode (0 for a legacy frame)
+ * \param num_messages The number of players it was sent to
+ * \param num_bytes The bytes sent to all of them together
+ */
+void count_sent_message(opcode_t opcode, size_t num_messages, size_t num_bytes) {
+  metrics_add(METRIC_MESSAGES_SENT + opcode, num_messages);
+  metrics_add(METRIC_BYTES_SENT + opcode, num_bytes);
+}
+
+/**
+ * Count memory allocated (or freed) for connections in the metrics.
+ * 
+ * \param num_bytes The bytes allocated, or negative for the bytes freed
+ */
+void count_connection_memory(ssize_t num_bytes) {
+  metrics_add(METRIC_MEMORY, num_bytes);
+}
 
+/**
+ * Write the lock profile and dump the trace each time the process receives DIAGNOSTICS_SIGNAL, and
+ * exit once it receives SIGTERM or SIGINT, after writing the analytics and log still waiting.
+ * 
+ * \param args The signals to wait for (which every other thread blocks).
+ */
+void* report_diagnostics(void* args) {
+  sigset_t* signals = (sigset_t*) args;
+  while (true) {
+    int signal;
+    if (sigwait(signals, &signal) != 0) {
+      continue;
+    }
+
+    // Exiting runs the exit handlers, which write the analytics and log still waiting (and the
+    // profile of a build instrumented for profile-guided optimization).
+    if (signal == SIGTERM || signal == SIGINT) {
+      log_info("Stopping");
+      exit(EXIT_SUCCESS);
+    }
+
+    lock_profile_report(stderr);
+    if (trace_path != NULL) {
+      if (trace_dump(trace_path) == -1) {
+        log_perror("Failed to dump the trace");
+      } else {
+        log_info("Dumped the trace to %s", trace_path);
+      }
+    }
+  }
   return NULL;
 }
 
-int main() {
-  // Open a server socket
-  unsigned short port = 0;
-  int server_socket_fd = server_socket_open(&port);
-  if (server_socket_fd == -1) {
-    perror("Server socket was not opened");
+/**
+ * Start the thread that reports diagnostics. Must be called before any other thread is started, so
+ * that they all leave DIAGNOSTICS_SIGNAL, SIGTERM and SIGINT to it.
+ */
+void start_diagnostics(void) {
+  static sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, DIAGNOSTICS_SIGNAL);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  pthread_t reporter;
+  if (pthread_create(&reporter, NULL, report_diagnostics, &signals) != 0) {
+    perror("Failed to create the diagnostics thread");
     exit(EXIT_FAILURE);
   }
+  pthread_detach(reporter);
+}
+
+int main(int argc, char** argv) {
+  int backlog = SOMAXCONN; // Maximum number of connections waiting to be accepted
+  int num_welcome_workers = DEFAULT_WELCOME_WORKERS;
+  int num_room_workers = DEFAULT_ROOM_WORKERS;
+  int num_listeners = 1; // Number of SO_REUSEPORT listening sockets (0 means one per core)
+  message_io_backend_t io_backend = MESSAGE_IO_BLOCKING;
+  int turn_timeout = DEFAULT_TURN_TIMEOUT;
+  int room_size = DEFAULT_ROOM_SIZE;
+  int max_lobby_wait = DEFAULT_MAX_LOBBY_WAIT;
+  int resume_grace = DEFAULT_RESUME_GRACE;
+  int ping_interval = DEFAULT_PING_INTERVAL;
+  int dead_peer_timeout = DEFAULT_DEAD_PEER_TIMEOUT;
+  max_rooms = DEFAULT_MAX_ROOMS;
+  max_sends_in_progress = DEFAULT_MAX_SENDS_IN_PROGRESS;
+  max_timer_lag_ms = DEFAULT_MAX_TIMER_LAG;
+  cork_delay_us = DEFAULT_CORK_DELAY;
+  int max_queued_kb = DEFAULT_MAX_QUEUED;
+  int max_memory_mb = DEFAULT_MAX_MEMORY;
+  int analytics_file_mb = DEFAULT_ANALYTICS_FILE_SIZE;
+
+  // Read command line options.
+  int opt;
+  while ((opt = getopt(argc, argv, "a:b:c:d:e:f:g:i:j:k:l:m:n:o:p:q:r:s:t:u:v:w:x:z:")) != -1) {
+    switch (opt) {
+      case 'a':
+        num_room_workers = atoi(optarg);
+        break;
+      case 'b':
+        backlog = atoi(optarg);
+        break;
+      case 'c':
+        max_rooms = atoi(optarg);
+        break;
+      case 'd':
+        dead_peer_timeout = atoi(optarg);
+        break;
+      case 'e':
+        trace_path = optarg;
+        trace_is_on = true;
+        break;
+      case 'f':
+        cork_delay_us = atoi(optarg);
+        break;
+      case 'g':
+        resume_grace = atoi(optarg);
+        break;
+      case 'i':
+        if (strcmp(optarg, "uring") == 0) {
+          io_backend = MESSAGE_IO_URING;
+        } else if (strcmp(optarg, "blocking") == 0) {
+          io_backend = MESSAGE_IO_BLOCKING;
+        } else {
+          fprintf(stderr, "Unknown I/O backend %s (use blocking or uring)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'j':
+        analytics_path = optarg;
+        break;
+      case 'k':
+        analytics_file_mb = atoi(optarg);
+        break;
+      case 'l':
+        num_listeners = atoi(optarg);
+        break;
+      case 'm':
+        max_lobby_wait = atoi(optarg);
+        break;
+      case 'n':
+        local_path = optarg;
+        break;
+      case 'o':
+        max_sends_in_progress = atoi(optarg);
+        break;
+      case 'p':
+        ping_interval = atoi(optarg);
+        break;
+      case 'q':
+        max_queued_kb = atoi(optarg);
+        break;
+      case 'r':
+        room_size = atoi(optarg);
+        break;
+      case 's':
+        metrics_name = optarg;
+        break;
+      case 't':
+        turn_timeout = atoi(optarg);
+        break;
+      case 'u':
+        handoff_path = optarg;
+        break;
+      case 'v':
+        if (log_parse_level(optarg, &log_min_level) != 0) {
+          fprintf(stderr, "Unknown log level %s (use debug, info, warn, or error)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'w':
+        num_welcome_workers = atoi(optarg);
+        break;
+      case 'x':
+        max_timer_lag_ms = atoi(optarg);
+        break;
+      case 'z':
+        max_memory_mb = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-a room workers] [-b listen backlog] [-c max rooms] "
+                        "[-d dead peer timeout] [-e trace dump] [-f cork delay] "
+                        "[-g resume grace] "
+                        "[-i blocking|uring] [-j analytics path] [-k analytics file size] "
+                        "[-l listeners] "
+                        "[-m max lobby wait] [-n unix socket] [-o max sends in progress] "
+                        "[-p ping interval] [-q max queued] "
+                        "[-r room size] [-s metrics segment] [-t turn timeout] "
+                        "[-u handoff socket] [-v log level] [-w welcome workers] "
+                        "[-x max timer lag] [-z max memory]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
 
-  // Start listening for connections, with a maximum of one queued connection
-  if (listen(server_socket_fd, 1)) {
-    perror("listen failed");
+  if (num_listeners == 0) {
+    num_listeners = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  if (num_room_workers == 0) {
+    num_room_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  if (turn_timeout < 0 || max_lobby_wait < 0 || resume_grace < 0 || ping_interval < 0 || 
+      dead_peer_timeout < 0) {
+    fprintf(stderr, "The turn timeout, max lobby wait, resume grace, ping interval, and dead peer "
+                    "timeout can't be negative\n");
     exit(EXIT_FAILURE);
   }
 
-  printf("Server listening on port %u\n", port);
+  if (max_rooms < 0 || max_sends_in_progress < 0 || max_timer_lag_ms < 0 || cork_delay_us < 0 || 
+      max_queued_kb < 0 || max_memory_mb < 0) {
+    fprintf(stderr, "The max rooms, sends in progress, timer lag, cork delay, queued frames, and "
+                    "memory can't be negative\n");
+    exit(EXIT_FAILURE);
+  }
+  max_queued_bytes = (size_t)max_queued_kb * 1024;
+  max_memory = (int64_t)max_memory_mb * 1024 * 1024;
 
-  // Allocate space for server info.
-  server_info_global = (server_info_t *) malloc(sizeof(server_info_t));
+  // A client that answers every ping must never look dead.
+  if (ping_interval > 0 && dead_peer_timeout > 0 && dead_peer_timeout <= ping_interval) {
+    fprintf(stderr, "The dead peer timeout must be longer than the ping interval\n");
+    exit(EXIT_FAILURE);
+  }
 
-  // Initialize fields for server info and the lock.
-  user_list_t* users = (user_list_t*) malloc(sizeof(user_list_t));
-  users->first_user = NULL;
-  users->numUsers = 0;
+  // Every player in a room needs their own 16-bit player id.
+  if (room_size < LOBBY_MIN_PLAYERS || room_size > UINT16_MAX) {
+    fprintf(stderr, "A room needs at least %d and at most %d players\n", LOBBY_MIN_PLAYERS, 
+            UINT16_MAX);
+    exit(EXIT_FAILURE);
+  }
+  turn_timeout_ms = turn_timeout * 1000;
+  resume_grace_ms = resume_grace * 1000;
+  ping_interval_ms = ping_interval * 1000;
+  dead_peer_ms = dead_peer_timeout * 1000;
+
+  if (backlog <= 0 || num_welcome_workers <= 0 || num_listeners <= 0 || num_room_workers <= 0 || 
+      analytics_file_mb <= 0) {
+    fprintf(stderr, "The listen backlog, analytics file size, and number of listeners, welcome "
+                    "workers, and room workers must be positive\n");
+    exit(EXIT_FAILURE);
+  }
 
-  server_info_global->chat_users = users;
-  server_info_global->is_game_initialized = false;
-  server_info_global->curr_question = 0;
-  server_info_global->max_questions = 2;
-  server_info_global->is_receiving_secret_word = false;
-  server_info_global->is_guessing = false;
-  server_info_global->guessed_secret_word = false;
-  server_info_global->asker_updated = false;
-  server_info_global->host_updated = false;
-  server_info_global->end_game = false;
+  // Writing to a player that has disconnected should fail with an error instead of killing the 
+  // server.
+  signal(SIGPIPE, SIG_IGN);
 
-  pthread_mutex_init(&server_info_global_lock, NULL);
+  // The lock profile (if built with it) and the trace (if on) are written on a signal, and the
+  // server stops on another, which every thread started from here on leaves to the reporter.
+  add_trace_types();
+  start_diagnostics();
 
-  // Continuously wait for a client to connect.
-  while (true) {
-    pthread_mutex_lock(&server_info_global_lock);
-    // Check if there are enough players connected to start the game.
-    if (server_info_global->chat_users->numUsers >= 2 && !server_info_global->is_game_initialized) { 
-      // Indicate that the game has started once there are at least 2 players connected.
-      server_info_global->is_game_initialized = true;
+  // Counters are published for wgstat (or kept privately), and every message sent is counted.
+  if (metrics_create(metrics_name) != 0) {
+    perror("Failed to create the metrics segment");
+    exit(EXIT_FAILURE);
+  }
+  message_io_count_sent(count_sent_message);
+  message_io_count_memory(count_connection_memory);
+
+  // Messages are written by a thread of their own, so that threads never wait on the terminal.
+  if (log_start() != 0) {
+    perror("Failed to start logging");
+    exit(EXIT_FAILURE);
+  }
+
+  // Guesses and rounds are written by a thread of their own as well.
+  if (analytics_path != NULL && 
+      analytics_start(analytics_path, (size_t)analytics_file_mb * 1024 * 1024) != 0) {
+    perror("Failed to start analytics");
+    exit(EXIT_FAILURE);
+  }
+
+  // Every client can read a legacy frame, even one that asked for a session.
+  char busy_msg[64];
+  snprintf(busy_msg, sizeof(busy_msg), "Server busy, retry in %d s", BUSY_RETRY_AFTER);
+  busy_frame = frame_encode(FRAME_LEGACY, 0, 0, busy_msg, strlen(busy_msg), "Server", 
+                            strlen("Server"));
+  if (busy_frame == NULL) {
+    perror("Failed to encode the busy message");
+    exit(EXIT_FAILURE);
+  }
+
+  // Pick how messages are sent and received, falling back to blocking I/O if io_uring is not 
+  // supported by the kernel.
+  message_io_backend_t requested_io_backend = io_backend;
+  io_backend = message_io_init(requested_io_backend);
+  if (io_backend != requested_io_backend) {
+    log_warn("io_uring is not supported, using blocking I/O");
+  }
+
+  // With a handoff socket, a new server process takes over the sockets (and games) of the one 
+  // already listening there, if there is one.
+  profiled_mutex_init(&all_rooms_lock, "all_rooms_lock");
+  profiled_mutex_init(&stoppable_threads_lock, "stoppable_threads_lock");
+  profiled_mutex_init(&handoff_lock, "handoff_lock");
+  pthread_cond_init(&handoff_failed, NULL);
+  int handoff_channel = -1;
+  handoff_buffer_t handed_over;
+  handoff_buffer_init(&handed_over);
+  if (handoff_path != NULL) {
+    // Whatever io_uring read ahead from a socket would be lost.
+    if (io_backend != MESSAGE_IO_BLOCKING) {
+      fprintf(stderr, "Hot restarts need the blocking I/O backend\n");
+      exit(EXIT_FAILURE);
+    }
 
-      // Create thread to start game.
-      pthread_t thread;
-      pthread_create(&thread, NULL, start_game, server_info_global);
+    // Without SA_RESTART, the signal interrupts whatever a stoppable thread is blocked in.
+    struct sigaction action = {.sa_handler = wake_for_handoff};
+    sigemptyset(&action.sa_mask);
+    sigaction(HANDOFF_SIGNAL, &action, NULL);
+
+    handoff_channel = handoff_connect(handoff_path);
+    if (handoff_channel == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+      perror("Failed to connect to the handoff socket");
+      exit(EXIT_FAILURE);
     }
-    pthread_mutex_unlock(&server_info_global_lock);
+    if (handoff_channel != -1 && handoff_receive(handoff_channel, &handed_over) == -1) {
+      perror("Failed to take over from the server process");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-    // Accept connection from user.
-    int client_socket_fd = server_socket_accept(server_socket_fd); 
+  unsigned short port = 0;
+  uint64_t stopped_us = 0; // When the server process taken over from stopped
+  if (handoff_channel != -1) {
+    if (handoff_get_u64(&handed_over) != HANDOFF_STATE_VERSION) {
+      fprintf(stderr, "The server process to take over from runs an incompatible version\n");
+      exit(EXIT_FAILURE);
+    }
+
+    stopped_us = handoff_get_u64(&handed_over);
+    port = handoff_get_u64(&handed_over);
+    num_listeners = handoff_get_u64(&handed_over);
+    if (!handed_over.is_valid || num_listeners <= 0) {
+      fprintf(stderr, "The server process to take over from sent a state that isn't valid\n");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-    pthread_mutex_lock(&server_info_global_lock);
-    // Remember the socket fd of who just connected to use later.
-    server_info_global->connecting_user_socket_fd = client_socket_fd;
+  // Open the server sockets (or take them over). With more than one listener, every socket shares 
+  // the port the OS picked for the first one, and the kernel spreads incoming connections across 
+  // them.
+  bool reuse_port = num_listeners > 1;
+  int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  listener_t* listeners = malloc(sizeof(listener_t) * (num_listeners + 1));
 
-    // Create thread for the new user to send a welcome message to it.
-    pthread_t welcome_thread;
-    pthread_create(&welcome_thread, NULL, welcome, &client_socket_fd);
+  for (int i = 0; i < num_listeners; i++) {
+    if (handoff_channel != -1) {
+      listeners[i].socket_fd = handoff_get_fd(&handed_over);
+    } else {
+      listeners[i].socket_fd = server_socket_open(&port, reuse_port);
+      if (listeners[i].socket_fd == -1) {
+        perror("Server socket was not opened");
+        exit(EXIT_FAILURE);
+      }
 
-    pthread_mutex_unlock(&server_info_global_lock);
+      // Start listening for connections, queueing up to backlog connections during bursts
+      if (listen(listeners[i].socket_fd, backlog)) {
+        perror("listen failed");
+        exit(EXIT_FAILURE);
+      }
+    }
 
-    // Add new player to list of players.
-    add_player_to_list(users, client_socket_fd);
+    listeners[i].cpu = reuse_port ? i % num_cpus : -1;
+    listeners[i].welcome_inline = reuse_port;
+    listeners[i].is_local = false;
+  }
 
-    // Connection was unsuccessful.
-    if (client_socket_fd == -1) {
-      perror("accept failed");
+  // Players on this machine can also connect through a Unix socket, which keeps the one the 
+  // server process taken over from listened on.
+  if (handoff_channel != -1) {
+    local_path = handoff_get_string(&handed_over);
+    if (local_path != NULL) {
+      listeners[num_listeners].socket_fd = handoff_get_fd(&handed_over);
+    }
+  } else if (local_path != NULL) {
+    listeners[num_listeners].socket_fd = server_socket_open_unix(local_path);
+    if (listeners[num_listeners].socket_fd == -1) {
+      perror("Unix server socket was not opened");
+      exit(EXIT_FAILURE);
+    }
+    if (listen(listeners[num_listeners].socket_fd, backlog)) {
+      perror("listen failed");
       exit(EXIT_FAILURE);
     }
+  }
+  int num_listening = num_listeners;
+  if (local_path != NULL) {
+    listeners[num_listeners].cpu = -1;
+    listeners[num_listeners].welcome_inline = reuse_port;
+    listeners[num_listeners].is_local = true;
+    num_listening++;
+  }
 
-    printf("Client connected!\n");
+  log_info("Server listening on port %u", port);
+  if (local_path != NULL) {
+    log_info("Server listening on %s%s", SOCKET_UNIX_PREFIX, local_path);
   }
 
-  // Traversing through the users linked list to free each node 
-  user_node_t* current = server_info_global->chat_users->first_user;
-  while (current != NULL) {
-    user_node_t* temp = current->next;
-    free(current);
-    current = temp;
+  // Turn deadlines are kept from now on, but only expire once the timer threads start. Each room
+  // worker's worth of rooms gets its own wheel, lock, and thread.
+  num_timer_shards = num_room_workers;
+  timer_shards = malloc(sizeof(timer_shard_t) * num_timer_shards);
+  for (int i = 0; i < num_timer_shards; i++) {
+    timer_wheel_init(&timer_shards[i].wheel, now_ticks());
+    profiled_mutex_init(&timer_shards[i].lock, "timer_shard_lock");
+    timer_shards[i].wake_tick = UINT64_MAX;
+    timer_shards[i].wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    atomic_init(&timer_shards[i].lag_ms, 0);
+    if (timer_shards[i].wake_fd == -1) {
+      perror("Failed to create the timer threads' wakeups");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Secret words are only compared by their hash, which needs a key nobody else knows.
+  if (secret_init_key() == -1) {
+    perror("Failed to pick the secret word hash key");
+    exit(EXIT_FAILURE);
+  }
+
+  // Keep track of whose seat each token takes back.
+  profiled_mutex_init(&seat_tokens_lock, "seat_tokens_lock");
+  if (token_map_init(&seat_tokens) == -1) {
+    perror("Failed to create the seat tokens");
+    exit(EXIT_FAILURE);
+  }
+
+  // New connections are watched for a resume on their way to the lobby.
+  profiled_mutex_init(&arrivals_lock, "arrivals_lock");
+  arrivals_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (arrivals_epoll_fd == -1) {
+    perror("Failed to watch new connections");
+    exit(EXIT_FAILURE);
+  }
+
+  // Start the workers that run the rooms' actors: a pool per listener when the kernel spreads 
+  // connections across them, splitting the room workers between them, or else a single one. The 
+  // Unix listener shares the first.
+  num_room_pools = reuse_port ? num_listeners : 1;
+  room_pools = malloc(sizeof(worker_pool_t) * num_room_pools);
+  for (int i = 0; i < num_room_pools; i++) {
+    int num_workers = num_room_workers / num_room_pools + (i < num_room_workers % num_room_pools);
+    if (pool_init(&room_pools[i], num_workers > 0 ? num_workers : 1, ROOM_QUEUE_CAPACITY, 
+                  run_room) == -1) {
+      perror("Failed to start the room workers");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < num_listening; i++) {
+    listeners[i].room_pool_index = i < num_room_pools ? i : 0;
+  }
+
+  // Keep track of the listener every connection came from, for as many as the process can open.
+  max_room_pool_fds = ROOM_POOL_MAX_FDS;
+  struct rlimit fd_limit;
+  if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_max < ROOM_POOL_MAX_FDS) {
+    max_room_pool_fds = fd_limit.rlim_max;
+  }
+  room_pool_by_fd = calloc(max_room_pool_fds, sizeof(uint16_t));
+  if (room_pool_by_fd == NULL) {
+    max_room_pool_fds = 0;
+  }
+
+  // Start matching players into rooms.
+  if (lobby_init(&lobby, LOBBY_CAPACITY, room_size, max_lobby_wait * 1000, match_players) == -1) {
+    perror("Failed to start the lobby");
+    exit(EXIT_FAILURE);
   }
 
-  free(server_info_global->chat_users); // Freeing the linked list
-  free(server_info_global->secret_word); // Freeing secret word
-  free(server_info_global->leading_username); // Freeing leading user name
-  free(server_info_global);
-  close(server_socket_fd);
+  // Start the workers that greet new players (only needed when a single thread accepts).
+  if (!reuse_port && 
+      pool_init(&welcome_pool, num_welcome_workers, WELCOME_QUEUE_CAPACITY, welcome) == -1) {
+    perror("Failed to start welcome workers");
+    exit(EXIT_FAILURE);
+  }
+
+  // Set up the games of the server process taken over from, if any.
+  if (handoff_channel != -1) {
+    take_over(handoff_channel, &handed_over, num_listening, stopped_us);
+  }
+  handoff_buffer_destroy(&handed_over);
+
+  // Start expiring turn deadlines.
+  for (int i = 0; i < num_timer_shards; i++) {
+    start_stoppable_thread(&timer_shards[i].stoppable, run_timer_shard, &timer_shards[i]);
+  }
+
+  // Start watching new connections for players taking their seat back.
+  stoppable_thread_t arrivals_thread;
+  if (resume_grace_ms > 0) {
+    start_stoppable_thread(&arrivals_thread, watch_arrivals, &arrivals_thread);
+  }
+
+  // Accept connections on every listener. The main thread serves the first one.
+  for (int i = 1; i < num_listening; i++) {
+    start_stoppable_thread(&listeners[i].stoppable, accept_connections, &listeners[i]);
+  }
+  watch_current_thread(&listeners[0].stoppable);
+
+  // Wait for a new server process to take over, now that every thread it has to stop is running.
+  if (handoff_path != NULL) {
+    handoff_thread_args_t* handoff_args = malloc(sizeof(handoff_thread_args_t));
+    handoff_args->socket_fd = handoff_listen(handoff_path);
+    if (handoff_args->socket_fd == -1) {
+      perror("Failed to open the handoff socket");
+      exit(EXIT_FAILURE);
+    }
+    handoff_args->listeners = listeners;
+    handoff_args->num_listeners = num_listeners;
+    handoff_args->port = port;
+    handoff_args->local_path = local_path;
+
+    pthread_t handoff_thread;
+    pthread_create(&handoff_thread, NULL, wait_for_successor, handoff_args);
+    pthread_detach(handoff_thread);
+  }
+
+  accept_connections(&listeners[0]);
+
+  for (int i = 0; i < num_listening; i++) {
+    close(listeners[i].socket_fd);
+  }
+  free(listeners);
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "siphash.h"
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+  do {                           \
+    v0 += v1;                    \
+    v1 = ROTL(v1, 13);           \
+    v1 ^= v0;                    \
+    v0 = ROTL(v0, 32);           \
+    v2 += v3;                    \
+    v3 = ROTL(v3, 16);           \
+    v3 ^= v2;                    \
+    v0 += v3;                    \
+    v3 = ROTL(v3, 21);           \
+    v3 ^= v0;                    \
+    v2 += v1;                    \
+    v1 = ROTL(v1, 17);           \
+    v1 ^= v2;                    \
+    v2 = ROTL(v2, 32);           \
+  } while (0)
+
+/**
+ * Read a little-endian 64-bit word (of up to 8 bytes), folding ASCII letters to lowercase if asked
+ * to.
+ */
+static uint64_t load_word(const uint8_t* bytes, size_t len, bool fold_case) {
+  uint64_t word = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t byte = bytes[i];
+    if (fold_case && (uint8_t)(byte - 'A') < 26) {
+      byte += 'a' - 'A';
+    }
+    word |= (uint64_t)byte << (8 * i);
+  }
+  return word;
+}
+
+// Hash len bytes of data.
+uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LEN], const void* data, size_t len,
+                   bool fold_case) {
+  uint64_t k0 = load_word(key, 8, false);
+  uint64_t k1 = load_word(key + 8, 8, false);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+  // Two rounds per full word.
+  const uint8_t* bytes = data;
+  size_t num_full = len - len % 8;
+  for (size_t i = 0; i < num_full; i += 8) {
+    uint64_t m = load_word(bytes + i, 8, fold_case);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  // The last word carries the leftover bytes and the length.
+  uint64_t last = load_word(bytes + num_full, len % 8, fold_case) | (uint64_t)len << 56;
+  v3 ^= last;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  v0 ^= last;
+
+  // Four finalization rounds.
+  v2 ^= 0xff;
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+  SIPROUND(v0, v1, v2, v3);
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// SipHash-2-4: a fast keyed 64-bit hash. Without the key, nobody can find inputs that share a
+// hash, so a hash can stand in for the input it was computed from.
+// Citation: Jean-Philippe Aumasson and Daniel J. Bernstein, "SipHash: a fast short-input PRF".
+
+#define SIPHASH_KEY_LEN 16
+
+// Hash len bytes of data. With fold_case, ASCII letters are hashed as lowercase, so inputs that
+// only differ in case get the same hash.
+uint64_t siphash24(const uint8_t key[SIPHASH_KEY_LEN], const void* data, size_t len,
+                   bool fold_case);
@@ -3,52 +3,114 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 // Necessary code for socket-related functionality.
 // Citation: P2P lab (starter code)
 
+#define SOCKET_UNIX_PREFIX "unix:" // Server names that start with it are Unix socket paths
+
+/**
+ * Set up the address of the Unix socket at path.
+ *
+ * \returns   Non-zero value if the path is too long, with errno set to
+ *            ENAMETOOLONG.
+ */
+static int socket_unix_address(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
 /**
  * Create a new socket and connect to a server.
  *
  * \param server_name   A null-terminated string that specifies either the IP
- *                      address or host name of the server to connect to.
- * \param port          The port number the server should be listening on.
+ *                      address (IPv4 or IPv6) or host name of the server to
+ *                      connect to, or the path of its Unix socket prefixed with
+ *                      SOCKET_UNIX_PREFIX (like unix:/tmp/wordguess.sock).
+ * \param port          The port number the server should be listening on
+ *                      (ignored for a Unix socket).
  *
  * \returns   A file descriptor for the connected socket, or -1 if there is an
  *            error. The errno value will be set by the failed POSIX call.
  */
 static int socket_connect(char* server_name, unsigned short port) {
-  // Look up the server by name
-  struct hostent* server = gethostbyname(server_name);
-  if (server == NULL) {
-    // Set errno, since gethostbyname does not
-    errno = EHOSTDOWN;
-    return -1;
-  }
+  // Players on the same machine skip TCP altogether
+  if (strncmp(server_name, SOCKET_UNIX_PREFIX, strlen(SOCKET_UNIX_PREFIX)) == 0) {
+    struct sockaddr_un addr;
+    if (socket_unix_address(server_name + strlen(SOCKET_UNIX_PREFIX), &addr) == -1) {
+      return -1;
+    }
 
-  // Open a socket
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un))) {
+      int error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+
+    return fd;
   }
 
-  // Set up an address
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET,   // This is an internet socket
-      .sin_port = htons(port)  // Connect to the appropriate port number
+  // Look up the server by name. Unlike gethostbyname, getaddrinfo is reentrant
+  // (so threads can connect at the same time) and finds IPv6 addresses too.
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC,                       // IPv4 or IPv6
+      .ai_socktype = SOCK_STREAM,                   // TCP
+      .ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG    // Only addresses this machine can reach
   };
+  struct addrinfo* addrs;
+  int rc = getaddrinfo(server_name, service, &hints, &addrs);
+  if (rc != 0) {
+    // Set errno, since getaddrinfo only does for system errors
+    if (rc != EAI_SYSTEM) {
+      errno = EHOSTDOWN;
+    }
+    return -1;
+  }
 
-  // Copy the server address info returned by gethostbyname into the address
-  memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+  // Connect to the first address that works
+  int fd = -1;
+  int error = EHOSTDOWN;
+  for (struct addrinfo* addr = addrs; addr != NULL && fd == -1; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd == -1) {
+      error = errno;
+      continue;
+    }
 
-  // Connect to the server
-  if (connect(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in))) {
-    close(fd);
-    return -1;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen)) {
+      error = errno;
+      close(fd);
+      fd = -1;
+    }
   }
+  freeaddrinfo(addrs);
 
+  if (fd == -1) {
+    errno = error;
+  }
   return fd;
 }
 
@@ -59,34 +121,71 @@ static int socket_connect(char* server_name, unsigned short port) {
  *                function will attempt to open a server socket using that port.
  *                If *port is zero, the OS will choose. Regardless of the method
  *                used, this function writes the socket's port number to *port.
+ * \param reuse_port  Whether to set SO_REUSEPORT, so several server sockets
+ *                    can be bound to the same port. The kernel then spreads
+ *                    incoming connections across all of them.
  *
  * \returns       A file descriptor for the server socket. The socket has been
  *                bound to a particular port and address, but is not listening.
  *                In case of failure, this function returns -1. The value of
  *                errno will be set by the POSIX socket function that failed.
  */
-static int server_socket_open(unsigned short* port) {
-  // Create a server socket. Return if there is an error.
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
+static int server_socket_open(unsigned short* port, bool reuse_port) {
+  // Create a server socket that takes both IPv6 and IPv4 connections, or only
+  // IPv4 ones if the kernel has no IPv6. Return if there is an error.
+  int family = AF_INET6;
+  int fd = socket(AF_INET6, SOCK_STREAM, 0);
+  if (fd == -1 && errno == EAFNOSUPPORT) {
+    family = AF_INET;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+  }
   if (fd == -1) {
     return -1;
   }
 
+  // Allow other server sockets to share the port. Return if there is an error.
+  int enable = 1;
+  if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))) {
+    close(fd);
+    return -1;
+  }
+
+  // Accept IPv4 connections on the IPv6 socket too, as IPv4-mapped addresses.
+  int disable = 0;
+  if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int))) {
+    close(fd);
+    return -1;
+  }
+
   // Set up the server socket to listen
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET,          // This is an internet socket
-      .sin_addr.s_addr = INADDR_ANY,  // Listen for connections from any client
-      .sin_port = htons(*port)        // Use the specified port (may be zero)
-  };
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  if (family == AF_INET6) {
+    struct sockaddr_in6 addr6 = {
+        .sin6_family = AF_INET6,      // This is an IPv6 socket
+        .sin6_addr = in6addr_any,     // Listen for connections from any client
+        .sin6_port = htons(*port)     // Use the specified port (may be zero)
+    };
+    memcpy(&addr, &addr6, sizeof(struct sockaddr_in6));
+    addrlen = sizeof(struct sockaddr_in6);
+  } else {
+    struct sockaddr_in addr4 = {
+        .sin_family = AF_INET,          // This is an internet socket
+        .sin_addr.s_addr = INADDR_ANY,  // Listen for connections from any client
+        .sin_port = htons(*port)        // Use the specified port (may be zero)
+    };
+    memcpy(&addr, &addr4, sizeof(struct sockaddr_in));
+    addrlen = sizeof(struct sockaddr_in);
+  }
 
   // Bind the server socket to the address. Return if there is an error.
-  if (bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in))) {
+  if (bind(fd, (struct sockaddr*)&addr, addrlen)) {
     close(fd);
     return -1;
   }
 
   // Get information about the new socket
-  socklen_t addrlen = sizeof(struct sockaddr_in);
+  addrlen = sizeof(struct sockaddr_storage);
   if (getsockname(fd, (struct sockaddr*)&addr, &addrlen)) {
     close(fd);
     return -1;
@@ -94,32 +193,113 @@ static int server_socket_open(unsigned short* port) {
 
   // Read out the port information for the socket. If *port was zero, the OS
   // will select a port for us. This tells the caller which port was chosen.
-  *port = ntohs(addr.sin_port);
+  *port = ntohs(family == AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port
+                                   : ((struct sockaddr_in*)&addr)->sin_port);
 
   // Return the server socket file descriptor
   return fd;
 }
 
+/**
+ * Open a server socket that will accept connections from processes on this
+ * machine through a Unix socket, which skips the TCP/IP stack altogether.
+ *
+ * \param path    The path of the socket. Whatever is already at that path
+ *                (like the socket of a server that didn't clean up) is removed.
+ *
+ * \returns       A file descriptor for the server socket. The socket has been
+ *                bound to the path, but is not listening. In case of failure,
+ *                this function returns -1. The value of errno will be set by
+ *                the POSIX socket function that failed.
+ */
+static int server_socket_open_unix(const char* path) {
+  struct sockaddr_un addr;
+  if (socket_unix_address(path, &addr) == -1) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_un))) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Make the kernel give up on a connection whose peer has gone away without
+ * closing it. An idle connection is probed with keepalives, and data that the
+ * peer doesn't acknowledge in time makes reads and writes fail with ETIMEDOUT.
+ *
+ * \param fd            The connected socket.
+ * \param dead_peer_ms  How long the peer can be unreachable before the
+ *                      connection is given up on.
+ *
+ * \returns   0 on success, or -1 with errno set by the failed setsockopt call.
+ */
+static int socket_detect_dead_peer(int fd, int dead_peer_ms) {
+  // Probe an idle connection after a quarter of the time, then three more
+  // times a quarter apart, so that a dead peer is found out in time.
+  int enable = 1;
+  int probe_interval = dead_peer_ms / 4000 > 0 ? dead_peer_ms / 4000 : 1;
+  int num_probes = 3;
+  unsigned int user_timeout = dead_peer_ms;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int)) ||
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &probe_interval, sizeof(int)) ||
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &probe_interval, sizeof(int)) ||
+      setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &num_probes, sizeof(int)) ||
+      setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(unsigned int))) {
+    return -1;
+  }
+
+  return 0;
+}
+
 /**
  * Accept an incoming connection on a server socket.
  *
+ * The client socket is created close-on-exec in the same system call. It is
+ * left in blocking mode because each player is served by a thread that blocks
+ * on reads and writes to its socket.
+ *
  * \param server_socket_fd  The server socket that should accept the connection.
+ * \param dead_peer_ms      How long a client can be unreachable before the
+ *                          kernel gives up on its connection (0 means the
+ *                          kernel's defaults are kept, as they must be for a
+ *                          Unix socket, which has no TCP options).
  *
  * \returns   The file descriptor for the newly-connected client socket. In case
  *            of failure, returns -1 with errno set by the failed accept call.
  */
-static int server_socket_accept(int server_socket_fd) {
+static int server_socket_accept(int server_socket_fd, int dead_peer_ms) {
   // Create a struct to record the connected client's address
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_len = sizeof(struct sockaddr_in);
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len = sizeof(struct sockaddr_storage);
 
   // Block until we receive a connection or failure
-  int client_socket_fd = accept(server_socket_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+  int client_socket_fd = accept4(server_socket_fd, (struct sockaddr*)&client_addr, &client_addr_len,
+                                 SOCK_CLOEXEC);
 
   // Did something go wrong?
   if (client_socket_fd == -1) {
     return -1;
   }
 
+  // Find out about clients that vanished without closing their connection.
+  // This is best effort: the connection is still usable if the kernel doesn't
+  // support some of the options.
+  if (dead_peer_ms > 0) {
+    socket_detect_dead_peer(client_socket_fd, dead_peer_ms);
+  }
+
   return client_socket_fd;
 }
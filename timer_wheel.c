@@ -0,0 +1,167 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// The furthest a timer can be placed from the current tick (further timers are placed here and
+// moved again when they reach the bottom level).
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+/**
+ * Unlink a timer from the slot it is in.
+ */
+static void unlink_timer(wheel_timer_t* timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/**
+ * Link a timer into the slot matching its expiry tick.
+ */
+static void place_timer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  uint64_t delta = timer->expires - wheel->now;
+  uint64_t placed_at = timer->expires;
+
+  // Timers beyond the top level wait in the furthest slot and are placed again from there.
+  if (delta > MAX_DELTA) {
+    delta = MAX_DELTA;
+    placed_at = wheel->now + MAX_DELTA;
+  }
+
+  // Each level covers 64 times as many ticks as the one below it.
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+    level++;
+  }
+
+  int slot = (placed_at >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+  wheel_timer_t* head = &wheel->slots[level][slot];
+
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+// Initialize an empty wheel.
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->num_pending = 0;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      wheel->slots[level][slot].next = &wheel->slots[level][slot];
+      wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+    }
+  }
+}
+
+// Initialize a timer that isn't pending.
+void timer_init(wheel_timer_t* timer, void* arg) {
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->expires = 0;
+  timer->arg = arg;
+}
+
+// Check whether a timer is waiting to expire.
+bool timer_is_pending(wheel_timer_t* timer) {
+  return timer->prev != NULL;
+}
+
+// Start a timer.
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, uint64_t expires) {
+  if (timer_is_pending(timer)) {
+    unlink_timer(timer);
+  } else {
+    wheel->num_pending++;
+  }
+
+  timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+  place_timer(wheel, timer);
+}
+
+// Stop a pending timer.
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer) {
+  if (timer_is_pending(timer)) {
+    unlink_timer(timer);
+    wheel->num_pending--;
+  }
+}
+
+// Process every tick up to and including now.
+wheel_timer_t* timer_wheel_advance(timer_wheel_t* wheel, uint64_t now) {
+  wheel_timer_t* expired = NULL;
+
+  while (wheel->now < now) {
+    // Nothing can expire, so skip straight to the end.
+    if (wheel->num_pending == 0) {
+      wheel->now = now;
+      break;
+    }
+
+    wheel->now++;
+
+    // When a level wraps around, move the timers of its next slot down to the lower levels.
+    for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint64_t level_ticks = 1ULL << (level * TIMER_WHEEL_SLOT_BITS);
+      if (wheel->now % level_ticks != 0) {
+        continue;
+      }
+
+      wheel_timer_t* head = &wheel->slots[level][(wheel->now / level_ticks) & SLOT_MASK];
+      while (head->next != head) {
+        wheel_timer_t* timer = head->next;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+      }
+    }
+
+    // Every timer in the bottom level slot for this tick has expired.
+    wheel_timer_t* head = &wheel->slots[0][wheel->now & SLOT_MASK];
+    while (head->next != head) {
+      wheel_timer_t* timer = head->next;
+      unlink_timer(timer);
+      wheel->num_pending--;
+
+      timer->next = expired;
+      expired = timer;
+    }
+  }
+
+  return expired;
+}
+
+// Get the first tick that advancing the wheel has anything to do on.
+uint64_t timer_wheel_next_tick(timer_wheel_t* wheel) {
+  if (wheel->num_pending == 0) {
+    return UINT64_MAX;
+  }
+
+  // The bottom level's slots are the next 64 ticks.
+  uint64_t next = UINT64_MAX;
+  for (uint64_t tick = wheel->now + 1; tick <= wheel->now + TIMER_WHEEL_SLOTS; tick++) {
+    wheel_timer_t* head = &wheel->slots[0][tick & SLOT_MASK];
+    if (head->next != head) {
+      next = tick;
+      break;
+    }
+  }
+
+  // A slot of a higher level is moved down when the level wraps around to it.
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    uint64_t level_ticks = 1ULL << (level * TIMER_WHEEL_SLOT_BITS);
+    for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+      uint64_t tick = (wheel->now / level_ticks + i) * level_ticks;
+      wheel_timer_t* head = &wheel->slots[level][(tick / level_ticks) & SLOT_MASK];
+      if (head->next != head) {
+        next = tick < next ? tick : next;
+        break;
+      }
+    }
+  }
+
+  return next;
+}
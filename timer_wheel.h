@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A hierarchical timing wheel. Timers are kept in per-tick slots across 4 levels of 64 slots
+// each, so adding and cancelling a timer is O(1) no matter how many timers are pending. Timers
+// further away than the first level are moved down a level as their time approaches.
+// The wheel is not thread-safe: callers must serialize access to it.
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+// A timer. It is embedded in whatever it times, and is linked into a slot while pending.
+typedef struct wheel_timer {
+  struct wheel_timer* next;
+  struct wheel_timer* prev;
+  uint64_t expires; // The tick the timer expires on
+  void* arg;        // Whatever the owner of the timer wants to get back when it expires
+} wheel_timer_t;
+
+typedef struct timer_wheel {
+  uint64_t now; // The last tick that has been processed
+  size_t num_pending;
+  wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // Sentinels of circular lists
+} timer_wheel_t;
+
+// Initialize an empty wheel whose current tick is now.
+void timer_wheel_init(timer_wheel_t* wheel, uint64_t now);
+
+// Initialize a timer that isn't pending.
+void timer_init(wheel_timer_t* timer, void* arg);
+
+// Check whether a timer is waiting to expire.
+bool timer_is_pending(wheel_timer_t* timer);
+
+// Start a timer that expires on the given tick (or the next tick if that has passed). A timer
+// that is already pending is moved to the new tick.
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, uint64_t expires);
+
+// Stop a pending timer. Does nothing if the timer isn't pending.
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+// Process every tick up to and including now. Returns the timers that expired as a list linked
+// through their next pointers (NULL if none did). They are no longer pending, so they can be
+// added again, but their next pointers must be read before that.
+wheel_timer_t* timer_wheel_advance(timer_wheel_t* wheel, uint64_t now);
+
+// Get the first tick that advancing the wheel has anything to do on (a timer expires or moves
+// down a level), or UINT64_MAX if no timer is pending. The wheel can skip every tick before it.
+uint64_t timer_wheel_next_tick(timer_wheel_t* wheel);
@@ -0,0 +1,131 @@
+#include "token_map.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/random.h>
+
+#define INITIAL_BUCKETS 64
+
+/**
+ * Get the bucket a token belongs in. Tokens are random, so their low bits are spread evenly.
+ */
+static token_entry_t** bucket_of(token_map_t* map, uint64_t token) {
+  return &map->buckets[token & (map->num_buckets - 1)];
+}
+
+/**
+ * Double the number of buckets once the map has as many entries as buckets.
+ *
+ * \returns Non-zero value if an error occurs (the map is left as it was).
+ */
+static int grow(token_map_t* map) {
+  size_t num_buckets = map->num_buckets * 2;
+  token_entry_t** buckets = calloc(num_buckets, sizeof(token_entry_t*));
+  if (buckets == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < map->num_buckets; i++) {
+    token_entry_t* entry = map->buckets[i];
+    while (entry != NULL) {
+      token_entry_t* next = entry->next;
+      token_entry_t** bucket = &buckets[entry->token & (num_buckets - 1)];
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+
+  free(map->buckets);
+  map->buckets = buckets;
+  map->num_buckets = num_buckets;
+  return 0;
+}
+
+// Initialize an empty map.
+int token_map_init(token_map_t* map) {
+  map->buckets = calloc(INITIAL_BUCKETS, sizeof(token_entry_t*));
+  if (map->buckets == NULL) {
+    return -1;
+  }
+
+  map->num_buckets = INITIAL_BUCKETS;
+  map->num_entries = 0;
+  return 0;
+}
+
+// Free the memory of a map.
+void token_map_destroy(token_map_t* map) {
+  for (size_t i = 0; i < map->num_buckets; i++) {
+    token_entry_t* entry = map->buckets[i];
+    while (entry != NULL) {
+      token_entry_t* next = entry->next;
+      free(entry);
+      entry = next;
+    }
+  }
+
+  free(map->buckets);
+  map->buckets = NULL;
+}
+
+// Store a value under a new token.
+uint64_t token_map_issue(token_map_t* map, void* value) {
+  // A collision is astronomically unlikely, but a token must never name two entries.
+  uint64_t token;
+  do {
+    if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+      if (errno == EINTR) {
+        token = TOKEN_NONE;
+        continue;
+      }
+      return TOKEN_NONE;
+    }
+  } while (token == TOKEN_NONE || token_map_get(map, token) != NULL);
+
+  return token_map_put(map, token, value) == -1 ? TOKEN_NONE : token;
+}
+
+// Store a value under a token that was issued before.
+int token_map_put(token_map_t* map, uint64_t token, void* value) {
+  if (map->num_entries >= map->num_buckets && grow(map) == -1) {
+    return -1;
+  }
+
+  token_entry_t* entry = malloc(sizeof(token_entry_t));
+  if (entry == NULL) {
+    return -1;
+  }
+
+  token_entry_t** bucket = bucket_of(map, token);
+  entry->token = token;
+  entry->value = value;
+  entry->next = *bucket;
+  *bucket = entry;
+  map->num_entries++;
+  return 0;
+}
+
+// Get the value stored under a token.
+void* token_map_get(token_map_t* map, uint64_t token) {
+  for (token_entry_t* entry = *bucket_of(map, token); entry != NULL; entry = entry->next) {
+    if (entry->token == token) {
+      return entry->value;
+    }
+  }
+
+  return NULL;
+}
+
+// Remove a token from the map.
+void token_map_remove(token_map_t* map, uint64_t token) {
+  for (token_entry_t** link = bucket_of(map, token); *link != NULL; link = &(*link)->next) {
+    token_entry_t* entry = *link;
+    if (entry->token == token) {
+      *link = entry->next;
+      free(entry);
+      map->num_entries--;
+      return;
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A hash map from random 64-bit tokens to values. Tokens are drawn from the kernel's random
+// number generator, so they can be handed to clients as proof of who they are.
+// The map is not thread-safe: callers must serialize access to it.
+
+// A token the map never issues (a client without a token can send it instead).
+#define TOKEN_NONE 0
+
+typedef struct token_entry {
+  uint64_t token;
+  void* value;
+  struct token_entry* next; // The next entry in the same bucket
+} token_entry_t;
+
+typedef struct token_map {
+  token_entry_t** buckets;
+  size_t num_buckets; // Always a power of two
+  size_t num_entries;
+} token_map_t;
+
+// Initialize an empty map. Returns non-zero value if an error occurs.
+int token_map_init(token_map_t* map);
+
+// Free the memory of a map (but not the values in it).
+void token_map_destroy(token_map_t* map);
+
+// Store a value under a new token. Returns the token, or TOKEN_NONE if an error occurs.
+uint64_t token_map_issue(token_map_t* map, void* value);
+
+// Store a value under a token that was issued before (by another map, such as the map of the
+// process a server took over from). The token must not be in the map. Returns non-zero value if
+// an error occurs.
+int token_map_put(token_map_t* map, uint64_t token, void* value);
+
+// Get the value stored under a token (NULL if the token isn't in the map).
+void* token_map_get(token_map_t* map, uint64_t token);
+
+// Remove a token from the map. Does nothing if the token isn't in the map.
+void token_map_remove(token_map_t* map, uint64_t token);
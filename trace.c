@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (TRACE_RING_EVENTS - 1)
+
+// The events of one thread. A ring only ever has one writer, and is handed to a new thread once
+// its thread has ended, keeping the events it has so far.
+typedef struct trace_ring {
+  atomic_uint_fast64_t num_written; // Events ever written (the latest ones are still in the ring)
+  struct trace_ring* next;          // The next ring ever used
+  struct trace_ring* next_free;     // The next ring without a thread
+  trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+typedef struct trace_type {
+  const char* name;
+  const char* arg_names[2];
+} trace_type_t;
+
+bool trace_is_on = false;
+
+static trace_type_t types[TRACE_MAX_TYPES];
+static int num_types = 1; // Type 0 is never recorded
+static pthread_mutex_t types_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static trace_ring_t* all_rings;  // Every ring ever used
+static trace_ring_t* free_rings; // Rings whose thread has ended
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;   // Gives a thread's ring back when the thread ends
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local trace_ring_t* thread_ring;
+static _Thread_local uint32_t thread_id;
+static _Thread_local bool is_thread_named;
+
+static atomic_uint last_flow;
+
+// Register a type of event.
+uint16_t trace_add_type(const char* name, const char* arg0_name, const char* arg1_name) {
+  pthread_mutex_lock(&types_lock);
+  if (num_types == TRACE_MAX_TYPES) {
+    pthread_mutex_unlock(&types_lock);
+    return 0;
+  }
+
+  uint16_t type = num_types++;
+  types[type] = (trace_type_t) {.name = name, .arg_names = {arg0_name, arg1_name}};
+  pthread_mutex_unlock(&types_lock);
+  return type;
+}
+
+/**
+ * Put a ring back on the free list. Runs when the thread that wrote to it ends.
+ */
+static void give_back_ring(void* ring) {
+  pthread_mutex_lock(&rings_lock);
+  ((trace_ring_t*) ring)->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_ring_key(void) {
+  pthread_key_create(&ring_key, give_back_ring);
+}
+
+/**
+ * Get the calling thread's ring, taking one the first time the thread records an event.
+ *
+ * \returns The ring, or NULL if there is no memory for one.
+ */
+static trace_ring_t* get_thread_ring(void) {
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  pthread_once(&ring_key_once, make_ring_key);
+  pthread_mutex_lock(&rings_lock);
+  trace_ring_t* ring = free_rings;
+  if (ring != NULL) {
+    free_rings = ring->next_free;
+  } else {
+    ring = calloc(1, sizeof(trace_ring_t));
+    if (ring != NULL) {
+      ring->next = all_rings;
+      all_rings = ring;
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  if (ring != NULL) {
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    thread_id = gettid();
+  }
+  return ring;
+}
+
+// Record an event on the calling thread's ring.
+void trace_record(uint16_t type, trace_phase_t phase, uint32_t arg0, uint32_t arg1) {
+  trace_ring_t* ring = get_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  // Only this thread writes to the ring, and a dump checks the count again after reading, to
+  // drop whatever was overwritten meanwhile.
+  uint64_t num_written = atomic_load_explicit(&ring->num_written, memory_order_relaxed);
+  trace_event_t* event = &ring->events[num_written & RING_MASK];
+  event->timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  event->args[0] = arg0;
+  event->args[1] = arg1;
+  event->thread_id = thread_id;
+  event->type = type;
+  event->phase = phase;
+  event->reserved = 0;
+  atomic_store_explicit(&ring->num_written, num_written + 1, memory_order_release);
+}
+
+// Name the calling thread in the trace.
+void trace_name_thread(uint16_t name_type) {
+  if (trace_is_on && !is_thread_named) {
+    is_thread_named = true;
+    trace_record(name_type, TRACE_THREAD_NAME, 0, 0);
+  }
+}
+
+// Pick the id of a new flow.
+uint32_t trace_new_flow(void) {
+  return trace_is_on ? atomic_fetch_add(&last_flow, 1) + 1 : 0;
+}
+
+/**
+ * Write a length-prefixed string (empty for NULL).
+ */
+static void write_string(FILE* file, const char* string) {
+  uint32_t len = string != NULL ? strlen(string) : 0;
+  fwrite(&len, sizeof(len), 1, file);
+  fwrite(string, 1, len, file);
+}
+
+/**
+ * Copy the events still in a ring, oldest first.
+ *
+ * \param events Filled with up to TRACE_RING_EVENTS events
+ * \returns The number of events copied.
+ */
+static size_t copy_ring(trace_ring_t* ring, trace_event_t* events) {
+  uint64_t end = atomic_load_explicit(&ring->num_written, memory_order_acquire);
+  uint64_t start = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+  for (uint64_t i = start; i < end; i++) {
+    events[i - start] = ring->events[i & RING_MASK];
+  }
+
+  // The writer may have lapped the oldest events while they were copied.
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t now_written = atomic_load_explicit(&ring->num_written, memory_order_relaxed);
+  uint64_t first_intact = now_written > TRACE_RING_EVENTS ? now_written - TRACE_RING_EVENTS : 0;
+  if (first_intact > start) {
+    size_t num_lost = first_intact - start < end - start ? first_intact - start : end - start;
+    memmove(events, events + num_lost, sizeof(trace_event_t) * (end - start - num_lost));
+    return end - start - num_lost;
+  }
+  return end - start;
+}
+
+// Write the events of every ring to a file.
+int trace_dump(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    return -1;
+  }
+
+  fwrite(TRACE_DUMP_MAGIC, 1, strlen(TRACE_DUMP_MAGIC), file);
+  pthread_mutex_lock(&types_lock);
+  uint32_t num_written_types = num_types;
+  fwrite(&num_written_types, sizeof(num_written_types), 1, file);
+  for (int i = 0; i < num_types; i++) {
+    write_string(file, types[i].name);
+    write_string(file, types[i].arg_names[0]);
+    write_string(file, types[i].arg_names[1]);
+  }
+  pthread_mutex_unlock(&types_lock);
+
+  // The number of events is only known once every ring is copied.
+  long count_offset = ftell(file);
+  uint64_t num_events = 0;
+  fwrite(&num_events, sizeof(num_events), 1, file);
+
+  pthread_mutex_lock(&rings_lock);
+  trace_ring_t* first_ring = all_rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  // Rings are never freed, and new ones are only added in front of the first.
+  trace_event_t* events = malloc(sizeof(trace_event_t) * TRACE_RING_EVENTS);
+  for (trace_ring_t* ring = first_ring; ring != NULL && events != NULL; ring = ring->next) {
+    size_t num_copied = copy_ring(ring, events);
+    fwrite(events, sizeof(trace_event_t), num_copied, file);
+    num_events += num_copied;
+  }
+  bool failed = events == NULL;
+  free(events);
+
+  fseek(file, count_offset, SEEK_SET);
+  fwrite(&num_events, sizeof(num_events), 1, file);
+  failed = failed || ferror(file);
+  return fclose(file) == 0 && !failed ? 0 : -1;
+}
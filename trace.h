@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Event tracing. Every thread records timestamped events into a ring buffer of its own, without
+// locks, and the latest TRACE_RING_EVENTS events of every ring can be dumped to a file at any time.
+// tracejson turns a dump into Chrome trace JSON (for chrome://tracing or Perfetto). Events have a
+// type (registered up front, with the name shown in the trace and the names of its two arguments)
+// and a phase: spans begin and end on the same thread, and flows link an event on one thread to
+// a span on another, like a frame received by a player's thread and handled by its room's actor.
+// While tracing is off, recording an event only checks a flag.
+// Recording is thread-safe, and so are registering types and dumping.
+
+#define TRACE_RING_EVENTS 4096 // Events kept per thread (a power of 2)
+#define TRACE_MAX_TYPES 256
+#define TRACE_DUMP_MAGIC "WGTRACE1"
+
+typedef enum trace_phase {
+  TRACE_BEGIN = 'B',
+  TRACE_END = 'E',
+  TRACE_INSTANT = 'i',
+  TRACE_FLOW_START = 's', // The first argument is the flow's id
+  TRACE_FLOW_END = 'f',   // Binds to the span the thread is in (the first argument is the id)
+  TRACE_THREAD_NAME = 'M' // The type's name is the thread's name
+} trace_phase_t;
+
+// Dump format, in host byte order: TRACE_DUMP_MAGIC, the number of types (4 bytes), each type as
+// three strings (its name and the names of its arguments, each a 4-byte length and the bytes,
+// with an empty name for an unused argument), the number of events (8 bytes), and the events.
+typedef struct trace_event {
+  uint64_t timestamp_ns; // CLOCK_MONOTONIC
+  uint32_t args[2];
+  uint32_t thread_id;
+  uint16_t type;
+  uint8_t phase;
+  uint8_t reserved;
+} trace_event_t;
+
+extern bool trace_is_on; // Only set before any thread records an event
+
+// Register a type of event. The argument names may be NULL if the arguments are unused. Returns
+// the type (0, which is never recorded, once TRACE_MAX_TYPES types are registered).
+uint16_t trace_add_type(const char* name, const char* arg0_name, const char* arg1_name);
+
+// Record an event on the calling thread's ring.
+void trace_record(uint16_t type, trace_phase_t phase, uint32_t arg0, uint32_t arg1);
+
+// Record an event if tracing is on.
+static inline void trace_event(uint16_t type, trace_phase_t phase, uint32_t arg0, uint32_t arg1) {
+  if (trace_is_on && type != 0) {
+    trace_record(type, phase, arg0, arg1);
+  }
+}
+
+// Name the calling thread in the trace, with a registered type. Only the first name counts.
+void trace_name_thread(uint16_t name_type);
+
+// Pick the id of a new flow (0 while tracing is off).
+uint32_t trace_new_flow(void);
+
+// Write the events of every ring to a file. Returns non-zero value if an error occurs.
+int trace_dump(const char* path);
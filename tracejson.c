@@ -0,0 +1,209 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Converts a trace dump written by the server into Chrome trace JSON, which chrome://tracing and
+// Perfetto (ui.perfetto.dev) can open. Timestamps are shifted so the oldest event is at 0.
+
+typedef struct type_names {
+  char* name;
+  char* arg_names[2];
+} type_names_t;
+
+// How deep in spans a thread is, so ends whose begin was overwritten in its ring can be dropped
+typedef struct thread_depth {
+  uint32_t thread_id;
+  int depth;
+} thread_depth_t;
+
+/**
+ * Read a length-prefixed string.
+ *
+ * \returns The string (which must be freed later), or NULL if the dump ended.
+ */
+char* read_string(FILE* dump) {
+  uint32_t len;
+  if (fread(&len, sizeof(len), 1, dump) != 1) {
+    return NULL;
+  }
+
+  char* string = malloc(len + 1);
+  if (fread(string, 1, len, dump) != len) {
+    free(string);
+    return NULL;
+  }
+  string[len] = '\0';
+  return string;
+}
+
+/**
+ * Write a string as a JSON string.
+ */
+void print_json_string(const char* string) {
+  putchar('"');
+  for (const char* c = string; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      putchar('\\');
+      putchar(*c);
+    } else if ((unsigned char)*c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+/**
+ * Find how deep in spans a thread is, adding the thread if it wasn't seen yet.
+ */
+int* find_depth(thread_depth_t** depths, size_t* num_depths, uint32_t thread_id) {
+  for (size_t i = 0; i < *num_depths; i++) {
+    if ((*depths)[i].thread_id == thread_id) {
+      return &(*depths)[i].depth;
+    }
+  }
+
+  *depths = realloc(*depths, sizeof(thread_depth_t) * (*num_depths + 1));
+  (*depths)[*num_depths] = (thread_depth_t) {.thread_id = thread_id, .depth = 0};
+  return &(*depths)[(*num_depths)++].depth;
+}
+
+/**
+ * Write one event as a JSON object, after a separator.
+ *
+ * \returns Whether anything was written.
+ */
+bool print_event(const trace_event_t* event, const type_names_t* type, uint64_t first_ns,
+                 int* depth, const char* separator) {
+  if (event->phase == TRACE_END) {
+    if (*depth == 0) {
+      return false;
+    }
+    (*depth)--;
+  } else if (event->phase == TRACE_BEGIN) {
+    (*depth)++;
+  }
+
+  printf("%s", separator);
+  if (event->phase == TRACE_THREAD_NAME) {
+    printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+           event->thread_id);
+    print_json_string(type->name);
+    printf("}}");
+    return true;
+  }
+
+  uint64_t ns = event->timestamp_ns - first_ns;
+  printf("{\"name\":");
+  print_json_string(type->name);
+  printf(",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%u", event->phase,
+         (unsigned long long)(ns / 1000), (unsigned long long)(ns % 1000), event->thread_id);
+
+  switch (event->phase) {
+    case TRACE_INSTANT:
+      printf(",\"s\":\"t\"");
+      break;
+    case TRACE_FLOW_START:
+      printf(",\"cat\":\"flow\",\"id\":%u", event->args[0]);
+      break;
+    case TRACE_FLOW_END:
+      printf(",\"cat\":\"flow\",\"id\":%u,\"bp\":\"e\"", event->args[0]);
+      break;
+    default:
+      break;
+  }
+
+  if (event->phase != TRACE_END && event->phase != TRACE_FLOW_START &&
+      event->phase != TRACE_FLOW_END) {
+    printf(",\"args\":{");
+    bool is_first = true;
+    for (int i = 0; i < 2; i++) {
+      if (type->arg_names[i][0] == '\0') {
+        continue;
+      }
+      printf("%s", is_first ? "" : ",");
+      print_json_string(type->arg_names[i]);
+      printf(":%u", event->args[i]);
+      is_first = false;
+    }
+    printf("}");
+  }
+  printf("}");
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  FILE* dump = fopen(argv[1], "r");
+  if (dump == NULL) {
+    perror("Failed to open the trace dump");
+    exit(EXIT_FAILURE);
+  }
+
+  char magic[sizeof(TRACE_DUMP_MAGIC) - 1];
+  uint32_t num_types;
+  if (fread(magic, 1, sizeof(magic), dump) != sizeof(magic) ||
+      memcmp(magic, TRACE_DUMP_MAGIC, sizeof(magic)) != 0 ||
+      fread(&num_types, sizeof(num_types), 1, dump) != 1) {
+    fprintf(stderr, "%s is not a trace dump\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+
+  type_names_t* types = calloc(num_types, sizeof(type_names_t));
+  for (uint32_t i = 0; i < num_types; i++) {
+    types[i].name = read_string(dump);
+    types[i].arg_names[0] = read_string(dump);
+    types[i].arg_names[1] = read_string(dump);
+    if (types[i].name == NULL || types[i].arg_names[0] == NULL || types[i].arg_names[1] == NULL) {
+      fprintf(stderr, "The trace dump ended early\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  uint64_t num_events;
+  if (fread(&num_events, sizeof(num_events), 1, dump) != 1) {
+    fprintf(stderr, "The trace dump ended early\n");
+    exit(EXIT_FAILURE);
+  }
+  trace_event_t* events = malloc(sizeof(trace_event_t) * (num_events > 0 ? num_events : 1));
+  if (fread(events, sizeof(trace_event_t), num_events, dump) != num_events) {
+    fprintf(stderr, "The trace dump ended early\n");
+    exit(EXIT_FAILURE);
+  }
+  fclose(dump);
+
+  uint64_t first_ns = UINT64_MAX;
+  for (uint64_t i = 0; i < num_events; i++) {
+    if (events[i].timestamp_ns < first_ns) {
+      first_ns = events[i].timestamp_ns;
+    }
+  }
+
+  // Each thread's events are in the order they happened, so spans nest.
+  thread_depth_t* depths = NULL;
+  size_t num_depths = 0;
+  bool is_first = true;
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (uint64_t i = 0; i < num_events; i++) {
+    if (events[i].type == 0 || events[i].type >= num_types) {
+      continue;
+    }
+
+    int* depth = find_depth(&depths, &num_depths, events[i].thread_id);
+    if (print_event(&events[i], &types[events[i].type], first_ns, depth, is_first ? "" : ",\n")) {
+      is_first = false;
+    }
+  }
+  printf("\n]}\n");
+
+  return 0;
+}
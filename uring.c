@@ -0,0 +1,151 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The ring indices are shared with the kernel, so they are read and written with atomics.
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Set up a ring and map its queues into memory.
+int uring_init(uring_t* ring, unsigned entries) {
+  memset(ring, 0, sizeof(uring_t));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(struct io_uring_params));
+
+  ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->ring_fd == -1) {
+    return -1;
+  }
+
+  // Map the submission ring, the completion ring, and the array of submission entries.
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels map both rings with a single mmap.
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = 0;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->ring_fd);
+    return -1;
+  }
+
+  if (ring->cq_ring_size == 0) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->ring_fd);
+      return -1;
+    }
+  }
+
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->ring_fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    return -1;
+  }
+
+  // Find the fields of each ring inside the mapped memory.
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring->sq_pending_tail = *ring->sq_tail;
+
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+// Tear down a ring.
+void uring_destroy(uring_t* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->ring_fd);
+}
+
+// Get a zeroed submission entry to fill in.
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+  unsigned head = load_acquire(ring->sq_head);
+  unsigned mask = *ring->sq_mask;
+
+  // The queue is full when every entry has been filled in but not yet consumed by the kernel.
+  if (ring->sq_pending_tail - head > mask) {
+    return NULL;
+  }
+
+  unsigned index = ring->sq_pending_tail & mask;
+  ring->sq_array[index] = index;
+  ring->sq_pending_tail++;
+
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+// Hand the filled-in submission entries to the kernel and wait for completions.
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr) {
+  store_release(ring->sq_tail, ring->sq_pending_tail);
+
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    // Submit whatever the kernel hasn't consumed yet.
+    unsigned to_submit = ring->sq_pending_tail - load_acquire(ring->sq_head);
+    int rc = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr, flags, NULL, 0);
+    if (rc >= 0) {
+      return 0;
+    }
+
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+// Get the oldest unconsumed completion.
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+  unsigned head = *ring->cq_head;
+  if (head == load_acquire(ring->cq_tail)) {
+    return NULL;
+  }
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Mark the oldest completion as consumed.
+void uring_cqe_seen(uring_t* ring) {
+  store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+// Register resources with a ring.
+int uring_register(uring_t* ring, unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, ring->ring_fd, opcode, arg, nr_args) < 0 ? -1 : 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A minimal io_uring wrapper built directly on the io_uring system calls (so the server doesn't
+// need liburing). A ring must only be used by one thread at a time.
+
+typedef struct uring {
+  int ring_fd;
+
+  // Submission queue (shared with the kernel)
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned sq_pending_tail; // Tail including entries that haven't been handed to the kernel yet
+
+  // Completion queue (shared with the kernel)
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // Mapped regions, so they can be unmapped later
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring_t;
+
+// Set up a ring with room for at least entries submissions. Returns non-zero value if an error
+// occurs (errno is set, e.g. to ENOSYS when the kernel doesn't support io_uring).
+int uring_init(uring_t* ring, unsigned entries);
+
+// Tear down a ring. Any requests still in flight are cancelled by the kernel.
+void uring_destroy(uring_t* ring);
+
+// Get a zeroed submission entry to fill in, or NULL if the submission queue is full.
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+// Hand all filled-in submission entries to the kernel and wait until at least wait_nr completions
+// are available. Returns non-zero value if an error occurs.
+int uring_submit_and_wait(uring_t* ring, unsigned wait_nr);
+
+// Get the oldest completion that hasn't been consumed yet, or NULL if there is none.
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+
+// Mark the completion returned by uring_peek_cqe as consumed.
+void uring_cqe_seen(uring_t* ring);
+
+// Register resources (buffers, buffer rings, ...) with a ring. Returns non-zero value if an error
+// occurs.
+int uring_register(uring_t* ring, unsigned opcode, void* arg, unsigned nr_args);
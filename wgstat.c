@@ -0,0 +1,217 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// Shows live statistics of a server started with -s <name>, like top. Everything is read from the
+// server's metrics segment, so the server doesn't do anything for it.
+
+#define DEFAULT_INTERVAL 1 // Seconds between updates
+#define NUM_ROOMS_SHOWN 10 // Rooms listed, the ones with the most players first
+
+static const char* opcode_names[NUM_OPCODES] = {
+  "legacy", "join", "secret", "question", "answer", "guess", "notice", "score", "turn", "chat",
+  "quit", "token", "snapshot", "ping", "pong"
+};
+
+// A room's entry, copied out of the segment.
+typedef struct room_row {
+  unsigned int id;
+  unsigned int phase;
+  unsigned int num_players;
+} room_row_t;
+
+typedef struct sample {
+  int64_t values[NUM_METRICS];
+  uint64_t taken_ns;
+} sample_t;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Read every counter of a segment.
+ */
+static void take_sample(const metrics_segment_t* segment, sample_t* sample) {
+  for (int i = 0; i < NUM_METRICS; i++) {
+    sample->values[i] = metrics_read(segment, i);
+  }
+  sample->taken_ns = now_ns();
+}
+
+/**
+ * Find how fast a counter went up between two samples, per second.
+ */
+static double rate(const sample_t* prev, const sample_t* curr, metric_t metric) {
+  double seconds = (curr->taken_ns - prev->taken_ns) / 1e9;
+  return seconds > 0 ? (curr->values[metric] - prev->values[metric]) / seconds : 0;
+}
+
+static int by_players(const void* a, const void* b) {
+  unsigned int players_a = ((const room_row_t*) a)->num_players;
+  unsigned int players_b = ((const room_row_t*) b)->num_players;
+  return players_a < players_b ? 1 : players_a > players_b ? -1 : 0;
+}
+
+/**
+ * Print the rooms with the most players.
+ */
+static void print_rooms(const metrics_segment_t* segment) {
+  // The entries are copied first, since the server keeps changing them.
+  static room_row_t rooms[METRICS_MAX_ROOMS];
+  size_t num_rooms = 0;
+  for (int i = 0; i < METRICS_MAX_ROOMS; i++) {
+    const metrics_room_t* room = &segment->rooms[i];
+    unsigned int id = atomic_load((atomic_uint*) &room->id);
+    if (id != 0) {
+      rooms[num_rooms].id = id;
+      rooms[num_rooms].phase = atomic_load((atomic_uint*) &room->phase);
+      rooms[num_rooms].num_players = atomic_load((atomic_uint*) &room->num_players);
+      num_rooms++;
+    }
+  }
+  qsort(rooms, num_rooms, sizeof(room_row_t), by_players);
+
+  printf("\n%10s %8s  %s\n", "room", "players", "phase");
+  for (size_t i = 0; i < num_rooms && i < NUM_ROOMS_SHOWN; i++) {
+    unsigned int phase = rooms[i].phase;
+    printf("%10u %8u  %s\n", rooms[i].id, rooms[i].num_players,
+           phase < NUM_ROOM_PHASES ? room_phase_names[phase] : "?");
+  }
+  if (num_rooms > NUM_ROOMS_SHOWN) {
+    printf("%10s and %zu more\n", "", num_rooms - NUM_ROOMS_SHOWN);
+  }
+}
+
+/**
+ * Print the statistics, with rates over the time between two samples.
+ */
+static void print_stats(const char* name, const metrics_segment_t* segment, const sample_t* prev,
+                        const sample_t* curr) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t up_s = now.tv_sec - segment->started_ns / 1000000000;
+  printf("wgstat %s: pid %d, up %llu:%02llu:%02llu\n\n", name, (int) segment->pid,
+         (unsigned long long)(up_s / 3600), (unsigned long long)(up_s / 60 % 60),
+         (unsigned long long)(up_s % 60));
+
+  const int64_t* values = curr->values;
+  printf("connections %8lld open %10lld accepted %9.1f/s %8lld turned away %7.1f/s\n",
+         (long long) values[METRIC_CONNECTIONS_OPEN],
+         (long long) values[METRIC_CONNECTIONS_ACCEPTED],
+         rate(prev, curr, METRIC_CONNECTIONS_ACCEPTED),
+         (long long) values[METRIC_CONNECTIONS_TURNED_AWAY],
+         rate(prev, curr, METRIC_CONNECTIONS_TURNED_AWAY));
+
+  int64_t num_rooms = 0;
+  for (int phase = 0; phase < NUM_ROOM_PHASES; phase++) {
+    num_rooms += values[METRIC_ROOMS_IN_PHASE + phase];
+  }
+  printf("rooms       %8lld open %10lld opened   %9.1f/s\n", (long long) num_rooms,
+         (long long) values[METRIC_ROOMS_OPENED], rate(prev, curr, METRIC_ROOMS_OPENED));
+  printf("           ");
+  for (int phase = 0; phase < NUM_ROOM_PHASES; phase++) {
+    printf(" %lld %s", (long long) values[METRIC_ROOMS_IN_PHASE + phase], room_phase_names[phase]);
+  }
+  printf("\n");
+  printf("players     %8lld\n", (long long) values[METRIC_PLAYERS]);
+  printf("memory      %8.1f MiB %6.1f MiB queued\n", values[METRIC_MEMORY] / 1048576.0,
+         values[METRIC_QUEUED_BYTES] / 1048576.0);
+  printf("rounds      %8lld      %9.1f/s\n", (long long) values[METRIC_ROUNDS],
+         rate(prev, curr, METRIC_ROUNDS));
+  printf("guesses     %8lld      %9.1f/s %8lld correct %11.1f/s\n",
+         (long long) values[METRIC_GUESSES_CHECKED], rate(prev, curr, METRIC_GUESSES_CHECKED),
+         (long long) values[METRIC_GUESSES_CORRECT], rate(prev, curr, METRIC_GUESSES_CORRECT));
+
+  printf("\n%-10s %10s %12s %10s %12s %12s %12s\n", "message", "sent/s", "sent B/s", "recv/s",
+         "recv B/s", "sent", "received");
+  for (int opcode = 0; opcode < NUM_OPCODES; opcode++) {
+    int64_t num_sent = values[METRIC_MESSAGES_SENT + opcode];
+    int64_t num_received = values[METRIC_MESSAGES_RECEIVED + opcode];
+    if (num_sent == 0 && num_received == 0) {
+      continue;
+    }
+    printf("%-10s %10.1f %12.1f %10.1f %12.1f %12lld %12lld\n", opcode_names[opcode],
+           rate(prev, curr, METRIC_MESSAGES_SENT + opcode),
+           rate(prev, curr, METRIC_BYTES_SENT + opcode),
+           rate(prev, curr, METRIC_MESSAGES_RECEIVED + opcode),
+           rate(prev, curr, METRIC_BYTES_RECEIVED + opcode), (long long) num_sent,
+           (long long) num_received);
+  }
+
+  print_rooms(segment);
+}
+
+int main(int argc, char** argv) {
+  int interval = DEFAULT_INTERVAL;
+  int num_updates = 0; // 0 means forever
+
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'n':
+        num_updates = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-i interval] [-n updates] <metrics segment>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || interval <= 0 || num_updates < 0) {
+    fprintf(stderr, "Usage: %s [-i interval] [-n updates] <metrics segment>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char* name = argv[optind];
+
+  ino_t inode;
+  const metrics_segment_t* segment = metrics_open(name, &inode);
+  if (segment == NULL) {
+    perror("Failed to open the metrics segment");
+    exit(EXIT_FAILURE);
+  }
+
+  bool is_terminal = isatty(STDOUT_FILENO);
+  sample_t samples[2];
+  int curr = 0;
+  take_sample(segment, &samples[curr]);
+  for (int i = 0; num_updates == 0 || i < num_updates; i++) {
+    sleep(interval);
+
+    // A hot restart replaces the segment, and the new server's counters start over.
+    ino_t new_inode;
+    const metrics_segment_t* new_segment = metrics_open(name, &new_inode);
+    if (new_segment != NULL && new_inode != inode) {
+      metrics_close(segment);
+      segment = new_segment;
+      inode = new_inode;
+      take_sample(segment, &samples[curr]);
+      continue;
+    } else if (new_segment != NULL) {
+      metrics_close(new_segment);
+    }
+
+    curr = !curr;
+    take_sample(segment, &samples[curr]);
+    if (is_terminal) {
+      printf("\033[H\033[2J");
+    } else if (i > 0) {
+      printf("\n");
+    }
+    print_stats(name, segment, &samples[!curr], &samples[curr]);
+    fflush(stdout);
+  }
+
+  metrics_close(segment);
+  return 0;
+}